@@ -90,9 +90,26 @@ opt_safe(int outer, ndt_context_t *ctx)
     return true;
 }
 
+/* Name of the variant selected by 'flag'. */
+const char *
+gm_variant_name(uint32_t flag)
+{
+    switch (flag) {
+    case OPT_C: return "OptC";
+    case OPT_Z: return "OptZ";
+    case OPT_S: return "OptS";
+    case INNER_C: return "C";
+    case INNER_F: return "Fortran";
+    case INNER_X: return "Xnd";
+    case INNER_S: return "Strided";
+    default: return "";
+    }
+}
+
+/* Apply a kernel without recording statistics. */
 int
-gm_apply(const gm_kernel_t *kernel, xnd_t stack[], int outer_dims,
-         ndt_context_t *ctx)
+gm_apply_nostats(const gm_kernel_t *kernel, xnd_t stack[], int outer_dims,
+                 ndt_context_t *ctx)
 {
     const int nargs = (int)kernel->set->sig->Function.nargs;
 
@@ -158,6 +175,49 @@ gm_apply(const gm_kernel_t *kernel, xnd_t stack[], int outer_dims,
     return -1;
 }
 
+int
+gm_apply(const gm_kernel_t *kernel, xnd_t stack[], int outer_dims,
+         ndt_context_t *ctx)
+{
+    const bool stats = gm_stats_enabled();
+    const bool trace = gm_trace_enabled();
+    gm_trace_event_t event = {
+      GM_TRACE_APPLY, NULL, kernel->set, kernel->flag, stack,
+      (int)kernel->set->sig->Function.nargs, -1, 0, 0 };
+    gm_counters_t counters;
+    bool have_counters = false;
+    double start = 0;
+    int ret;
+
+    if (!stats && !trace) {
+        return gm_apply_nostats(kernel, stack, outer_dims, ctx);
+    }
+
+    if (trace) {
+        gm_trace_begin(&event);
+    }
+    if (stats) {
+        have_counters = gm_counters_start(&counters);
+        start = gm_stats_clock();
+    }
+
+    ret = gm_apply_nostats(kernel, stack, outer_dims, ctx);
+
+    if (stats && ret == 0) {
+        const double time = gm_stats_clock() - start;
+        if (have_counters) {
+            gm_counters_stop(&counters);
+        }
+        gm_stats_record(kernel, stack, time, false,
+                        have_counters ? &counters : NULL);
+    }
+    if (trace) {
+        gm_trace_end(&event);
+    }
+
+    return ret;
+}
+
 static gm_kernel_t
 select_kernel(const ndt_apply_spec_t *spec, const gm_kernel_set_t *set,
               ndt_context_t *ctx)
@@ -216,16 +276,15 @@ select_kernel(const ndt_apply_spec_t *spec, const gm_kernel_set_t *set,
     return kernel;
 }
 
-/* Look up a multimethod by name and select a kernel. */
-gm_kernel_t
-gm_select(ndt_apply_spec_t *spec, const gm_tbl_t *tbl, const char *name,
-          const ndt_t *types[], const int64_t li[], int nin, int nout,
-          bool check_broadcast, const xnd_t args[], ndt_context_t *ctx)
+static gm_kernel_t
+lookup_kernel(ndt_apply_spec_t *spec, const gm_tbl_t *tbl, const char *name,
+              const ndt_t *types[], const int64_t li[], int nin, int nout,
+              bool check_broadcast, const xnd_t args[], ndt_context_t *ctx)
 {
     gm_kernel_t empty_kernel = {0U, NULL};
     const gm_func_t *f;
     char *s;
-    int i;
+    int i, n;
 
     f = gm_tbl_find(tbl, name, ctx);
     if (f == NULL) {
@@ -241,7 +300,8 @@ gm_select(ndt_apply_spec_t *spec, const gm_tbl_t *tbl, const char *name,
         return select_kernel(spec, set, ctx);
     }
 
-    for (i = 0; i < f->nkernels; i++) {
+    n = gm_func_nkernels(f);
+    for (i = 0; i < n; i++) {
         const gm_kernel_set_t *set = &f->kernels[i];
         if (ndt_typecheck(spec, set->sig, types, li, nin, nout,
                           check_broadcast, set->constraint, args,
@@ -263,3 +323,28 @@ gm_select(ndt_apply_spec_t *spec, const gm_tbl_t *tbl, const char *name,
 
     return empty_kernel;
 }
+
+/* Look up a multimethod by name and select a kernel. */
+gm_kernel_t
+gm_select(ndt_apply_spec_t *spec, const gm_tbl_t *tbl, const char *name,
+          const ndt_t *types[], const int64_t li[], int nin, int nout,
+          bool check_broadcast, const xnd_t args[], ndt_context_t *ctx)
+{
+    gm_trace_event_t event = {
+      GM_TRACE_SELECT, name, NULL, 0, NULL, 0, -1, 0, 0 };
+    gm_kernel_t kernel;
+
+    if (!gm_trace_enabled()) {
+        return lookup_kernel(spec, tbl, name, types, li, nin, nout,
+                             check_broadcast, args, ctx);
+    }
+
+    gm_trace_begin(&event);
+    kernel = lookup_kernel(spec, tbl, name, types, li, nin, nout,
+                           check_broadcast, args, ctx);
+    event.set = kernel.set;
+    event.flag = kernel.flag;
+    gm_trace_end(&event);
+
+    return kernel;
+}
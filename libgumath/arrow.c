@@ -0,0 +1,666 @@
+/*
+ * BSD 3-Clause License
+ *
+ * Copyright (c) 2017-2018, plures
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include "ndtypes.h"
+#include "xnd.h"
+#include "gumath.h"
+
+
+/*
+ * Zero-copy conversion between the Arrow C data interface and xnd views.
+ *
+ * Arrow validity buffers have the same LSB bit order as the xnd bitmaps
+ * of optional dtypes.  Both formats index the bitmap with the logical
+ * element index, so the Arrow offset of a (possibly sliced) array can be
+ * used directly as the linear index of the xnd view.
+ */
+
+
+/* Placeholder for zero length arrays that do not have a data buffer. */
+static char empty_data[16];
+
+
+/*****************************************************************************/
+/*                                Type mapping                               */
+/*****************************************************************************/
+
+static const char *
+dtype_from_format(const char *format)
+{
+    if (format == NULL || format[0] == '\0' || format[1] != '\0') {
+        return NULL;
+    }
+
+    switch (format[0]) {
+    case 'c': return "int8";
+    case 'C': return "uint8";
+    case 's': return "int16";
+    case 'S': return "uint16";
+    case 'i': return "int32";
+    case 'I': return "uint32";
+    case 'l': return "int64";
+    case 'L': return "uint64";
+    case 'e': return "float16";
+    case 'f': return "float32";
+    case 'g': return "float64";
+    default: return NULL;
+    }
+}
+
+static const char *
+format_from_dtype(const ndt_t *t)
+{
+    switch (t->tag) {
+    case Int8: return "c";
+    case Uint8: return "C";
+    case Int16: return "s";
+    case Uint16: return "S";
+    case Int32: return "i";
+    case Uint32: return "I";
+    case Int64: return "l";
+    case Uint64: return "L";
+    case Float16: return "e";
+    case Float32: return "f";
+    case Float64: return "g";
+    default: return NULL;
+    }
+}
+
+static inline bool
+has_validity(const struct ArrowArray *array)
+{
+    return array->null_count != 0 && array->buffers[0] != NULL;
+}
+
+
+/*****************************************************************************/
+/*                                   Import                                  */
+/*****************************************************************************/
+
+static int
+unsupported_format(const struct ArrowSchema *schema, ndt_context_t *ctx)
+{
+    ndt_err_format(ctx, NDT_NotImplementedError,
+        "arrow import: unsupported format '%s' (bit-packed booleans, "
+        "variable length and nested types other than fixed size lists "
+        "of primitive types cannot be viewed without copying)",
+        schema->format ? schema->format : "NULL");
+    return -1;
+}
+
+static int
+import_view(xnd_t *x, const char *dtype, int64_t length, int64_t inner,
+            const uint8_t *validity, const void *data, int64_t index,
+            ndt_context_t *ctx)
+{
+    char buf[128];
+    const ndt_t *t;
+
+    if (inner < 0) {
+        snprintf(buf, sizeof buf, "%" PRIi64 " * %s%s",
+                 length, validity ? "?" : "", dtype);
+    }
+    else {
+        snprintf(buf, sizeof buf, "%" PRIi64 " * %" PRIi64 " * %s%s",
+                 length, inner, validity ? "?" : "", dtype);
+    }
+
+    t = ndt_from_string(buf, ctx);
+    if (t == NULL) {
+        return -1;
+    }
+
+    x->bitmap.data = (uint8_t *)validity;
+    x->bitmap.size = 0;
+    x->bitmap.next = NULL;
+    x->index = index;
+    x->type = t;
+    x->ptr = data ? (char *)data : empty_data;
+
+    return 0;
+}
+
+/*
+ * 'offset' and 'length' describe the logical slice of 'array'.  For top level
+ * arrays these are the array's own fields, for struct children the parent's
+ * offset is added to the child offset.
+ */
+static int
+import_array(xnd_t *x, const struct ArrowSchema *schema,
+             const struct ArrowArray *array, int64_t offset, int64_t length,
+             ndt_context_t *ctx)
+{
+    const char *format = schema->format;
+    const char *dtype;
+
+    if (array->release == NULL) {
+        ndt_err_format(ctx, NDT_ValueError, "arrow import: array has been released");
+        return -1;
+    }
+
+    if (array->dictionary != NULL || schema->dictionary != NULL) {
+        return unsupported_format(schema, ctx);
+    }
+
+    dtype = dtype_from_format(format);
+    if (dtype != NULL) {
+        if (array->n_buffers != 2) {
+            ndt_err_format(ctx, NDT_ValueError,
+                "arrow import: expected 2 buffers for a primitive array, got %" PRIi64,
+                array->n_buffers);
+            return -1;
+        }
+
+        return import_view(x, dtype, length, -1,
+                           has_validity(array) ? array->buffers[0] : NULL,
+                           array->buffers[1], offset, ctx);
+    }
+
+    if (format != NULL && strncmp(format, "+w:", 3) == 0) {
+        const struct ArrowSchema *child_schema;
+        const struct ArrowArray *child;
+        char *end;
+        int64_t inner;
+
+        inner = strtoll(format+3, &end, 10);
+        if (*end != '\0' || inner < 0) {
+            return unsupported_format(schema, ctx);
+        }
+
+        if (schema->n_children != 1 || array->n_children != 1) {
+            ndt_err_format(ctx, NDT_ValueError,
+                "arrow import: fixed size list must have exactly one child");
+            return -1;
+        }
+
+        if (has_validity(array)) {
+            ndt_err_format(ctx, NDT_NotImplementedError,
+                "arrow import: missing values in the outer dimension of a "
+                "fixed size list cannot be represented");
+            return -1;
+        }
+
+        child_schema = schema->children[0];
+        child = array->children[0];
+
+        dtype = dtype_from_format(child_schema->format);
+        if (dtype == NULL || child->n_buffers != 2) {
+            return unsupported_format(child_schema, ctx);
+        }
+
+        return import_view(x, dtype, length, inner,
+                           has_validity(child) ? child->buffers[0] : NULL,
+                           child->buffers[1], child->offset + offset * inner,
+                           ctx);
+    }
+
+    return unsupported_format(schema, ctx);
+}
+
+/*
+ * Create an xnd view of an Arrow array without copying values or validity
+ * bitmaps.  Arrays with missing values are mapped to optional dtypes, fixed
+ * size lists are mapped to two-dimensional arrays.
+ *
+ * The view borrows the Arrow buffers, which must outlive it.  The caller
+ * owns the reference to x->type.
+ */
+int
+gm_arrow_import(xnd_t *x, const struct ArrowSchema *schema,
+                const struct ArrowArray *array, ndt_context_t *ctx)
+{
+    return import_array(x, schema, array, array->offset, array->length, ctx);
+}
+
+/* Create an xnd view of column 'i' of a record batch (an Arrow struct array). */
+int
+gm_arrow_import_column(xnd_t *x, const struct ArrowSchema *schema,
+                       const struct ArrowArray *array, int64_t i,
+                       ndt_context_t *ctx)
+{
+    const struct ArrowArray *child;
+
+    if (schema->format == NULL || strcmp(schema->format, "+s") != 0) {
+        ndt_err_format(ctx, NDT_TypeError,
+            "arrow import: expected a struct array (record batch)");
+        return -1;
+    }
+
+    if (i < 0 || i >= array->n_children || i >= schema->n_children) {
+        ndt_err_format(ctx, NDT_IndexError,
+            "arrow import: column index out of range");
+        return -1;
+    }
+
+    if (has_validity(array)) {
+        ndt_err_format(ctx, NDT_NotImplementedError,
+            "arrow import: struct arrays with missing rows are not supported");
+        return -1;
+    }
+
+    child = array->children[i];
+
+    return import_array(x, schema->children[i], child,
+                        child->offset + array->offset, array->length, ctx);
+}
+
+
+/*****************************************************************************/
+/*                                   Export                                  */
+/*****************************************************************************/
+
+typedef struct {
+    char format[32];
+    char *name;
+} schema_private_t;
+
+typedef struct {
+    gm_arrow_release_t release; /* releases 'owner' */
+    void *owner;
+    const void *buffers[2];
+} array_private_t;
+
+static void
+release_schema(struct ArrowSchema *schema)
+{
+    schema_private_t *p = schema->private_data;
+
+    for (int64_t i = 0; i < schema->n_children; i++) {
+        struct ArrowSchema *child = schema->children[i];
+        if (child->release != NULL) {
+            child->release(child);
+        }
+        ndt_free(child);
+    }
+    ndt_free(schema->children);
+
+    ndt_free(p->name);
+    ndt_free(p);
+
+    schema->release = NULL;
+}
+
+static void
+release_array(struct ArrowArray *array)
+{
+    array_private_t *p = array->private_data;
+
+    for (int64_t i = 0; i < array->n_children; i++) {
+        struct ArrowArray *child = array->children[i];
+        if (child->release != NULL) {
+            child->release(child);
+        }
+        ndt_free(child);
+    }
+    ndt_free(array->children);
+
+    if (p->release != NULL) {
+        p->release(p->owner);
+    }
+    ndt_free(p);
+
+    array->release = NULL;
+}
+
+static int
+init_schema(struct ArrowSchema *schema, const char *format, const char *name,
+            int64_t flags, int64_t n_children, ndt_context_t *ctx)
+{
+    schema_private_t *p;
+
+    p = ndt_calloc(1, sizeof *p);
+    if (p == NULL) {
+        (void)ndt_memory_error(ctx);
+        return -1;
+    }
+    snprintf(p->format, sizeof p->format, "%s", format);
+
+    if (name != NULL) {
+        p->name = ndt_strdup(name, ctx);
+        if (p->name == NULL) {
+            ndt_free(p);
+            return -1;
+        }
+    }
+
+    schema->format = p->format;
+    schema->name = p->name;
+    schema->metadata = NULL;
+    schema->flags = flags;
+    schema->n_children = 0;
+    schema->children = NULL;
+    schema->dictionary = NULL;
+    schema->release = release_schema;
+    schema->private_data = p;
+
+    if (n_children > 0) {
+        schema->children = ndt_calloc(n_children, sizeof *schema->children);
+        if (schema->children == NULL) {
+            release_schema(schema);
+            (void)ndt_memory_error(ctx);
+            return -1;
+        }
+
+        for (int64_t i = 0; i < n_children; i++) {
+            schema->children[i] = ndt_calloc(1, sizeof **schema->children);
+            if (schema->children[i] == NULL) {
+                release_schema(schema);
+                (void)ndt_memory_error(ctx);
+                return -1;
+            }
+            schema->n_children++;
+        }
+    }
+
+    return 0;
+}
+
+static int
+init_array(struct ArrowArray *array, int64_t length, int64_t null_count,
+           int64_t offset, int64_t n_buffers, const void *validity,
+           const void *data, int64_t n_children, ndt_context_t *ctx)
+{
+    array_private_t *p;
+
+    p = ndt_calloc(1, sizeof *p);
+    if (p == NULL) {
+        (void)ndt_memory_error(ctx);
+        return -1;
+    }
+    p->release = NULL;
+    p->owner = NULL;
+    p->buffers[0] = validity;
+    p->buffers[1] = data;
+
+    array->length = length;
+    array->null_count = null_count;
+    array->offset = offset;
+    array->n_buffers = n_buffers;
+    array->n_children = 0;
+    array->buffers = p->buffers;
+    array->children = NULL;
+    array->dictionary = NULL;
+    array->release = release_array;
+    array->private_data = p;
+
+    if (n_children > 0) {
+        array->children = ndt_calloc(n_children, sizeof *array->children);
+        if (array->children == NULL) {
+            release_array(array);
+            (void)ndt_memory_error(ctx);
+            return -1;
+        }
+
+        for (int64_t i = 0; i < n_children; i++) {
+            array->children[i] = ndt_calloc(1, sizeof **array->children);
+            if (array->children[i] == NULL) {
+                release_array(array);
+                (void)ndt_memory_error(ctx);
+                return -1;
+            }
+            array->n_children++;
+        }
+    }
+
+    return 0;
+}
+
+/* Transfer ownership of 'owner' to the array node that holds the data. */
+static void
+attach_owner(struct ArrowArray *array, gm_arrow_release_t release, void *owner)
+{
+    array_private_t *p;
+
+    while (array->n_children == 1 && array->n_buffers == 1) {
+        array = array->children[0];
+    }
+
+    p = array->private_data;
+    p->release = release;
+    p->owner = owner;
+}
+
+static void
+release_master(void *owner)
+{
+    xnd_del((xnd_master_t *)owner);
+}
+
+/* Build schema and array without taking ownership of 'x'. */
+static int
+export_array(struct ArrowSchema *schema, struct ArrowArray *array,
+             const xnd_t *x, const char *name, ndt_context_t *ctx)
+{
+    const ndt_t *t = x->type;
+    const ndt_t *dtype;
+    const char *format;
+    const void *validity;
+    int64_t null_count;
+    int64_t flags;
+
+    if (t->tag != FixedDim || (t->ndim != 1 && t->ndim != 2) ||
+        !ndt_is_c_contiguous(t)) {
+        ndt_err_format(ctx, NDT_NotImplementedError,
+            "arrow export requires a one or two dimensional C-contiguous array");
+        return -1;
+    }
+
+    dtype = ndt_dtype(t);
+    format = format_from_dtype(dtype);
+    if (format == NULL) {
+        ndt_err_format(ctx, NDT_NotImplementedError,
+            "arrow export: unsupported dtype");
+        return -1;
+    }
+
+    /* The null count is not computed: -1 is valid and means "unknown". */
+    if (ndt_is_optional(dtype)) {
+        validity = x->bitmap.data;
+        null_count = -1;
+        flags = ARROW_FLAG_NULLABLE;
+    }
+    else {
+        validity = NULL;
+        null_count = 0;
+        flags = 0;
+    }
+
+    if (t->ndim == 1) {
+        if (init_schema(schema, format, name, flags, 0, ctx) < 0) {
+            return -1;
+        }
+
+        if (init_array(array, t->FixedDim.shape, null_count, x->index, 2,
+                       validity, x->ptr, 0, ctx) < 0) {
+            schema->release(schema);
+            return -1;
+        }
+
+        return 0;
+    }
+    else {
+        const int64_t N = t->FixedDim.shape;
+        const int64_t M = t->FixedDim.type->FixedDim.shape;
+        char list_format[32];
+
+        snprintf(list_format, sizeof list_format, "+w:%" PRIi64, M);
+
+        if (init_schema(schema, list_format, name, 0, 1, ctx) < 0) {
+            return -1;
+        }
+        if (init_schema(schema->children[0], format, "item", flags, 0, ctx) < 0) {
+            schema->release(schema);
+            return -1;
+        }
+
+        /* The child offset already points to the first row.  Arrow adds
+           the list offset (in rows) to it, so that must be zero. */
+        if (init_array(array, N, 0, 0, 1, NULL, NULL, 1, ctx) < 0) {
+            schema->release(schema);
+            return -1;
+        }
+        if (init_array(array->children[0], N * M, null_count, x->index, 2,
+                       validity, x->ptr, 0, ctx) < 0) {
+            array->release(array);
+            schema->release(schema);
+            return -1;
+        }
+
+        return 0;
+    }
+}
+
+/*
+ * Export a one or two dimensional C-contiguous view as an Arrow array.
+ * Two dimensional arrays are exported as fixed size lists, the index of the
+ * view becomes the Arrow offset.
+ *
+ * No data is copied.  On success the Arrow release callback calls
+ * release(owner), which must keep the memory of 'x' alive until then.  On
+ * failure 'release' is not called.
+ */
+int
+gm_arrow_export_view(struct ArrowSchema *schema, struct ArrowArray *array,
+                     const xnd_t *x, gm_arrow_release_t release, void *owner,
+                     ndt_context_t *ctx)
+{
+    if (export_array(schema, array, x, NULL, ctx) < 0) {
+        return -1;
+    }
+
+    attach_owner(array, release, owner);
+    return 0;
+}
+
+/* Same as gm_arrow_export_view(), the Arrow array takes ownership of 'x'. */
+int
+gm_arrow_export(struct ArrowSchema *schema, struct ArrowArray *array,
+                xnd_master_t *x, ndt_context_t *ctx)
+{
+    return gm_arrow_export_view(schema, array, &x->master, release_master, x,
+                                ctx);
+}
+
+/*
+ * Export a record batch of views as an Arrow struct array.  All columns must
+ * have the same length.  On success the release callback of column 'i'
+ * calls release(owners[i]).  On failure 'release' is not called.
+ */
+int
+gm_arrow_export_batch_view(struct ArrowSchema *schema, struct ArrowArray *array,
+                           const char *names[], const xnd_t columns[],
+                           int64_t ncolumns, gm_arrow_release_t release,
+                           void *owners[], ndt_context_t *ctx)
+{
+    int64_t length = 0;
+
+    for (int64_t i = 0; i < ncolumns; i++) {
+        const ndt_t *t = columns[i].type;
+        int64_t n;
+
+        if (t->tag != FixedDim) {
+            ndt_err_format(ctx, NDT_TypeError,
+                "arrow export: columns must have a fixed outer dimension");
+            return -1;
+        }
+
+        n = t->FixedDim.shape;
+        if (i == 0) {
+            length = n;
+        }
+        else if (n != length) {
+            ndt_err_format(ctx, NDT_ValueError,
+                "arrow export: all columns must have the same length");
+            return -1;
+        }
+    }
+
+    if (init_schema(schema, "+s", NULL, 0, ncolumns, ctx) < 0) {
+        return -1;
+    }
+
+    if (init_array(array, length, 0, 0, 1, NULL, NULL, ncolumns, ctx) < 0) {
+        schema->release(schema);
+        return -1;
+    }
+
+    for (int64_t i = 0; i < ncolumns; i++) {
+        if (export_array(schema->children[i], array->children[i],
+                         &columns[i], names[i], ctx) < 0) {
+            array->release(array);
+            schema->release(schema);
+            return -1;
+        }
+    }
+
+    for (int64_t i = 0; i < ncolumns; i++) {
+        attach_owner(array->children[i], release, owners[i]);
+    }
+
+    return 0;
+}
+
+/*
+ * Export a record batch as an Arrow struct array.  On success the Arrow
+ * array takes ownership of all columns.  On failure the caller retains
+ * ownership.
+ */
+int
+gm_arrow_export_batch(struct ArrowSchema *schema, struct ArrowArray *array,
+                      const char *names[], xnd_master_t *columns[],
+                      int64_t ncolumns, ndt_context_t *ctx)
+{
+    xnd_t *views;
+    int ret;
+
+    views = ndt_alloc(ncolumns == 0 ? 1 : ncolumns, sizeof *views);
+    if (views == NULL) {
+        (void)ndt_memory_error(ctx);
+        return -1;
+    }
+
+    for (int64_t i = 0; i < ncolumns; i++) {
+        views[i] = columns[i]->master;
+    }
+
+    ret = gm_arrow_export_batch_view(schema, array, names, views, ncolumns,
+                                     release_master, (void **)columns, ctx);
+    ndt_free(views);
+
+    return ret;
+}
@@ -0,0 +1,503 @@
+/*
+ * BSD 3-Clause License
+ *
+ * Copyright (c) 2017-2018, plures
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include "ndtypes.h"
+#include "xnd.h"
+#include "gumath.h"
+#include "config.h"
+
+
+#ifdef HAVE_PTHREAD_H
+#include <pthread.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <fenv.h>
+#ifdef __linux__
+#include <sys/eventfd.h>
+#endif
+
+
+/****************************************************************************/
+/*                            Asynchronous apply                            */
+/****************************************************************************/
+
+/*
+ * gm_apply_async() queues a call for a pool of at most GM_ASYNC_WORKERS
+ * worker threads, which are started on demand and never exit.  A worker runs
+ * the call with gm_apply_thread(), so the parts of a threaded call run on the
+ * installed executor.  Completion is signalled on a condition variable and,
+ * once gm_future_fd() has been called, on an eventfd (a pipe on systems
+ * without eventfd) that event loops can poll.
+ *
+ * Calls that gm_apply_thread() would run without threads go to a separate
+ * queue that the workers serve ahead of threaded calls.  With reserved
+ * threads (gm_set_reserved_threads()), a lane worker that only runs small
+ * calls serves this queue as well, so a small call does not wait for a
+ * large call even if all other workers are busy with large calls.
+ */
+
+struct gm_future {
+    gm_kernel_t kernel;
+    xnd_t *stack;
+    int nargs;
+    int outer_dims;
+    int64_t nthreads;
+    int rounding;
+
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    bool done;
+    int ret;
+    ndt_context_t ctx;
+    int fd[2]; /* read and write end, equal for an eventfd, -1 if unused */
+
+    gm_future_t *next;
+};
+
+typedef struct {
+    gm_future_t *head;
+    gm_future_t *tail;
+} queue_t;
+
+static pthread_mutex_t queue_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t queue_cond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t lane_cond = PTHREAD_COND_INITIALIZER;
+static queue_t small_calls = {NULL, NULL};
+static queue_t large_calls = {NULL, NULL};
+static int nworkers = 0;
+static int nidle = 0;
+static bool lane_started = false;
+static bool lane_idle = false;
+static bool atfork_installed = false;
+
+
+static void
+notify(const gm_future_t *f)
+{
+#ifdef __linux__
+    const uint64_t one = 1;
+    (void)!write(f->fd[1], &one, sizeof one);
+#else
+    const char one = 1;
+    (void)!write(f->fd[1], &one, sizeof one);
+#endif
+}
+
+/* Called with f->lock held. */
+static int
+open_fd(gm_future_t *f)
+{
+#ifdef __linux__
+    const int fd = eventfd(0, EFD_CLOEXEC|EFD_NONBLOCK);
+    if (fd < 0) {
+        return -1;
+    }
+    f->fd[0] = f->fd[1] = fd;
+#else
+    int fds[2];
+
+    if (pipe(fds) < 0) {
+        return -1;
+    }
+    for (int i = 0; i < 2; i++) {
+        (void)fcntl(fds[i], F_SETFD, FD_CLOEXEC);
+        (void)fcntl(fds[i], F_SETFL, O_NONBLOCK);
+    }
+    f->fd[0] = fds[0];
+    f->fd[1] = fds[1];
+#endif
+
+    return 0;
+}
+
+static void
+run(gm_future_t *f)
+{
+    const int rounding = fegetround();
+    int ret;
+
+    /* Worker threads do not inherit the rounding mode of the caller. */
+    if (rounding != f->rounding) {
+        fesetround(f->rounding);
+    }
+
+    ret = gm_apply_thread(&f->kernel, f->stack, f->outer_dims, f->nthreads,
+                          &f->ctx);
+
+    if (rounding != f->rounding) {
+        fesetround(rounding);
+    }
+
+    pthread_mutex_lock(&f->lock);
+    f->ret = ret;
+    f->done = true;
+    if (f->fd[1] >= 0) {
+        notify(f);
+    }
+    pthread_cond_broadcast(&f->cond);
+    pthread_mutex_unlock(&f->lock);
+}
+
+/* Called with queue_lock held. */
+static void
+push(queue_t *q, gm_future_t *f)
+{
+    f->next = NULL;
+    if (q->tail == NULL) {
+        q->head = q->tail = f;
+    }
+    else {
+        q->tail->next = f;
+        q->tail = f;
+    }
+}
+
+/* Called with queue_lock held. */
+static gm_future_t *
+pop(queue_t *q)
+{
+    gm_future_t *f = q->head;
+
+    if (f != NULL) {
+        q->head = f->next;
+        if (q->head == NULL) {
+            q->tail = NULL;
+        }
+    }
+
+    return f;
+}
+
+static void *
+worker(void *arg)
+{
+    (void)arg;
+
+    pthread_mutex_lock(&queue_lock);
+    for (;;) {
+        gm_future_t *f;
+
+        while (small_calls.head == NULL && large_calls.head == NULL) {
+            nidle++;
+            pthread_cond_wait(&queue_cond, &queue_lock);
+            nidle--;
+        }
+
+        f = pop(&small_calls);
+        if (f == NULL) {
+            f = pop(&large_calls);
+        }
+
+        pthread_mutex_unlock(&queue_lock);
+        run(f);
+        pthread_mutex_lock(&queue_lock);
+    }
+
+    return NULL;
+}
+
+/* The lane worker only runs small calls. */
+static void *
+lane_worker(void *arg)
+{
+    (void)arg;
+
+    pthread_mutex_lock(&queue_lock);
+    for (;;) {
+        gm_future_t *f;
+
+        while (small_calls.head == NULL) {
+            lane_idle = true;
+            pthread_cond_wait(&lane_cond, &queue_lock);
+            lane_idle = false;
+        }
+
+        f = pop(&small_calls);
+
+        pthread_mutex_unlock(&queue_lock);
+        run(f);
+        pthread_mutex_lock(&queue_lock);
+    }
+
+    return NULL;
+}
+
+/*
+ * The workers do not exist in a child process.  Queued calls fail, calls that
+ * a worker of the parent was running must not be waited for.
+ */
+static void
+atfork_child(void)
+{
+    gm_future_t *f;
+
+    pthread_mutex_init(&queue_lock, NULL);
+    pthread_cond_init(&queue_cond, NULL);
+    pthread_cond_init(&lane_cond, NULL);
+
+    while ((f = pop(&small_calls)) != NULL || (f = pop(&large_calls)) != NULL) {
+        pthread_mutex_init(&f->lock, NULL);
+        f->ret = -1;
+        f->done = true;
+        f->ctx.err = NDT_RuntimeError;
+        f->ctx.msg = ConstMsg;
+        f->ctx.ConstMsg = "call was queued when the process forked";
+    }
+
+    nworkers = nidle = 0;
+    lane_started = lane_idle = false;
+}
+
+/* Called with queue_lock held. */
+static bool
+start_thread(void *(*f)(void *))
+{
+    pthread_attr_t attr;
+    pthread_t tid;
+    int ret;
+
+    if (!atfork_installed) {
+        if (pthread_atfork(NULL, NULL, atfork_child) != 0) {
+            return false;
+        }
+        atfork_installed = true;
+    }
+
+    if (pthread_attr_init(&attr) != 0) {
+        return false;
+    }
+    (void)pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    ret = pthread_create(&tid, &attr, f, NULL);
+    (void)pthread_attr_destroy(&attr);
+
+    return ret == 0;
+}
+
+/* Called with queue_lock held. */
+static bool
+start_worker(void)
+{
+    if (!start_thread(worker)) {
+        return false;
+    }
+
+    nworkers++;
+    return true;
+}
+
+/* Called with queue_lock held. */
+static bool
+start_lane(void)
+{
+    if (!lane_started && start_thread(lane_worker)) {
+        lane_started = true;
+    }
+
+    return lane_started;
+}
+
+/*
+ * Queue the application of 'kernel' to 'stack' and return immediately.  The
+ * types in 'stack' are referenced by the future, the data must stay valid
+ * until the future is done.  If no worker can be started, the call is run
+ * before returning.
+ */
+gm_future_t *
+gm_apply_async(const gm_kernel_t *kernel, const xnd_t stack[], int outer_dims,
+               int64_t nthreads, ndt_context_t *ctx)
+{
+    NDT_STATIC_CONTEXT(success);
+    const int nargs = (int)kernel->set->sig->Function.nargs;
+    ALLOCA(const ndt_t *, types, nargs == 0 ? 1 : nargs);
+    bool inline_call = false;
+    bool small;
+    const char *reason;
+    gm_future_t *f;
+
+    f = ndt_calloc(1, sizeof *f);
+    if (f == NULL) {
+        return ndt_memory_error(ctx);
+    }
+
+    f->stack = ndt_alloc(nargs == 0 ? 1 : nargs, sizeof *f->stack);
+    if (f->stack == NULL) {
+        ndt_free(f);
+        return ndt_memory_error(ctx);
+    }
+
+    for (int i = 0; i < nargs; i++) {
+        f->stack[i] = stack[i];
+        ndt_incref(stack[i].type);
+        types[i] = stack[i].type;
+    }
+    small = gm_thread_decision(kernel, stack, types, outer_dims, nthreads, &reason) <= 1;
+
+    f->kernel = *kernel;
+    f->nargs = nargs;
+    f->outer_dims = outer_dims;
+    f->nthreads = nthreads;
+    f->rounding = fegetround();
+    pthread_mutex_init(&f->lock, NULL);
+    pthread_cond_init(&f->cond, NULL);
+    f->done = false;
+    f->ret = 0;
+    f->ctx = success;
+    f->fd[0] = f->fd[1] = -1;
+    f->next = NULL;
+
+    pthread_mutex_lock(&queue_lock);
+    if (small && gm_reserved_threads() > 0) {
+        if (!start_lane() && nworkers == 0 && !start_worker()) {
+            inline_call = true;
+        }
+        else {
+            push(&small_calls, f);
+            if (lane_idle || nidle == 0) {
+                pthread_cond_signal(&lane_cond);
+            }
+            else {
+                pthread_cond_signal(&queue_cond);
+            }
+        }
+    }
+    else {
+        if (nidle == 0 && nworkers < GM_ASYNC_WORKERS && !start_worker() &&
+            nworkers == 0) {
+            inline_call = true;
+        }
+        else {
+            push(small ? &small_calls : &large_calls, f);
+            pthread_cond_signal(&queue_cond);
+        }
+    }
+    pthread_mutex_unlock(&queue_lock);
+
+    if (inline_call) {
+        run(f);
+    }
+
+    return f;
+}
+
+/* Return true if the call has finished. */
+bool
+gm_future_done(gm_future_t *f)
+{
+    bool done;
+
+    pthread_mutex_lock(&f->lock);
+    done = f->done;
+    pthread_mutex_unlock(&f->lock);
+
+    return done;
+}
+
+/* Wait for the call to finish and return its result. */
+int
+gm_future_wait(gm_future_t *f, ndt_context_t *ctx)
+{
+    pthread_mutex_lock(&f->lock);
+    while (!f->done) {
+        pthread_cond_wait(&f->cond, &f->lock);
+    }
+    pthread_mutex_unlock(&f->lock);
+
+    if (f->ret < 0) {
+        ndt_err_format(ctx, f->ctx.err, "%s", ndt_context_msg(&f->ctx));
+    }
+
+    return f->ret;
+}
+
+/*
+ * Return a descriptor that becomes readable when the call has finished.  The
+ * descriptor is owned by the future.
+ */
+int
+gm_future_fd(gm_future_t *f, ndt_context_t *ctx)
+{
+    int fd;
+
+    pthread_mutex_lock(&f->lock);
+    if (f->fd[0] < 0) {
+        if (open_fd(f) < 0) {
+            pthread_mutex_unlock(&f->lock);
+            ndt_err_format(ctx, NDT_OSError,
+                "could not create a completion descriptor");
+            return -1;
+        }
+        if (f->done) {
+            notify(f);
+        }
+    }
+    fd = f->fd[0];
+    pthread_mutex_unlock(&f->lock);
+
+    return fd;
+}
+
+/* Wait for the call to finish and release the future. */
+void
+gm_future_del(gm_future_t *f)
+{
+    NDT_STATIC_CONTEXT(ctx);
+
+    if (f == NULL) {
+        return;
+    }
+
+    (void)gm_future_wait(f, &ctx);
+    ndt_err_clear(&ctx);
+    ndt_err_clear(&f->ctx);
+
+    if (f->fd[0] >= 0) {
+        (void)close(f->fd[0]);
+        if (f->fd[1] != f->fd[0]) {
+            (void)close(f->fd[1]);
+        }
+    }
+
+    for (int i = 0; i < f->nargs; i++) {
+        ndt_decref(f->stack[i].type);
+    }
+
+    pthread_mutex_destroy(&f->lock);
+    pthread_cond_destroy(&f->cond);
+    ndt_free(f->stack);
+    ndt_free(f);
+}
+#endif
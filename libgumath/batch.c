@@ -0,0 +1,445 @@
+/*
+ * BSD 3-Clause License
+ *
+ * Copyright (c) 2017-2018, plures
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <fenv.h>
+#include "ndtypes.h"
+#include "xnd.h"
+#include "gumath.h"
+#include "sys.h"
+
+
+/*
+ * Batched application of one function to many independent argument lists.
+ *
+ * Items whose input types and indices are equal share a group, which is
+ * type checked and selected once.  Groups are found through a hash of the
+ * input types, so init is linear in the number of items.  gm_batch_alloc()
+ * places the outputs of all items in one pooled arena, gm_batch_run() applies
+ * the kernels to the items back to back, or to ranges of items on several
+ * threads.
+ */
+
+
+/* Minimum number of output elements per range of items. */
+#define MIN_RANGE 16384
+
+typedef struct {
+    gm_batch_t *b;
+    int rounding;
+    ndt_context_t *ctx;
+    int failed;
+} run_t;
+
+static gm_mutex_t error_lock = GM_MUTEX_INIT;
+
+
+/* Mix 'v' into the FNV-1a style hash 'h'. */
+static inline uint64_t
+mix(uint64_t h, uint64_t v)
+{
+    h ^= v;
+    h *= UINT64_C(1099511628211);
+    return h ^ (h >> 29);
+}
+
+/*
+ * Hash the parts of a type that ndt_equal() compares cheaply: the tags,
+ * shapes and steps of the dimensions and the tag and size of the dtype.
+ * Equal types have equal hashes, collisions are resolved by same_group().
+ */
+static uint64_t
+type_hash(uint64_t h, const ndt_t *t)
+{
+    for (;;) {
+        h = mix(h, (uint64_t)t->tag);
+        h = mix(h, (uint64_t)t->datasize);
+        switch (t->tag) {
+        case FixedDim:
+            h = mix(h, (uint64_t)t->FixedDim.shape);
+            h = mix(h, (uint64_t)t->Concrete.FixedDim.step);
+            t = t->FixedDim.type;
+            break;
+        case VarDim:
+            t = t->VarDim.type;
+            break;
+        default:
+            return h;
+        }
+    }
+}
+
+static uint64_t
+item_hash(const gm_batch_t *b, const xnd_t in[], int64_t i)
+{
+    const xnd_t *item = &in[i * b->nin];
+    uint64_t h = UINT64_C(14695981039346656037);
+
+    for (int k = 0; k < b->nin; k++) {
+        h = mix(h, (uint64_t)item[k].index);
+        h = type_hash(h, item[k].type);
+    }
+
+    return h;
+}
+
+/* Return true if item 'i' has the input types and indices of 'g'. */
+static bool
+same_group(const gm_batch_t *b, const gm_batch_group_t *g, const xnd_t in[],
+           int64_t i)
+{
+    const xnd_t *first = &in[g->first * b->nin];
+    const xnd_t *item = &in[i * b->nin];
+
+    for (int k = 0; k < b->nin; k++) {
+        if (item[k].index != first[k].index ||
+            !ndt_equal(item[k].type, first[k].type)) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+static gm_batch_group_t *
+new_group(gm_batch_t *b, int64_t *alloc, const gm_tbl_t *tbl, const char *name,
+          const xnd_t in[], int64_t i, ndt_context_t *ctx)
+{
+    ALLOCA(const ndt_t *, types, b->nin == 0 ? 1 : b->nin);
+    ALLOCA(int64_t, li, b->nin == 0 ? 1 : b->nin);
+    const xnd_t *item = &in[i * b->nin];
+    gm_batch_group_t *g;
+
+    if (b->ngroups == *alloc) {
+        const int64_t n = *alloc == 0 ? 4 : 2 * *alloc;
+        g = ndt_realloc(b->groups, n, sizeof *g);
+        if (g == NULL) {
+            return ndt_memory_error(ctx);
+        }
+        b->groups = g;
+        *alloc = n;
+    }
+
+    for (int k = 0; k < b->nin; k++) {
+        types[k] = item[k].type;
+        li[k] = item[k].index;
+    }
+
+    g = &b->groups[b->ngroups];
+    g->spec = ndt_apply_spec_empty;
+    g->kernel = gm_select(&g->spec, tbl, name, types, li, b->nin, 0, false,
+                          item, ctx);
+    if (g->kernel.set == NULL) {
+        return NULL;
+    }
+
+    if (b->ngroups > 0 && g->spec.nout != b->nout) {
+        ndt_apply_spec_clear(&g->spec);
+        ndt_err_format(ctx, NDT_TypeError,
+            "batch: kernels of '%s' have different numbers of outputs", name);
+        return NULL;
+    }
+
+    for (int k = 0; k < g->spec.nout; k++) {
+        if (!ndt_is_concrete(g->spec.types[b->nin+k])) {
+            ndt_apply_spec_clear(&g->spec);
+            ndt_err_format(ctx, NDT_ValueError,
+                "batch: output types must be concrete");
+            return NULL;
+        }
+    }
+
+    g->first = i;
+    g->nitems = 0;
+    b->nout = g->spec.nout;
+    b->ngroups++;
+
+    return g;
+}
+
+/*
+ * Type check the items of 'in', which holds 'nitems' rows of 'nin' inputs.
+ * The outputs in b->args are typed but have no data until they are set by
+ * the caller or by gm_batch_alloc().  The inputs must stay valid until the
+ * batch is cleared.
+ */
+int
+gm_batch_init(gm_batch_t *b, const gm_tbl_t *tbl, const char *name,
+              const xnd_t in[], int64_t nitems, int nin, ndt_context_t *ctx)
+{
+    gm_batch_group_t *g = NULL;
+    int64_t *slots, mask;
+    uint64_t *hashes;
+    int64_t alloc = 0;
+    int nargs;
+
+    memset(b, 0, sizeof *b);
+    b->nitems = nitems;
+    b->nin = nin;
+
+    if (nitems < 0 || nin < 0 || nin > NDT_MAX_ARGS) {
+        ndt_err_format(ctx, NDT_ValueError, "batch: invalid number of items");
+        return -1;
+    }
+
+    b->group = ndt_alloc(nitems == 0 ? 1 : nitems, sizeof *b->group);
+    if (b->group == NULL) {
+        (void)ndt_memory_error(ctx);
+        return -1;
+    }
+
+    /* Open addressing table of group indices, at most half full. */
+    mask = 1;
+    while (mask < 2 * nitems) {
+        mask <<= 1;
+    }
+    slots = ndt_alloc(mask, sizeof *slots);
+    hashes = ndt_alloc(nitems == 0 ? 1 : nitems, sizeof *hashes);
+    if (slots == NULL || hashes == NULL) {
+        ndt_free(slots);
+        ndt_free(hashes);
+        gm_batch_clear(b);
+        (void)ndt_memory_error(ctx);
+        return -1;
+    }
+    for (int64_t j = 0; j < mask; j++) {
+        slots[j] = -1;
+    }
+    mask--;
+
+    for (int64_t i = 0; i < nitems; i++) {
+        const uint64_t h = item_hash(b, in, i);
+        int64_t j = (int64_t)(h & (uint64_t)mask);
+
+        if (g == NULL || hashes[g-b->groups] != h || !same_group(b, g, in, i)) {
+            for (g = NULL; slots[j] >= 0; j = (j + 1) & mask) {
+                if (hashes[slots[j]] == h &&
+                    same_group(b, &b->groups[slots[j]], in, i)) {
+                    g = &b->groups[slots[j]];
+                    break;
+                }
+            }
+            if (g == NULL) {
+                g = new_group(b, &alloc, tbl, name, in, i, ctx);
+                if (g == NULL) {
+                    ndt_free(slots);
+                    ndt_free(hashes);
+                    gm_batch_clear(b);
+                    return -1;
+                }
+                slots[j] = g - b->groups;
+                hashes[slots[j]] = h;
+            }
+        }
+
+        b->group[i] = g - b->groups;
+        g->nitems++;
+    }
+
+    ndt_free(slots);
+    ndt_free(hashes);
+
+    nargs = nin + b->nout;
+    b->args = ndt_calloc(nitems * nargs == 0 ? 1 : nitems * nargs, sizeof *b->args);
+    if (b->args == NULL) {
+        gm_batch_clear(b);
+        (void)ndt_memory_error(ctx);
+        return -1;
+    }
+
+    for (int64_t i = 0; i < nitems; i++) {
+        const ndt_apply_spec_t *spec = &b->groups[b->group[i]].spec;
+        xnd_t *row = &b->args[i * nargs];
+
+        for (int k = 0; k < nin; k++) {
+            row[k] = in[i * nin + k];
+            row[k].type = spec->types[k];
+        }
+        for (int k = nin; k < nargs; k++) {
+            row[k].type = spec->types[k];
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * Allocate the outputs of all items from one pooled block.  Only fixed
+ * arrays without missing values can be placed in the arena.
+ */
+int
+gm_batch_alloc(gm_batch_t *b, ndt_context_t *ctx)
+{
+    const int nargs = b->nin + b->nout;
+    int64_t size = 0;
+    char *ptr;
+
+    for (int64_t i = 0; i < b->nitems; i++) {
+        for (int k = b->nin; k < nargs; k++) {
+            const ndt_t *t = b->args[i * nargs + k].type;
+            if (!ndt_is_ndarray(t) || ndt_is_optional(ndt_dtype(t))) {
+                ndt_err_format(ctx, NDT_NotImplementedError,
+                    "batch: only fixed arrays without missing values can be "
+                    "allocated in the arena");
+                return -1;
+            }
+            size += (t->datasize + GM_POOL_ALIGN - 1) & ~(int64_t)(GM_POOL_ALIGN - 1);
+        }
+    }
+
+    ptr = gm_pool_alloc(size == 0 ? 1 : size, ctx);
+    if (ptr == NULL) {
+        return -1;
+    }
+    b->arena = ptr;
+
+    for (int64_t i = 0; i < b->nitems; i++) {
+        for (int k = b->nin; k < nargs; k++) {
+            xnd_t *x = &b->args[i * nargs + k];
+            x->ptr = ptr;
+            x->index = 0;
+            ptr += (x->type->datasize + GM_POOL_ALIGN - 1) & ~(int64_t)(GM_POOL_ALIGN - 1);
+        }
+    }
+
+    return 0;
+}
+
+static void
+run_range(int64_t begin, int64_t end, void *arg)
+{
+    run_t *r = arg;
+    gm_batch_t *b = r->b;
+    const int nargs = b->nin + b->nout;
+    ALLOCA(xnd_t, stack, nargs == 0 ? 1 : nargs);
+    const int rounding = fegetround();
+    NDT_STATIC_CONTEXT(ctx);
+
+    /* Executor threads do not inherit the rounding mode of the caller. */
+    if (rounding != r->rounding) {
+        fesetround(r->rounding);
+    }
+
+    for (int64_t i = begin; i < end; i++) {
+        const gm_batch_group_t *g = &b->groups[b->group[i]];
+
+        if (gm_load_acquire_int(&r->failed)) {
+            break;
+        }
+
+        memcpy(stack, &b->args[i * nargs], nargs * sizeof *stack);
+        if (gm_apply(&g->kernel, stack, g->spec.outer_dims, &ctx) < 0) {
+            gm_mutex_lock(&error_lock);
+            if (!ndt_err_occurred(r->ctx)) {
+                ndt_err_format(r->ctx, ctx.err, "%s", ndt_context_msg(&ctx));
+            }
+            gm_store_release_int(&r->failed, 1);
+            gm_mutex_unlock(&error_lock);
+            ndt_err_clear(&ctx);
+            break;
+        }
+    }
+
+    if (rounding != r->rounding) {
+        fesetround(rounding);
+    }
+}
+
+/*
+ * Apply the selected kernels to all items.  The items are divided into
+ * ranges of at least MIN_RANGE output elements, batches with fewer than
+ * gm_thread_cutoff() output elements in total run on the calling thread.
+ */
+int
+gm_batch_run(gm_batch_t *b, int64_t nthreads, ndt_context_t *ctx)
+{
+    const int nargs = b->nin + b->nout;
+    run_t r = { b, fegetround(), ctx, 0 };
+    int64_t nelem = 0, grain = 1;
+
+    for (int64_t i = 0; i < b->nitems && b->nout > 0; i++) {
+        nelem += ndt_nelem(b->args[i * nargs + b->nin].type);
+    }
+
+    if (nelem < gm_thread_cutoff()) {
+        nthreads = 1;
+    }
+    else if (nelem > 0) {
+        grain = MIN_RANGE * b->nitems / nelem;
+    }
+
+    gm_parallel_for(b->nitems, grain, nthreads, run_range, &r);
+
+    return r.failed ? -1 : 0;
+}
+
+void
+gm_batch_clear(gm_batch_t *b)
+{
+    for (int64_t i = 0; i < b->ngroups; i++) {
+        ndt_apply_spec_clear(&b->groups[i].spec);
+    }
+
+    if (b->arena != NULL) {
+        gm_pool_free(b->arena);
+    }
+
+    ndt_free(b->groups);
+    ndt_free(b->group);
+    ndt_free(b->args);
+    memset(b, 0, sizeof *b);
+}
+
+/*
+ * Type check, allocate and apply in one step.  The outputs of item 'i' are
+ * b->args[i*(nin+nout)+nin] ... and stay valid until gm_batch_clear().
+ */
+int
+gm_apply_batch(gm_batch_t *b, const gm_tbl_t *tbl, const char *name,
+               const xnd_t in[], int64_t nitems, int nin, int64_t nthreads,
+               ndt_context_t *ctx)
+{
+    if (gm_batch_init(b, tbl, name, in, nitems, nin, ctx) < 0) {
+        return -1;
+    }
+
+    if (gm_batch_alloc(b, ctx) < 0 || gm_batch_run(b, nthreads, ctx) < 0) {
+        gm_batch_clear(b);
+        return -1;
+    }
+
+    return 0;
+}
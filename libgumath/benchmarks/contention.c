@@ -0,0 +1,545 @@
+/*
+ * BSD 3-Clause License
+ *
+ * Copyright (c) 2017-2018, plures
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+/*
+ * Latency of small calls while large threaded calls run concurrently.
+ *
+ * A background thread keeps GM_ASYNC_WORKERS calls of multiply float64 on
+ * --large elements with --threads threads in flight with gm_apply_async().
+ * The main thread submits calls of multiply float64 on --small elements with
+ * gm_apply_async(), waits for each of them and records its latency.  The
+ * modes are:
+ *
+ *   idle:  no background calls
+ *   fifo:  no reserved threads, small calls wait for a free worker
+ *   lane:  --reserved threads, small calls run on the lane worker and the
+ *          large calls leave --reserved processors free
+ *
+ * For each mode, the percentiles of the small call latency and the number
+ * of large calls per second are reported.
+ *
+ *   usage: contention [--format text|csv|json] [--threads N] [--large N]
+ *                     [--small N] [--reserved N] [--samples N]
+ */
+
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <string.h>
+#include <stdio.h>
+#include <math.h>
+#include <pthread.h>
+#include <unistd.h>
+#include "ndtypes.h"
+#include "xnd.h"
+#include "gumath.h"
+
+
+enum { FMT_TEXT, FMT_CSV, FMT_JSON };
+
+typedef struct {
+    const gm_tbl_t *tbl;
+    int format;
+    int64_t nthreads;
+    int64_t large;
+    int64_t small;
+    int64_t reserved;
+    int64_t samples;
+    int64_t nresults;
+} bench_t;
+
+/* Arguments of one call. */
+typedef struct {
+    gm_kernel_t kernel;
+    ndt_apply_spec_t spec;
+    const ndt_t *types[NDT_MAX_ARGS];
+    xnd_master_t *args[NDT_MAX_ARGS];
+    xnd_t stack[NDT_MAX_ARGS];
+    int nargs;
+} call_t;
+
+/* State of the background thread. */
+typedef struct {
+    const call_t *call;
+    int64_t nthreads;
+    volatile bool stop;
+    int64_t ncalls;
+    int ret;
+    ndt_context_t ctx;
+} load_t;
+
+
+/*****************************************************************************/
+/*                                   Calls                                   */
+/*****************************************************************************/
+
+static void
+call_clear(call_t *c)
+{
+    for (int i = 0; i < c->nargs; i++) {
+        xnd_del(c->args[i]);
+    }
+    for (int i = 0; i < c->spec.nin; i++) {
+        ndt_decref(c->types[i]);
+    }
+    ndt_apply_spec_clear(&c->spec);
+}
+
+/* Inputs and output of multiply float64 with 'n' elements. */
+static int
+call_init(call_t *c, const gm_tbl_t *tbl, int64_t n, ndt_context_t *ctx)
+{
+    int64_t li[NDT_MAX_ARGS];
+    char buf[64];
+    int i;
+
+    memset(c, 0, sizeof *c);
+    c->spec = ndt_apply_spec_empty;
+
+    snprintf(buf, sizeof buf, "%" PRIi64 " * float64", n);
+
+    for (i = 0; i < 2; i++) {
+        c->types[i] = ndt_from_string(buf, ctx);
+        if (c->types[i] == NULL) {
+            goto error;
+        }
+
+        c->args[i] = xnd_empty_from_type(c->types[i], XND_OWN_EMBEDDED, ctx);
+        if (c->args[i] == NULL) {
+            ndt_decref(c->types[i]);
+            goto error;
+        }
+
+        memset(c->args[i]->master.ptr, 0x3f, (size_t)c->types[i]->datasize);
+        c->stack[i] = c->args[i]->master;
+        li[i] = 0;
+    }
+
+    c->kernel = gm_select(&c->spec, tbl, "multiply", c->types, li, 2, 0,
+                          false, c->stack, ctx);
+    if (c->kernel.set == NULL) {
+        goto error;
+    }
+    c->nargs = 2;
+
+    for (i = 2; i < c->spec.nargs; i++) {
+        c->args[i] = xnd_empty_from_type(c->spec.types[i], XND_OWN_EMBEDDED, ctx);
+        if (c->args[i] == NULL) {
+            call_clear(c);
+            return -1;
+        }
+        c->stack[i] = c->args[i]->master;
+        c->nargs++;
+    }
+
+    for (i = 0; i < c->spec.nargs; i++) {
+        c->stack[i].type = c->spec.types[i];
+    }
+
+    return 0;
+
+error:
+    while (--i >= 0) {
+        xnd_del(c->args[i]);
+        ndt_decref(c->types[i]);
+    }
+    return -1;
+}
+
+static gm_future_t *
+submit(const call_t *c, int64_t nthreads, ndt_context_t *ctx)
+{
+    return gm_apply_async(&c->kernel, c->stack, c->spec.outer_dims, nthreads,
+                          ctx);
+}
+
+/* Submit a call and wait for it. */
+static int
+apply(const call_t *c, int64_t nthreads, ndt_context_t *ctx)
+{
+    gm_future_t *f = submit(c, nthreads, ctx);
+    int ret;
+
+    if (f == NULL) {
+        return -1;
+    }
+
+    ret = gm_future_wait(f, ctx);
+    gm_future_del(f);
+    return ret;
+}
+
+/* Keep GM_ASYNC_WORKERS large calls in flight. */
+static void *
+load(void *arg)
+{
+    load_t *l = arg;
+    gm_future_t *f[GM_ASYNC_WORKERS] = {NULL};
+    int i = 0;
+
+    while (!l->stop) {
+        if (f[i] != NULL) {
+            const int ret = gm_future_wait(f[i], &l->ctx);
+            gm_future_del(f[i]);
+            f[i] = NULL;
+            if (ret < 0) {
+                l->ret = -1;
+                break;
+            }
+            l->ncalls++;
+        }
+
+        f[i] = submit(l->call, l->nthreads, &l->ctx);
+        if (f[i] == NULL) {
+            l->ret = -1;
+            break;
+        }
+        i = (i + 1) % GM_ASYNC_WORKERS;
+    }
+
+    for (i = 0; i < GM_ASYNC_WORKERS; i++) {
+        gm_future_del(f[i]);
+    }
+
+    return NULL;
+}
+
+static int
+cmp_double(const void *a, const void *b)
+{
+    const double x = *(const double *)a;
+    const double y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+/* Percentile 'p' of the sorted array 'v'. */
+static double
+percentile(const double *v, int64_t n, double p)
+{
+    int64_t i = (int64_t)ceil(p * (double)n) - 1;
+    return v[i < 0 ? 0 : i];
+}
+
+
+/*****************************************************************************/
+/*                                   Output                                  */
+/*****************************************************************************/
+
+static void
+print_header(const bench_t *b)
+{
+    switch (b->format) {
+    case FMT_CSV:
+        printf("mode,reserved,samples,p50_us,p90_us,p99_us,max_us,large_per_s\n");
+        break;
+    case FMT_JSON:
+        printf("{\n  \"threads\": %" PRIi64 ",\n  \"large\": %" PRIi64
+               ",\n  \"small\": %" PRIi64 ",\n  \"results\": [",
+               b->nthreads, b->large, b->small);
+        break;
+    default:
+        printf("# threads %" PRIi64 ", large %" PRIi64 ", small %" PRIi64 "\n",
+               b->nthreads, b->large, b->small);
+        printf("%-6s %10s %8s %10s %10s %10s %10s %12s\n", "mode", "reserved",
+               "samples", "p50_us", "p90_us", "p99_us", "max_us", "large/s");
+        break;
+    }
+}
+
+static void
+print_result(bench_t *b, const char *mode, int64_t reserved, double *v,
+             double large_per_s)
+{
+    const int64_t n = b->samples;
+    const double p50 = percentile(v, n, 0.50) * 1e6;
+    const double p90 = percentile(v, n, 0.90) * 1e6;
+    const double p99 = percentile(v, n, 0.99) * 1e6;
+    const double max = v[n-1] * 1e6;
+
+    switch (b->format) {
+    case FMT_CSV:
+        printf("%s,%" PRIi64 ",%" PRIi64 ",%.2f,%.2f,%.2f,%.2f,%.2f\n",
+               mode, reserved, n, p50, p90, p99, max, large_per_s);
+        break;
+    case FMT_JSON:
+        printf("%s\n    {\"mode\": \"%s\", \"reserved\": %" PRIi64 ", \"samples\": %"
+               PRIi64 ", \"p50_us\": %.2f, \"p90_us\": %.2f, \"p99_us\": %.2f, "
+               "\"max_us\": %.2f, \"large_per_s\": %.2f}", b->nresults ? "," : "",
+               mode, reserved, n, p50, p90, p99, max, large_per_s);
+        break;
+    default:
+        printf("%-6s %10" PRIi64 " %8" PRIi64 " %10.2f %10.2f %10.2f %10.2f %12.2f\n",
+               mode, reserved, n, p50, p90, p99, max, large_per_s);
+        break;
+    }
+
+    b->nresults++;
+    fflush(stdout);
+}
+
+static void
+print_footer(const bench_t *b)
+{
+    if (b->format == FMT_JSON) {
+        printf("\n  ]\n}\n");
+    }
+}
+
+
+/*****************************************************************************/
+/*                                  Benchmark                                */
+/*****************************************************************************/
+
+/*
+ * Record the latency of b->samples small calls, with the large call running
+ * in the background unless 'large' is NULL.
+ */
+static int
+run_mode(bench_t *b, const char *mode, int64_t reserved, const call_t *small,
+         const call_t *large, ndt_context_t *ctx)
+{
+    NDT_STATIC_CONTEXT(success);
+    double *v;
+    double start, elapsed;
+    load_t l;
+    pthread_t tid;
+    int ret = 0;
+
+    v = ndt_alloc(b->samples, sizeof *v);
+    if (v == NULL) {
+        (void)ndt_memory_error(ctx);
+        return -1;
+    }
+
+    gm_set_reserved_threads(reserved);
+
+    l.call = large;
+    l.nthreads = b->nthreads;
+    l.stop = false;
+    l.ncalls = 0;
+    l.ret = 0;
+    l.ctx = success;
+
+    if (large != NULL && pthread_create(&tid, NULL, load, &l) != 0) {
+        ndt_free(v);
+        ndt_err_format(ctx, NDT_RuntimeError, "could not start the load thread");
+        return -1;
+    }
+
+    start = gm_stats_clock();
+    for (int64_t i = 0; i < b->samples; i++) {
+        const double t = gm_stats_clock();
+        if (apply(small, b->nthreads, ctx) < 0) {
+            ret = -1;
+            break;
+        }
+        v[i] = gm_stats_clock() - t;
+    }
+    elapsed = gm_stats_clock() - start;
+
+    if (large != NULL) {
+        l.stop = true;
+        (void)pthread_join(tid, NULL);
+        if (l.ret < 0 && ret == 0) {
+            ndt_err_format(ctx, l.ctx.err, "%s", ndt_context_msg(&l.ctx));
+            ret = -1;
+        }
+        ndt_err_clear(&l.ctx);
+    }
+
+    if (ret == 0) {
+        qsort(v, (size_t)b->samples, sizeof *v, cmp_double);
+        print_result(b, mode, reserved, v, (double)l.ncalls / elapsed);
+    }
+
+    gm_set_reserved_threads(0);
+    ndt_free(v);
+    return ret;
+}
+
+
+/*****************************************************************************/
+/*                                     Main                                  */
+/*****************************************************************************/
+
+static void
+usage(void)
+{
+    fprintf(stderr,
+        "usage: contention [--format text|csv|json] [--threads N] [--large N]\n"
+        "                  [--small N] [--reserved N] [--samples N]\n"
+        "\n"
+        "  --format    output format (default: text)\n"
+        "  --threads   threads of the large call (default: number of cpus)\n"
+        "  --large     elements of the large call (default: 2^25)\n"
+        "  --small     elements of the small call (default: 1024)\n"
+        "  --reserved  reserved threads in lane mode (default: 1)\n"
+        "  --samples   number of small calls per mode (default: 20000)\n");
+}
+
+static int
+parse_args(bench_t *b, int argc, char *argv[])
+{
+    for (int i = 1; i < argc; i++) {
+        const char *arg = argv[i];
+        const char *value = i+1 < argc ? argv[i+1] : NULL;
+
+        if (value == NULL) {
+            return -1;
+        }
+
+        if (strcmp(arg, "--format") == 0) {
+            if (strcmp(value, "text") == 0) b->format = FMT_TEXT;
+            else if (strcmp(value, "csv") == 0) b->format = FMT_CSV;
+            else if (strcmp(value, "json") == 0) b->format = FMT_JSON;
+            else return -1;
+        }
+        else if (strcmp(arg, "--threads") == 0) {
+            b->nthreads = strtoll(value, NULL, 10);
+            if (b->nthreads < 2 || b->nthreads > INT64_C(1) << 20) {
+                return -1;
+            }
+        }
+        else if (strcmp(arg, "--large") == 0) {
+            b->large = strtoll(value, NULL, 10);
+            if (b->large < GM_THREAD_CUTOFF) {
+                return -1;
+            }
+        }
+        else if (strcmp(arg, "--small") == 0) {
+            b->small = strtoll(value, NULL, 10);
+            if (b->small < 1 || b->small >= GM_THREAD_CUTOFF) {
+                return -1;
+            }
+        }
+        else if (strcmp(arg, "--reserved") == 0) {
+            b->reserved = strtoll(value, NULL, 10);
+            if (b->reserved < 1) {
+                return -1;
+            }
+        }
+        else if (strcmp(arg, "--samples") == 0) {
+            b->samples = strtoll(value, NULL, 10);
+            if (b->samples < 1) {
+                return -1;
+            }
+        }
+        else {
+            return -1;
+        }
+
+        i++;
+    }
+
+    return 0;
+}
+
+int
+main(int argc, char *argv[])
+{
+    NDT_STATIC_CONTEXT(ctx);
+    call_t small, large;
+    gm_tbl_t *tbl;
+    bench_t b;
+    int ret = 0;
+
+    memset(&b, 0, sizeof b);
+    b.format = FMT_TEXT;
+    b.nthreads = 2;
+    b.large = INT64_C(1) << 25;
+    b.small = 1024;
+    b.reserved = 1;
+    b.samples = 20000;
+
+    {
+        long n = sysconf(_SC_NPROCESSORS_ONLN);
+        if (n > 2) {
+            b.nthreads = n;
+        }
+    }
+
+    if (parse_args(&b, argc, argv) < 0) {
+        usage();
+        return 2;
+    }
+
+    gm_init();
+
+    tbl = gm_tbl_new(&ctx);
+    if (tbl == NULL) {
+        goto error;
+    }
+
+    if (gm_init_cpu_binary_kernels(tbl, &ctx) < 0) {
+        gm_tbl_del(tbl);
+        goto error;
+    }
+    b.tbl = tbl;
+
+    if (call_init(&small, tbl, b.small, &ctx) < 0) {
+        gm_tbl_del(tbl);
+        goto error;
+    }
+    if (call_init(&large, tbl, b.large, &ctx) < 0) {
+        call_clear(&small);
+        gm_tbl_del(tbl);
+        goto error;
+    }
+
+    print_header(&b);
+    if (run_mode(&b, "idle", 0, &small, NULL, &ctx) < 0 ||
+        run_mode(&b, "fifo", 0, &small, &large, &ctx) < 0 ||
+        run_mode(&b, "lane", b.reserved, &small, &large, &ctx) < 0) {
+        fprintf(stderr, "contention: %s\n", ndt_context_msg(&ctx));
+        ndt_err_clear(&ctx);
+        ret = 1;
+    }
+    print_footer(&b);
+
+    call_clear(&large);
+    call_clear(&small);
+    gm_tbl_del(tbl);
+    gm_finalize();
+
+    return ret;
+
+error:
+    fprintf(stderr, "contention: %s\n", ndt_context_msg(&ctx));
+    ndt_err_clear(&ctx);
+    gm_finalize();
+    return 1;
+}
@@ -0,0 +1,758 @@
+/*
+ * BSD 3-Clause License
+ *
+ * Copyright (c) 2017-2018, plures
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+/*
+ * Microbenchmark for all elementwise kernels in the builtin cpu tables.
+ *
+ * Every kernel set is run on contiguous, strided, scalar-broadcast and var
+ * dimension layouts at working set sizes that fit into L1, L2, the last
+ * level cache and main memory.  Sets with optional dtypes exercise the
+ * optional layout.  Results are reported as ns/element and GB/s together
+ * with the memcpy bandwidth at the same working set size.
+ *
+ *   usage: kernels [--format text|csv|json] [--func NAME] [--level NAME]
+ *                  [--time SECONDS] [--quick]
+ */
+
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <string.h>
+#include <stdio.h>
+#include <math.h>
+#ifndef _WIN32
+  #include <unistd.h>
+#endif
+#include "ndtypes.h"
+#include "xnd.h"
+#include "gumath.h"
+
+
+#define ROUNDS 5
+#define MAX_LEVELS 4
+#define MIN_NELEM 64
+#define MAX_DRAM_SIZE (INT64_C(1) << 30)
+
+enum { FMT_TEXT, FMT_CSV, FMT_JSON };
+
+typedef enum { CONTIGUOUS, STRIDED, SCALAR, VAR, NUM_LAYOUTS } layout_t;
+
+static const char *layout_names[NUM_LAYOUTS] = {
+  "contiguous", "strided", "scalar", "var"
+};
+
+typedef struct {
+    const char *name;
+    int64_t size;       /* cache size in bytes */
+    double roofline;    /* memcpy bandwidth in GB/s */
+} level_t;
+
+typedef struct {
+    const gm_tbl_t *tbl;
+    int format;
+    const char *func;
+    const char *level;
+    double min_time;
+    level_t levels[MAX_LEVELS];
+    int nlevels;
+    int64_t nresults;
+    int64_t nerrors;
+} bench_t;
+
+/* Defeats elimination of the memcpy in memcpy_bandwidth(). */
+static volatile char sink;
+
+/* Input argument: 'master' owns the memory, 'view' is passed to the kernel. */
+typedef struct {
+    const ndt_t *type;
+    xnd_master_t *master;
+    xnd_t view;
+} arg_t;
+
+
+/*****************************************************************************/
+/*                                   Machine                                 */
+/*****************************************************************************/
+
+static int64_t
+cache_size(int name, int64_t dflt)
+{
+#ifndef _WIN32
+    long n = sysconf(name);
+    if (n > 0) {
+        return n;
+    }
+#else
+    (void)name;
+#endif
+    return dflt;
+}
+
+#if defined(_WIN32) || !defined(_SC_LEVEL1_DCACHE_SIZE)
+  #define _SC_LEVEL1_DCACHE_SIZE -1
+  #define _SC_LEVEL2_CACHE_SIZE -1
+  #define _SC_LEVEL3_CACHE_SIZE -1
+#endif
+
+static void
+init_levels(bench_t *b)
+{
+    int64_t l1 = cache_size(_SC_LEVEL1_DCACHE_SIZE, INT64_C(32) << 10);
+    int64_t l2 = cache_size(_SC_LEVEL2_CACHE_SIZE, INT64_C(1) << 20);
+    int64_t llc = cache_size(_SC_LEVEL3_CACHE_SIZE, l2);
+    int64_t dram = llc * 8 < MAX_DRAM_SIZE ? llc * 8 : MAX_DRAM_SIZE;
+
+    b->levels[0] = (level_t){ "L1", l1, 0 };
+    b->levels[1] = (level_t){ "L2", l2, 0 };
+    b->levels[2] = (level_t){ "LLC", llc, 0 };
+    b->levels[3] = (level_t){ "DRAM", dram, 0 };
+    b->nlevels = MAX_LEVELS;
+}
+
+/* Use half of each cache level so that the working set stays resident. */
+static int64_t
+working_set(const level_t *level)
+{
+    return level->size / 2;
+}
+
+/* Bandwidth of memcpy in GB/s, counting both the read and the write. */
+static double
+memcpy_bandwidth(int64_t size, double min_time)
+{
+    size_t n = (size_t)(size / 2);
+    char *src = malloc(n);
+    char *dst = malloc(n);
+    double best = HUGE_VAL;
+    int64_t reps = 1;
+
+    if (src == NULL || dst == NULL) {
+        free(src);
+        free(dst);
+        return 0;
+    }
+
+    memset(src, 1, n);
+    memset(dst, 0, n);
+
+    for (int round = 0; round < ROUNDS; round++) {
+        for (;;) {
+            double start = gm_stats_clock();
+            for (int64_t i = 0; i < reps; i++) {
+                memcpy(dst, src, n);
+                sink = dst[i % n];
+            }
+            double t = gm_stats_clock() - start;
+            if (t >= min_time / ROUNDS || reps >= INT64_C(1) << 40) {
+                if (t / reps < best) {
+                    best = t / reps;
+                }
+                break;
+            }
+            reps *= 2;
+        }
+    }
+
+    free(src);
+    free(dst);
+
+    return 2.0 * (double)n / best / 1e9;
+}
+
+
+/*****************************************************************************/
+/*                                  Arguments                                */
+/*****************************************************************************/
+
+static bool
+is_numeric(const ndt_t *t)
+{
+    switch (t->tag) {
+    case Bool:
+    case Int8: case Int16: case Int32: case Int64:
+    case Uint8: case Uint16: case Uint32: case Uint64:
+    case BFloat16: case Float16: case Float32: case Float64:
+    case Complex32: case Complex64: case Complex128:
+        return true;
+    default:
+        return false;
+    }
+}
+
+static void
+arg_clear(arg_t *a)
+{
+    if (a->master) {
+        xnd_del(a->master);
+    }
+    if (a->view.type && a->view.type != a->type) {
+        ndt_decref(a->view.type);
+    }
+    if (a->type) {
+        ndt_decref(a->type);
+    }
+    memset(a, 0, sizeof *a);
+}
+
+/*
+ * Allocate an input of 'n' elements of 'dtype' in the given layout.  The
+ * data is filled with the byte 0x3f, which yields small positive values for
+ * all numeric types.  All optional values are valid.
+ */
+static int
+arg_init(arg_t *a, const char *dtype, int64_t itemsize, layout_t layout,
+         bool scalar, int64_t n, ndt_context_t *ctx)
+{
+    char buf[512];
+    int64_t count;
+
+    memset(a, 0, sizeof *a);
+
+    if (scalar) {
+        snprintf(buf, sizeof buf, "%s", dtype);
+        count = 1;
+    }
+    else {
+        switch (layout) {
+        case STRIDED:
+            snprintf(buf, sizeof buf, "%" PRIi64 " * %s", 2*n, dtype);
+            count = 2*n;
+            break;
+        case VAR:
+            snprintf(buf, sizeof buf, "var(offsets=[0,%" PRIi64 "]) * %s", n, dtype);
+            count = n;
+            break;
+        default:
+            snprintf(buf, sizeof buf, "%" PRIi64 " * %s", n, dtype);
+            count = n;
+            break;
+        }
+    }
+
+    a->type = ndt_from_string(buf, ctx);
+    if (a->type == NULL) {
+        return -1;
+    }
+
+    a->master = xnd_empty_from_type(a->type, XND_OWN_EMBEDDED, ctx);
+    if (a->master == NULL) {
+        arg_clear(a);
+        return -1;
+    }
+
+    memset(a->master->master.ptr, 0x3f, (size_t)(count * itemsize));
+    if (a->master->master.bitmap.data != NULL) {
+        memset(a->master->master.bitmap.data, 0xff, (size_t)((count+7) / 8));
+    }
+
+    a->view = a->master->master;
+
+    if (layout == STRIDED && !scalar) {
+        xnd_index_t index;
+        index.tag = Slice;
+        index.Slice.start = 0;
+        index.Slice.stop = 2*n;
+        index.Slice.step = 2;
+
+        a->view = xnd_subscript(&a->master->master, &index, 1, ctx);
+        if (xnd_err_occurred(&a->view)) {
+            a->view.type = NULL;
+            arg_clear(a);
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+
+/*****************************************************************************/
+/*                                   Timing                                  */
+/*****************************************************************************/
+
+/*
+ * Minimum time per call over ROUNDS rounds.  The number of calls per round
+ * is doubled until a round takes at least min_time/ROUNDS seconds.
+ */
+static double
+time_kernel(const gm_kernel_t *kernel, const xnd_t stack[], int nargs,
+            int outer_dims, double min_time, ndt_context_t *ctx)
+{
+    xnd_t s[NDT_MAX_ARGS];
+    double best = HUGE_VAL;
+    int64_t reps = 1;
+
+    for (int round = 0; round < ROUNDS; round++) {
+        for (;;) {
+            double start = gm_stats_clock();
+            for (int64_t i = 0; i < reps; i++) {
+                memcpy(s, stack, nargs * sizeof *s);
+                if (gm_apply(kernel, s, outer_dims, ctx) < 0) {
+                    return -1;
+                }
+            }
+            double t = gm_stats_clock() - start;
+            if (t >= min_time / ROUNDS || reps >= INT64_C(1) << 40) {
+                if (t / reps < best) {
+                    best = t / reps;
+                }
+                break;
+            }
+            reps *= 2;
+        }
+    }
+
+    return best;
+}
+
+
+/*****************************************************************************/
+/*                                   Output                                  */
+/*****************************************************************************/
+
+static void
+print_json_string(const char *s)
+{
+    putchar('"');
+    for (; *s; s++) {
+        if (*s == '"' || *s == '\\') {
+            putchar('\\');
+        }
+        putchar(*s);
+    }
+    putchar('"');
+}
+
+static void
+print_header(const bench_t *b)
+{
+    switch (b->format) {
+    case FMT_CSV:
+        printf("func,sig,variant,layout,level,nelem,bytes,ns_per_elem,gbps,"
+               "roofline_gbps,efficiency\n");
+        break;
+    case FMT_JSON:
+        printf("{\n  \"isa\": \"%s\",\n  \"levels\": [", gm_cpu_isa());
+        for (int i = 0; i < b->nlevels; i++) {
+            printf("%s\n    {\"name\": \"%s\", \"size\": %" PRIi64 ", "
+                   "\"roofline_gbps\": %.3f}", i ? "," : "",
+                   b->levels[i].name, b->levels[i].size, b->levels[i].roofline);
+        }
+        printf("\n  ],\n  \"results\": [");
+        break;
+    default:
+        printf("# isa  %s\n", gm_cpu_isa());
+        for (int i = 0; i < b->nlevels; i++) {
+            printf("# %-4s %10" PRIi64 " bytes  memcpy %8.2f GB/s\n",
+                   b->levels[i].name, b->levels[i].size, b->levels[i].roofline);
+        }
+        printf("%-14s %-10s %-10s %-5s %10s %10s %10s %7s  %s\n",
+               "func", "variant", "layout", "level", "nelem", "ns/elem",
+               "GB/s", "roof%", "sig");
+        break;
+    }
+}
+
+static void
+print_result(bench_t *b, const char *func, const char *sig, const char *variant,
+             const char *layout, const level_t *level, int64_t n,
+             int64_t bytes, double t)
+{
+    double ns = t * 1e9 / (double)n;
+    double gbps = (double)bytes / t / 1e9;
+    double eff = level->roofline > 0 ? gbps / level->roofline : 0;
+
+    switch (b->format) {
+    case FMT_CSV:
+        printf("%s,\"%s\",%s,%s,%s,%" PRIi64 ",%" PRIi64 ",%.4f,%.3f,%.3f,%.4f\n",
+               func, sig, variant, layout, level->name, n, bytes, ns, gbps,
+               level->roofline, eff);
+        break;
+    case FMT_JSON:
+        printf("%s\n    {\"func\": ", b->nresults ? "," : "");
+        print_json_string(func);
+        printf(", \"sig\": ");
+        print_json_string(sig);
+        printf(", \"variant\": \"%s\", \"layout\": \"%s\", \"level\": \"%s\", "
+               "\"nelem\": %" PRIi64 ", \"bytes\": %" PRIi64 ", "
+               "\"ns_per_elem\": %.4f, \"gbps\": %.3f, \"efficiency\": %.4f}",
+               variant, layout, level->name, n, bytes, ns, gbps, eff);
+        break;
+    default:
+        printf("%-14s %-10s %-10s %-5s %10" PRIi64 " %10.3f %10.2f %6.1f%%  %s\n",
+               func, variant, layout, level->name, n, ns, gbps, 100*eff, sig);
+        break;
+    }
+
+    b->nresults++;
+    fflush(stdout);
+}
+
+static void
+print_footer(const bench_t *b)
+{
+    if (b->format == FMT_JSON) {
+        printf("\n  ]\n}\n");
+    }
+}
+
+
+/*****************************************************************************/
+/*                                  Benchmark                                */
+/*****************************************************************************/
+
+static void
+report_error(bench_t *b, const char *func, const char *sig, const char *layout,
+             ndt_context_t *ctx)
+{
+    fprintf(stderr, "kernels: %s %s (%s): %s\n", func, sig, layout,
+            ndt_context_msg(ctx));
+    ndt_err_clear(ctx);
+    b->nerrors++;
+}
+
+/* Run a single kernel set on one layout and working set size. */
+static void
+bench_layout(bench_t *b, const gm_func_t *f, const gm_kernel_set_t *set,
+             const char *sig, const char *dtypes[], const int64_t itemsize[],
+             int64_t elemsize, layout_t layout, const char *label,
+             const level_t *level)
+{
+    NDT_STATIC_CONTEXT(ctx);
+    const int nin = (int)set->sig->Function.nin;
+    ndt_apply_spec_t spec = ndt_apply_spec_empty;
+    arg_t in[NDT_MAX_ARGS];
+    xnd_master_t *out[NDT_MAX_ARGS];
+    xnd_t stack[NDT_MAX_ARGS];
+    const ndt_t *types[NDT_MAX_ARGS];
+    int64_t li[NDT_MAX_ARGS];
+    gm_kernel_t kernel;
+    int64_t bytes = 0;
+    int64_t n;
+    double t;
+    int i, k;
+
+    n = working_set(level) / elemsize;
+    if (n < MIN_NELEM) {
+        n = MIN_NELEM;
+    }
+
+    for (i = 0; i < nin; i++) {
+        bool scalar = layout == SCALAR && i == nin-1;
+        if (arg_init(&in[i], dtypes[i], itemsize[i], layout, scalar, n, &ctx) < 0) {
+            report_error(b, f->name, sig, label, &ctx);
+            goto clear_inputs;
+        }
+        stack[i] = in[i].view;
+        types[i] = stack[i].type;
+        li[i] = stack[i].index;
+        bytes += scalar ? 0 : n * itemsize[i];
+    }
+
+    kernel = gm_select(&spec, b->tbl, f->name, types, li, nin, 0, false,
+                       stack, &ctx);
+    if (kernel.set == NULL) {
+        /* The layout is not supported by this function. */
+        ndt_err_clear(&ctx);
+        goto clear_inputs;
+    }
+
+    /* The inputs are dispatched to an earlier set with a matching signature. */
+    if (kernel.set != set) {
+        ndt_apply_spec_clear(&spec);
+        goto clear_inputs;
+    }
+
+    for (k = 0; k < spec.nout; k++) {
+        const ndt_t *u = spec.types[nin+k];
+
+        if (!ndt_is_concrete(u)) {
+            goto clear_outputs;
+        }
+
+        out[k] = xnd_empty_from_type(u, XND_OWN_EMBEDDED, &ctx);
+        if (out[k] == NULL) {
+            report_error(b, f->name, sig, label, &ctx);
+            goto clear_outputs;
+        }
+
+        stack[nin+k] = out[k]->master;
+        bytes += n * ndt_dtype(u)->datasize;
+    }
+
+    for (int j = 0; j < spec.nargs; j++) {
+        stack[j].type = spec.types[j];
+    }
+
+    t = time_kernel(&kernel, stack, spec.nargs, spec.outer_dims, b->min_time, &ctx);
+    if (t < 0) {
+        report_error(b, f->name, sig, label, &ctx);
+    }
+    else {
+        print_result(b, f->name, sig, gm_variant_name(kernel.flag), label,
+                     level, n, bytes, t);
+    }
+
+clear_outputs:
+    while (--k >= 0) {
+        xnd_del(out[k]);
+    }
+    ndt_apply_spec_clear(&spec);
+clear_inputs:
+    while (--i >= 0) {
+        arg_clear(&in[i]);
+    }
+}
+
+static int
+bench_set(bench_t *b, const gm_func_t *f, const gm_kernel_set_t *set)
+{
+    NDT_STATIC_CONTEXT(ctx);
+    const gm_kernel_t kernel = { 0, set };
+    const int nin = (int)set->sig->Function.nin;
+    const int nargs = (int)set->sig->Function.nargs;
+    char *dtypes[NDT_MAX_ARGS];
+    int64_t itemsize[NDT_MAX_ARGS];
+    int64_t elemsize = 0;
+    bool optional = false;
+    char *sig = NULL;
+    int i;
+
+    if (nin == 0 || !gm_is_elementwise(&kernel)) {
+        return 0;
+    }
+
+    for (i = 0; i < nargs; i++) {
+        const ndt_t *t = set->sig->Function.types[i];
+
+        if (t->tag == EllipsisDim) {
+            t = t->EllipsisDim.type;
+        }
+
+        if (i < nin) {
+            if (ndt_is_abstract(t) || !is_numeric(t)) {
+                goto out;
+            }
+
+            dtypes[i] = ndt_as_string(t, &ctx);
+            if (dtypes[i] == NULL) {
+                report_error(b, f->name, "", "", &ctx);
+                goto out;
+            }
+
+            itemsize[i] = t->datasize;
+            optional |= ndt_is_optional(t);
+        }
+
+        /* Abstract outputs are approximated by the size of the first input. */
+        elemsize += ndt_is_concrete(t) ? t->datasize : itemsize[0];
+    }
+
+    sig = ndt_as_string(set->sig, &ctx);
+    if (sig == NULL) {
+        report_error(b, f->name, "", "", &ctx);
+        goto out;
+    }
+
+    for (int l = 0; l < b->nlevels; l++) {
+        for (int layout = 0; layout < NUM_LAYOUTS; layout++) {
+            char label[32];
+
+            if (layout == SCALAR && nin < 2) {
+                continue;
+            }
+
+            snprintf(label, sizeof label, "%s%s", optional ? "optional-" : "",
+                     layout_names[layout]);
+
+            bench_layout(b, f, set, sig, (const char **)dtypes, itemsize,
+                         elemsize, (layout_t)layout, label, &b->levels[l]);
+        }
+    }
+
+out:
+    ndt_free(sig);
+    while (--i >= 0) {
+        if (i < nin) {
+            ndt_free(dtypes[i]);
+        }
+    }
+    return 0;
+}
+
+static int
+bench_func(const gm_func_t *f, void *state)
+{
+    bench_t *b = (bench_t *)state;
+
+    if (b->func != NULL && strcmp(f->name, b->func) != 0) {
+        return 0;
+    }
+
+    for (int i = 0; i < f->nkernels; i++) {
+        if (bench_set(b, f, &f->kernels[i]) < 0) {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+
+/*****************************************************************************/
+/*                                     Main                                  */
+/*****************************************************************************/
+
+static void
+usage(void)
+{
+    fprintf(stderr,
+        "usage: kernels [--format text|csv|json] [--func NAME] [--level NAME]\n"
+        "               [--time SECONDS] [--quick]\n"
+        "\n"
+        "  --format  output format (default: text)\n"
+        "  --func    only run the kernels of function NAME\n"
+        "  --level   only use the working set size of L1, L2, LLC or DRAM\n"
+        "  --time    minimum measurement time per result (default: 0.05)\n"
+        "  --quick   shorthand for --time 0.005\n");
+}
+
+static int
+parse_args(bench_t *b, int argc, char *argv[])
+{
+    for (int i = 1; i < argc; i++) {
+        const char *arg = argv[i];
+        const char *value = i+1 < argc ? argv[i+1] : NULL;
+
+        if (strcmp(arg, "--quick") == 0) {
+            b->min_time = 0.005;
+            continue;
+        }
+
+        if (value == NULL) {
+            return -1;
+        }
+
+        if (strcmp(arg, "--format") == 0) {
+            if (strcmp(value, "text") == 0) b->format = FMT_TEXT;
+            else if (strcmp(value, "csv") == 0) b->format = FMT_CSV;
+            else if (strcmp(value, "json") == 0) b->format = FMT_JSON;
+            else return -1;
+        }
+        else if (strcmp(arg, "--func") == 0) {
+            b->func = value;
+        }
+        else if (strcmp(arg, "--level") == 0) {
+            b->level = value;
+        }
+        else if (strcmp(arg, "--time") == 0) {
+            b->min_time = strtod(value, NULL);
+            if (!(b->min_time > 0)) {
+                return -1;
+            }
+        }
+        else {
+            return -1;
+        }
+
+        i++;
+    }
+
+    return 0;
+}
+
+int
+main(int argc, char *argv[])
+{
+    NDT_STATIC_CONTEXT(ctx);
+    bench_t b;
+    gm_tbl_t *tbl;
+    int n = 0;
+
+    memset(&b, 0, sizeof b);
+    b.format = FMT_TEXT;
+    b.min_time = 0.05;
+
+    if (parse_args(&b, argc, argv) < 0) {
+        usage();
+        return 2;
+    }
+
+    init_levels(&b);
+    for (int i = 0; i < b.nlevels; i++) {
+        if (b.level == NULL || strcmp(b.levels[i].name, b.level) == 0) {
+            b.levels[n] = b.levels[i];
+            b.levels[n].roofline = memcpy_bandwidth(working_set(&b.levels[n]),
+                                                    b.min_time);
+            n++;
+        }
+    }
+    if (n == 0) {
+        usage();
+        return 2;
+    }
+    b.nlevels = n;
+
+    gm_init();
+
+    tbl = gm_tbl_new(&ctx);
+    if (tbl == NULL) {
+        goto error;
+    }
+
+    if (gm_init_cpu_unary_kernels(tbl, &ctx) < 0 ||
+        gm_init_cpu_binary_kernels(tbl, &ctx) < 0) {
+        gm_tbl_del(tbl);
+        goto error;
+    }
+    b.tbl = tbl;
+
+    print_header(&b);
+    (void)gm_tbl_map(tbl, bench_func, &b);
+    print_footer(&b);
+
+    gm_tbl_del(tbl);
+    gm_finalize();
+
+    return b.nerrors > 0;
+
+error:
+    fprintf(stderr, "kernels: %s\n", ndt_context_msg(&ctx));
+    ndt_err_clear(&ctx);
+    gm_finalize();
+    return 1;
+}
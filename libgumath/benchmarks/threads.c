@@ -0,0 +1,618 @@
+/*
+ * BSD 3-Clause License
+ *
+ * Copyright (c) 2017-2018, plures
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+/*
+ * Thread scaling of gm_apply_thread() for cheap (add uint8), medium
+ * (multiply float64) and expensive (tgamma float64, euclidian_pdist) kernels.
+ *
+ * Strong scaling: fixed sizes from 2^10 elements up to --max-size, which
+ * bracket GM_THREAD_CUTOFF, on 1 to --threads threads.  The cutoff is
+ * disabled during the measurements.
+ *
+ * Weak scaling: GM_THREAD_CUTOFF/4 elements per thread.
+ *
+ * Break-even: the smallest size from which on the threaded call is faster
+ * than the serial call.
+ *
+ * The arguments are taken from the buffer pool without zero-filling.  With
+ * --numa, the workers are pinned (GM_NUMA_PIN) and the inputs and outputs
+ * are first touched by the threads that process them (GM_NUMA_FIRST_TOUCH),
+ * so that bandwidth bound kernels can be compared across sockets.
+ *
+ *   usage: threads [--format text|csv|json] [--threads N] [--max-size N]
+ *                  [--time SECONDS] [--quick] [--numa]
+ */
+
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <string.h>
+#include <stdio.h>
+#include <math.h>
+#ifndef _WIN32
+  #include <unistd.h>
+#endif
+#include "ndtypes.h"
+#include "xnd.h"
+#include "gumath.h"
+
+
+#define ROUNDS 5
+#define MAX_THREADS 256
+#define MAX_SIZES 64
+#define MIN_SIZE (INT64_C(1) << 10)
+
+enum { FMT_TEXT, FMT_CSV, FMT_JSON };
+
+typedef struct {
+    const char *func;
+    const char *type;     /* input type, formatted with the size */
+    const char *cost;
+    int nin;
+    int64_t min_size;
+    int64_t max_size;     /* 0 for --max-size */
+    bool weak;            /* the size is proportional to the work */
+} case_t;
+
+static const case_t cases[] = {
+  { "add", "%" PRIi64 " * uint8", "cheap", 2, MIN_SIZE, 0, true },
+  { "multiply", "%" PRIi64 " * float64", "medium", 2, MIN_SIZE, 0, true },
+  { "tgamma", "%" PRIi64 " * float64", "expensive", 1, MIN_SIZE, 0, true },
+  { "euclidian_pdist", "%" PRIi64 " * 16 * float64", "expensive", 1, 64, 2048, false },
+};
+
+#define NUM_CASES (sizeof cases / sizeof cases[0])
+
+typedef struct {
+    const gm_tbl_t *tbl;
+    int format;
+    double min_time;
+    int64_t max_size;
+    bool numa;
+    int64_t threads[MAX_THREADS];
+    int nthreads;
+    int64_t nresults;
+    int64_t nerrors;
+} bench_t;
+
+/* Arguments of one call. */
+typedef struct {
+    gm_kernel_t kernel;
+    ndt_apply_spec_t spec;
+    const ndt_t *types[NDT_MAX_ARGS];
+    xnd_t args[NDT_MAX_ARGS];   /* pooled containers */
+    xnd_t stack[NDT_MAX_ARGS];
+    int nargs;
+} call_t;
+
+
+/*****************************************************************************/
+/*                                   Calls                                   */
+/*****************************************************************************/
+
+static void
+call_clear(call_t *c)
+{
+    for (int i = 0; i < c->nargs; i++) {
+        gm_pool_xnd_del(&c->args[i]);
+    }
+    for (int i = 0; i < c->spec.nin; i++) {
+        ndt_decref(c->types[i]);
+    }
+    ndt_apply_spec_clear(&c->spec);
+}
+
+static void
+fill_range(int64_t begin, int64_t end, void *arg)
+{
+    const xnd_t *x = arg;
+    const int64_t size = x->type->datasize;
+    const int64_t n = x->type->datasize / 4096 + 1;
+    const int64_t lo = begin * size / n;
+    const int64_t hi = end * size / n;
+
+    memset(x->ptr + lo, 0x3f, (size_t)(hi - lo));
+}
+
+/* With --numa, the pages of each part are touched by its worker first. */
+static void
+fill_input(const xnd_t *x, const bench_t *b)
+{
+    if (b->numa) {
+        const int64_t nthreads = b->threads[b->nthreads-1];
+        gm_parallel_for(x->type->datasize / 4096 + 1, 1, nthreads, fill_range,
+                        (void *)x);
+    }
+    else {
+        memset(x->ptr, 0x3f, (size_t)x->type->datasize);
+    }
+}
+
+/*
+ * Create the inputs for case 'k' with size 'n' and select the kernel.  The
+ * inputs are filled with the byte 0x3f, which yields small positive values.
+ */
+static int
+call_init(call_t *c, const bench_t *b, const case_t *k, int64_t n,
+          ndt_context_t *ctx)
+{
+    int64_t li[NDT_MAX_ARGS];
+    char buf[128];
+    int i;
+
+    memset(c, 0, sizeof *c);
+    c->spec = ndt_apply_spec_empty;
+
+    snprintf(buf, sizeof buf, k->type, n);
+
+    for (i = 0; i < k->nin; i++) {
+        c->types[i] = ndt_from_string(buf, ctx);
+        if (c->types[i] == NULL) {
+            goto error;
+        }
+
+        if (gm_pool_xnd_empty(&c->args[i], c->types[i], ctx) < 0) {
+            ndt_decref(c->types[i]);
+            goto error;
+        }
+
+        fill_input(&c->args[i], b);
+        c->stack[i] = c->args[i];
+        li[i] = 0;
+    }
+
+    c->kernel = gm_select(&c->spec, b->tbl, k->func, c->types, li, k->nin, 0,
+                          false, c->stack, ctx);
+    if (c->kernel.set == NULL) {
+        goto error;
+    }
+    c->nargs = k->nin;
+
+    for (i = k->nin; i < c->spec.nargs; i++) {
+        if (gm_pool_xnd_empty(&c->args[i], c->spec.types[i], ctx) < 0) {
+            call_clear(c);
+            return -1;
+        }
+        c->stack[i] = c->args[i];
+        c->nargs++;
+    }
+
+    for (i = 0; i < c->spec.nargs; i++) {
+        c->stack[i].type = c->spec.types[i];
+    }
+
+    return 0;
+
+error:
+    while (--i >= 0) {
+        gm_pool_xnd_del(&c->args[i]);
+        ndt_decref(c->types[i]);
+    }
+    return -1;
+}
+
+/* Minimum time per call over ROUNDS rounds. */
+static double
+time_call(const call_t *c, int64_t nthreads, double min_time, ndt_context_t *ctx)
+{
+    xnd_t s[NDT_MAX_ARGS];
+    double best = HUGE_VAL;
+    int64_t reps = 1;
+
+    for (int round = 0; round < ROUNDS; round++) {
+        for (;;) {
+            double start = gm_stats_clock();
+            for (int64_t i = 0; i < reps; i++) {
+                int ret;
+                memcpy(s, c->stack, c->nargs * sizeof *s);
+                ret = nthreads > 1
+                    ? gm_apply_thread(&c->kernel, s, c->spec.outer_dims, nthreads, ctx)
+                    : gm_apply(&c->kernel, s, c->spec.outer_dims, ctx);
+                if (ret < 0) {
+                    return -1;
+                }
+            }
+            double t = gm_stats_clock() - start;
+            if (t >= min_time / ROUNDS || reps >= INT64_C(1) << 40) {
+                if (t / reps < best) {
+                    best = t / reps;
+                }
+                break;
+            }
+            reps *= 2;
+        }
+    }
+
+    return best;
+}
+
+/* Number of threads that gm_apply_thread() actually uses for 'c'. */
+static int64_t
+used_threads(call_t *c, int64_t nthreads, const char **reason)
+{
+    return gm_thread_decision(&c->kernel, c->stack, c->spec.types, c->spec.outer_dims,
+                              nthreads, reason);
+}
+
+
+/*****************************************************************************/
+/*                                   Output                                  */
+/*****************************************************************************/
+
+static void
+print_header(const bench_t *b)
+{
+    switch (b->format) {
+    case FMT_CSV:
+        printf("mode,func,cost,nelem,threads,ns,speedup,efficiency\n");
+        break;
+    case FMT_JSON:
+        printf("{\n  \"thread_cutoff\": %" PRIi64 ",\n  \"max_threads\": %" PRIi64
+               ",\n  \"numa_nodes\": %d,\n  \"numa\": %s,\n  \"results\": [",
+               (int64_t)GM_THREAD_CUTOFF, b->threads[b->nthreads-1],
+               gm_numa_nodes(), b->numa ? "true" : "false");
+        break;
+    default:
+        printf("# GM_THREAD_CUTOFF %" PRIi64 ", max threads %" PRIi64
+               ", numa nodes %d%s\n", (int64_t)GM_THREAD_CUTOFF,
+               b->threads[b->nthreads-1], gm_numa_nodes(),
+               b->numa ? " (pinned, first touch)" : "");
+        printf("%-10s %-16s %-9s %10s %7s %14s %8s %6s\n", "mode", "func",
+               "cost", "nelem", "threads", "ns", "speedup", "eff");
+        break;
+    }
+}
+
+/* A break-even row has t == 0, nelem == -1 if there is no break-even size. */
+static void
+print_result(bench_t *b, const char *mode, const case_t *k, int64_t n,
+             int64_t nthreads, double t, double speedup)
+{
+    const double ns = t * 1e9;
+    const double eff = speedup / (double)nthreads;
+
+    switch (b->format) {
+    case FMT_CSV:
+        printf("%s,%s,%s,%" PRIi64 ",%" PRIi64 ",%.1f,%.4f,%.4f\n",
+               mode, k->func, k->cost, n, nthreads, ns, speedup, eff);
+        break;
+    case FMT_JSON:
+        printf("%s\n    {\"mode\": \"%s\", \"func\": \"%s\", \"cost\": \"%s\", "
+               "\"nelem\": %" PRIi64 ", \"threads\": %" PRIi64 ", \"ns\": %.1f, "
+               "\"speedup\": %.4f, \"efficiency\": %.4f}", b->nresults ? "," : "",
+               mode, k->func, k->cost, n, nthreads, ns, speedup, eff);
+        break;
+    default:
+        printf("%-10s %-16s %-9s %10" PRIi64 " %7" PRIi64 " %14.1f %8.2f %6.2f\n",
+               mode, k->func, k->cost, n, nthreads, ns, speedup, eff);
+        break;
+    }
+
+    b->nresults++;
+    fflush(stdout);
+}
+
+static void
+print_footer(const bench_t *b)
+{
+    if (b->format == FMT_JSON) {
+        printf("\n  ]\n}\n");
+    }
+}
+
+static void
+report_error(bench_t *b, const case_t *k, int64_t n, ndt_context_t *ctx)
+{
+    fprintf(stderr, "threads: %s (%" PRIi64 "): %s\n", k->func, n,
+            ndt_context_msg(ctx));
+    ndt_err_clear(ctx);
+    b->nerrors++;
+}
+
+
+/*****************************************************************************/
+/*                                  Benchmark                                */
+/*****************************************************************************/
+
+/* Strong scaling and break-even sizes for case 'k'. */
+static void
+strong_scaling(bench_t *b, const case_t *k)
+{
+    NDT_STATIC_CONTEXT(ctx);
+    const int64_t max_size = k->max_size ? k->max_size : b->max_size;
+    int64_t sizes[MAX_SIZES];
+    bool faster[MAX_SIZES][MAX_THREADS];
+    int nsizes = 0;
+
+    for (int64_t n = k->min_size; n <= max_size && nsizes < MAX_SIZES; n *= 2) {
+        const char *reason;
+        bool serial = false;
+        double t1 = -1;
+        call_t c;
+
+        sizes[nsizes] = n;
+        memset(faster[nsizes], 0, sizeof faster[nsizes]);
+
+        if (call_init(&c, b, k, n, &ctx) < 0) {
+            report_error(b, k, n, &ctx);
+            continue;
+        }
+
+        for (int i = 0; i < b->nthreads; i++) {
+            const int64_t p = b->threads[i];
+            double t;
+
+            if (p > 1 && used_threads(&c, p, &reason) <= 1) {
+                serial = true;
+                break;
+            }
+
+            t = time_call(&c, p, b->min_time, &ctx);
+            if (t < 0) {
+                report_error(b, k, n, &ctx);
+                break;
+            }
+            if (p == 1) {
+                t1 = t;
+            }
+
+            print_result(b, "strong", k, n, p, t, t1 / t);
+            faster[nsizes][i] = t < t1;
+        }
+
+        if (serial && b->format == FMT_TEXT) {
+            printf("# %s is not split: %s\n", k->func, reason);
+        }
+
+        call_clear(&c);
+        nsizes++;
+    }
+
+    for (int i = 1; i < b->nthreads; i++) {
+        int64_t n = -1;
+
+        for (int j = nsizes-1; j >= 0 && faster[j][i]; j--) {
+            n = sizes[j];
+        }
+
+        print_result(b, "breakeven", k, n, b->threads[i], 0, 0);
+    }
+}
+
+/* Weak scaling with GM_THREAD_CUTOFF/4 elements per thread. */
+static void
+weak_scaling(bench_t *b, const case_t *k)
+{
+    NDT_STATIC_CONTEXT(ctx);
+    const int64_t size = GM_THREAD_CUTOFF / 4;
+    double t1 = -1;
+
+    if (!k->weak) {
+        return;
+    }
+
+    for (int i = 0; i < b->nthreads; i++) {
+        const int64_t p = b->threads[i];
+        const int64_t n = size * p;
+        const char *reason;
+        double t;
+        call_t c;
+
+        if (n > b->max_size) {
+            break;
+        }
+
+        if (call_init(&c, b, k, n, &ctx) < 0) {
+            report_error(b, k, n, &ctx);
+            break;
+        }
+
+        if (p > 1 && used_threads(&c, p, &reason) <= 1) {
+            call_clear(&c);
+            break;
+        }
+
+        t = time_call(&c, p, b->min_time, &ctx);
+        call_clear(&c);
+        if (t < 0) {
+            report_error(b, k, n, &ctx);
+            break;
+        }
+        if (p == 1) {
+            t1 = t;
+        }
+
+        /* Speedup in throughput: p times the work in time t. */
+        print_result(b, "weak", k, n, p, t, (double)p * t1 / t);
+    }
+}
+
+
+/*****************************************************************************/
+/*                                     Main                                  */
+/*****************************************************************************/
+
+static void
+usage(void)
+{
+    fprintf(stderr,
+        "usage: threads [--format text|csv|json] [--threads N] [--max-size N]\n"
+        "               [--time SECONDS] [--quick] [--numa]\n"
+        "\n"
+        "  --format    output format (default: text)\n"
+        "  --threads   maximum number of threads (default: number of cpus)\n"
+        "  --max-size  maximum number of elements (default: 2^24)\n"
+        "  --time      minimum measurement time per result (default: 0.05)\n"
+        "  --quick     shorthand for --time 0.005\n"
+        "  --numa      pin workers and first touch the arguments in parallel\n");
+}
+
+static int
+parse_args(bench_t *b, int64_t *max_threads, int argc, char *argv[])
+{
+    for (int i = 1; i < argc; i++) {
+        const char *arg = argv[i];
+        const char *value = i+1 < argc ? argv[i+1] : NULL;
+
+        if (strcmp(arg, "--quick") == 0) {
+            b->min_time = 0.005;
+            continue;
+        }
+        if (strcmp(arg, "--numa") == 0) {
+            b->numa = true;
+            continue;
+        }
+
+        if (value == NULL) {
+            return -1;
+        }
+
+        if (strcmp(arg, "--format") == 0) {
+            if (strcmp(value, "text") == 0) b->format = FMT_TEXT;
+            else if (strcmp(value, "csv") == 0) b->format = FMT_CSV;
+            else if (strcmp(value, "json") == 0) b->format = FMT_JSON;
+            else return -1;
+        }
+        else if (strcmp(arg, "--threads") == 0) {
+            *max_threads = strtoll(value, NULL, 10);
+            if (*max_threads < 1 || *max_threads > INT64_C(1) << 20) {
+                return -1;
+            }
+        }
+        else if (strcmp(arg, "--max-size") == 0) {
+            b->max_size = strtoll(value, NULL, 10);
+            if (b->max_size < MIN_SIZE) {
+                return -1;
+            }
+        }
+        else if (strcmp(arg, "--time") == 0) {
+            b->min_time = strtod(value, NULL);
+            if (!(b->min_time > 0)) {
+                return -1;
+            }
+        }
+        else {
+            return -1;
+        }
+
+        i++;
+    }
+
+    return 0;
+}
+
+/* 1, 2, 4, ... and max_threads. */
+static void
+init_threads(bench_t *b, int64_t max_threads)
+{
+    b->nthreads = 0;
+    for (int64_t p = 1; p < max_threads && b->nthreads < MAX_THREADS-1; p *= 2) {
+        b->threads[b->nthreads++] = p;
+    }
+    b->threads[b->nthreads++] = max_threads;
+}
+
+int
+main(int argc, char *argv[])
+{
+    NDT_STATIC_CONTEXT(ctx);
+    int64_t max_threads = 1;
+    gm_tbl_t *tbl;
+    bench_t b;
+
+    memset(&b, 0, sizeof b);
+    b.format = FMT_TEXT;
+    b.min_time = 0.05;
+    b.max_size = INT64_C(1) << 24;
+
+#ifndef _WIN32
+    {
+        long n = sysconf(_SC_NPROCESSORS_ONLN);
+        if (n > 0) {
+            max_threads = n;
+        }
+    }
+#endif
+
+    if (parse_args(&b, &max_threads, argc, argv) < 0) {
+        usage();
+        return 2;
+    }
+    init_threads(&b, max_threads);
+
+    gm_init();
+
+    tbl = gm_tbl_new(&ctx);
+    if (tbl == NULL) {
+        goto error;
+    }
+
+    if (gm_init_cpu_unary_kernels(tbl, &ctx) < 0 ||
+        gm_init_cpu_binary_kernels(tbl, &ctx) < 0 ||
+        gm_init_pdist_kernels(tbl, &ctx) < 0) {
+        gm_tbl_del(tbl);
+        goto error;
+    }
+    b.tbl = tbl;
+
+    /* Measure below the cutoff in order to find the break-even size. */
+    gm_set_thread_cutoff(0);
+    if (b.numa) {
+        /* Fresh pages for each size: cached blocks keep their placement. */
+        gm_set_numa_policy(GM_NUMA_PIN|GM_NUMA_FIRST_TOUCH);
+        gm_pool_set_cap(0);
+    }
+
+    print_header(&b);
+    for (size_t i = 0; i < NUM_CASES; i++) {
+        strong_scaling(&b, &cases[i]);
+        weak_scaling(&b, &cases[i]);
+    }
+    print_footer(&b);
+
+    gm_set_thread_cutoff(GM_THREAD_CUTOFF);
+    gm_tbl_del(tbl);
+    gm_finalize();
+
+    return b.nerrors > 0;
+
+error:
+    fprintf(stderr, "threads: %s\n", ndt_context_msg(&ctx));
+    ndt_err_clear(&ctx);
+    gm_finalize();
+    return 1;
+}
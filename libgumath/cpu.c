@@ -0,0 +1,200 @@
+/*
+ * BSD 3-Clause License
+ *
+ * Copyright (c) 2017-2018, plures
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#include <stdlib.h>
+#include <string.h>
+#include "ndtypes.h"
+#include "gumath.h"
+#ifndef _MSC_VER
+#include "config.h"
+#endif
+
+#if defined(HAVE_GM_CPU_ISA_SVE)
+  #include <sys/auxv.h>
+  #ifndef HWCAP_SVE
+    #define HWCAP_SVE (1 << 22)
+  #endif
+#endif
+
+
+/****************************************************************************/
+/*                  Instruction set variants of the cpu kernels             */
+/****************************************************************************/
+
+/*
+ * The cpu kernels are compiled once for the baseline of the target and once
+ * for each instruction set in HAVE_GM_CPU_ISA_*.  The variant is chosen at
+ * the first table initialization and applies to the whole process.
+ */
+
+int gm_init_cpu_unary_kernels_baseline(gm_tbl_t *tbl, ndt_context_t *ctx);
+int gm_init_cpu_binary_kernels_baseline(gm_tbl_t *tbl, ndt_context_t *ctx);
+
+#ifdef HAVE_GM_CPU_ISA_AVX512
+int gm_init_cpu_unary_kernels_avx512(gm_tbl_t *tbl, ndt_context_t *ctx);
+int gm_init_cpu_binary_kernels_avx512(gm_tbl_t *tbl, ndt_context_t *ctx);
+#endif
+#ifdef HAVE_GM_CPU_ISA_AVX2
+int gm_init_cpu_unary_kernels_avx2(gm_tbl_t *tbl, ndt_context_t *ctx);
+int gm_init_cpu_binary_kernels_avx2(gm_tbl_t *tbl, ndt_context_t *ctx);
+#endif
+#ifdef HAVE_GM_CPU_ISA_SVE
+int gm_init_cpu_unary_kernels_sve(gm_tbl_t *tbl, ndt_context_t *ctx);
+int gm_init_cpu_binary_kernels_sve(gm_tbl_t *tbl, ndt_context_t *ctx);
+#endif
+
+#if defined(__x86_64__) || defined(_M_X64)
+  #define GM_CPU_ISA_BASELINE_NAME "sse2"
+#elif defined(__aarch64__) || defined(_M_ARM64)
+  #define GM_CPU_ISA_BASELINE_NAME "neon"
+#else
+  #define GM_CPU_ISA_BASELINE_NAME "generic"
+#endif
+
+typedef struct {
+    const char *name;
+    int (*supported)(void);
+    int (*init_unary)(gm_tbl_t *, ndt_context_t *);
+    int (*init_binary)(gm_tbl_t *, ndt_context_t *);
+} isa_t;
+
+#ifdef HAVE_GM_CPU_ISA_AVX512
+static int
+avx512_supported(void)
+{
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx512f") &&
+           __builtin_cpu_supports("avx512bw") &&
+           __builtin_cpu_supports("avx512dq") &&
+           __builtin_cpu_supports("avx512vl") &&
+           __builtin_cpu_supports("avx2") &&
+           __builtin_cpu_supports("fma");
+}
+#endif
+
+#ifdef HAVE_GM_CPU_ISA_AVX2
+static int
+avx2_supported(void)
+{
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx2") &&
+           __builtin_cpu_supports("fma");
+}
+#endif
+
+#ifdef HAVE_GM_CPU_ISA_SVE
+static int
+sve_supported(void)
+{
+    return (getauxval(AT_HWCAP) & HWCAP_SVE) != 0;
+}
+#endif
+
+static int
+baseline_supported(void)
+{
+    return 1;
+}
+
+/* Ordered from the most to the least capable variant. */
+static const isa_t isa_table[] = {
+#ifdef HAVE_GM_CPU_ISA_AVX512
+  { "avx512", avx512_supported, gm_init_cpu_unary_kernels_avx512, gm_init_cpu_binary_kernels_avx512 },
+#endif
+#ifdef HAVE_GM_CPU_ISA_AVX2
+  { "avx2", avx2_supported, gm_init_cpu_unary_kernels_avx2, gm_init_cpu_binary_kernels_avx2 },
+#endif
+#ifdef HAVE_GM_CPU_ISA_SVE
+  { "sve", sve_supported, gm_init_cpu_unary_kernels_sve, gm_init_cpu_binary_kernels_sve },
+#endif
+  { GM_CPU_ISA_BASELINE_NAME, baseline_supported, gm_init_cpu_unary_kernels_baseline, gm_init_cpu_binary_kernels_baseline }
+};
+
+static const isa_t *isa_selected = NULL;
+
+/*
+ * Select the most capable variant supported by the running cpu.  The
+ * environment variable GUMATH_CPU_ISA restricts the choice to the named
+ * variant (or a less capable one if it is not available), which is useful
+ * for benchmarking and for reproducing results across machines.
+ */
+static const isa_t *
+isa_select(void)
+{
+    const size_t n = sizeof isa_table / sizeof isa_table[0];
+    const char *env;
+    size_t start = 0;
+    size_t i;
+
+    if (isa_selected != NULL) {
+        return isa_selected;
+    }
+
+    env = getenv("GUMATH_CPU_ISA");
+    if (env != NULL) {
+        for (i = 0; i < n; i++) {
+            if (strcmp(isa_table[i].name, env) == 0 ||
+                (strcmp(env, "baseline") == 0 && i == n-1)) {
+                start = i;
+                break;
+            }
+        }
+    }
+
+    for (i = start; i < n; i++) {
+        if (isa_table[i].supported()) {
+            break;
+        }
+    }
+
+    isa_selected = &isa_table[i < n ? i : n-1];
+    return isa_selected;
+}
+
+const char *
+gm_cpu_isa(void)
+{
+    return isa_select()->name;
+}
+
+int
+gm_init_cpu_unary_kernels(gm_tbl_t *tbl, ndt_context_t *ctx)
+{
+    return isa_select()->init_unary(tbl, ctx);
+}
+
+int
+gm_init_cpu_binary_kernels(gm_tbl_t *tbl, ndt_context_t *ctx)
+{
+    return isa_select()->init_binary(tbl, ctx);
+}
@@ -0,0 +1,798 @@
+/*
+ * BSD 3-Clause License
+ *
+ * Copyright (c) 2017-2018, plures
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include "ndtypes.h"
+#include "xnd.h"
+#include "gumath.h"
+#ifndef _MSC_VER
+#include "config.h"
+#endif
+#include "sys.h"
+
+
+/*
+ * Task graphs of kernel applications.
+ *
+ * Each node applies one kernel to a stack of xnd_t views.  Edges are
+ * inferred from memory overlap between the arguments (read after write,
+ * write after read, write after write) and can be added explicitly.
+ *
+ * Elementwise nodes are split along their outer dimensions.  If an edge
+ * connects two nodes whose shared arguments have identical layouts, chunk
+ * k of the consumer only waits for chunk k of the producer, so that
+ * dependent stages run as a pipeline.  All other edges wait for the
+ * complete producer.
+ */
+
+
+/* Minimum number of elements per chunk. */
+#define MIN_CHUNK 16384
+
+typedef struct {
+    int node;
+    bool aligned; /* all overlapping arguments have identical layouts */
+} edge_t;
+
+typedef struct {
+    gm_kernel_t kernel;
+    xnd_t *stack;
+    int nargs;
+    int nin;
+    int outer_dims;
+    bool splittable;
+
+    int ndeps;
+    edge_t *deps;      /* dependencies, all with a lower node id */
+
+    /* Per run */
+    int nchunks;
+    xnd_t *chunks;     /* nchunks * nargs views, equal to 'stack' if unsplit */
+    int *pending;      /* unresolved dependencies per chunk */
+    int remaining;     /* unfinished chunks */
+    int nsucc;
+    edge_t *succ;
+    double time;       /* accumulated kernel time */
+    double finish;     /* end of the longest path through this node */
+    int prev;          /* predecessor on the longest path */
+} node_t;
+
+struct gm_graph {
+    int nnodes;
+    int alloc;
+    node_t *nodes;
+};
+
+
+/******************************************************************************/
+/*                                Construction                                */
+/******************************************************************************/
+
+gm_graph_t *
+gm_graph_new(ndt_context_t *ctx)
+{
+    gm_graph_t *g;
+
+    g = ndt_calloc(1, sizeof *g);
+    if (g == NULL) {
+        return ndt_memory_error(ctx);
+    }
+
+    return g;
+}
+
+void
+gm_graph_del(gm_graph_t *g)
+{
+    if (g == NULL) {
+        return;
+    }
+
+    for (int i = 0; i < g->nnodes; i++) {
+        node_t *n = &g->nodes[i];
+        for (int k = 0; k < n->nargs; k++) {
+            ndt_decref(n->stack[k].type);
+        }
+        ndt_free(n->stack);
+        ndt_free(n->deps);
+    }
+
+    ndt_free(g->nodes);
+    ndt_free(g);
+}
+
+static int
+add_edge(node_t *n, int dep, bool aligned, ndt_context_t *ctx)
+{
+    edge_t *deps;
+
+    for (int i = 0; i < n->ndeps; i++) {
+        if (n->deps[i].node == dep) {
+            n->deps[i].aligned &= aligned;
+            return 0;
+        }
+    }
+
+    deps = ndt_realloc(n->deps, n->ndeps+1, sizeof *deps);
+    if (deps == NULL) {
+        (void)ndt_memory_error(ctx);
+        return -1;
+    }
+
+    deps[n->ndeps].node = dep;
+    deps[n->ndeps].aligned = aligned;
+    n->deps = deps;
+    n->ndeps++;
+
+    return 0;
+}
+
+/*
+ * Record the overlap between 'a' and 'b' in 'conflict' and 'aligned'.
+ * Two reads never conflict.
+ */
+static void
+check_pair(bool *conflict, bool *aligned, const xnd_t *a, const xnd_t *b)
+{
+    switch (gm_mem_overlap(a, b)) {
+    case GM_MEM_DISJOINT:
+        return;
+    case GM_MEM_ALIAS:
+        *conflict = true;
+        return;
+    default:
+        *conflict = true;
+        *aligned = false;
+        return;
+    }
+}
+
+/*
+ * Add a kernel application to the graph.  The graph takes references to
+ * the types in 'stack', the data must stay valid until the graph is run.
+ * Return the node id.
+ */
+int
+gm_graph_add(gm_graph_t *g, const gm_kernel_t *kernel, const xnd_t stack[],
+             int outer_dims, ndt_context_t *ctx)
+{
+    const ndt_t *sig = kernel->set->sig;
+    const int nargs = (int)sig->Function.nargs;
+    const int nin = (int)sig->Function.nin;
+    const int id = g->nnodes;
+    node_t *n;
+    int plan[NDT_MAX_ARGS];
+    int overlap;
+
+    if (g->nnodes == INT32_MAX) {
+        ndt_err_format(ctx, NDT_ValueError, "too many nodes in task graph");
+        return -1;
+    }
+
+    overlap = gm_overlap_plan(plan, kernel, stack, nin, nargs-nin);
+    if (overlap == GM_OVERLAP_COPY) {
+        ndt_err_format(ctx, NDT_ValueError,
+            "task graph nodes must not partially overlap inputs and outputs");
+        return -1;
+    }
+
+    if (g->nnodes == g->alloc) {
+        const int alloc = g->alloc == 0 ? 8 : 2 * g->alloc;
+        node_t *nodes = ndt_realloc(g->nodes, alloc, sizeof *nodes);
+        if (nodes == NULL) {
+            (void)ndt_memory_error(ctx);
+            return -1;
+        }
+        g->nodes = nodes;
+        g->alloc = alloc;
+    }
+
+    n = &g->nodes[id];
+    memset(n, 0, sizeof *n);
+
+    n->stack = ndt_alloc(nargs == 0 ? 1 : nargs, sizeof *n->stack);
+    if (n->stack == NULL) {
+        (void)ndt_memory_error(ctx);
+        return -1;
+    }
+
+    n->kernel = *kernel;
+    n->nargs = nargs;
+    n->nin = nin;
+    n->outer_dims = outer_dims;
+    n->splittable = outer_dims > 0 && overlap == GM_OVERLAP_NONE &&
+                    gm_is_elementwise(kernel);
+
+    for (int i = 0; i < nargs; i++) {
+        n->stack[i] = stack[i];
+        ndt_incref(stack[i].type);
+        if (!ndt_is_ndarray(stack[i].type)) {
+            n->splittable = false;
+        }
+    }
+
+    for (int m = 0; m < id; m++) {
+        const node_t *p = &g->nodes[m];
+        bool conflict = false;
+        bool aligned = p->outer_dims == outer_dims;
+
+        /* outputs of this node against all arguments of the earlier node */
+        for (int i = nin; i < nargs; i++) {
+            for (int k = 0; k < p->nargs; k++) {
+                check_pair(&conflict, &aligned, &n->stack[i], &p->stack[k]);
+            }
+        }
+
+        /* inputs of this node against outputs of the earlier node */
+        for (int i = 0; i < nin; i++) {
+            for (int k = p->nin; k < p->nargs; k++) {
+                check_pair(&conflict, &aligned, &n->stack[i], &p->stack[k]);
+            }
+        }
+
+        if (conflict && add_edge(n, m, aligned, ctx) < 0) {
+            goto error;
+        }
+    }
+
+    g->nnodes++;
+    return id;
+
+error:
+    for (int i = 0; i < nargs; i++) {
+        ndt_decref(n->stack[i].type);
+    }
+    ndt_free(n->stack);
+    ndt_free(n->deps);
+    return -1;
+}
+
+/* Explicitly order 'node' after 'dep'. */
+int
+gm_graph_add_dep(gm_graph_t *g, int node, int dep, ndt_context_t *ctx)
+{
+    if (node < 0 || node >= g->nnodes || dep < 0 || dep >= node) {
+        ndt_err_format(ctx, NDT_IndexError,
+            "invalid dependency: %d -> %d", dep, node);
+        return -1;
+    }
+
+    return add_edge(&g->nodes[node], dep, false, ctx);
+}
+
+
+/******************************************************************************/
+/*                                  Execution                                 */
+/******************************************************************************/
+
+static int
+apply_chunk(node_t *n, int chunk, ndt_context_t *ctx)
+{
+    ALLOCA(xnd_t, stack, n->nargs);
+
+    for (int i = 0; i < n->nargs; i++) {
+        stack[i] = n->chunks[chunk * n->nargs + i];
+    }
+
+    return gm_apply_nostats(&n->kernel, stack, n->outer_dims, ctx);
+}
+
+static void
+critical_path(gm_graph_t *g)
+{
+    for (int i = 0; i < g->nnodes; i++) {
+        node_t *n = &g->nodes[i];
+
+        n->finish = n->time;
+        n->prev = -1;
+
+        for (int k = 0; k < n->ndeps; k++) {
+            const node_t *p = &g->nodes[n->deps[k].node];
+            if (p->finish + n->time > n->finish) {
+                n->finish = p->finish + n->time;
+                n->prev = n->deps[k].node;
+            }
+        }
+    }
+}
+
+static int
+run_serial(gm_graph_t *g, ndt_context_t *ctx)
+{
+    for (int i = 0; i < g->nnodes; i++) {
+        node_t *n = &g->nodes[i];
+        const double start = gm_clock();
+
+        n->nchunks = 1;
+        n->chunks = n->stack;
+
+        if (apply_chunk(n, 0, ctx) < 0) {
+            return -1;
+        }
+
+        n->time = gm_clock() - start;
+
+        if (gm_stats_enabled()) {
+            gm_stats_record(&n->kernel, n->stack, n->time, false, NULL);
+        }
+    }
+
+    critical_path(g);
+    return 0;
+}
+
+#ifdef HAVE_PTHREAD_H
+typedef struct {
+    int node;
+    int chunk;
+} task_t;
+
+typedef struct {
+    gm_graph_t *g;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    task_t *ready;     /* LIFO: a finished chunk's successors run next */
+    int top;
+    int64_t done;
+    int64_t total;
+    bool abort;
+    ndt_context_t ctx; /* first error */
+} run_t;
+
+static void
+init_static_context(ndt_context_t *ctx)
+{
+    static const ndt_context_t c = {
+      .flags=0,
+      .err=NDT_Success,
+      .msg=ConstMsg,
+      .ConstMsg="Success" };
+
+    *ctx = c;
+}
+
+static int64_t
+max_nelem(const node_t *n)
+{
+    int64_t nelem = 0;
+
+    for (int i = 0; i < n->nargs; i++) {
+        const int64_t k = ndt_nelem(n->stack[i].type);
+        if (k > nelem) {
+            nelem = k;
+        }
+    }
+
+    return nelem;
+}
+
+static void
+clear_chunks(node_t *n)
+{
+    if (n->chunks != n->stack) {
+        for (int64_t i = 0; i < (int64_t)n->nchunks * n->nargs; i++) {
+            ndt_decref(n->chunks[i].type);
+        }
+        ndt_free(n->chunks);
+    }
+
+    n->nchunks = 1;
+    n->chunks = n->stack;
+}
+
+/* Split all arguments into the same number of chunks, or leave the node whole. */
+static int
+split_node(node_t *n, int64_t nchunks, ndt_context_t *ctx)
+{
+    int64_t k = max_nelem(n) / MIN_CHUNK;
+    int64_t ncols = -1;
+
+    n->nchunks = 1;
+    n->chunks = n->stack;
+
+    if (k > nchunks) {
+        k = nchunks;
+    }
+    if (!n->splittable || k <= 1 || n->nargs == 0) {
+        return 0;
+    }
+
+    for (int i = 0; i < n->nargs; i++) {
+        int64_t m = k;
+        xnd_t *slices = xnd_split(&n->stack[i], &m, n->outer_dims, ctx);
+        if (slices == NULL) {
+            clear_chunks(n);
+            return -1;
+        }
+
+        if (ncols < 0) {
+            n->chunks = ndt_alloc(m * n->nargs, sizeof *n->chunks);
+            if (n->chunks == NULL) {
+                for (int64_t c = 0; c < m; c++) {
+                    ndt_decref(slices[c].type);
+                }
+                ndt_free(slices);
+                n->chunks = n->stack;
+                (void)ndt_memory_error(ctx);
+                return -1;
+            }
+            ncols = m;
+            n->nchunks = (int)m;
+        }
+
+        if (m != ncols) {
+            for (int64_t c = 0; c < m; c++) {
+                ndt_decref(slices[c].type);
+            }
+            ndt_free(slices);
+            /* only the first i arguments are filled */
+            for (int64_t c = 0; c < ncols; c++) {
+                for (int j = 0; j < i; j++) {
+                    ndt_decref(n->chunks[c * n->nargs + j].type);
+                }
+            }
+            ndt_free(n->chunks);
+            n->nchunks = 1;
+            n->chunks = n->stack;
+            return 0;
+        }
+
+        for (int64_t c = 0; c < m; c++) {
+            n->chunks[c * n->nargs + i] = slices[c];
+        }
+        ndt_free(slices);
+    }
+
+    return 0;
+}
+
+static bool
+pointwise(const node_t *from, const node_t *to, const edge_t *e)
+{
+    return e->aligned && from->nchunks == to->nchunks;
+}
+
+static void
+push(run_t *r, int node, int chunk)
+{
+    r->ready[r->top].node = node;
+    r->ready[r->top].chunk = chunk;
+    r->top++;
+}
+
+static void
+resolve(run_t *r, int node, int chunk)
+{
+    node_t *n = &r->g->nodes[node];
+
+    if (--n->pending[chunk] == 0) {
+        push(r, node, chunk);
+    }
+}
+
+/* Called with the lock held. */
+static void
+complete(run_t *r, const task_t *t)
+{
+    node_t *n = &r->g->nodes[t->node];
+
+    r->done++;
+
+    if (--n->remaining == 0 && gm_stats_enabled()) {
+        gm_stats_record(&n->kernel, n->stack, n->time, n->nchunks > 1, NULL);
+    }
+
+    for (int i = 0; i < n->nsucc; i++) {
+        const edge_t *e = &n->succ[i];
+        const node_t *s = &r->g->nodes[e->node];
+
+        if (pointwise(n, s, e)) {
+            resolve(r, e->node, t->chunk);
+        }
+        else {
+            for (int c = s->nchunks-1; c >= 0; c--) {
+                resolve(r, e->node, c);
+            }
+        }
+    }
+}
+
+static void *
+worker(void *arg)
+{
+    run_t *r = arg;
+    ndt_context_t ctx;
+    task_t t;
+
+    init_static_context(&ctx);
+
+    pthread_mutex_lock(&r->lock);
+    for (;;) {
+        while (r->top == 0 && r->done < r->total && !r->abort) {
+            pthread_cond_wait(&r->cond, &r->lock);
+        }
+        if (r->done == r->total || r->abort) {
+            break;
+        }
+
+        t = r->ready[--r->top];
+        pthread_mutex_unlock(&r->lock);
+
+        const double start = gm_clock();
+        const int ret = apply_chunk(&r->g->nodes[t.node], t.chunk, &ctx);
+        const double time = gm_clock() - start;
+
+        pthread_mutex_lock(&r->lock);
+        r->g->nodes[t.node].time += time;
+
+        if (ret < 0) {
+            if (!r->abort) {
+                r->abort = true;
+                ndt_err_format(&r->ctx, ctx.err, "%s", ndt_context_msg(&ctx));
+            }
+            ndt_err_clear(&ctx);
+            pthread_cond_broadcast(&r->cond);
+            break;
+        }
+
+        const int top = r->top;
+        complete(r, &t);
+        if (r->top > top+1 || r->done == r->total) {
+            pthread_cond_broadcast(&r->cond);
+        }
+        else if (r->top > top && r->top > 1) {
+            pthread_cond_signal(&r->cond);
+        }
+    }
+    pthread_mutex_unlock(&r->lock);
+
+    return NULL;
+}
+
+static void
+clear_run(gm_graph_t *g, run_t *r)
+{
+    for (int i = 0; i < g->nnodes; i++) {
+        node_t *n = &g->nodes[i];
+        clear_chunks(n);
+        ndt_free(n->pending);
+        ndt_free(n->succ);
+        n->pending = NULL;
+        n->succ = NULL;
+        n->nsucc = 0;
+    }
+
+    ndt_free(r->ready);
+}
+
+static int
+prepare(gm_graph_t *g, run_t *r, int64_t nchunks, ndt_context_t *ctx)
+{
+    for (int i = 0; i < g->nnodes; i++) {
+        node_t *n = &g->nodes[i];
+
+        if (split_node(n, nchunks, ctx) < 0) {
+            return -1;
+        }
+
+        n->pending = ndt_calloc(n->nchunks, sizeof *n->pending);
+        if (n->pending == NULL) {
+            (void)ndt_memory_error(ctx);
+            return -1;
+        }
+
+        n->remaining = n->nchunks;
+        r->total += n->nchunks;
+        for (int k = 0; k < n->ndeps; k++) {
+            g->nodes[n->deps[k].node].nsucc++;
+        }
+    }
+
+    for (int i = 0; i < g->nnodes; i++) {
+        node_t *n = &g->nodes[i];
+        if (n->nsucc > 0) {
+            n->succ = ndt_alloc(n->nsucc, sizeof *n->succ);
+            if (n->succ == NULL) {
+                (void)ndt_memory_error(ctx);
+                return -1;
+            }
+            n->nsucc = 0;
+        }
+    }
+
+    for (int i = 0; i < g->nnodes; i++) {
+        node_t *n = &g->nodes[i];
+
+        for (int k = 0; k < n->ndeps; k++) {
+            const edge_t *e = &n->deps[k];
+            node_t *p = &g->nodes[e->node];
+            const int count = pointwise(p, n, e) ? 1 : p->nchunks;
+
+            p->succ[p->nsucc].node = i;
+            p->succ[p->nsucc].aligned = e->aligned;
+            p->nsucc++;
+
+            for (int c = 0; c < n->nchunks; c++) {
+                n->pending[c] += count;
+            }
+        }
+    }
+
+    r->ready = ndt_alloc(r->total, sizeof *r->ready);
+    if (r->ready == NULL) {
+        (void)ndt_memory_error(ctx);
+        return -1;
+    }
+
+    /* reversed, so that the first node is taken first */
+    for (int i = g->nnodes-1; i >= 0; i--) {
+        const node_t *n = &g->nodes[i];
+        for (int c = n->nchunks-1; c >= 0; c--) {
+            if (n->pending[c] == 0) {
+                push(r, i, c);
+            }
+        }
+    }
+
+    return 0;
+}
+
+/* Each index is one worker, which runs until the graph is complete. */
+static void
+worker_range(int64_t begin, int64_t end, void *arg)
+{
+    for (int64_t i = begin; i < end; i++) {
+        (void)worker(arg);
+    }
+}
+
+static int
+run_parallel(gm_graph_t *g, int64_t nthreads, int64_t nchunks, ndt_context_t *ctx)
+{
+    run_t r;
+
+    memset(&r, 0, sizeof r);
+    r.g = g;
+    init_static_context(&r.ctx);
+
+    if (prepare(g, &r, nchunks, ctx) < 0) {
+        clear_run(g, &r);
+        return -1;
+    }
+
+    pthread_mutex_init(&r.lock, NULL);
+    pthread_cond_init(&r.cond, NULL);
+
+    /* Workers only wait for chunks that other running workers have taken,
+       so the graph completes with any number of concurrent workers. */
+    gm_parallel_for(nthreads, 1, nthreads, worker_range, &r);
+
+    pthread_cond_destroy(&r.cond);
+    pthread_mutex_destroy(&r.lock);
+    clear_run(g, &r);
+
+    if (ndt_err_occurred(&r.ctx)) {
+        ndt_err_format(ctx, r.ctx.err, "%s", ndt_context_msg(&r.ctx));
+        ndt_err_clear(&r.ctx);
+        return -1;
+    }
+
+    critical_path(g);
+    return 0;
+}
+#endif
+
+/*
+ * Run all nodes.  Independent nodes run concurrently on 'nthreads' threads
+ * (including the caller).  Elementwise nodes are split into at most
+ * 'nchunks' chunks, 0 selects 'nthreads'.
+ */
+int
+gm_graph_run(gm_graph_t *g, int64_t nthreads, int64_t nchunks, ndt_context_t *ctx)
+{
+    for (int i = 0; i < g->nnodes; i++) {
+        g->nodes[i].time = 0;
+        g->nodes[i].finish = 0;
+        g->nodes[i].prev = -1;
+    }
+
+    if (nchunks <= 0) {
+        nchunks = nthreads;
+    }
+
+#ifdef HAVE_PTHREAD_H
+    if (nthreads > 1 && g->nnodes > 0) {
+        return run_parallel(g, nthreads, nchunks, ctx);
+    }
+#else
+    (void)nchunks;
+#endif
+
+    return run_serial(g, ctx);
+}
+
+
+/******************************************************************************/
+/*                                  Profiling                                 */
+/******************************************************************************/
+
+/* Kernel time of 'node' in the last run, summed over all chunks. */
+double
+gm_graph_node_time(const gm_graph_t *g, int node)
+{
+    if (node < 0 || node >= g->nnodes) {
+        return -1.0;
+    }
+
+    return g->nodes[node].time;
+}
+
+/*
+ * Return the length of the longest chain of dependent nodes in the last
+ * run, weighted by node time.  If 'path' is not NULL, it must have room for
+ * all nodes and receives the node ids of the chain in execution order.
+ */
+double
+gm_graph_critical_path(const gm_graph_t *g, int path[], int *length)
+{
+    int last = -1;
+    int n = 0;
+
+    for (int i = 0; i < g->nnodes; i++) {
+        if (last < 0 || g->nodes[i].finish > g->nodes[last].finish) {
+            last = i;
+        }
+    }
+
+    for (int i = last; i >= 0; i = g->nodes[i].prev) {
+        n++;
+    }
+
+    if (path != NULL) {
+        int k = n;
+        for (int i = last; i >= 0; i = g->nodes[i].prev) {
+            path[--k] = i;
+        }
+    }
+
+    if (length != NULL) {
+        *length = n;
+    }
+
+    return last < 0 ? 0.0 : g->nodes[last].finish;
+}
@@ -0,0 +1,292 @@
+/*
+ * BSD 3-Clause License
+ *
+ * Copyright (c) 2017-2018, plures
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include "ndtypes.h"
+#include "xnd.h"
+#include "gumath.h"
+#include "sys.h"
+#ifndef _MSC_VER
+#include "config.h"
+#endif
+
+
+/****************************************************************************/
+/*                               Executors                                  */
+/****************************************************************************/
+
+/*
+ * All parallel loops in libgumath run through the installed executor.  The
+ * default executor starts one pthread per range and runs the first range on
+ * the calling thread.  With GM_NUMA_PIN, range 'i' runs on gm_numa_cpu(i, k),
+ * which also applies to the calling thread for the duration of its range.
+ * Host applications with their own scheduler install an executor with
+ * gm_set_executor() to avoid oversubscription.
+ */
+
+static void
+serial_parallel_for(void *state, int64_t n, int64_t grain, int64_t nthreads,
+                    gm_range_t f, void *arg)
+{
+    (void)state; (void)grain; (void)nthreads;
+
+    if (n > 0) {
+        f(0, n, arg);
+    }
+}
+
+#ifdef HAVE_PTHREAD_H
+#include <pthread.h>
+
+/* Number of ranges for 'n' indices with at least 'grain' indices each. */
+static int64_t
+num_ranges(int64_t n, int64_t grain, int64_t nthreads)
+{
+    int64_t k = grain > 1 ? n / grain : n;
+
+    if (k > nthreads) {
+        k = nthreads;
+    }
+
+    return k < 1 ? 1 : k;
+}
+
+/* Bounds of range 'i' of 'k' nearly equal ranges over [0, n). */
+static void
+range_bounds(int64_t *begin, int64_t *end, int64_t i, int64_t k, int64_t n)
+{
+    const int64_t q = n / k;
+    const int64_t r = n % k;
+
+    *begin = i * q + (i < r ? i : r);
+    *end = *begin + q + (i < r ? 1 : 0);
+}
+
+struct range_task {
+    pthread_t tid;
+    bool started;
+    int cpu;
+    gm_range_t f;
+    void *arg;
+    int64_t begin;
+    int64_t end;
+};
+
+static void *
+run_range(void *arg)
+{
+    struct range_task *t = arg;
+    void *saved = gm_numa_bind(t->cpu);
+
+    t->f(t->begin, t->end, t->arg);
+
+    gm_numa_unbind(saved);
+    return NULL;
+}
+
+static void
+pthread_parallel_for(void *state, int64_t n, int64_t grain, int64_t nthreads,
+                     gm_range_t f, void *arg)
+{
+    const int64_t k = n > 0 ? num_ranges(n, grain, nthreads) : 0;
+    struct range_task *tasks;
+    (void)state;
+
+    if (k <= 1) {
+        serial_parallel_for(NULL, n, grain, nthreads, f, arg);
+        return;
+    }
+
+    tasks = ndt_calloc(k, sizeof *tasks);
+    if (tasks == NULL) {
+        f(0, n, arg);
+        return;
+    }
+
+    for (int64_t i = 0; i < k; i++) {
+        tasks[i].f = f;
+        tasks[i].arg = arg;
+        tasks[i].cpu = gm_numa_cpu(i, k);
+        range_bounds(&tasks[i].begin, &tasks[i].end, i, k, n);
+    }
+
+    /* The calling thread runs the first range and every range for which
+       no thread could be created. */
+    for (int64_t i = 1; i < k; i++) {
+        tasks[i].started =
+            pthread_create(&tasks[i].tid, NULL, &run_range, &tasks[i]) == 0;
+    }
+
+    for (int64_t i = 0; i < k; i++) {
+        if (!tasks[i].started) {
+            (void)run_range(&tasks[i]);
+        }
+    }
+
+    for (int64_t i = 1; i < k; i++) {
+        if (tasks[i].started) {
+            pthread_join(tasks[i].tid, NULL);
+        }
+    }
+
+    ndt_free(tasks);
+}
+
+#define DEFAULT_EXECUTOR { .name = "pthread", .parallel_for = pthread_parallel_for, .state = NULL }
+#else
+#define DEFAULT_EXECUTOR { .name = "serial", .parallel_for = serial_parallel_for, .state = NULL }
+#endif
+
+static const gm_executor_t default_executor = DEFAULT_EXECUTOR;
+
+
+/*
+ * The installed executor is a refcounted copy.  A parallel loop holds a
+ * reference for its duration, so gm_set_executor() can replace an executor
+ * while loops are running on it.  The last reference calls 'release'.
+ */
+typedef struct {
+    gm_executor_t e;
+    int64_t refcnt;
+} executor_ref_t;
+
+static gm_mutex_t executor_lock = GM_MUTEX_INIT;
+static executor_ref_t *executor = NULL; /* NULL: default executor */
+
+static executor_ref_t *
+executor_acquire(void)
+{
+    executor_ref_t *x;
+
+    gm_mutex_lock(&executor_lock);
+    x = executor;
+    if (x != NULL) {
+        x->refcnt++;
+    }
+    gm_mutex_unlock(&executor_lock);
+
+    return x;
+}
+
+static void
+executor_release(executor_ref_t *x)
+{
+    int64_t refcnt;
+
+    if (x == NULL) {
+        return;
+    }
+
+    gm_mutex_lock(&executor_lock);
+    refcnt = --x->refcnt;
+    gm_mutex_unlock(&executor_lock);
+
+    if (refcnt == 0) {
+        if (x->e.release != NULL) {
+            x->e.release(x->e.state);
+        }
+        ndt_free(x);
+    }
+}
+
+/*
+ * Install 'e' for all subsequent parallel loops, or restore the default
+ * executor if 'e' is NULL.  Loops that are running keep their executor,
+ * whose 'release' function is called after the last of them has finished.
+ */
+int
+gm_set_executor(const gm_executor_t *e, ndt_context_t *ctx)
+{
+    executor_ref_t *x = NULL;
+    executor_ref_t *old;
+
+    if (e != NULL && e->parallel_for != NULL) {
+        x = ndt_alloc_size(sizeof *x);
+        if (x == NULL) {
+            (void)ndt_memory_error(ctx);
+            return -1;
+        }
+        x->e = *e;
+        x->refcnt = 1;
+    }
+
+    gm_mutex_lock(&executor_lock);
+    old = executor;
+    executor = x;
+    gm_mutex_unlock(&executor_lock);
+
+    executor_release(old);
+
+    return 0;
+}
+
+/* Name of the installed executor. */
+const char *
+gm_executor_name(void)
+{
+    const char *name;
+
+    gm_mutex_lock(&executor_lock);
+    name = executor == NULL ? default_executor.name : executor->e.name;
+    gm_mutex_unlock(&executor_lock);
+
+    return name;
+}
+
+/*
+ * Call 'f' on disjoint ranges that cover [0, n), with at most 'nthreads'
+ * ranges in flight.  Returns when all ranges have been run.
+ */
+void
+gm_parallel_for(int64_t n, int64_t grain, int64_t nthreads, gm_range_t f, void *arg)
+{
+    executor_ref_t *x;
+    const gm_executor_t *e;
+
+    if (n <= 0) {
+        return;
+    }
+
+    if (nthreads <= 1 || n == 1) {
+        f(0, n, arg);
+        return;
+    }
+
+    x = executor_acquire();
+    e = x == NULL ? &default_executor : &x->e;
+    e->parallel_for(e->state, n, grain < 1 ? 1 : grain, nthreads, f, arg);
+    executor_release(x);
+}
@@ -0,0 +1,125 @@
+/*
+ * BSD 3-Clause License
+ *
+ * Copyright (c) 2017-2018, plures
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include "ndtypes.h"
+#include "xnd.h"
+#include "gumath.h"
+
+
+/*
+ * Describe what gm_select() and gm_apply_thread() would do for a call
+ * without applying the kernel.
+ *
+ * The cost estimate uses the recorded time per element if statistics for
+ * the selected kernel exist.  Otherwise it assumes that contiguous loops
+ * are limited by memory bandwidth and adds a per element overhead for the
+ * Xnd loop, which visits every element through the generic xnd indexing.
+ */
+
+#define BANDWIDTH 1e10      /* bytes per second */
+#define ELEM_COST 1e-10     /* seconds per element of a specialized loop */
+#define XND_ELEM_COST 2e-8  /* seconds per element of the Xnd loop */
+#define THREAD_COST 2e-5    /* seconds to start and join one thread */
+
+
+static double
+estimate(const gm_explain_t *e)
+{
+    const bool xnd_loop = e->kernel.flag == NDT_INNER_XND;
+    double t;
+
+    t = (double)e->bytes / BANDWIDTH;
+    t += (double)e->nelem * (xnd_loop ? XND_ELEM_COST : ELEM_COST);
+
+    if (e->nthreads > 1) {
+        t = t / (double)e->nthreads + THREAD_COST * (double)e->nthreads;
+    }
+
+    return t;
+}
+
+int
+gm_explain(gm_explain_t *e, const gm_tbl_t *tbl, const char *name,
+           const ndt_t *types[], const int64_t li[], int nin, int nout,
+           bool check_broadcast, const xnd_t args[], int64_t nthreads,
+           ndt_context_t *ctx)
+{
+    gm_stats_t entry;
+
+    memset(e, 0, sizeof *e);
+    e->spec = ndt_apply_spec_empty;
+
+    e->kernel = gm_select(&e->spec, tbl, name, types, li, nin, nout,
+                          check_broadcast, args, ctx);
+    if (e->kernel.set == NULL) {
+        return -1;
+    }
+
+    for (int i = 0; i < e->spec.nargs; i++) {
+        const ndt_t *t = e->spec.types[i];
+        if (ndt_is_ndarray(t)) {
+            const int64_t n = ndt_nelem(t);
+            if (n > e->nelem) {
+                e->nelem = n;
+            }
+            e->bytes += n * ndt_dtype(t)->datasize;
+        }
+    }
+
+    e->nthreads = gm_thread_decision(&e->kernel, args, e->spec.types,
+                                     e->spec.outer_dims, nthreads, &e->reason);
+    if (e->nthreads > gm_lane_threads(nthreads)) {
+        e->nthreads = gm_lane_threads(nthreads);
+    }
+
+    if (gm_stats_lookup(&entry, e->kernel.set, e->kernel.flag) &&
+        entry.elements > 0) {
+        e->cost = entry.time / (double)entry.elements * (double)e->nelem;
+        e->measured = true;
+    }
+    else {
+        e->cost = estimate(e);
+    }
+
+    return 0;
+}
+
+void
+gm_explain_clear(gm_explain_t *e)
+{
+    ndt_apply_spec_clear(&e->spec);
+}
@@ -143,7 +143,8 @@ gm_divmod10(xnd_t stack[], ndt_context_t *ctx)
 
 
 static const gm_kernel_init_t kernels[] = {
-  { .name = "add_scalar", .sig = "... * N * int64, ... * int64 -> ... * N * int64", .Xnd = gm_0D_add_scalar },
+  { .name = "add_scalar", .sig = "... * N * int64, ... * int64 -> ... * N * int64",
+    .cap = GM_CAP_SPLIT, .Xnd = gm_0D_add_scalar },
 
   { .name = "count_valid_missing",
     .sig = "... * N * {index: int64, name: string, value: ?int64} -> ... * {valid: int64, missing: int64}",
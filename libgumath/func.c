@@ -40,6 +40,7 @@
 #include <assert.h>
 #include "ndtypes.h"
 #include "gumath.h"
+#include "sys.h"
 
 
 /******************************************************************************/
@@ -79,25 +80,53 @@ gm_func_del(gm_func_t *f)
     ndt_free(f);
 }
 
-gm_func_t *
-gm_add_func(gm_tbl_t *tbl, const char *name, ndt_context_t *ctx)
+int
+gm_func_nkernels(const gm_func_t *f)
+{
+    return gm_load_acquire_int(&f->nkernels);
+}
+
+
+/******************************************************************************/
+/*                            Kernel registration                             */
+/******************************************************************************/
+
+/*
+ * Writers are serialized by 'add_lock'.  Readers (gm_select() etc.) do not
+ * lock: a new function is fully initialized before it is inserted into the
+ * table, and a new kernel is stored before the release store of 'nkernels'.
+ * Kernels are never removed, so readers always see a valid prefix.
+ */
+static gm_mutex_t add_lock = GM_MUTEX_INIT;
+
+static gm_func_t *
+add_func(gm_tbl_t *tbl, const char *name, gm_typecheck_t typecheck,
+         ndt_context_t *ctx)
 {
     gm_func_t *f = gm_func_new(name, ctx);
 
     if (f == NULL) {
         return NULL;
     }
+    f->typecheck = typecheck;
 
+    /* gm_tbl_add() deletes 'f' on failure. */
     if (gm_tbl_add(tbl, name, f, ctx) < 0) {
-        gm_func_del(f);
         return NULL;
     }
 
     return f;
 }
 
-int
-gm_add_kernel(gm_tbl_t *tbl, const gm_kernel_init_t *k, ndt_context_t *ctx)
+gm_func_t *
+gm_add_func(gm_tbl_t *tbl, const char *name, ndt_context_t *ctx)
+{
+    return add_func(tbl, name, NULL, ctx);
+}
+
+static int
+add_kernel(gm_tbl_t *tbl, const gm_kernel_init_t *k, gm_typecheck_t typecheck,
+           ndt_context_t *ctx)
 {
     gm_func_t *f = gm_tbl_find(tbl, k->name, ctx);
     gm_kernel_set_t kernel;
@@ -105,7 +134,7 @@ gm_add_kernel(gm_tbl_t *tbl, const gm_kernel_init_t *k, ndt_context_t *ctx)
 
     if (f == NULL) {
         ndt_err_clear(ctx);
-        f = gm_add_func(tbl, k->name, ctx);
+        f = add_func(tbl, k->name, typecheck, ctx);
         if (f == NULL) {
             return -1;
         }
@@ -125,6 +154,7 @@ gm_add_kernel(gm_tbl_t *tbl, const gm_kernel_init_t *k, ndt_context_t *ctx)
 
     kernel.sig = t;
     kernel.constraint = k->constraint;
+    kernel.cap = k->cap;
     kernel.OptC = k->OptC;
     kernel.OptZ = k->OptZ;
     kernel.OptS = k->OptS;
@@ -133,49 +163,32 @@ gm_add_kernel(gm_tbl_t *tbl, const gm_kernel_init_t *k, ndt_context_t *ctx)
     kernel.Xnd = k->Xnd;
     kernel.Strided = k->Strided;
 
-    f->kernels[f->nkernels++] = kernel;
+    f->kernels[f->nkernels] = kernel;
+    gm_store_release_int(&f->nkernels, f->nkernels+1);
     return 0;
 }
 
 int
-gm_add_kernel_typecheck(gm_tbl_t *tbl, const gm_kernel_init_t *k, ndt_context_t *ctx,
-                        gm_typecheck_t typecheck)
+gm_add_kernel(gm_tbl_t *tbl, const gm_kernel_init_t *k, ndt_context_t *ctx)
 {
-    gm_func_t *f = gm_tbl_find(tbl, k->name, ctx);
-    gm_kernel_set_t kernel;
-    const ndt_t *t;
+    int ret;
 
-    if (f == NULL) {
-        ndt_err_clear(ctx);
-        f = gm_add_func(tbl, k->name, ctx);
-        if (f == NULL) {
-            return -1;
-        }
-        f->typecheck = typecheck;
-    }
+    gm_mutex_lock(&add_lock);
+    ret = add_kernel(tbl, k, NULL, ctx);
+    gm_mutex_unlock(&add_lock);
 
-    t = ndt_from_string_v(k->sig, ctx);
-    if (t == NULL) {
-        return -1;
-    }
+    return ret;
+}
 
-    if (f->nkernels == GM_MAX_KERNELS) {
-        ndt_decref(t);
-        ndt_err_format(ctx, NDT_RuntimeError,
-            "%s: maximum number of kernels reached for", f->name);
-        return -1;
-    }
+int
+gm_add_kernel_typecheck(gm_tbl_t *tbl, const gm_kernel_init_t *k, ndt_context_t *ctx,
+                        gm_typecheck_t typecheck)
+{
+    int ret;
 
-    kernel.sig = t;
-    kernel.constraint = k->constraint;
-    kernel.OptC = k->OptC;
-    kernel.OptZ = k->OptZ;
-    kernel.OptS = k->OptS;
-    kernel.C = k->C;
-    kernel.Fortran = k->Fortran;
-    kernel.Xnd = k->Xnd;
-    kernel.Strided = k->Strided;
+    gm_mutex_lock(&add_lock);
+    ret = add_kernel(tbl, k, typecheck, ctx);
+    gm_mutex_unlock(&add_lock);
 
-    f->kernels[f->nkernels++] = kernel;
-    return 0;
+    return ret;
 }
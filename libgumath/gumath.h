@@ -78,6 +78,8 @@ extern "C" {
 
 #define GM_MAX_KERNELS 8192
 #define GM_THREAD_CUTOFF 1000000
+#define GM_YIELD_CHUNK 1048576
+#define GM_MAX_PARTS 16
 
 typedef float float32_t;
 typedef double float64_t;
@@ -98,6 +100,7 @@ typedef int (* gm_strided_kernel_t)(char **args, intptr_t *dimensions, intptr_t
 typedef struct {
     const ndt_t *sig;
     const ndt_constraint_t *constraint;
+    uint32_t cap;            /* GM_CAP_* flags */
 
     /* Xnd signatures */
     gm_xnd_kernel_t OptC;    /* C in inner+1 dimensions */
@@ -117,6 +120,9 @@ typedef struct {
     const ndt_methods_t *meth;
 } gm_typedef_init_t;
 
+/* The kernel can be applied to parts of the first core dimension. */
+#define GM_CAP_SPLIT 0x0001U
+
 typedef struct {
     const char *name;
     const char *sig;
@@ -164,6 +170,7 @@ typedef struct _gm_tbl gm_tbl_t;
 
 GM_API gm_func_t *gm_func_new(const char *name, ndt_context_t *ctx);
 GM_API void gm_func_del(gm_func_t *f);
+GM_API int gm_func_nkernels(const gm_func_t *f);
 
 GM_API gm_func_t *gm_add_func(gm_tbl_t *tbl, const char *name, ndt_context_t *ctx);
 GM_API int gm_add_kernel(gm_tbl_t *tbl, const gm_kernel_init_t *kernel, ndt_context_t *ctx);
@@ -174,6 +181,98 @@ GM_API gm_kernel_t gm_select(ndt_apply_spec_t *spec, const gm_tbl_t *tbl, const
                              bool check_broadcast, const xnd_t args[], ndt_context_t *ctx);
 GM_API int gm_apply(const gm_kernel_t *kernel, xnd_t stack[], int outer_dims, ndt_context_t *ctx);
 GM_API int gm_apply_thread(const gm_kernel_t *kernel, xnd_t stack[], int outer_dims, const int64_t nthreads, ndt_context_t *ctx);
+GM_API int gm_apply_nostats(const gm_kernel_t *kernel, xnd_t stack[], int outer_dims, ndt_context_t *ctx);
+GM_API int gm_apply_where(const gm_kernel_t *kernel, xnd_t stack[], int outer_dims,
+                          const xnd_t *mask, ndt_context_t *ctx);
+GM_API int64_t gm_thread_cutoff(void);
+GM_API void gm_set_thread_cutoff(int64_t n);
+GM_API int64_t gm_yield_chunk(void);
+GM_API void gm_set_yield_chunk(int64_t n);
+GM_API int64_t gm_reserved_threads(void);
+GM_API void gm_set_reserved_threads(int64_t n);
+GM_API int64_t gm_lane_threads(int64_t nthreads);
+GM_API int64_t gm_thread_decision(const gm_kernel_t *kernel, const xnd_t args[],
+                                  const ndt_t *types[], int outer_dims, int64_t nthreads,
+                                  const char **reason);
+GM_API const char *gm_variant_name(uint32_t flag);
+
+
+/******************************************************************************/
+/*                                 Executors                                  */
+/******************************************************************************/
+
+/* Run the indices [begin, end) of a parallel loop. */
+typedef void (* gm_range_t)(int64_t begin, int64_t end, void *arg);
+
+/*
+ * A parallel-for: 'parallel_for' must call 'f' on disjoint ranges that cover
+ * [0, n) and return when all calls have finished.  Ranges should contain at
+ * least 'grain' indices.  'nthreads' is the requested concurrency, which the
+ * executor may lower, down to running everything on the calling thread.
+ * 'release' is called with 'state' when the executor has been replaced and
+ * no loop is running on it any more.  'name' must be a static string.
+ */
+typedef struct {
+    const char *name;
+    void (* parallel_for)(void *state, int64_t n, int64_t grain, int64_t nthreads,
+                          gm_range_t f, void *arg);
+    void *state;
+    void (* release)(void *state); /* may be NULL */
+} gm_executor_t;
+
+GM_API int gm_set_executor(const gm_executor_t *e, ndt_context_t *ctx);
+GM_API const char *gm_executor_name(void);
+GM_API void gm_parallel_for(int64_t n, int64_t grain, int64_t nthreads, gm_range_t f, void *arg);
+
+
+/******************************************************************************/
+/*                             Asynchronous apply                             */
+/******************************************************************************/
+
+#define GM_ASYNC_WORKERS 2
+
+/* Pending kernel application */
+typedef struct gm_future gm_future_t;
+
+GM_API gm_future_t *gm_apply_async(const gm_kernel_t *kernel, const xnd_t stack[], int outer_dims,
+                                   int64_t nthreads, ndt_context_t *ctx);
+GM_API bool gm_future_done(gm_future_t *f);
+GM_API int gm_future_wait(gm_future_t *f, ndt_context_t *ctx);
+GM_API int gm_future_fd(gm_future_t *f, ndt_context_t *ctx);
+GM_API void gm_future_del(gm_future_t *f);
+
+
+/******************************************************************************/
+/*                                Batched apply                               */
+/******************************************************************************/
+
+/* Items with equal input types */
+typedef struct {
+    gm_kernel_t kernel;
+    ndt_apply_spec_t spec;
+    int64_t first;            /* first item of the group */
+    int64_t nitems;           /* number of items in the group */
+} gm_batch_group_t;
+
+typedef struct {
+    int64_t nitems;
+    int nin;
+    int nout;
+    xnd_t *args;              /* nitems rows of nin inputs and nout outputs */
+    int64_t *group;           /* group of each item */
+    gm_batch_group_t *groups;
+    int64_t ngroups;
+    void *arena;              /* outputs allocated by gm_batch_alloc() */
+} gm_batch_t;
+
+GM_API int gm_batch_init(gm_batch_t *b, const gm_tbl_t *tbl, const char *name,
+                         const xnd_t in[], int64_t nitems, int nin, ndt_context_t *ctx);
+GM_API int gm_batch_alloc(gm_batch_t *b, ndt_context_t *ctx);
+GM_API int gm_batch_run(gm_batch_t *b, int64_t nthreads, ndt_context_t *ctx);
+GM_API void gm_batch_clear(gm_batch_t *b);
+GM_API int gm_apply_batch(gm_batch_t *b, const gm_tbl_t *tbl, const char *name,
+                          const xnd_t in[], int64_t nitems, int nin, int64_t nthreads,
+                          ndt_context_t *ctx);
 
 
 /******************************************************************************/
@@ -218,6 +317,264 @@ GM_API gm_func_t *gm_tbl_find(const gm_tbl_t *tbl, const char *key, ndt_context_
 GM_API int gm_tbl_map(const gm_tbl_t *tbl, int (*f)(const gm_func_t *, void *state), void *state);
 
 
+/******************************************************************************/
+/*                               Memory overlap                               */
+/******************************************************************************/
+
+typedef enum {
+  GM_MEM_DISJOINT, /* no shared memory */
+  GM_MEM_ALIAS,    /* identical memory layout */
+  GM_MEM_OVERLAP   /* partial overlap or unknown */
+} gm_overlap_t;
+
+#define GM_OVERLAP_NONE   0
+#define GM_OVERLAP_SERIAL 1
+#define GM_OVERLAP_COPY   2
+
+GM_API bool gm_is_elementwise(const gm_kernel_t *kernel);
+GM_API gm_overlap_t gm_mem_overlap(const xnd_t *a, const xnd_t *b);
+GM_API int gm_overlap_plan(int plan[], const gm_kernel_t *kernel, const xnd_t stack[],
+                           int nin, int nout);
+
+
+/******************************************************************************/
+/*                                   Explain                                  */
+/******************************************************************************/
+
+typedef struct {
+    gm_kernel_t kernel;    /* selected kernel */
+    ndt_apply_spec_t spec; /* flags, outer dimensions and types after broadcasting */
+    int64_t nelem;         /* elements of the largest argument */
+    int64_t bytes;         /* bytes of all array arguments */
+    int64_t nthreads;      /* threads used by gm_apply_thread() */
+    const char *reason;    /* reason for the threading decision */
+    double cost;           /* estimated time in seconds */
+    bool measured;         /* 'cost' is based on recorded statistics */
+} gm_explain_t;
+
+GM_API int gm_explain(gm_explain_t *e, const gm_tbl_t *tbl, const char *name,
+                      const ndt_t *types[], const int64_t li[], int nin, int nout,
+                      bool check_broadcast, const xnd_t args[], int64_t nthreads,
+                      ndt_context_t *ctx);
+GM_API void gm_explain_clear(gm_explain_t *e);
+
+
+/******************************************************************************/
+/*                                 Statistics                                 */
+/******************************************************************************/
+
+typedef struct {
+    int64_t cycles;
+    int64_t instructions;
+    int64_t cache_misses;
+    int64_t branch_misses;
+} gm_counters_t;
+
+typedef struct {
+    const gm_kernel_set_t *set; /* kernel set */
+    uint32_t flag;              /* selected variant, see gm_variant_name() */
+    int64_t calls;              /* kernel applications */
+    int64_t elements;           /* elements of the largest argument */
+    int64_t bytes;              /* bytes of all array arguments */
+    int64_t threaded;           /* applications split across threads */
+    int64_t fallbacks;          /* Xnd selected although faster variants exist */
+    double time;                /* wall time in seconds */
+    gm_counters_t counters;     /* hardware counters, if enabled */
+} gm_stats_t;
+
+GM_API void gm_stats_enable(bool enable);
+GM_API bool gm_stats_enabled(void);
+GM_API void gm_stats_reset(void);
+GM_API double gm_stats_clock(void);
+GM_API void gm_stats_record(const gm_kernel_t *kernel, const xnd_t stack[], double time,
+                            bool threaded, const gm_counters_t *counters);
+GM_API int gm_stats_map(int (*f)(const gm_stats_t *, void *state), void *state,
+                        ndt_context_t *ctx);
+GM_API bool gm_stats_lookup(gm_stats_t *entry, const gm_kernel_set_t *set, uint32_t flag);
+GM_API const char *gm_stats_func(const gm_tbl_t *tbl, const gm_kernel_set_t *set);
+
+GM_API int gm_counters_enable(bool enable, ndt_context_t *ctx);
+GM_API bool gm_counters_enabled(void);
+GM_API int gm_counters_read(gm_counters_t *counts);
+GM_API bool gm_counters_start(gm_counters_t *counts);
+GM_API void gm_counters_stop(gm_counters_t *counts);
+
+
+/******************************************************************************/
+/*                                   Tracing                                  */
+/******************************************************************************/
+
+typedef enum {
+  GM_TRACE_SELECT, /* type checking and kernel selection */
+  GM_TRACE_ALLOC,  /* allocation of outputs */
+  GM_TRACE_APPLY,  /* kernel application */
+  GM_TRACE_CHUNK,  /* part of a threaded application */
+  GM_TRACE_JOIN    /* parallel loop on the executor */
+} gm_trace_phase_t;
+
+typedef struct {
+    gm_trace_phase_t phase;
+    const char *name;           /* function name or NULL */
+    const gm_kernel_set_t *set; /* selected kernel set or NULL */
+    uint32_t flag;              /* selected variant */
+    const xnd_t *stack;         /* arguments or NULL */
+    int nargs;
+    int64_t chunk;              /* chunk index or -1 */
+    uint64_t tid;               /* set by gm_trace_begin/end */
+    double time;                /* set by gm_trace_begin/end */
+} gm_trace_event_t;
+
+typedef void (* gm_trace_hook_t)(const gm_trace_event_t *event, bool begin, void *state);
+
+GM_API int gm_trace_set_hook(gm_trace_hook_t hook, void *state, ndt_context_t *ctx);
+GM_API bool gm_trace_enabled(void);
+GM_API void gm_trace_begin(gm_trace_event_t *event);
+GM_API void gm_trace_end(gm_trace_event_t *event);
+GM_API int gm_trace_start(const char *path, ndt_context_t *ctx);
+GM_API int gm_trace_stop(ndt_context_t *ctx);
+
+
+/******************************************************************************/
+/*                                 Task graphs                                */
+/******************************************************************************/
+
+typedef struct gm_graph gm_graph_t;
+
+GM_API gm_graph_t *gm_graph_new(ndt_context_t *ctx);
+GM_API void gm_graph_del(gm_graph_t *g);
+GM_API int gm_graph_add(gm_graph_t *g, const gm_kernel_t *kernel, const xnd_t stack[],
+                        int outer_dims, ndt_context_t *ctx);
+GM_API int gm_graph_add_dep(gm_graph_t *g, int node, int dep, ndt_context_t *ctx);
+GM_API int gm_graph_run(gm_graph_t *g, int64_t nthreads, int64_t nchunks, ndt_context_t *ctx);
+GM_API double gm_graph_node_time(const gm_graph_t *g, int node);
+GM_API double gm_graph_critical_path(const gm_graph_t *g, int path[], int *length);
+
+
+/******************************************************************************/
+/*                                    NUMA                                    */
+/******************************************************************************/
+
+#define GM_NUMA_PIN         0x0001U /* pin the threads of the default executor */
+#define GM_NUMA_FIRST_TOUCH 0x0002U /* new outputs are first touched by the workers */
+
+GM_API int gm_numa_nodes(void);
+GM_API uint32_t gm_numa_policy(void);
+GM_API void gm_set_numa_policy(uint32_t flags);
+GM_API int gm_numa_cpu(int64_t i, int64_t n);
+GM_API int gm_numa_node_of_cpu(int cpu);
+GM_API void *gm_numa_bind(int cpu);
+GM_API void gm_numa_unbind(void *saved);
+GM_API void *gm_numa_alloc(int64_t size);
+GM_API void gm_numa_free(void *ptr, int64_t size);
+
+
+/******************************************************************************/
+/*                                 Buffer pool                                */
+/******************************************************************************/
+
+#define GM_POOL_ALIGN 64
+
+typedef struct {
+    int64_t cap;       /* maximum number of cached bytes */
+    int64_t cached;    /* bytes in cached blocks */
+    int64_t in_use;    /* bytes in blocks handed out */
+    int64_t peak;      /* maximum of in_use */
+    int64_t hits;      /* allocations served from the cache */
+    int64_t misses;    /* allocations served by the system allocator */
+    int64_t evictions; /* cached blocks released because of the cap */
+} gm_pool_stats_t;
+
+GM_API void *gm_pool_alloc(int64_t size, ndt_context_t *ctx);
+GM_API void *gm_pool_calloc(int64_t size, ndt_context_t *ctx);
+GM_API void gm_pool_free(void *ptr);
+GM_API void gm_pool_set_cap(int64_t cap);
+GM_API void gm_pool_stats(gm_pool_stats_t *stats);
+GM_API void gm_pool_clear(void);
+
+GM_API int gm_pool_xnd_empty(xnd_t *x, const ndt_t *t, ndt_context_t *ctx);
+GM_API void gm_pool_xnd_del(xnd_t *x);
+
+
+/******************************************************************************/
+/*                           Arrow C data interface                           */
+/******************************************************************************/
+
+#ifndef ARROW_C_DATA_INTERFACE
+#define ARROW_C_DATA_INTERFACE
+
+#define ARROW_FLAG_DICTIONARY_ORDERED 1
+#define ARROW_FLAG_NULLABLE 2
+#define ARROW_FLAG_MAP_KEYS_SORTED 4
+
+struct ArrowSchema {
+    const char *format;
+    const char *name;
+    const char *metadata;
+    int64_t flags;
+    int64_t n_children;
+    struct ArrowSchema **children;
+    struct ArrowSchema *dictionary;
+    void (*release)(struct ArrowSchema *);
+    void *private_data;
+};
+
+struct ArrowArray {
+    int64_t length;
+    int64_t null_count;
+    int64_t offset;
+    int64_t n_buffers;
+    int64_t n_children;
+    const void **buffers;
+    struct ArrowArray **children;
+    struct ArrowArray *dictionary;
+    void (*release)(struct ArrowArray *);
+    void *private_data;
+};
+
+#endif /* ARROW_C_DATA_INTERFACE */
+
+GM_API int gm_arrow_import(xnd_t *x, const struct ArrowSchema *schema,
+                           const struct ArrowArray *array, ndt_context_t *ctx);
+GM_API int gm_arrow_import_column(xnd_t *x, const struct ArrowSchema *schema,
+                                  const struct ArrowArray *array, int64_t i,
+                                  ndt_context_t *ctx);
+GM_API int gm_arrow_export(struct ArrowSchema *schema, struct ArrowArray *array,
+                           xnd_master_t *x, ndt_context_t *ctx);
+GM_API int gm_arrow_export_batch(struct ArrowSchema *schema, struct ArrowArray *array,
+                                 const char *names[], xnd_master_t *columns[],
+                                 int64_t ncolumns, ndt_context_t *ctx);
+
+typedef void (*gm_arrow_release_t)(void *owner);
+
+GM_API int gm_arrow_export_view(struct ArrowSchema *schema, struct ArrowArray *array,
+                                const xnd_t *x, gm_arrow_release_t release, void *owner,
+                                ndt_context_t *ctx);
+GM_API int gm_arrow_export_batch_view(struct ArrowSchema *schema, struct ArrowArray *array,
+                                      const char *names[], const xnd_t columns[],
+                                      int64_t ncolumns, gm_arrow_release_t release,
+                                      void *owners[], ndt_context_t *ctx);
+
+
+/******************************************************************************/
+/*                              Streaming apply                               */
+/******************************************************************************/
+
+/* Called with each output block in row order, 'row' is the first row of the block. */
+typedef int (* gm_stream_reduce_t)(const xnd_t *block, int64_t row, void *state, ndt_context_t *ctx);
+
+typedef struct {
+    const char *rowtype;       /* row type of raw input files, ignored for .npy files */
+    const char *out;           /* output file (.npy or raw), or NULL */
+    gm_stream_reduce_t reduce; /* output callback if 'out' is NULL */
+    void *state;               /* passed to 'reduce' */
+    int64_t block_size;        /* block size in bytes, 0 for the default */
+    int64_t nthreads;          /* threads per block */
+} gm_stream_t;
+
+GM_API int gm_stream_apply(const gm_tbl_t *tbl, const char *name, const char *path,
+                           const gm_stream_t *opts, ndt_context_t *ctx);
+
+
 /******************************************************************************/
 /*                       Library initialization and tables                    */
 /******************************************************************************/
@@ -226,6 +583,7 @@ GM_API void gm_init(void);
 GM_API int gm_init_cpu_unary_kernels(gm_tbl_t *tbl, ndt_context_t *ctx);
 GM_API int gm_init_cpu_binary_kernels(gm_tbl_t *tbl, ndt_context_t *ctx);
 GM_API int gm_init_bitwise_kernels(gm_tbl_t *tbl, ndt_context_t *ctx);
+GM_API const char *gm_cpu_isa(void);
 
 GM_API int gm_init_cuda_unary_kernels(gm_tbl_t *tbl, ndt_context_t *ctx);
 GM_API int gm_init_cuda_binary_kernels(gm_tbl_t *tbl, ndt_context_t *ctx);
@@ -39,15 +39,19 @@
 #include "device.hh"
 
 
+/* Kernels are compiled for the instruction set variant (see cpu_device_isa.h). */
+GM_CPU_ISA_BEGIN
+
+
 /*****************************************************************************/
 /*                         CPU device binary kernels                         */
 /*****************************************************************************/
 
 #define CPU_DEVICE_BINARY(name, func, t0, t1, t2, common) \
 extern "C" void                                                             \
-gm_cpu_device_fixed_1D_C_##name##_##t0##_##t1##_##t2(                       \
-    const char *a0, const char *a1, char *a2,                               \
-    const int64_t N)                                                        \
+GM_CPU_DEVICE(fixed_1D_C_##name##_##t0##_##t1##_##t2)(                      \
+     const char *a0, const char *a1, char *a2,                              \
+     const int64_t N)                                                       \
 {                                                                           \
     const t0##_t *x0 = (const t0##_t *)a0;                                  \
     const t1##_t *x1 = (const t1##_t *)a1;                                  \
@@ -70,10 +74,10 @@ gm_cpu_device_fixed_1D_C_##name##_##t0##_##t1##_##t2(                       \
 }                                                                           \
                                                                             \
 extern "C" void                                                             \
-gm_cpu_device_fixed_1D_S_##name##_##t0##_##t1##_##t2(                       \
-    const char *a0, const char *a1, char *a2,                               \
-    const int64_t s0, const int64_t s1, const int64_t s2,                   \
-    const int64_t N)                                                        \
+GM_CPU_DEVICE(fixed_1D_S_##name##_##t0##_##t1##_##t2)(                      \
+     const char *a0, const char *a1, char *a2,                              \
+     const int64_t s0, const int64_t s1, const int64_t s2,                  \
+     const int64_t N)                                                       \
 {                                                                           \
     const t0##_t *x0 = (const t0##_t *)a0;                                  \
     const t1##_t *x1 = (const t1##_t *)a1;                                  \
@@ -86,8 +90,8 @@ gm_cpu_device_fixed_1D_S_##name##_##t0##_##t1##_##t2(                       \
 }                                                                           \
                                                                             \
 extern "C" void                                                             \
-gm_cpu_device_0D_##name##_##t0##_##t1##_##t2(                               \
-    const char *a0, const char *a1, char *a2)                               \
+GM_CPU_DEVICE(0D_##name##_##t0##_##t1##_##t2)(                              \
+     const char *a0, const char *a1, char *a2)                              \
 {                                                                           \
     const t0##_t x0 = *(const t0##_t *)a0;                                  \
     const t1##_t x1 = *(const t1##_t *)a1;                                  \
@@ -1081,8 +1085,8 @@ CPU_DEVICE_ALL_BITWISE(bitwise_xor, bitwise_xor)
 
 #define CPU_DEVICE_BINARY_MV(name, func, t0, t1, t2, t3) \
 extern "C" void                                                    \
-gm_cpu_device_fixed_1D_C_##name##_##t0##_##t1##_##t2##_##t3(       \
-    const char *a0, const char *a1, char *a2, char *a3, int64_t N) \
+GM_CPU_DEVICE(fixed_1D_C_##name##_##t0##_##t1##_##t2##_##t3)(      \
+     const char *a0, const char *a1, char *a2, char *a3, int64_t N) \
 {                                                                  \
     const t0##_t *x0 = (const t0##_t *)a0;                         \
     const t1##_t *x1 = (const t1##_t *)a1;                         \
@@ -1096,8 +1100,8 @@ gm_cpu_device_fixed_1D_C_##name##_##t0##_##t1##_##t2##_##t3(       \
 }                                                                  \
                                                                    \
 extern "C" void                                                    \
-gm_cpu_device_0D_##name##_##t0##_##t1##_##t2##_##t3(               \
-    const char *a0, const char *a1, char *a2, char *a3)            \
+GM_CPU_DEVICE(0D_##name##_##t0##_##t1##_##t2##_##t3)(              \
+     const char *a0, const char *a1, char *a2, char *a3)           \
 {                                                                  \
     const t0##_t x0 = *(const t0##_t *)a0;                         \
     const t1##_t x1 = *(const t1##_t *)a1;                         \
@@ -1121,3 +1125,6 @@ gm_cpu_device_0D_##name##_##t0##_##t1##_##t2##_##t3(               \
     CPU_DEVICE_BINARY_MV(name, func, float64, float64, float64, float64)
 
 CPU_DEVICE_ALL_BINARY_MV(divmod, _divmod)
+
+
+GM_CPU_ISA_END
@@ -47,6 +47,8 @@ typedef std::complex<double> complex128_t;
 #include <stdint.h>
 #endif
 
+#include "cpu_device_isa.h"
+
 
 typedef bool bool_t;
 typedef float float32_t;
@@ -59,40 +61,40 @@ typedef double float64_t;
 
 #ifdef __cplusplus
   #define CPU_DEVICE_BINARY_DECL(name, t0, t1, t2) \
-  extern "C" void gm_cpu_device_fixed_1D_C_##name##_##t0##_##t1##_##t2( \
-                 const char *a0, const char *a1, char *a2,              \
-                 const int64_t N);                                      \
-  extern "C" void gm_cpu_device_fixed_1D_S_##name##_##t0##_##t1##_##t2( \
-                 const char *a0, const char *a1, char *a2,              \
-                 const int64_t s0, const int64_t s1, const int64_t s2,  \
-                 const int64_t N);                                      \
-  extern "C" void gm_cpu_device_0D_##name##_##t0##_##t1##_##t2(         \
-                 const char *a0, const char *a1, char *a2);
+  extern "C" void GM_CPU_DEVICE(fixed_1D_C_##name##_##t0##_##t1##_##t2)( \
+                  const char *a0, const char *a1, char *a2,             \
+                  const int64_t N);                                     \
+  extern "C" void GM_CPU_DEVICE(fixed_1D_S_##name##_##t0##_##t1##_##t2)( \
+                  const char *a0, const char *a1, char *a2,             \
+                  const int64_t s0, const int64_t s1, const int64_t s2, \
+                  const int64_t N);                                     \
+  extern "C" void GM_CPU_DEVICE(0D_##name##_##t0##_##t1##_##t2)(        \
+                  const char *a0, const char *a1, char *a2);
 
   #define CPU_DEVICE_BINARY_MV_DECL(name, t0, t1, t2, t3) \
-  extern "C" void gm_cpu_device_fixed_1D_C_##name##_##t0##_##t1##_##t2##_##t3( \
-                 const char *a0, const char *a1, char *a2, char *a3,           \
-                 const int64_t N);                                             \
-  extern "C" void gm_cpu_device_0D_##name##_##t0##_##t1##_##t2##_##t3(         \
-                 const char *a0, const char *a1, char *a2, char *a3);
+  extern "C" void GM_CPU_DEVICE(fixed_1D_C_##name##_##t0##_##t1##_##t2##_##t3)( \
+                  const char *a0, const char *a1, char *a2, char *a3,          \
+                  const int64_t N);                                            \
+  extern "C" void GM_CPU_DEVICE(0D_##name##_##t0##_##t1##_##t2##_##t3)(        \
+                  const char *a0, const char *a1, char *a2, char *a3);
 #else
   #define CPU_DEVICE_BINARY_DECL(name, t0, t1, t2) \
-  void gm_cpu_device_fixed_1D_C_##name##_##t0##_##t1##_##t2( \
-      const char *a0, const char *a1, char *a2,              \
-      const int64_t N);                                      \
-  void gm_cpu_device_fixed_1D_S_##name##_##t0##_##t1##_##t2( \
-      const char *a0, const char *a1, char *a2,              \
-      const int64_t s0, const int64_t s1, const int64_t s2,  \
-      const int64_t N);                                      \
-  void gm_cpu_device_0D_##name##_##t0##_##t1##_##t2(         \
-      const char *a0, const char *a1, char *a2);
+  void GM_CPU_DEVICE(fixed_1D_C_##name##_##t0##_##t1##_##t2)( \
+       const char *a0, const char *a1, char *a2,             \
+       const int64_t N);                                     \
+  void GM_CPU_DEVICE(fixed_1D_S_##name##_##t0##_##t1##_##t2)( \
+       const char *a0, const char *a1, char *a2,             \
+       const int64_t s0, const int64_t s1, const int64_t s2, \
+       const int64_t N);                                     \
+  void GM_CPU_DEVICE(0D_##name##_##t0##_##t1##_##t2)(        \
+       const char *a0, const char *a1, char *a2);
 
   #define CPU_DEVICE_BINARY_MV_DECL(name, t0, t1, t2, t3) \
-  void gm_cpu_device_fixed_1D_C_##name##_##t0##_##t1##_##t2##_##t3( \
-      const char *a0, const char *a1, char *a2, char *a3,           \
-      const int64_t N);                                             \
-  void gm_cpu_device_0D_##name##_##t0##_##t1##_##t2##_##t3(         \
-      const char *a0, const char *a1, char *a2, char *a3);
+  void GM_CPU_DEVICE(fixed_1D_C_##name##_##t0##_##t1##_##t2##_##t3)( \
+       const char *a0, const char *a1, char *a2, char *a3,          \
+       const int64_t N);                                            \
+  void GM_CPU_DEVICE(0D_##name##_##t0##_##t1##_##t2##_##t3)(        \
+       const char *a0, const char *a1, char *a2, char *a3);
 #endif
 
 #define CPU_DEVICE_NOKERN_DECL(name, t0, t1, t2)
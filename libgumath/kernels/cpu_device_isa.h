@@ -0,0 +1,93 @@
+/*
+* BSD 3-Clause License
+*
+* Copyright (c) 2017-2018, plures
+* All rights reserved.
+*
+* Redistribution and use in source and binary forms, with or without
+* modification, are permitted provided that the following conditions are met:
+*
+* 1. Redistributions of source code must retain the above copyright notice,
+*    this list of conditions and the following disclaimer.
+*
+* 2. Redistributions in binary form must reproduce the above copyright notice,
+*    this list of conditions and the following disclaimer in the documentation
+*    and/or other materials provided with the distribution.
+*
+* 3. Neither the name of the copyright holder nor the names of its
+*    contributors may be used to endorse or promote products derived from
+*    this software without specific prior written permission.
+*
+* THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+* AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+* IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+* DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+* FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+* DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+* SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+* CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+* OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+* OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+
+#ifndef CPU_DEVICE_ISA_H
+#define CPU_DEVICE_ISA_H
+
+
+/*****************************************************************************/
+/*                      Instruction set variants of kernels                  */
+/*****************************************************************************/
+
+/*
+ * The cpu host and device kernels are compiled once for the baseline
+ * instruction set and once for each variant that the build enables, e.g.
+ * with -DGM_CPU_ISA_AVX2.  Each variant has its own symbol prefix for the
+ * device kernels and its own table init functions.  At runtime gm_cpu_isa()
+ * selects the best variant that the cpu supports.
+ *
+ * In the device files GM_CPU_ISA_BEGIN follows the #include directives:
+ * Inline functions from headers are emitted in every variant under the same
+ * name, so they must be compiled for the baseline.
+ */
+
+#define GM_ISA_XCAT(a, b) a##b
+#define GM_ISA_CAT(a, b) GM_ISA_XCAT(a, b)
+#define GM_ISA_PRAGMA(x) _Pragma(#x)
+
+#if defined(__clang__)
+  #define GM_ISA_TARGET(t) \
+    GM_ISA_PRAGMA(clang attribute push (__attribute__((target(t))), apply_to = function))
+  #define GM_ISA_TARGET_END GM_ISA_PRAGMA(clang attribute pop)
+#elif defined(__GNUC__)
+  #define GM_ISA_TARGET(t) GM_ISA_PRAGMA(GCC push_options) GM_ISA_PRAGMA(GCC target(t))
+  #define GM_ISA_TARGET_END GM_ISA_PRAGMA(GCC pop_options)
+#endif
+
+#if defined(GM_CPU_ISA_AVX512)
+  #define GM_CPU_ISA avx512
+  #define GM_CPU_ISA_BEGIN GM_ISA_TARGET("avx512f,avx512bw,avx512dq,avx512vl,avx2,fma")
+  #define GM_CPU_ISA_END GM_ISA_TARGET_END
+#elif defined(GM_CPU_ISA_AVX2)
+  #define GM_CPU_ISA avx2
+  #define GM_CPU_ISA_BEGIN GM_ISA_TARGET("avx2,fma")
+  #define GM_CPU_ISA_END GM_ISA_TARGET_END
+#elif defined(GM_CPU_ISA_SVE)
+  #define GM_CPU_ISA sve
+  #define GM_CPU_ISA_BEGIN GM_ISA_TARGET("+sve")
+  #define GM_CPU_ISA_END GM_ISA_TARGET_END
+#else
+  #define GM_CPU_ISA baseline
+  #define GM_CPU_ISA_BEGIN
+  #define GM_CPU_ISA_END
+#endif
+
+/* gm_cpu_device_<isa>_<name> */
+#define GM_CPU_DEVICE(name) \
+    GM_ISA_CAT(GM_ISA_CAT(gm_cpu_device_, GM_CPU_ISA), GM_ISA_CAT(_, name))
+
+/* <name>_<isa> */
+#define GM_CPU_HOST_INIT(name) GM_ISA_CAT(name, GM_ISA_CAT(_, GM_CPU_ISA))
+
+
+#endif /* CPU_DEVICE_ISA_H */
@@ -50,8 +50,8 @@
 
 #define CPU_DEVICE_UNARY(name, func, t0, t1, common) \
 extern "C" void                                                                   \
-gm_cpu_device_fixed_1D_C_##name##_##t0##_##t1(const char *a0, char *a1,           \
-                                              int64_t N)                          \
+GM_CPU_DEVICE(fixed_1D_C_##name##_##t0##_##t1)(const char *a0, char *a1,          \
+                                               int64_t N)                         \
 {                                                                                 \
     const t0##_t *x0 = (const t0##_t *)a0;                                        \
     t1##_t *x1 = (t1##_t *)a1;                                                    \
@@ -62,9 +62,9 @@ gm_cpu_device_fixed_1D_C_##name##_##t0##_##t1(const char *a0, char *a1,
 }                                                                                 \
                                                                                   \
 extern "C" void                                                                   \
-gm_cpu_device_fixed_1D_S_##name##_##t0##_##t1(const char *a0, char *a1,           \
-                                              const int64_t s0, const int64_t s1, \
-                                              const int64_t N)                    \
+GM_CPU_DEVICE(fixed_1D_S_##name##_##t0##_##t1)(const char *a0, char *a1,          \
+                                               const int64_t s0, const int64_t s1, \
+                                               const int64_t N)                   \
 {                                                                                 \
     const t0##_t *x0 = (const t0##_t *)a0;                                        \
     t1##_t *x1 = (t1##_t *)a1;                                                    \
@@ -76,7 +76,7 @@ gm_cpu_device_fixed_1D_S_##name##_##t0##_##t1(const char *a0, char *a1,
 }                                                                                 \
                                                                                   \
 extern "C" void                                                                   \
-gm_cpu_device_0D_##name##_##t0##_##t1(const char *a0, char *a1)                   \
+GM_CPU_DEVICE(0D_##name##_##t0##_##t1)(const char *a0, char *a1)                  \
 {                                                                                 \
     const t0##_t x0 = *((const t0##_t *)a0);                                      \
     t1##_t *x1 = (t1##_t *)a1;                                                    \
@@ -224,9 +224,9 @@ CPU_DEVICE_UNARY_ALL_COMPLEX_MATH(atanh)
 
 #define CPU_DEVICE_BINARY(name, func, t0, t1, t2, common) \
 extern "C" void                                                          \
-gm_cpu_device_fixed_1D_C_##name##_##t0##_##t1##_##t2(                    \
-    const char *a0, const char *a1, char *a2,                            \
-    const int64_t N)                                                     \
+GM_CPU_DEVICE(fixed_1D_C_##name##_##t0##_##t1##_##t2)(                   \
+     const char *a0, const char *a1, char *a2,                           \
+     const int64_t N)                                                    \
 {                                                                        \
     const t0##_t *x0 = (const t0##_t *)a0;                               \
     const t1##_t *x1 = (const t1##_t *)a1;                               \
@@ -249,10 +249,10 @@ gm_cpu_device_fixed_1D_C_##name##_##t0##_##t1##_##t2(                    \
 }                                                                        \
                                                                          \
 extern "C" void                                                          \
-gm_cpu_device_fixed_1D_S_##name##_##t0##_##t1##_##t2(                    \
-    const char *a0, const char *a1, char *a2,                            \
-    const int64_t s0, const int64_t s1, const int64_t s2,                \
-    const int64_t N)                                                     \
+GM_CPU_DEVICE(fixed_1D_S_##name##_##t0##_##t1##_##t2)(                   \
+     const char *a0, const char *a1, char *a2,                           \
+     const int64_t s0, const int64_t s1, const int64_t s2,               \
+     const int64_t N)                                                    \
 {                                                                        \
     const t0##_t *x0 = (const t0##_t *)a0;                               \
     const t1##_t *x1 = (const t1##_t *)a1;                               \
@@ -265,8 +265,8 @@ gm_cpu_device_fixed_1D_S_##name##_##t0##_##t1##_##t2(                    \
 }                                                                        \
                                                                          \
 extern "C" void                                                          \
-gm_cpu_device_0D_##name##_##t0##_##t1##_##t2(                            \
-    const char *a0, const char *a1, char *a2)                            \
+GM_CPU_DEVICE(0D_##name##_##t0##_##t1##_##t2)(                           \
+     const char *a0, const char *a1, char *a2)                           \
 {                                                                        \
     const t0##_t x0 = *(const t0##_t *)a0;                               \
     const t1##_t x1 = *(const t1##_t *)a1;                               \
@@ -38,14 +38,18 @@
 #include "contrib/bfloat16.h"
 
 
+/* Kernels are compiled for the instruction set variant (see cpu_device_isa.h). */
+GM_CPU_ISA_BEGIN
+
+
 /*****************************************************************************/
 /*                          CPU device unary kernels                         */
 /*****************************************************************************/
 
 #define CPU_DEVICE_UNARY(name, func, t0, t1, common) \
 extern "C" void                                                                   \
-gm_cpu_device_fixed_1D_C_##name##_##t0##_##t1(const char *a0, char *a1,           \
-                                              const int64_t N)                    \
+GM_CPU_DEVICE(fixed_1D_C_##name##_##t0##_##t1)(const char *a0, char *a1,          \
+                                               const int64_t N)                   \
 {                                                                                 \
     const t0##_t *x0 = (const t0##_t *)a0;                                        \
     t1##_t *x1 = (t1##_t *)a1;                                                    \
@@ -56,9 +60,9 @@ gm_cpu_device_fixed_1D_C_##name##_##t0##_##t1(const char *a0, char *a1,
 }                                                                                 \
                                                                                   \
 extern "C" void                                                                   \
-gm_cpu_device_fixed_1D_S_##name##_##t0##_##t1(const char *a0, char *a1,           \
-                                              const int64_t s0, const int64_t s1, \
-                                              const int64_t N)                    \
+GM_CPU_DEVICE(fixed_1D_S_##name##_##t0##_##t1)(const char *a0, char *a1,          \
+                                               const int64_t s0, const int64_t s1, \
+                                               const int64_t N)                   \
 {                                                                                 \
     const t0##_t *x0 = (const t0##_t *)a0;                                        \
     t1##_t *x1 = (t1##_t *)a1;                                                    \
@@ -70,7 +74,7 @@ gm_cpu_device_fixed_1D_S_##name##_##t0##_##t1(const char *a0, char *a1,
 }                                                                                 \
                                                                                   \
 extern "C" void                                                                   \
-gm_cpu_device_0D_##name##_##t0##_##t1(const char *a0, char *a1)                   \
+GM_CPU_DEVICE(0D_##name##_##t0##_##t1)(const char *a0, char *a1)                  \
 {                                                                                 \
     const t0##_t x0 = *((const t0##_t *)a0);                                      \
     t1##_t *x1 = (t1##_t *)a1;                                                    \
@@ -366,3 +370,6 @@ CPU_DEVICE_UNARY_ALL_REAL_MATH(floor)
 CPU_DEVICE_UNARY_ALL_REAL_MATH(trunc)
 CPU_DEVICE_UNARY_ALL_REAL_MATH(round)
 CPU_DEVICE_UNARY_ALL_REAL_MATH(nearbyint)
+
+
+GM_CPU_ISA_END
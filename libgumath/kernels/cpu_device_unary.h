@@ -46,6 +46,8 @@ typedef std::complex<double> complex128_t;
 #include <stdint.h>
 #endif
 
+#include "cpu_device_isa.h"
+
 
 typedef bool bool_t;
 typedef float float32_t;
@@ -58,20 +60,20 @@ typedef double float64_t;
 
 #ifdef __cplusplus
   #define CPU_DEVICE_UNARY_DECL(name, t0, t1) \
-  extern "C" void gm_cpu_device_fixed_1D_C_##name##_##t0##_##t1(const char *a0, char *a1,           \
-                                                                const int64_t N);                   \
-  extern "C" void gm_cpu_device_fixed_1D_S_##name##_##t0##_##t1(const char *a0, char *a1,           \
-                                                                const int64_t s0, const int64_t s1, \
-                                                                const int64_t N);                   \
-  extern "C" void gm_cpu_device_0D_##name##_##t0##_##t1(const char *a0, char *a1);
+  extern "C" void GM_CPU_DEVICE(fixed_1D_C_##name##_##t0##_##t1)(const char *a0, char *a1,          \
+                                                                 const int64_t N);                  \
+  extern "C" void GM_CPU_DEVICE(fixed_1D_S_##name##_##t0##_##t1)(const char *a0, char *a1,          \
+                                                                 const int64_t s0, const int64_t s1, \
+                                                                 const int64_t N);                  \
+  extern "C" void GM_CPU_DEVICE(0D_##name##_##t0##_##t1)(const char *a0, char *a1);
 #else
   #define CPU_DEVICE_UNARY_DECL(name, t0, t1) \
-  void gm_cpu_device_fixed_1D_C_##name##_##t0##_##t1(const char *a0, char *a1,           \
-                                                     const int64_t N);                   \
-  void gm_cpu_device_fixed_1D_S_##name##_##t0##_##t1(const char *a0, char *a1,           \
-                                                     const int64_t s0, const int64_t s1, \
-                                                     const int64_t N);                   \
-  void gm_cpu_device_0D_##name##_##t0##_##t1(const char *a0, char *a1);
+  void GM_CPU_DEVICE(fixed_1D_C_##name##_##t0##_##t1)(const char *a0, char *a1,          \
+                                                      const int64_t N);                  \
+  void GM_CPU_DEVICE(fixed_1D_S_##name##_##t0##_##t1)(const char *a0, char *a1,          \
+                                                      const int64_t s0, const int64_t s1, \
+                                                      const int64_t N);                  \
+  void GM_CPU_DEVICE(0D_##name##_##t0##_##t1)(const char *a0, char *a1);
 #endif
 
 #define CPU_DEVICE_UNARY_NOIMPL_DECL(name, t0, t1)
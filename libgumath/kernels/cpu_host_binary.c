@@ -622,7 +622,7 @@ gm_cpu_host_fixed_1D_C_##name##_##t0##_##t1##_##t2(xnd_t stack[], ndt_context_t
         }                                                                              \
     }                                                                                  \
                                                                                        \
-    gm_cpu_device_fixed_1D_C_##name##_##t0##_##t1##_##t2(a0, a1, a2, N);               \
+    GM_CPU_DEVICE(fixed_1D_C_##name##_##t0##_##t1##_##t2)(a0, a1, a2, N);              \
                                                                                        \
     if (ndt_is_optional(ndt_dtype(stack[2].type))) {                                   \
         binary_update_bitmap_1D_S(stack);                                              \
@@ -652,7 +652,7 @@ gm_cpu_host_fixed_1D_S_##name##_##t0##_##t1##_##t2(xnd_t stack[], ndt_context_t
         }                                                                              \
     }                                                                                  \
                                                                                        \
-    gm_cpu_device_fixed_1D_S_##name##_##t0##_##t1##_##t2(a0, a1, a2, s0, s1, s2, N);   \
+    GM_CPU_DEVICE(fixed_1D_S_##name##_##t0##_##t1##_##t2)(a0, a1, a2, s0, s1, s2, N);  \
                                                                                        \
     if (ndt_is_optional(ndt_dtype(stack[2].type))) {                                   \
         binary_update_bitmap_1D_S(stack);                                              \
@@ -687,7 +687,7 @@ gm_cpu_host_array_1D_C_##name##_##t0##_##t1##_##t2(xnd_t stack[], ndt_context_t
         }                                                                              \
     }                                                                                  \
                                                                                        \
-    gm_cpu_device_fixed_1D_C_##name##_##t0##_##t1##_##t2(a0, a1, a2, N);               \
+    GM_CPU_DEVICE(fixed_1D_C_##name##_##t0##_##t1##_##t2)(a0, a1, a2, N);              \
                                                                                        \
     if (ndt_is_optional(ndt_dtype(stack[2].type))) {                                   \
         binary_update_bitmap_1D_S(stack);                                              \
@@ -713,7 +713,7 @@ gm_cpu_host_0D_##name##_##t0##_##t1##_##t2(xnd_t stack[], ndt_context_t *ctx)
         }                                                                              \
     }                                                                                  \
                                                                                        \
-    gm_cpu_device_0D_##name##_##t0##_##t1##_##t2(a0, a1, a2);                          \
+    GM_CPU_DEVICE(0D_##name##_##t0##_##t1##_##t2)(a0, a1, a2);                         \
                                                                                        \
     if (ndt_is_optional(ndt_dtype(stack[2].type))) {                                   \
         binary_update_bitmap_0D(stack);                                                \
@@ -2837,8 +2837,8 @@ gm_cpu_host_fixed_1D_C_##name##_##t0##_##t1##_##t2##_##t3(xnd_t stack[], ndt_con
     int64_t N = xnd_fixed_shape(&stack[0]);                                                  \
     (void)ctx;                                                                               \
                                                                                              \
-    gm_cpu_device_fixed_1D_C_##name##_##t0##_##t1##_##t2##_##t3(                             \
-        a0, a1, a2, a3, N);                                                                  \
+    GM_CPU_DEVICE(fixed_1D_C_##name##_##t0##_##t1##_##t2##_##t3)(                            \
+         a0, a1, a2, a3, N);                                                                 \
                                                                                              \
     return 0;                                                                                \
 }                                                                                            \
@@ -2852,7 +2852,7 @@ gm_cpu_host_0D_##name##_##t0##_##t1##_##t2##_##t3(xnd_t stack[], ndt_context_t *
     char *a3 = stack[3].ptr;                                                                 \
     (void)ctx;                                                                               \
                                                                                              \
-    gm_cpu_device_0D_##name##_##t0##_##t1##_##t2##_##t3(a0, a1, a2, a3);                     \
+    GM_CPU_DEVICE(0D_##name##_##t0##_##t1##_##t2##_##t3)(a0, a1, a2, a3);                    \
                                                                                              \
     return 0;                                                                                \
 }
@@ -2925,8 +2925,9 @@ bitwise_typecheck(ndt_apply_spec_t *spec, const gm_func_t *f, const ndt_t *types
 }
 
 
+/* Table init of the instruction set variant, called from cpu.c. */
 int
-gm_init_cpu_binary_kernels(gm_tbl_t *tbl, ndt_context_t *ctx)
+GM_CPU_HOST_INIT(gm_init_cpu_binary_kernels)(gm_tbl_t *tbl, ndt_context_t *ctx)
 {
     const gm_kernel_init_t *k;
 
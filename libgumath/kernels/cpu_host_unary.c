@@ -348,7 +348,7 @@ gm_cpu_host_fixed_1D_C_##name##_##t0##_##t1(xnd_t stack[], ndt_context_t *ctx) \
     const int64_t N = xnd_fixed_shape(&stack[0]);                              \
     (void)ctx;                                                                 \
                                                                                \
-    gm_cpu_device_fixed_1D_C_##name##_##t0##_##t1(a0, a1, N);                  \
+    GM_CPU_DEVICE(fixed_1D_C_##name##_##t0##_##t1)(a0, a1, N);                 \
                                                                                \
     if (ndt_is_optional(ndt_dtype(stack[1].type))) {                           \
         unary_update_bitmap_1D_S(stack);                                       \
@@ -367,7 +367,7 @@ gm_cpu_host_fixed_1D_S_##name##_##t0##_##t1(xnd_t stack[], ndt_context_t *ctx) \
     const int64_t s1 = xnd_fixed_step(&stack[1]);                              \
     (void)ctx;                                                                 \
                                                                                \
-    gm_cpu_device_fixed_1D_S_##name##_##t0##_##t1(a0, a1, s0, s1, N);          \
+    GM_CPU_DEVICE(fixed_1D_S_##name##_##t0##_##t1)(a0, a1, s0, s1, N);         \
                                                                                \
     if (ndt_is_optional(ndt_dtype(stack[1].type))) {                           \
         unary_update_bitmap_1D_S(stack);                                       \
@@ -388,7 +388,7 @@ gm_cpu_host_array_1D_C_##name##_##t0##_##t1(xnd_t stack[], ndt_context_t *ctx) \
     }                                                                          \
     char *a1 = XND_ARRAY_DATA(stack[1].ptr);                                   \
                                                                                \
-    gm_cpu_device_fixed_1D_C_##name##_##t0##_##t1(a0, a1, N);                  \
+    GM_CPU_DEVICE(fixed_1D_C_##name##_##t0##_##t1)(a0, a1, N);                 \
                                                                                \
     if (ndt_is_optional(ndt_dtype(stack[1].type))) {                           \
         unary_update_bitmap_1D_S(stack);                                       \
@@ -404,7 +404,7 @@ gm_cpu_host_0D_##name##_##t0##_##t1(xnd_t stack[], ndt_context_t *ctx)         \
     char *a1 = stack[1].ptr;                                                   \
     (void)ctx;                                                                 \
                                                                                \
-    gm_cpu_device_0D_##name##_##t0##_##t1(a0, a1);                             \
+    GM_CPU_DEVICE(0D_##name##_##t0##_##t1)(a0, a1);                            \
                                                                                \
     if (ndt_is_optional(ndt_dtype(stack[1].type))) {                           \
         unary_update_bitmap_0D(stack);                                         \
@@ -1067,8 +1067,9 @@ unary_math_typecheck(ndt_apply_spec_t *spec, const gm_func_t *f, const ndt_t *ty
                                nin, nout, check_broadcast, ctx);
 }
 
+/* Table init of the instruction set variant, called from cpu.c. */
 int
-gm_init_cpu_unary_kernels(gm_tbl_t *tbl, ndt_context_t *ctx)
+GM_CPU_HOST_INIT(gm_init_cpu_unary_kernels)(gm_tbl_t *tbl, ndt_context_t *ctx)
 {
     const gm_kernel_init_t *k;
 
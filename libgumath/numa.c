@@ -0,0 +1,377 @@
+/*
+ * BSD 3-Clause License
+ *
+ * Copyright (c) 2017-2018, plures
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#ifdef __linux__
+#define _GNU_SOURCE
+#endif
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <stdio.h>
+#include "ndtypes.h"
+#include "xnd.h"
+#include "gumath.h"
+#include "sys.h"
+
+
+/*
+ * NUMA placement.
+ *
+ * The topology is read from /sys/devices/system/node and restricted to the
+ * cpus in the affinity mask of the process.  The cpus are ordered by node,
+ * and range 'i' of 'n' ranges of a parallel loop is assigned to the cpu at
+ * position i * ncpus / n.  Consecutive ranges are therefore placed on the
+ * same node, and a range is always placed on the same node for the same
+ * number of ranges, so repeated calls on the same data access local memory.
+ *
+ * With GM_NUMA_FIRST_TOUCH, gm_numa_alloc() maps fresh pages for large
+ * pooled blocks.  Nothing writes them before the kernel runs, so the worker
+ * that first writes a page allocates it on its own node.
+ *
+ * On systems other than Linux there is a single node and binding is a
+ * no-op.
+ */
+
+#define FIRST_TOUCH_MIN (1024 * 1024)
+
+static struct {
+    gm_mutex_t lock;
+    bool init;
+    int nnodes;
+    int ncpus;
+    int *cpus;  /* allowed cpus, ordered by node */
+    int *nodes; /* node of cpus[i] */
+    uint32_t policy;
+} numa = {
+  .lock = GM_MUTEX_INIT,
+  .init = false,
+  .nnodes = 1,
+  .ncpus = 0,
+  .cpus = NULL,
+  .nodes = NULL,
+  .policy = 0
+};
+
+
+#ifdef __linux__
+#include <sched.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+/* Parse a list like "0-3,8-11" into 'set'. */
+static void
+parse_cpulist(cpu_set_t *set, const char *s)
+{
+    CPU_ZERO(set);
+
+    while (*s != '\0' && *s != '\n') {
+        char *end;
+        long lo, hi;
+
+        lo = strtol(s, &end, 10);
+        if (end == s) {
+            return;
+        }
+        hi = lo;
+        s = end;
+
+        if (*s == '-') {
+            hi = strtol(s+1, &end, 10);
+            if (end == s+1) {
+                return;
+            }
+            s = end;
+        }
+
+        for (long cpu = lo; cpu <= hi && cpu < CPU_SETSIZE; cpu++) {
+            CPU_SET((int)cpu, set);
+        }
+
+        if (*s == ',') {
+            s++;
+        }
+    }
+}
+
+/* Read a file in cpulist format, e.g. node/online or nodeN/cpulist. */
+static bool
+read_list(cpu_set_t *set, const char *path)
+{
+    char buf[4096];
+    FILE *fp;
+
+    fp = fopen(path, "r");
+    if (fp == NULL) {
+        return false;
+    }
+
+    if (fgets(buf, sizeof buf, fp) == NULL) {
+        buf[0] = '\0';
+    }
+    fclose(fp);
+
+    parse_cpulist(set, buf);
+    return true;
+}
+
+static void
+init_topology(void)
+{
+    cpu_set_t allowed, online, node_set;
+    char path[64];
+    int ncpus, n = 0;
+
+    if (sched_getaffinity(0, sizeof allowed, &allowed) < 0) {
+        return;
+    }
+
+    ncpus = CPU_COUNT(&allowed);
+    numa.cpus = malloc(ncpus * sizeof *numa.cpus);
+    numa.nodes = malloc(ncpus * sizeof *numa.nodes);
+    if (numa.cpus == NULL || numa.nodes == NULL) {
+        free(numa.cpus);
+        free(numa.nodes);
+        numa.cpus = numa.nodes = NULL;
+        return;
+    }
+
+    if (!read_list(&online, "/sys/devices/system/node/online")) {
+        CPU_ZERO(&online);
+    }
+
+    numa.nnodes = 0;
+    for (int node = 0; node < CPU_SETSIZE && n < ncpus; node++) {
+        if (!CPU_ISSET(node, &online)) {
+            continue;
+        }
+
+        snprintf(path, sizeof path, "/sys/devices/system/node/node%d/cpulist", node);
+        if (!read_list(&node_set, path)) {
+            continue;
+        }
+
+        CPU_AND(&node_set, &node_set, &allowed);
+        if (CPU_COUNT(&node_set) == 0) {
+            continue;
+        }
+
+        for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+            if (CPU_ISSET(cpu, &node_set) && n < ncpus) {
+                numa.cpus[n] = cpu;
+                numa.nodes[n] = node;
+                CPU_CLR(cpu, &allowed);
+                n++;
+            }
+        }
+        numa.nnodes++;
+    }
+
+    /* No sysfs or cpus without a node: a single node. */
+    for (int cpu = 0; cpu < CPU_SETSIZE && n < ncpus; cpu++) {
+        if (CPU_ISSET(cpu, &allowed)) {
+            numa.cpus[n] = cpu;
+            numa.nodes[n] = 0;
+            n++;
+        }
+    }
+
+    if (numa.nnodes == 0) {
+        numa.nnodes = 1;
+    }
+    numa.ncpus = n;
+}
+#else
+static void
+init_topology(void)
+{
+    return;
+}
+#endif
+
+static void
+init_numa(void)
+{
+    gm_mutex_lock(&numa.lock);
+    if (!numa.init) {
+        init_topology();
+        numa.init = true;
+    }
+    gm_mutex_unlock(&numa.lock);
+}
+
+
+/* Number of nodes with cpus that the process may run on. */
+int
+gm_numa_nodes(void)
+{
+    init_numa();
+    return numa.nnodes;
+}
+
+uint32_t
+gm_numa_policy(void)
+{
+    return numa.policy;
+}
+
+/* Enable GM_NUMA_PIN and GM_NUMA_FIRST_TOUCH. */
+void
+gm_set_numa_policy(uint32_t flags)
+{
+    init_numa();
+    numa.policy = flags & (GM_NUMA_PIN|GM_NUMA_FIRST_TOUCH);
+}
+
+/*
+ * Return the cpu for range 'i' of 'n' ranges if GM_NUMA_PIN is set, -1
+ * otherwise.
+ */
+int
+gm_numa_cpu(int64_t i, int64_t n)
+{
+    if (!(numa.policy & GM_NUMA_PIN) || numa.ncpus == 0 || n <= 0) {
+        return -1;
+    }
+
+    return numa.cpus[(i % n) * numa.ncpus / n];
+}
+
+/* Return the node of 'cpu', or -1 if the cpu is not known. */
+int
+gm_numa_node_of_cpu(int cpu)
+{
+    init_numa();
+
+    for (int i = 0; i < numa.ncpus; i++) {
+        if (numa.cpus[i] == cpu) {
+            return numa.nodes[i];
+        }
+    }
+
+    return -1;
+}
+
+/*
+ * Bind the calling thread to 'cpu'.  The result restores the previous
+ * affinity with gm_numa_unbind() and is NULL if nothing was changed.
+ */
+void *
+gm_numa_bind(int cpu)
+{
+#ifdef __linux__
+    cpu_set_t *saved;
+    cpu_set_t set;
+
+    if (cpu < 0 || cpu >= CPU_SETSIZE) {
+        return NULL;
+    }
+
+    saved = malloc(sizeof *saved);
+    if (saved == NULL) {
+        return NULL;
+    }
+
+    if (pthread_getaffinity_np(pthread_self(), sizeof *saved, saved) != 0) {
+        free(saved);
+        return NULL;
+    }
+
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    if (pthread_setaffinity_np(pthread_self(), sizeof set, &set) != 0) {
+        free(saved);
+        return NULL;
+    }
+
+    return saved;
+#else
+    (void)cpu;
+    return NULL;
+#endif
+}
+
+void
+gm_numa_unbind(void *saved)
+{
+#ifdef __linux__
+    if (saved != NULL) {
+        (void)pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), saved);
+        free(saved);
+    }
+#else
+    (void)saved;
+#endif
+}
+
+/*
+ * With GM_NUMA_FIRST_TOUCH on a multi-node system, map 'size' bytes of fresh
+ * pages that are placed on the node of the thread that first writes them.
+ * The pages read as zero.  Return NULL if the policy is off, the block is
+ * smaller than FIRST_TOUCH_MIN or the mapping fails: the caller then uses
+ * its usual allocator.
+ */
+void *
+gm_numa_alloc(int64_t size)
+{
+#ifdef __linux__
+    void *ptr;
+
+    if (!(numa.policy & GM_NUMA_FIRST_TOUCH) || numa.nnodes <= 1 ||
+        size < FIRST_TOUCH_MIN) {
+        return NULL;
+    }
+
+    ptr = mmap(NULL, (size_t)size, PROT_READ|PROT_WRITE,
+               MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+
+    return ptr == MAP_FAILED ? NULL : ptr;
+#else
+    (void)size;
+    return NULL;
+#endif
+}
+
+/* Release a block of 'size' bytes that was returned by gm_numa_alloc(). */
+void
+gm_numa_free(void *ptr, int64_t size)
+{
+#ifdef __linux__
+    (void)munmap(ptr, (size_t)size);
+#else
+    (void)ptr;
+    (void)size;
+#endif
+}
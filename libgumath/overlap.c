@@ -0,0 +1,250 @@
+/*
+ * BSD 3-Clause License
+ *
+ * Copyright (c) 2017-2018, plures
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include "ndtypes.h"
+#include "xnd.h"
+#include "gumath.h"
+
+
+/*
+ * Memory overlap between kernel arguments.
+ *
+ * Writing to an output that shares memory with an input is safe if the
+ * kernel is elementwise and either both arguments have the identical
+ * layout (exact aliasing) or the output trails the input in iteration
+ * order, so that every input element is read before it is overwritten.
+ * In all other cases the input has to be buffered.
+ */
+
+
+typedef struct {
+    int ndim;
+    int64_t itemsize;
+    int64_t shape[NDT_MAX_DIM];
+    int64_t strides[NDT_MAX_DIM];
+    const char *start;  /* address of the first element */
+    const char *lo;     /* lowest address touched */
+    const char *hi;     /* one past the highest address touched */
+} extent_t;
+
+
+/* Return false for types whose memory extent cannot be computed cheaply. */
+static bool
+get_extent(extent_t *e, const xnd_t *x)
+{
+    const ndt_t *t = x->type;
+    int64_t lo, hi;
+
+    if (!ndt_is_ndarray(t) || t->ndim > NDT_MAX_DIM) {
+        return false;
+    }
+
+    e->ndim = t->ndim;
+    e->itemsize = t->ndim == 0 ? t->datasize : t->Concrete.FixedDim.itemsize;
+    e->start = x->ptr + x->index * e->itemsize;
+
+    lo = hi = 0;
+    for (int i = 0; i < e->ndim; i++, t=t->FixedDim.type) {
+        const int64_t shape = t->FixedDim.shape;
+        const int64_t step = t->Concrete.FixedDim.step * e->itemsize;
+
+        e->shape[i] = shape;
+        e->strides[i] = step;
+
+        if (shape == 0) {
+            e->lo = e->hi = e->start;
+            return true;
+        }
+
+        if (step < 0) {
+            lo += (shape-1) * step;
+        }
+        else {
+            hi += (shape-1) * step;
+        }
+    }
+
+    e->lo = e->start + lo;
+    e->hi = e->start + hi + e->itemsize;
+
+    return true;
+}
+
+static bool
+same_layout(const extent_t *a, const extent_t *b)
+{
+    if (a->ndim != b->ndim || a->itemsize != b->itemsize) {
+        return false;
+    }
+
+    for (int i = 0; i < a->ndim; i++) {
+        if (a->shape[i] != b->shape[i] || a->strides[i] != b->strides[i]) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+/*
+ * Element addresses increase strictly in C iteration order: all strides
+ * are positive and each stride spans the complete inner block.
+ */
+static bool
+is_forward(const extent_t *e)
+{
+    int64_t span = e->itemsize;
+
+    for (int i = e->ndim-1; i >= 0; i--) {
+        if (e->shape[i] > 1) {
+            if (e->strides[i] < span) {
+                return false;
+            }
+            span = e->strides[i] * e->shape[i];
+        }
+    }
+
+    return true;
+}
+
+/* Classify the memory relation between two arguments. */
+gm_overlap_t
+gm_mem_overlap(const xnd_t *a, const xnd_t *b)
+{
+    extent_t x, y;
+
+    if (!get_extent(&x, a) || !get_extent(&y, b)) {
+        /* Views of distinct masters do not share data. */
+        if (a->ptr != b->ptr) {
+            return GM_MEM_DISJOINT;
+        }
+        if (a->index == b->index && ndt_equal(a->type, b->type)) {
+            return GM_MEM_ALIAS;
+        }
+        return GM_MEM_OVERLAP;
+    }
+
+    if (x.lo == x.hi || y.lo == y.hi || x.hi <= y.lo || y.hi <= x.lo) {
+        return GM_MEM_DISJOINT;
+    }
+
+    if (x.start == y.start && same_layout(&x, &y)) {
+        return GM_MEM_ALIAS;
+    }
+
+    return GM_MEM_OVERLAP;
+}
+
+/* All arguments of the signature are of the form '... * scalar'. */
+bool
+gm_is_elementwise(const gm_kernel_t *kernel)
+{
+    const ndt_t *sig = kernel->set->sig;
+
+    for (int64_t i = 0; i < sig->Function.nargs; i++) {
+        const ndt_t *t = sig->Function.types[i];
+
+        if (t->tag == EllipsisDim) {
+            t = t->EllipsisDim.type;
+        }
+
+        if (t->ndim != 0) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+static int
+plan_input(const gm_kernel_t *kernel, const xnd_t *in, const xnd_t *out)
+{
+    extent_t x, y;
+
+    switch (gm_mem_overlap(in, out)) {
+    case GM_MEM_DISJOINT:
+        return GM_OVERLAP_NONE;
+
+    case GM_MEM_ALIAS:
+        return gm_is_elementwise(kernel) ? GM_OVERLAP_NONE : GM_OVERLAP_COPY;
+
+    default:
+        if (gm_is_elementwise(kernel) &&
+            get_extent(&x, in) && get_extent(&y, out) &&
+            y.start < x.start && y.ndim == x.ndim &&
+            same_layout(&x, &y) && is_forward(&x)) {
+            /* Serial forward iteration reads each element before it is
+               overwritten, but concurrent chunks would race. */
+            return GM_OVERLAP_SERIAL;
+        }
+        return GM_OVERLAP_COPY;
+    }
+}
+
+/*
+ * Decide for each input how overlap with the outputs is resolved.  'stack'
+ * must contain the types after broadcasting.  The result is the strongest
+ * action required by any input:
+ *
+ *   GM_OVERLAP_NONE:   apply in place.
+ *   GM_OVERLAP_SERIAL: apply in place, but without splitting across threads.
+ *   GM_OVERLAP_COPY:   inputs with plan[i] == GM_OVERLAP_COPY must be
+ *                      replaced by a copy before applying the kernel.
+ */
+int
+gm_overlap_plan(int plan[], const gm_kernel_t *kernel, const xnd_t stack[],
+                int nin, int nout)
+{
+    int ret = GM_OVERLAP_NONE;
+
+    for (int i = 0; i < nin; i++) {
+        plan[i] = GM_OVERLAP_NONE;
+
+        for (int k = nin; k < nin+nout; k++) {
+            const int p = plan_input(kernel, &stack[i], &stack[k]);
+            if (p > plan[i]) {
+                plan[i] = p;
+            }
+        }
+
+        if (plan[i] > ret) {
+            ret = plan[i];
+        }
+    }
+
+    return ret;
+}
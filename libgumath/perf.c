@@ -0,0 +1,262 @@
+/*
+ * BSD 3-Clause License
+ *
+ * Copyright (c) 2017-2018, plures
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#ifdef __linux__
+#define _GNU_SOURCE
+#endif
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include "ndtypes.h"
+#include "xnd.h"
+#include "gumath.h"
+#include "sys.h"
+
+
+/*
+ * Hardware performance counters.
+ *
+ * On Linux, each thread that applies kernels lazily opens one counter per
+ * event with perf_event_open().  The counters run continuously and count
+ * only the calling thread.  They are read before and after each kernel
+ * application, and gm_apply_thread() reads them around each part on the
+ * thread that runs the part and adds up the differences.  This works with
+ * any executor, including executors whose threads outlive the call.
+ *
+ * Only user space events are counted, so the counters work with the
+ * default perf_event_paranoid setting of 2.
+ */
+
+static int counters_enabled = 0;
+
+#ifdef __linux__
+#include <errno.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+
+#define NEVENTS 4
+
+static const uint64_t events[NEVENTS] = {
+  PERF_COUNT_HW_CPU_CYCLES,
+  PERF_COUNT_HW_INSTRUCTIONS,
+  PERF_COUNT_HW_CACHE_MISSES,
+  PERF_COUNT_HW_BRANCH_MISSES
+};
+
+typedef struct {
+    int fd[NEVENTS];
+} thread_counters_t;
+
+static pthread_key_t key;
+static pthread_once_t once = PTHREAD_ONCE_INIT;
+static bool have_key = false;
+
+static void
+close_counters(void *arg)
+{
+    thread_counters_t *c = arg;
+
+    for (int i = 0; i < NEVENTS; i++) {
+        if (c->fd[i] >= 0) {
+            (void)close(c->fd[i]);
+        }
+    }
+
+    free(c);
+}
+
+static void
+init_key(void)
+{
+    have_key = pthread_key_create(&key, close_counters) == 0;
+}
+
+static int
+open_event(uint64_t config)
+{
+    struct perf_event_attr attr;
+
+    memset(&attr, 0, sizeof attr);
+    attr.size = sizeof attr;
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.config = config;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+
+    return (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0UL);
+}
+
+/* Counters of the calling thread, NULL if they are not available. */
+static thread_counters_t *
+get_counters(void)
+{
+    thread_counters_t *c;
+
+    (void)pthread_once(&once, init_key);
+    if (!have_key) {
+        return NULL;
+    }
+
+    c = pthread_getspecific(key);
+    if (c != NULL) {
+        return c->fd[0] < 0 ? NULL : c;
+    }
+
+    c = malloc(sizeof *c);
+    if (c == NULL) {
+        return NULL;
+    }
+
+    for (int i = 0; i < NEVENTS; i++) {
+        c->fd[i] = open_event(events[i]);
+    }
+
+    /* Cycles are required, the remaining events are optional.  A failed
+       open is remembered so that it is not retried on every call. */
+    if (c->fd[0] < 0) {
+        for (int i = 1; i < NEVENTS; i++) {
+            if (c->fd[i] >= 0) {
+                (void)close(c->fd[i]);
+                c->fd[i] = -1;
+            }
+        }
+    }
+
+    if (pthread_setspecific(key, c) != 0) {
+        close_counters(c);
+        return NULL;
+    }
+
+    return c->fd[0] < 0 ? NULL : c;
+}
+
+static int64_t
+read_event(int fd)
+{
+    uint64_t value;
+
+    if (fd < 0 || read(fd, &value, sizeof value) != (ssize_t)sizeof value) {
+        return 0;
+    }
+
+    return (int64_t)value;
+}
+
+int
+gm_counters_read(gm_counters_t *counts)
+{
+    const thread_counters_t *c = get_counters();
+
+    if (c == NULL) {
+        return -1;
+    }
+
+    counts->cycles = read_event(c->fd[0]);
+    counts->instructions = read_event(c->fd[1]);
+    counts->cache_misses = read_event(c->fd[2]);
+    counts->branch_misses = read_event(c->fd[3]);
+
+    return 0;
+}
+
+int
+gm_counters_enable(bool enable, ndt_context_t *ctx)
+{
+    gm_counters_t counts;
+
+    if (enable && gm_counters_read(&counts) < 0) {
+        ndt_err_format(ctx, NDT_OSError,
+            "hardware performance counters are not available "
+            "(check /proc/sys/kernel/perf_event_paranoid)");
+        return -1;
+    }
+
+    gm_store_release_int(&counters_enabled, enable);
+    return 0;
+}
+#else
+int
+gm_counters_read(gm_counters_t *counts)
+{
+    (void)counts;
+    return -1;
+}
+
+int
+gm_counters_enable(bool enable, ndt_context_t *ctx)
+{
+    if (enable) {
+        ndt_err_format(ctx, NDT_NotImplementedError,
+            "hardware performance counters are only supported on Linux");
+        return -1;
+    }
+
+    gm_store_release_int(&counters_enabled, 0);
+    return 0;
+}
+#endif
+
+bool
+gm_counters_enabled(void)
+{
+    return gm_load_acquire_int(&counters_enabled) != 0;
+}
+
+/* Read the counters if enabled.  Return false if no counts are available. */
+bool
+gm_counters_start(gm_counters_t *counts)
+{
+    return gm_counters_enabled() && gm_counters_read(counts) == 0;
+}
+
+/* Replace 'counts' by the difference to the current counts. */
+void
+gm_counters_stop(gm_counters_t *counts)
+{
+    gm_counters_t now;
+
+    if (gm_counters_read(&now) < 0) {
+        memset(counts, 0, sizeof *counts);
+        return;
+    }
+
+    counts->cycles = now.cycles - counts->cycles;
+    counts->instructions = now.instructions - counts->instructions;
+    counts->cache_misses = now.cache_misses - counts->cache_misses;
+    counts->branch_misses = now.branch_misses - counts->branch_misses;
+}
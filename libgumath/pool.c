@@ -0,0 +1,352 @@
+/*
+ * BSD 3-Clause License
+ *
+ * Copyright (c) 2017-2018, plures
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include "ndtypes.h"
+#include "xnd.h"
+#include "gumath.h"
+#include "sys.h"
+
+
+/*
+ * Size-bucketed buffer pool for kernel outputs and scratch memory.
+ *
+ * Requests are rounded up to the next power of two and served from a
+ * per-size free list.  Freed blocks are cached until the total size of
+ * cached blocks would exceed the cap, in which case they are returned to
+ * the system allocator.  Memory is not zero-filled unless gm_pool_calloc()
+ * is used.  With GM_NUMA_FIRST_TOUCH, large blocks are fresh mappings from
+ * gm_numa_alloc() whose pages are placed by the threads that write them.
+ */
+
+#define POOL_MIN_SHIFT 6                        /* 64 bytes */
+#define POOL_MAX_SHIFT 30                       /* 1GiB, larger blocks are not cached */
+#define POOL_NBUCKETS (POOL_MAX_SHIFT-POOL_MIN_SHIFT+1)
+#define POOL_DEFAULT_CAP (256 * 1024 * 1024)
+
+
+typedef struct pool_header {
+    struct pool_header *next; /* free list link while cached */
+    void *raw;                /* pointer returned by malloc() */
+    int64_t size;             /* usable size */
+    int bucket;               /* size class, -1 for uncached sizes */
+    bool mapped;              /* 'raw' was returned by gm_numa_alloc() */
+} pool_header_t;
+
+static struct {
+    gm_mutex_t lock;
+    pool_header_t *free[POOL_NBUCKETS];
+    gm_pool_stats_t stats;
+} pool = {
+  .lock = GM_MUTEX_INIT,
+  .free = {NULL},
+  .stats = { .cap = POOL_DEFAULT_CAP }
+};
+
+
+static inline pool_header_t *
+header(void *ptr)
+{
+    return (pool_header_t *)ptr - 1;
+}
+
+static int
+bucket_index(int64_t size)
+{
+    int shift = POOL_MIN_SHIFT;
+
+    while (((int64_t)1 << shift) < size) {
+        if (++shift > POOL_MAX_SHIFT) {
+            return -1;
+        }
+    }
+
+    return shift - POOL_MIN_SHIFT;
+}
+
+/* Size of the system allocation for a block of 'size' bytes. */
+static inline int64_t
+raw_size(int64_t size)
+{
+    return size + (int64_t)sizeof(pool_header_t) + GM_POOL_ALIGN;
+}
+
+static void *
+sys_alloc(int64_t size, int bucket)
+{
+    pool_header_t *h;
+    uintptr_t data;
+    bool mapped = true;
+    char *raw;
+
+    if ((uint64_t)size > SIZE_MAX - sizeof *h - GM_POOL_ALIGN) {
+        return NULL;
+    }
+
+    raw = gm_numa_alloc(raw_size(size));
+    if (raw == NULL) {
+        mapped = false;
+        raw = malloc((size_t)raw_size(size));
+        if (raw == NULL) {
+            return NULL;
+        }
+    }
+
+    data = (uintptr_t)(raw + sizeof *h);
+    data = (data + GM_POOL_ALIGN - 1) & ~(uintptr_t)(GM_POOL_ALIGN - 1);
+
+    h = header((void *)data);
+    h->next = NULL;
+    h->raw = raw;
+    h->size = size;
+    h->bucket = bucket;
+    h->mapped = mapped;
+
+    return (void *)data;
+}
+
+static void
+sys_free(pool_header_t *h)
+{
+    if (h->mapped) {
+        gm_numa_free(h->raw, raw_size(h->size));
+    }
+    else {
+        free(h->raw);
+    }
+}
+
+/* Evict cached blocks, largest first, until the cache fits into 'cap'. */
+static pool_header_t *
+evict(int64_t cap)
+{
+    pool_header_t *list = NULL;
+
+    for (int i = POOL_NBUCKETS-1; i >= 0 && pool.stats.cached > cap; i--) {
+        while (pool.free[i] != NULL && pool.stats.cached > cap) {
+            pool_header_t *h = pool.free[i];
+            pool.free[i] = h->next;
+            pool.stats.cached -= h->size;
+            pool.stats.evictions++;
+            h->next = list;
+            list = h;
+        }
+    }
+
+    return list;
+}
+
+static void
+free_list(pool_header_t *list)
+{
+    while (list != NULL) {
+        pool_header_t *next = list->next;
+        sys_free(list);
+        list = next;
+    }
+}
+
+
+/*
+ * Return an uninitialized block of at least 'size' bytes, aligned to
+ * GM_POOL_ALIGN.  The block must be released with gm_pool_free().
+ */
+void *
+gm_pool_alloc(int64_t size, ndt_context_t *ctx)
+{
+    const int bucket = bucket_index(size);
+    const int64_t bsize = bucket < 0 ? size : (int64_t)1 << (bucket + POOL_MIN_SHIFT);
+    pool_header_t *h = NULL;
+    void *ptr;
+
+    if (size < 0) {
+        ndt_err_format(ctx, NDT_ValueError, "pool: negative size");
+        return NULL;
+    }
+
+    gm_mutex_lock(&pool.lock);
+    if (bucket >= 0 && pool.free[bucket] != NULL) {
+        h = pool.free[bucket];
+        pool.free[bucket] = h->next;
+        pool.stats.cached -= bsize;
+        pool.stats.hits++;
+    }
+    else {
+        pool.stats.misses++;
+    }
+    pool.stats.in_use += bsize;
+    if (pool.stats.in_use > pool.stats.peak) {
+        pool.stats.peak = pool.stats.in_use;
+    }
+    gm_mutex_unlock(&pool.lock);
+
+    if (h != NULL) {
+        h->next = NULL;
+        return h + 1;
+    }
+
+    ptr = sys_alloc(bsize, bucket);
+    if (ptr == NULL) {
+        gm_mutex_lock(&pool.lock);
+        pool.stats.in_use -= bsize;
+        gm_mutex_unlock(&pool.lock);
+        (void)ndt_memory_error(ctx);
+        return NULL;
+    }
+
+    return ptr;
+}
+
+/* Same as gm_pool_alloc(), but the block is zero-filled. */
+void *
+gm_pool_calloc(int64_t size, ndt_context_t *ctx)
+{
+    void *ptr = gm_pool_alloc(size, ctx);
+
+    if (ptr != NULL) {
+        memset(ptr, 0, (size_t)size);
+    }
+
+    return ptr;
+}
+
+void
+gm_pool_free(void *ptr)
+{
+    pool_header_t *h;
+    pool_header_t *list = NULL;
+
+    if (ptr == NULL) {
+        return;
+    }
+
+    h = header(ptr);
+
+    gm_mutex_lock(&pool.lock);
+    pool.stats.in_use -= h->size;
+    if (h->bucket >= 0 && h->size <= pool.stats.cap) {
+        h->next = pool.free[h->bucket];
+        pool.free[h->bucket] = h;
+        pool.stats.cached += h->size;
+        list = evict(pool.stats.cap);
+    }
+    else {
+        h->next = NULL;
+        list = h;
+    }
+    gm_mutex_unlock(&pool.lock);
+
+    free_list(list);
+}
+
+/* Set the maximum number of bytes kept in the cache, 0 disables caching. */
+void
+gm_pool_set_cap(int64_t cap)
+{
+    pool_header_t *list;
+
+    gm_mutex_lock(&pool.lock);
+    pool.stats.cap = cap < 0 ? 0 : cap;
+    list = evict(pool.stats.cap);
+    gm_mutex_unlock(&pool.lock);
+
+    free_list(list);
+}
+
+void
+gm_pool_stats(gm_pool_stats_t *stats)
+{
+    gm_mutex_lock(&pool.lock);
+    *stats = pool.stats;
+    gm_mutex_unlock(&pool.lock);
+}
+
+/* Release all cached blocks. */
+void
+gm_pool_clear(void)
+{
+    pool_header_t *list;
+
+    gm_mutex_lock(&pool.lock);
+    list = evict(0);
+    gm_mutex_unlock(&pool.lock);
+
+    free_list(list);
+}
+
+
+/*****************************************************************************/
+/*                            Pooled xnd containers                          */
+/*****************************************************************************/
+
+/*
+ * Initialize 'x' as a container of type 't' whose data is taken from the
+ * pool.  The data is not initialized, which is correct for kernel outputs
+ * that are written in full.  Only fixed arrays of non-optional scalars are
+ * supported.  The container must be released with gm_pool_xnd_del().
+ */
+int
+gm_pool_xnd_empty(xnd_t *x, const ndt_t *t, ndt_context_t *ctx)
+{
+    if (!ndt_is_ndarray(t) || ndt_is_optional(ndt_dtype(t))) {
+        ndt_err_format(ctx, NDT_NotImplementedError,
+            "pool: only fixed arrays without missing values can be pooled");
+        return -1;
+    }
+
+    x->ptr = gm_pool_alloc(t->datasize, ctx);
+    if (x->ptr == NULL) {
+        return -1;
+    }
+
+    ndt_incref(t);
+    x->bitmap.data = NULL;
+    x->bitmap.size = 0;
+    x->bitmap.next = NULL;
+    x->index = 0;
+    x->type = t;
+
+    return 0;
+}
+
+void
+gm_pool_xnd_del(xnd_t *x)
+{
+    gm_pool_free(x->ptr);
+    ndt_decref(x->type);
+    x->ptr = NULL;
+    x->type = NULL;
+}
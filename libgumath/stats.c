@@ -0,0 +1,389 @@
+/*
+ * BSD 3-Clause License
+ *
+ * Copyright (c) 2017-2018, plures
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include "ndtypes.h"
+#include "xnd.h"
+#include "gumath.h"
+#include "sys.h"
+
+
+/*
+ * Per-kernel statistics.
+ *
+ * Entries are keyed by kernel set and selected variant and live in open
+ * addressing hash tables.  Each thread records into one of STATS_SHARDS
+ * tables, chosen by its thread id, so concurrent calls rarely share a lock.
+ * Readers merge the shards.  Recording is disabled by default.  When
+ * enabled, the cost per kernel application is two clock reads and one
+ * short, normally uncontended critical section, independent of the size of
+ * the arguments.
+ */
+
+#define STATS_MIN_SIZE 64
+#define STATS_SHARDS 16 /* power of two */
+
+typedef struct {
+    gm_mutex_t lock;
+    int64_t size;   /* power of two */
+    int64_t used;
+    gm_stats_t *entries;
+    char pad[64];   /* keep the locks of neighbouring shards apart */
+} shard_t;
+
+#define SHARD_INIT { .lock = GM_MUTEX_INIT, .size = 0, .used = 0, .entries = NULL }
+#define SHARD_INIT4 SHARD_INIT, SHARD_INIT, SHARD_INIT, SHARD_INIT
+
+static int stats_enabled = 0;
+static shard_t shards[STATS_SHARDS] = {
+  SHARD_INIT4, SHARD_INIT4, SHARD_INIT4, SHARD_INIT4
+};
+
+static inline uint64_t
+mix(uint64_t h)
+{
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+
+    return h;
+}
+
+static inline shard_t *
+thread_shard(void)
+{
+    return &shards[mix(gm_thread_id()) & (STATS_SHARDS-1)];
+}
+
+
+void
+gm_stats_enable(bool enable)
+{
+    gm_store_release_int(&stats_enabled, enable);
+}
+
+bool
+gm_stats_enabled(void)
+{
+    return gm_load_acquire_int(&stats_enabled) != 0;
+}
+
+double
+gm_stats_clock(void)
+{
+    return gm_clock();
+}
+
+void
+gm_stats_reset(void)
+{
+    for (int i = 0; i < STATS_SHARDS; i++) {
+        shard_t *sh = &shards[i];
+
+        gm_mutex_lock(&sh->lock);
+        ndt_free(sh->entries);
+        sh->entries = NULL;
+        sh->size = 0;
+        sh->used = 0;
+        gm_mutex_unlock(&sh->lock);
+    }
+}
+
+static inline uint64_t
+hash(const gm_kernel_set_t *set, uint32_t flag)
+{
+    return mix((uint64_t)(uintptr_t)set ^ ((uint64_t)flag << 32));
+}
+
+/* Called with the lock of 'sh' held. */
+static gm_stats_t *
+lookup(shard_t *sh, const gm_kernel_set_t *set, uint32_t flag)
+{
+    uint64_t i;
+
+    if (2 * (sh->used+1) > sh->size) {
+        const int64_t size = sh->size == 0 ? STATS_MIN_SIZE : 2 * sh->size;
+        gm_stats_t *entries = ndt_calloc(size, sizeof *entries);
+        if (entries == NULL) {
+            return NULL;
+        }
+
+        for (int64_t k = 0; k < sh->size; k++) {
+            const gm_stats_t *e = &sh->entries[k];
+            if (e->set != NULL) {
+                i = hash(e->set, e->flag) & (uint64_t)(size-1);
+                while (entries[i].set != NULL) {
+                    i = (i+1) & (uint64_t)(size-1);
+                }
+                entries[i] = *e;
+            }
+        }
+
+        ndt_free(sh->entries);
+        sh->entries = entries;
+        sh->size = size;
+    }
+
+    i = hash(set, flag) & (uint64_t)(sh->size-1);
+    for (;;) {
+        gm_stats_t *e = &sh->entries[i];
+
+        if (e->set == NULL) {
+            e->set = set;
+            e->flag = flag;
+            sh->used++;
+            return e;
+        }
+
+        if (e->set == set && e->flag == flag) {
+            return e;
+        }
+
+        i = (i+1) & (uint64_t)(sh->size-1);
+    }
+}
+
+/* Add the counts of 'src' to 'dst'. */
+static void
+add_entry(gm_stats_t *dst, const gm_stats_t *src)
+{
+    dst->calls += src->calls;
+    dst->elements += src->elements;
+    dst->bytes += src->bytes;
+    dst->time += src->time;
+    dst->threaded += src->threaded;
+    dst->fallbacks += src->fallbacks;
+    dst->counters.cycles += src->counters.cycles;
+    dst->counters.instructions += src->counters.instructions;
+    dst->counters.cache_misses += src->counters.cache_misses;
+    dst->counters.branch_misses += src->counters.branch_misses;
+}
+
+/* The selected variant is Xnd although the set has faster kernels. */
+static bool
+is_fallback(const gm_kernel_t *kernel)
+{
+    const gm_kernel_set_t *set = kernel->set;
+
+    return kernel->flag == NDT_INNER_XND &&
+           (set->OptC || set->OptZ || set->OptS || set->C || set->Fortran ||
+            set->Strided);
+}
+
+/*
+ * Record one application of 'kernel' to 'stack' that took 'time' seconds.
+ * 'counters' are the hardware counter differences or NULL.  If the table
+ * cannot grow, the call is silently not recorded.
+ */
+void
+gm_stats_record(const gm_kernel_t *kernel, const xnd_t stack[], double time,
+                bool threaded, const gm_counters_t *counters)
+{
+    const int nargs = (int)kernel->set->sig->Function.nargs;
+    gm_stats_t rec;
+    shard_t *sh;
+    gm_stats_t *e;
+
+    memset(&rec, 0, sizeof rec);
+    rec.calls = 1;
+    rec.time = time;
+    rec.threaded = threaded;
+    rec.fallbacks = is_fallback(kernel);
+    if (counters != NULL) {
+        rec.counters = *counters;
+    }
+
+    for (int i = 0; i < nargs; i++) {
+        const ndt_t *t = stack[i].type;
+        if (ndt_is_ndarray(t)) {
+            const int64_t n = ndt_nelem(t);
+            if (n > rec.elements) {
+                rec.elements = n;
+            }
+            rec.bytes += n * ndt_dtype(t)->datasize;
+        }
+    }
+
+    sh = thread_shard();
+
+    gm_mutex_lock(&sh->lock);
+    e = lookup(sh, kernel->set, kernel->flag);
+    if (e != NULL) {
+        add_entry(e, &rec);
+    }
+    gm_mutex_unlock(&sh->lock);
+}
+
+/* Copy the entry for 'set' and 'flag' to 'entry'.  Return false if there is none. */
+bool
+gm_stats_lookup(gm_stats_t *entry, const gm_kernel_set_t *set, uint32_t flag)
+{
+    bool found = false;
+
+    memset(entry, 0, sizeof *entry);
+    entry->set = set;
+    entry->flag = flag;
+
+    for (int k = 0; k < STATS_SHARDS; k++) {
+        shard_t *sh = &shards[k];
+
+        gm_mutex_lock(&sh->lock);
+        if (sh->size > 0) {
+            uint64_t i = hash(set, flag) & (uint64_t)(sh->size-1);
+            for (; sh->entries[i].set != NULL; i = (i+1) & (uint64_t)(sh->size-1)) {
+                if (sh->entries[i].set == set && sh->entries[i].flag == flag) {
+                    add_entry(entry, &sh->entries[i]);
+                    found = true;
+                    break;
+                }
+            }
+        }
+        gm_mutex_unlock(&sh->lock);
+    }
+
+    return found;
+}
+
+static int
+cmp_entry(const void *x, const void *y)
+{
+    const gm_stats_t *a = x;
+    const gm_stats_t *b = y;
+    const uintptr_t p = (uintptr_t)a->set;
+    const uintptr_t q = (uintptr_t)b->set;
+
+    if (p != q) {
+        return p < q ? -1 : 1;
+    }
+
+    return a->flag < b->flag ? -1 : a->flag > b->flag;
+}
+
+/*
+ * Call 'f' on a snapshot of all entries, merged across shards.  No lock is
+ * held while 'f' runs, so 'f' may apply kernels.
+ */
+int
+gm_stats_map(int (*f)(const gm_stats_t *, void *state), void *state,
+             ndt_context_t *ctx)
+{
+    gm_stats_t *entries = NULL;
+    int64_t n = 0;
+    int64_t m = 0;
+    int ret = 0;
+
+    for (int k = 0; k < STATS_SHARDS; k++) {
+        shard_t *sh = &shards[k];
+        gm_stats_t *tmp;
+
+        gm_mutex_lock(&sh->lock);
+        if (sh->used == 0) {
+            gm_mutex_unlock(&sh->lock);
+            continue;
+        }
+
+        tmp = ndt_realloc(entries, n + sh->used, sizeof *entries);
+        if (tmp == NULL) {
+            gm_mutex_unlock(&sh->lock);
+            ndt_free(entries);
+            (void)ndt_memory_error(ctx);
+            return -1;
+        }
+        entries = tmp;
+
+        for (int64_t i = 0; i < sh->size; i++) {
+            if (sh->entries[i].set != NULL) {
+                entries[n++] = sh->entries[i];
+            }
+        }
+        gm_mutex_unlock(&sh->lock);
+    }
+
+    if (n > 0) {
+        qsort(entries, (size_t)n, sizeof *entries, cmp_entry);
+        for (int64_t i = 1; i < n; i++) {
+            if (entries[i].set == entries[m].set &&
+                entries[i].flag == entries[m].flag) {
+                add_entry(&entries[m], &entries[i]);
+            }
+            else {
+                entries[++m] = entries[i];
+            }
+        }
+        m++;
+    }
+
+    for (int64_t i = 0; i < m; i++) {
+        if (f(&entries[i], state) < 0) {
+            ret = -1;
+            break;
+        }
+    }
+
+    ndt_free(entries);
+    return ret;
+}
+
+
+struct find_args {
+    const gm_kernel_set_t *set;
+    const char *name;
+};
+
+static int
+find_func(const gm_func_t *f, void *state)
+{
+    struct find_args *a = state;
+
+    if (a->set >= f->kernels && a->set < f->kernels + gm_func_nkernels(f)) {
+        a->name = f->name;
+        return -1;
+    }
+
+    return 0;
+}
+
+/* Return the name of the function in 'tbl' that owns 'set', or NULL. */
+const char *
+gm_stats_func(const gm_tbl_t *tbl, const gm_kernel_set_t *set)
+{
+    struct find_args args = {set, NULL};
+
+    (void)gm_tbl_map(tbl, find_func, &args);
+    return args.name;
+}
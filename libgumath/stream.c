@@ -0,0 +1,897 @@
+/*
+ * BSD 3-Clause License
+ *
+ * Copyright (c) 2017-2018, plures
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+/* mmap, posix_madvise, ftruncate */
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include "ndtypes.h"
+#include "xnd.h"
+#include "overflow.h"
+#include "gumath.h"
+#include "config.h"
+
+#ifdef HAVE_PTHREAD_H
+  #include <pthread.h>
+#endif
+
+
+/*
+ * Out-of-core apply: a file that is larger than main memory is mapped
+ * read-only and a unary kernel is applied to blocks of rows along the
+ * outermost dimension.
+ *
+ * The kernel reads the mapping directly.  While a block is computed, a
+ * prefetch thread reads one byte of each page of the next block, so the
+ * page faults and the disk reads overlap with the computation.  Without
+ * pthreads the next block is only announced with POSIX_MADV_WILLNEED.
+ * Consumed input pages are released with POSIX_MADV_DONTNEED to keep the
+ * resident set bounded.
+ */
+
+#define GM_STREAM_BLOCK_SIZE (4 * 1024 * 1024)
+#define NPY_MAGIC "\x93NUMPY"
+#define NPY_MAGIC_LEN 6
+
+
+typedef struct {
+    char *base;          /* start of the mapping */
+    int64_t size;        /* size of the mapping */
+    int64_t offset;      /* offset of the first row */
+    int64_t nrows;       /* length of the outer dimension */
+    int64_t rowsize;     /* datasize of a single row */
+    char rowtype[256];   /* type of a single row */
+} mapping_t;
+
+
+/*****************************************************************************/
+/*                                .npy headers                               */
+/*****************************************************************************/
+
+static inline bool
+little_endian(void)
+{
+    const uint16_t x = 1;
+    return *(const unsigned char *)&x == 1;
+}
+
+static const char *
+dtype_from_descr(const char *descr)
+{
+    static const struct { const char *descr; const char *dtype; } map[] = {
+      { "b1", "bool" },
+      { "i1", "int8" }, { "i2", "int16" }, { "i4", "int32" }, { "i8", "int64" },
+      { "u1", "uint8" }, { "u2", "uint16" }, { "u4", "uint32" }, { "u8", "uint64" },
+      { "f2", "float16" }, { "f4", "float32" }, { "f8", "float64" },
+      { "c8", "complex64" }, { "c16", "complex128" }
+    };
+
+    const char native = little_endian() ? '<' : '>';
+
+    /* Native byte order only. */
+    if (descr[0] != native && descr[0] != '|' && descr[0] != '=') {
+        return NULL;
+    }
+
+    /* '|' (no byte order) is only valid for single byte types. */
+    if (descr[0] == '|' && (descr[1] == '\0' || strcmp(descr+2, "1") != 0)) {
+        return NULL;
+    }
+
+    for (size_t i = 0; i < sizeof map / sizeof map[0]; i++) {
+        if (strcmp(descr+1, map[i].descr) == 0) {
+            return map[i].dtype;
+        }
+    }
+
+    return NULL;
+}
+
+/* The descr of 't' in native byte order, written to 'buf'. */
+static const char *
+descr_from_dtype(char buf[8], const ndt_t *t)
+{
+    const char *s;
+
+    switch (t->tag) {
+    case Bool: return "|b1";
+    case Int8: return "|i1";
+    case Uint8: return "|u1";
+    case Int16: s = "i2"; break;
+    case Int32: s = "i4"; break;
+    case Int64: s = "i8"; break;
+    case Uint16: s = "u2"; break;
+    case Uint32: s = "u4"; break;
+    case Uint64: s = "u8"; break;
+    case Float16: s = "f2"; break;
+    case Float32: s = "f4"; break;
+    case Float64: s = "f8"; break;
+    case Complex64: s = "c8"; break;
+    case Complex128: s = "c16"; break;
+    default: return NULL;
+    }
+
+    snprintf(buf, 8, "%c%s", little_endian() ? '<' : '>', s);
+    return buf;
+}
+
+static int
+npy_error(ndt_context_t *ctx)
+{
+    ndt_err_format(ctx, NDT_ValueError,
+        "stream: unsupported or invalid .npy header (only C-order arrays of "
+        "native byte order numeric types are supported)");
+    return -1;
+}
+
+/* Value of 'key' in the header dict, NULL if not present. */
+static const char *
+npy_value(const char *header, const char *key)
+{
+    const char *s = strstr(header, key);
+
+    if (s == NULL) {
+        return NULL;
+    }
+
+    s += strlen(key);
+    while (*s == ' ' || *s == ':') s++;
+
+    return s;
+}
+
+static int
+npy_parse(mapping_t *m, ndt_context_t *ctx)
+{
+    const unsigned char *p = (const unsigned char *)m->base;
+    char header[4096];
+    char descr[8];
+    const char *dtype;
+    const char *s;
+    int64_t len, hlen;
+    char *rt = m->rowtype;
+    size_t rtsize = sizeof m->rowtype;
+    bool overflow = false;
+    int n;
+
+    if (m->size < NPY_MAGIC_LEN + 4) {
+        return npy_error(ctx);
+    }
+
+    if (p[6] == 1) {
+        hlen = 2;
+        len = p[8] | (p[9] << 8);
+    }
+    else if (p[6] == 2 || p[6] == 3) {
+        hlen = 4;
+        if (m->size < NPY_MAGIC_LEN + 6) {
+            return npy_error(ctx);
+        }
+        len = (int64_t)p[8] | ((int64_t)p[9] << 8) | ((int64_t)p[10] << 16) |
+              ((int64_t)p[11] << 24);
+    }
+    else {
+        return npy_error(ctx);
+    }
+
+    m->offset = NPY_MAGIC_LEN + 2 + hlen + len;
+    if (len >= (int64_t)sizeof header || m->offset > m->size) {
+        return npy_error(ctx);
+    }
+    memcpy(header, m->base + NPY_MAGIC_LEN + 2 + hlen, len);
+    header[len] = '\0';
+
+    s = npy_value(header, "'fortran_order'");
+    if (s == NULL || strncmp(s, "False", 5) != 0) {
+        return npy_error(ctx);
+    }
+
+    s = npy_value(header, "'descr'");
+    if (s == NULL || *s != '\'' || sscanf(s, "'%7[^']'", descr) != 1) {
+        return npy_error(ctx);
+    }
+
+    dtype = dtype_from_descr(descr);
+    if (dtype == NULL) {
+        return npy_error(ctx);
+    }
+
+    s = npy_value(header, "'shape'");
+    if (s == NULL || *s != '(') {
+        return npy_error(ctx);
+    }
+    s++;
+
+    /* The outer dimension is streamed, the rest is the row type. */
+    m->nrows = -1;
+    rt[0] = '\0';
+    for (;;) {
+        char *end;
+        int64_t shape;
+
+        while (*s == ' ' || *s == ',') s++;
+        if (*s == ')') {
+            break;
+        }
+
+        shape = strtoll(s, &end, 10);
+        if (end == s || shape < 0) {
+            return npy_error(ctx);
+        }
+        s = end;
+        if (*s == 'L') s++;
+
+        if (m->nrows < 0) {
+            m->nrows = shape;
+        }
+        else {
+            n = snprintf(rt, rtsize, "%" PRIi64 " * ", shape);
+            if (n < 0 || (size_t)n >= rtsize) {
+                return npy_error(ctx);
+            }
+            rt += n;
+            rtsize -= n;
+        }
+    }
+
+    if (m->nrows < 0) {
+        return npy_error(ctx);
+    }
+
+    n = snprintf(rt, rtsize, "%s", dtype);
+    if (n < 0 || (size_t)n >= rtsize) {
+        return npy_error(ctx);
+    }
+
+    const ndt_t *t = ndt_from_string(m->rowtype, ctx);
+    if (t == NULL) {
+        return -1;
+    }
+    m->rowsize = t->datasize;
+    ndt_decref(t);
+
+    if (ADDi64(m->offset, MULi64(m->nrows, m->rowsize, &overflow), &overflow) > m->size ||
+        overflow) {
+        ndt_err_format(ctx, NDT_ValueError, "stream: .npy file is truncated");
+        return -1;
+    }
+
+    return 0;
+}
+
+/* Write a version 1.0 header, padded to 64 bytes for alignment. */
+static int64_t
+npy_header(char *buf, size_t size, const char *descr, int64_t nrows,
+           const ndt_t *row)
+{
+    char shape[256];
+    int64_t len, total;
+    size_t n;
+
+    n = snprintf(shape, sizeof shape, "%" PRIi64 ",", nrows);
+    for (const ndt_t *t = row; t->tag == FixedDim; t = t->FixedDim.type) {
+        if (n >= sizeof shape) {
+            return -1;
+        }
+        n += snprintf(shape+n, sizeof shape - n, " %" PRIi64 ",", t->FixedDim.shape);
+    }
+    if (n >= sizeof shape) {
+        return -1;
+    }
+    /* Python tuples of length 1 need the trailing comma, others do not. */
+    if (row->tag == FixedDim) {
+        shape[n-1] = '\0';
+    }
+
+    len = snprintf(buf+10, size-10,
+                   "{'descr': '%s', 'fortran_order': False, 'shape': (%s), }",
+                   descr, shape);
+    if (len < 0 || (size_t)len + 11 + 64 > size) {
+        return -1;
+    }
+
+    total = ((10 + len + 1 + 63) / 64) * 64;
+    memset(buf+10+len, ' ', total-10-len-1);
+    buf[total-1] = '\n';
+
+    memcpy(buf, NPY_MAGIC, NPY_MAGIC_LEN);
+    buf[6] = 1;
+    buf[7] = 0;
+    buf[8] = (char)((total-10) & 0xff);
+    buf[9] = (char)(((total-10) >> 8) & 0xff);
+
+    return total;
+}
+
+static bool
+has_npy_suffix(const char *path)
+{
+    size_t n = strlen(path);
+    return n >= 4 && strcmp(path+n-4, ".npy") == 0;
+}
+
+
+/*****************************************************************************/
+/*                                  Mappings                                 */
+/*****************************************************************************/
+
+static int
+sys_error(const char *msg, const char *path, ndt_context_t *ctx)
+{
+    ndt_err_format(ctx, NDT_OSError, "stream: %s '%s': %s", msg, path,
+                   strerror(errno));
+    return -1;
+}
+
+static int
+map_input(mapping_t *m, const char *path, const char *rowtype,
+          ndt_context_t *ctx)
+{
+    struct stat st;
+    int fd;
+
+    fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return sys_error("cannot open", path, ctx);
+    }
+
+    if (fstat(fd, &st) < 0) {
+        (void)close(fd);
+        return sys_error("cannot stat", path, ctx);
+    }
+
+    /* Empty raw files have zero rows and are not mapped. */
+    m->size = st.st_size;
+    if (m->size > 0) {
+        m->base = mmap(NULL, (size_t)m->size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (m->base == MAP_FAILED) {
+            m->base = NULL;
+            (void)close(fd);
+            return sys_error("cannot map", path, ctx);
+        }
+
+        (void)posix_madvise(m->base, (size_t)m->size, POSIX_MADV_SEQUENTIAL);
+    }
+    (void)close(fd);
+
+    if (m->size >= NPY_MAGIC_LEN && memcmp(m->base, NPY_MAGIC, NPY_MAGIC_LEN) == 0) {
+        return npy_parse(m, ctx);
+    }
+
+    if (rowtype == NULL) {
+        ndt_err_format(ctx, NDT_ValueError,
+            "stream: the row type of raw file '%s' must be given", path);
+        return -1;
+    }
+
+    if (strlen(rowtype) >= sizeof m->rowtype) {
+        ndt_err_format(ctx, NDT_ValueError, "stream: row type is too long");
+        return -1;
+    }
+    strcpy(m->rowtype, rowtype);
+
+    const ndt_t *t = ndt_from_string(rowtype, ctx);
+    if (t == NULL) {
+        return -1;
+    }
+
+    if (!ndt_is_concrete(t) || !ndt_is_c_contiguous(t) ||
+        ndt_is_optional(ndt_dtype(t)) || t->datasize == 0) {
+        ndt_decref(t);
+        ndt_err_format(ctx, NDT_ValueError,
+            "stream: the row type must be a C-contiguous fixed array or scalar");
+        return -1;
+    }
+
+    m->offset = 0;
+    m->rowsize = t->datasize;
+    ndt_decref(t);
+
+    if (m->size % m->rowsize != 0) {
+        ndt_err_format(ctx, NDT_ValueError,
+            "stream: size of '%s' is not a multiple of the row size", path);
+        return -1;
+    }
+    m->nrows = m->size / m->rowsize;
+
+    return 0;
+}
+
+static int
+map_output(mapping_t *m, const char *path, const ndt_t *row, int64_t nrows,
+           ndt_context_t *ctx)
+{
+    char header[1024];
+    char buf[8];
+    int64_t hlen = 0;
+    bool overflow = false;
+    int fd;
+
+    if (has_npy_suffix(path)) {
+        const char *descr = descr_from_dtype(buf, ndt_dtype(row));
+        if (descr == NULL) {
+            ndt_err_format(ctx, NDT_ValueError,
+                "stream: output dtype cannot be stored in a .npy file");
+            return -1;
+        }
+
+        hlen = npy_header(header, sizeof header, descr, nrows, row);
+        if (hlen < 0) {
+            ndt_err_format(ctx, NDT_ValueError, "stream: .npy header is too long");
+            return -1;
+        }
+    }
+
+    m->offset = hlen;
+    m->nrows = nrows;
+    m->rowsize = row->datasize;
+    m->size = ADDi64(hlen, MULi64(nrows, m->rowsize, &overflow), &overflow);
+    if (overflow) {
+        ndt_err_format(ctx, NDT_ValueError, "stream: output size overflow");
+        return -1;
+    }
+
+    fd = open(path, O_RDWR|O_CREAT|O_TRUNC, 0644);
+    if (fd < 0) {
+        return sys_error("cannot create", path, ctx);
+    }
+
+    if (ftruncate(fd, (off_t)m->size) < 0) {
+        (void)close(fd);
+        return sys_error("cannot resize", path, ctx);
+    }
+
+    if (m->size == 0) {
+        (void)close(fd);
+        m->base = NULL;
+        return 0;
+    }
+
+    m->base = mmap(NULL, (size_t)m->size, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+    (void)close(fd);
+    if (m->base == MAP_FAILED) {
+        m->base = NULL;
+        return sys_error("cannot map", path, ctx);
+    }
+
+    (void)posix_madvise(m->base, (size_t)m->size, POSIX_MADV_SEQUENTIAL);
+    memcpy(m->base, header, hlen);
+
+    return 0;
+}
+
+static void
+unmap(mapping_t *m)
+{
+    if (m->base != NULL) {
+        (void)munmap(m->base, (size_t)m->size);
+        m->base = NULL;
+    }
+}
+
+/* Page aligned range of the pages that contain [start, start+len). */
+static int64_t
+page_range(const mapping_t *m, int64_t *start, int64_t len)
+{
+    static int64_t pagesize = 0;
+    int64_t end;
+
+    if (pagesize == 0) {
+        pagesize = sysconf(_SC_PAGESIZE);
+    }
+
+    end = *start + len;
+    if (end > m->size) {
+        end = m->size;
+    }
+    *start = (*start / pagesize) * pagesize;
+
+    return end - *start;
+}
+
+static void
+advise(const mapping_t *m, int64_t start, int64_t len, int advice)
+{
+    if (m->base == NULL || len <= 0) {
+        return;
+    }
+
+    len = page_range(m, &start, len);
+    if (len > 0) {
+        (void)posix_madvise(m->base + start, (size_t)len, advice);
+    }
+}
+
+/* Start the writeback of a finished output block. */
+static void
+flush(const mapping_t *m, int64_t start, int64_t len)
+{
+    if (m->base == NULL || len <= 0) {
+        return;
+    }
+
+    len = page_range(m, &start, len);
+    if (len > 0) {
+        (void)msync(m->base + start, (size_t)len, MS_ASYNC);
+    }
+}
+
+
+/*****************************************************************************/
+/*                                  Prefetch                                 */
+/*****************************************************************************/
+
+typedef struct {
+    const mapping_t *m;
+#ifdef HAVE_PTHREAD_H
+    pthread_t tid;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    int64_t start;       /* pending range, len < 0 if none */
+    int64_t len;
+    bool running;        /* the thread has been started */
+    bool stop;
+#endif
+} prefetch_t;
+
+#ifdef HAVE_PTHREAD_H
+/* Keeps the reads of touch() from being optimized away. */
+static volatile char touch_sink;
+
+/* Fault in the pages of a range by reading one byte of each page. */
+static void
+touch(const mapping_t *m, int64_t start, int64_t len)
+{
+    const int64_t pagesize = sysconf(_SC_PAGESIZE);
+    char c = 0;
+
+    len = page_range(m, &start, len);
+    for (int64_t i = 0; i < len; i += pagesize) {
+        c ^= m->base[start+i];
+    }
+
+    touch_sink = c;
+}
+
+static void *
+prefetch_worker(void *arg)
+{
+    prefetch_t *p = arg;
+
+    pthread_mutex_lock(&p->lock);
+    for (;;) {
+        while (p->len < 0 && !p->stop) {
+            pthread_cond_wait(&p->cond, &p->lock);
+        }
+        if (p->stop) {
+            break;
+        }
+
+        const int64_t start = p->start;
+        const int64_t len = p->len;
+        p->len = -1;
+
+        pthread_mutex_unlock(&p->lock);
+        touch(p->m, start, len);
+        pthread_mutex_lock(&p->lock);
+    }
+    pthread_mutex_unlock(&p->lock);
+
+    return NULL;
+}
+#endif
+
+static void
+prefetch_init(prefetch_t *p, const mapping_t *m)
+{
+    p->m = m;
+#ifdef HAVE_PTHREAD_H
+    p->start = 0;
+    p->len = -1;
+    p->running = false;
+    p->stop = false;
+
+    if (m->base == NULL) {
+        return;
+    }
+
+    if (pthread_mutex_init(&p->lock, NULL) != 0) {
+        return;
+    }
+    if (pthread_cond_init(&p->cond, NULL) != 0) {
+        pthread_mutex_destroy(&p->lock);
+        return;
+    }
+    if (pthread_create(&p->tid, NULL, prefetch_worker, p) != 0) {
+        pthread_cond_destroy(&p->cond);
+        pthread_mutex_destroy(&p->lock);
+        return;
+    }
+
+    p->running = true;
+#endif
+}
+
+/*
+ * Read the range [start, start+len) of the mapping ahead of its use.  A
+ * range that the thread has not started yet is replaced, so the prefetch
+ * never falls behind the computation.
+ */
+static void
+prefetch(prefetch_t *p, int64_t start, int64_t len)
+{
+    advise(p->m, start, len, POSIX_MADV_WILLNEED);
+
+#ifdef HAVE_PTHREAD_H
+    if (p->running && len > 0 && start < p->m->size) {
+        pthread_mutex_lock(&p->lock);
+        p->start = start;
+        p->len = len;
+        pthread_cond_signal(&p->cond);
+        pthread_mutex_unlock(&p->lock);
+    }
+#endif
+}
+
+static void
+prefetch_stop(prefetch_t *p)
+{
+#ifdef HAVE_PTHREAD_H
+    if (p->running) {
+        pthread_mutex_lock(&p->lock);
+        p->stop = true;
+        pthread_cond_signal(&p->cond);
+        pthread_mutex_unlock(&p->lock);
+
+        (void)pthread_join(p->tid, NULL);
+        pthread_cond_destroy(&p->cond);
+        pthread_mutex_destroy(&p->lock);
+        p->running = false;
+    }
+#else
+    (void)p;
+#endif
+}
+
+
+/*****************************************************************************/
+/*                                   Apply                                   */
+/*****************************************************************************/
+
+static const ndt_t *
+block_type(const char *rowtype, int64_t nrows, ndt_context_t *ctx)
+{
+    char buf[512];
+
+    snprintf(buf, sizeof buf, "%" PRIi64 " * %s", nrows, rowtype);
+    return ndt_from_string(buf, ctx);
+}
+
+/* Data pointer of empty blocks of unmapped files. */
+static char empty[16];
+
+static void
+init_view(xnd_t *x, const ndt_t *t, char *ptr)
+{
+    x->bitmap.data = NULL;
+    x->bitmap.size = 0;
+    x->bitmap.next = NULL;
+    x->index = 0;
+    x->type = t;
+    x->ptr = ptr;
+}
+
+/*
+ * Apply the unary kernel 'name' to the file at 'path' in blocks along the
+ * outermost dimension.  Files that start with a .npy header describe their
+ * own type, raw files are interpreted as a sequence of 'opts->rowtype' rows.
+ *
+ * Results are written to 'opts->out' (a .npy file if the name ends with
+ * ".npy", a raw file otherwise) or, if 'opts->out' is NULL, passed to the
+ * 'opts->reduce' callback one block at a time.  Blocks passed to the callback
+ * are only valid for the duration of the call.
+ */
+int
+gm_stream_apply(const gm_tbl_t *tbl, const char *name, const char *path,
+                const gm_stream_t *opts, ndt_context_t *ctx)
+{
+    mapping_t in = { .base = NULL };
+    mapping_t out = { .base = NULL };
+    prefetch_t pre;
+    char *scratch = NULL;
+    const ndt_t *outrow = NULL;
+    int64_t block_size, block_rows;
+
+    if ((opts->out == NULL) == (opts->reduce == NULL)) {
+        ndt_err_format(ctx, NDT_ValueError,
+            "stream: exactly one of 'out' and 'reduce' must be given");
+        return -1;
+    }
+
+    if (map_input(&in, path, opts->rowtype, ctx) < 0) {
+        unmap(&in);
+        return -1;
+    }
+
+    block_size = opts->block_size > 0 ? opts->block_size : GM_STREAM_BLOCK_SIZE;
+    block_rows = block_size / in.rowsize;
+    if (block_rows == 0) {
+        block_rows = 1;
+    }
+
+    prefetch_init(&pre, &in);
+
+    /* An empty input still runs one empty block, which selects the kernel
+       and creates the output file. */
+    for (int64_t row = 0; row == 0 || row < in.nrows; row += block_rows) {
+        ndt_apply_spec_t spec = ndt_apply_spec_empty;
+        const int64_t nrows = row + block_rows <= in.nrows ? block_rows : in.nrows - row;
+        const int64_t start = in.offset + row * in.rowsize;
+        const ndt_t *types[1];
+        int64_t li[1] = { 0 };
+        xnd_t stack[2];
+        gm_kernel_t kernel;
+        char *outptr;
+        int ret;
+
+        /* Start reading the next block while this one is computed. */
+        if (row + nrows < in.nrows) {
+            prefetch(&pre, start + nrows * in.rowsize, block_rows * in.rowsize);
+        }
+
+        types[0] = block_type(in.rowtype, nrows, ctx);
+        if (types[0] == NULL) {
+            goto error;
+        }
+        init_view(&stack[0], types[0], in.base == NULL ? empty : in.base + start);
+
+        kernel = gm_select(&spec, tbl, name, types, li, 1, 0, false, stack, ctx);
+        if (kernel.set == NULL) {
+            ndt_decref(types[0]);
+            goto error;
+        }
+
+        if (spec.nout != 1) {
+            ndt_apply_spec_clear(&spec);
+            ndt_decref(types[0]);
+            ndt_err_format(ctx, NDT_NotImplementedError,
+                "stream: only kernels with one input and one output are supported");
+            goto error;
+        }
+
+        const ndt_t *t = spec.types[1];
+        if (!ndt_is_concrete(t) || !ndt_is_c_contiguous(t) || t->tag != FixedDim ||
+            t->FixedDim.shape != nrows || ndt_is_optional(ndt_dtype(t))) {
+            ndt_apply_spec_clear(&spec);
+            ndt_decref(types[0]);
+            ndt_err_format(ctx, NDT_NotImplementedError,
+                "stream: the output must be a C-contiguous array with one row "
+                "per input row and without missing values");
+            goto error;
+        }
+
+        if (outrow != NULL && !ndt_equal(t->FixedDim.type, outrow)) {
+            ndt_apply_spec_clear(&spec);
+            ndt_decref(types[0]);
+            ndt_err_format(ctx, NDT_RuntimeError,
+                "stream: output row type differs between blocks");
+            goto error;
+        }
+
+        /* The first block determines the output row type. */
+        if (outrow == NULL) {
+            outrow = t->FixedDim.type;
+            ndt_incref(outrow);
+
+            if (opts->out != NULL) {
+                if (map_output(&out, opts->out, outrow, in.nrows, ctx) < 0) {
+                    ndt_apply_spec_clear(&spec);
+                    ndt_decref(types[0]);
+                    goto error;
+                }
+            }
+            else {
+                scratch = gm_pool_alloc(block_rows * outrow->datasize, ctx);
+                if (scratch == NULL) {
+                    ndt_apply_spec_clear(&spec);
+                    ndt_decref(types[0]);
+                    goto error;
+                }
+            }
+        }
+
+        if (opts->out != NULL) {
+            outptr = out.base == NULL ? empty : out.base + out.offset + row * outrow->datasize;
+        }
+        else {
+            outptr = scratch;
+        }
+        init_view(&stack[1], t, outptr);
+
+#ifdef HAVE_PTHREAD_H
+        if (opts->nthreads > 1) {
+            ret = gm_apply_thread(&kernel, stack, spec.outer_dims, opts->nthreads, ctx);
+        }
+        else
+#endif
+        {
+            ret = gm_apply(&kernel, stack, spec.outer_dims, ctx);
+        }
+
+        if (ret == 0 && opts->reduce != NULL && nrows > 0) {
+            ret = opts->reduce(&stack[1], row, opts->state, ctx);
+        }
+
+        ndt_apply_spec_clear(&spec);
+        ndt_decref(types[0]);
+        if (ret < 0) {
+            goto error;
+        }
+
+        /* The consumed input is not needed any more. */
+        advise(&in, start, nrows * in.rowsize, POSIX_MADV_DONTNEED);
+        if (opts->out != NULL) {
+            flush(&out, outptr - out.base, nrows * outrow->datasize);
+        }
+    }
+
+    prefetch_stop(&pre);
+    if (outrow != NULL) {
+        ndt_decref(outrow);
+    }
+    gm_pool_free(scratch);
+    unmap(&out);
+    unmap(&in);
+    return 0;
+
+error:
+    prefetch_stop(&pre);
+    if (outrow != NULL) {
+        ndt_decref(outrow);
+    }
+    gm_pool_free(scratch);
+    unmap(&out);
+    unmap(&in);
+    return -1;
+}
@@ -0,0 +1,119 @@
+/*
+ * BSD 3-Clause License
+ *
+ * Copyright (c) 2017-2018, plures
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#ifndef GM_SYS_H
+#define GM_SYS_H
+
+
+/*
+ * Internal portability layer for locks, atomics and clocks.  This header is
+ * not installed.  On POSIX systems, files that use gm_clock() must define
+ * _POSIX_C_SOURCE >= 199309L before including any system headers.
+ */
+
+#include <stdint.h>
+
+#ifdef _WIN32
+  #include <windows.h>
+
+  typedef SRWLOCK gm_mutex_t;
+  #define GM_MUTEX_INIT SRWLOCK_INIT
+
+  static inline void gm_mutex_lock(gm_mutex_t *m) { AcquireSRWLockExclusive(m); }
+  static inline void gm_mutex_unlock(gm_mutex_t *m) { ReleaseSRWLockExclusive(m); }
+
+  /* Acquire loads, release stores and compare-and-swap for publication. */
+  #define gm_load_acquire_ptr(p) ReadPointerAcquire((PVOID volatile *)(p))
+  #define gm_store_release_ptr(p, v) WritePointerRelease((PVOID volatile *)(p), (PVOID)(v))
+  #define gm_cas_ptr(p, e, v) \
+    (InterlockedCompareExchangePointer((PVOID volatile *)(p), (PVOID)(v), (PVOID)(e)) == (PVOID)(e))
+  #define gm_load_acquire_int(p) ((int)ReadAcquire((LONG volatile *)(p)))
+  #define gm_store_release_int(p, v) WriteRelease((LONG volatile *)(p), (LONG)(v))
+
+  /* Id of the calling thread. */
+  static inline uint64_t gm_thread_id(void) { return (uint64_t)GetCurrentThreadId(); }
+
+  /* Monotonic clock in seconds. */
+  static inline double
+  gm_clock(void)
+  {
+      LARGE_INTEGER freq, count;
+      QueryPerformanceFrequency(&freq);
+      QueryPerformanceCounter(&count);
+      return (double)count.QuadPart / (double)freq.QuadPart;
+  }
+#else
+  #include <pthread.h>
+
+  typedef pthread_mutex_t gm_mutex_t;
+  #define GM_MUTEX_INIT PTHREAD_MUTEX_INITIALIZER
+
+  static inline void gm_mutex_lock(gm_mutex_t *m) { (void)pthread_mutex_lock(m); }
+  static inline void gm_mutex_unlock(gm_mutex_t *m) { (void)pthread_mutex_unlock(m); }
+
+  /* Acquire loads, release stores and compare-and-swap for publication. */
+  #define gm_load_acquire_ptr(p) __atomic_load_n(p, __ATOMIC_ACQUIRE)
+  #define gm_store_release_ptr(p, v) __atomic_store_n(p, v, __ATOMIC_RELEASE)
+  #define gm_cas_ptr(p, e, v) __sync_bool_compare_and_swap(p, e, v)
+  #define gm_load_acquire_int(p) __atomic_load_n(p, __ATOMIC_ACQUIRE)
+  #define gm_store_release_int(p, v) __atomic_store_n(p, v, __ATOMIC_RELEASE)
+
+  #include <string.h>
+
+  /* Id of the calling thread. */
+  static inline uint64_t
+  gm_thread_id(void)
+  {
+      pthread_t self = pthread_self();
+      uint64_t id = 0;
+
+      memcpy(&id, &self, sizeof self < sizeof id ? sizeof self : sizeof id);
+      return id;
+  }
+
+  #include <time.h>
+
+  #ifdef CLOCK_MONOTONIC
+  /* Monotonic clock in seconds. */
+  static inline double
+  gm_clock(void)
+  {
+      struct timespec ts;
+      (void)clock_gettime(CLOCK_MONOTONIC, &ts);
+      return (double)ts.tv_sec + (double)ts.tv_nsec * 1e-9;
+  }
+  #endif
+#endif
+
+
+#endif /* GM_SYS_H */
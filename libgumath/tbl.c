@@ -35,6 +35,7 @@
 #include <limits.h>
 #include <stddef.h>
 #include "gumath.h"
+#include "sys.h"
 
 
 /*****************************************************************************/
@@ -66,7 +67,12 @@ init_charmap(void)
 /*                              Function tables                              */
 /*****************************************************************************/
 
-/* Function table */
+/*
+ * Function table.  The table only grows, so nodes and functions are published
+ * with release stores (or compare-and-swap between concurrent writers) and
+ * lookups use acquire loads without locking.  Nothing is freed before
+ * gm_tbl_del(), which must not run concurrently with other operations.
+ */
 struct _gm_tbl {
     gm_func_t *value;
     gm_tbl_t *next[];
@@ -126,27 +132,28 @@ gm_tbl_add(gm_tbl_t *tbl, const char *key, gm_func_t *value, ndt_context_t *ctx)
             return -1;
         }
 
-        if (t->next[i] == NULL) {
-            gm_tbl_t *u = gm_tbl_new(ctx);
+        gm_tbl_t *u = gm_load_acquire_ptr(&t->next[i]);
+        if (u == NULL) {
+            u = gm_tbl_new(ctx);
             if (u == NULL) {
                 gm_func_del(value);
                 return -1;
             }
-            t->next[i] = u;
-            t = u;
-        }
-        else {
-            t = t->next[i];
+            if (!gm_cas_ptr(&t->next[i], NULL, u)) {
+                /* Another writer inserted the node first. */
+                ndt_free(u);
+                u = gm_load_acquire_ptr(&t->next[i]);
+            }
         }
+        t = u;
     }
 
-    if (t->value) {
+    if (!gm_cas_ptr(&t->value, NULL, value)) {
         ndt_err_format(ctx, NDT_ValueError, "duplicate function name '%s'", key);
         gm_func_del(value);
         return -1;
     }
 
-    t->value = value;
     return 0;
 }
 
@@ -155,6 +162,7 @@ gm_tbl_find(const gm_tbl_t *tbl, const char *key, ndt_context_t *ctx)
 {
     const gm_tbl_t *t = tbl;
     const unsigned char *cp;
+    gm_func_t *f;
     int i;
 
     for (cp = (const unsigned char *)key; *cp != '\0'; cp++) {
@@ -165,37 +173,39 @@ gm_tbl_find(const gm_tbl_t *tbl, const char *key, ndt_context_t *ctx)
             return NULL;
         }
 
-        if (t->next[i] == NULL) {
+        t = gm_load_acquire_ptr(&t->next[i]);
+        if (t == NULL) {
             ndt_err_format(ctx, NDT_ValueError,
                            "cannot find function '%s'", key);
             return NULL;
         }
-        t = t->next[i];
     }
 
-    if (t->value == NULL) {
+    f = gm_load_acquire_ptr(&t->value);
+    if (f == NULL) {
         ndt_err_format(ctx, NDT_RuntimeError,
                        "cannot find function '%s'", key);
         return NULL;
     }
 
-    return t->value;
+    return f;
 }
 
 int
 gm_tbl_map(const gm_tbl_t *tbl, int (*f)(const gm_func_t *, void *), void *state)
 {
-    const gm_tbl_t *t = tbl;
+    const gm_func_t *value = gm_load_acquire_ptr(&tbl->value);
     int i;
 
-    if (t->value) {
-        if (f(t->value, state) < 0) {
+    if (value) {
+        if (f(value, state) < 0) {
             return -1;
         }
     }
 
     for (i = 0; i < ALPHABET_LEN; i++) {
-        if (t->next[i] && gm_tbl_map(t->next[i], f, state) < 0) {
+        const gm_tbl_t *t = gm_load_acquire_ptr(&tbl->next[i]);
+        if (t && gm_tbl_map(t, f, state) < 0) {
             return -1;
         }
     }
@@ -221,3 +231,9 @@ gm_init(void)
                         "libgumath a second time\n");
     }
 }
+
+void
+gm_finalize(void)
+{
+    gm_pool_clear();
+}
@@ -39,19 +39,404 @@
 #include "xnd.h"
 #include "gumath.h"
 #include "config.h"
+#include "sys.h"
+
+
+/* Minimum number of elements per argument for threaded application. */
+static int64_t thread_cutoff = GM_THREAD_CUTOFF;
+
+int64_t
+gm_thread_cutoff(void)
+{
+    return thread_cutoff;
+}
+
+void
+gm_set_thread_cutoff(int64_t n)
+{
+    thread_cutoff = n < 0 ? 0 : n;
+}
+
+/*
+ * Maximum number of elements per part of a threaded call.  A large call is
+ * divided into more parts than threads, so that an executor can run other
+ * work between its parts.  0 means one part per thread.
+ */
+static int64_t yield_chunk = GM_YIELD_CHUNK;
+
+int64_t
+gm_yield_chunk(void)
+{
+    return yield_chunk;
+}
+
+void
+gm_set_yield_chunk(int64_t n)
+{
+    yield_chunk = n < 0 ? 0 : n;
+}
+
+/*
+ * Number of threads that threaded calls leave free for calls that run
+ * without threads.  A threaded call with 'nthreads' threads uses at most
+ * nthreads - reserved_threads of them, so small calls from other threads
+ * find an idle processor instead of competing with all parts of the large
+ * call.
+ */
+static int64_t reserved_threads = 0;
+
+int64_t
+gm_reserved_threads(void)
+{
+    return reserved_threads;
+}
+
+void
+gm_set_reserved_threads(int64_t n)
+{
+    reserved_threads = n < 0 ? 0 : n;
+}
+
+/* Number of threads that a threaded call with 'nthreads' threads uses. */
+int64_t
+gm_lane_threads(int64_t nthreads)
+{
+    const int64_t n = nthreads - reserved_threads;
+    return n < 1 ? 1 : n;
+}
 
 
 #ifdef HAVE_PTHREAD_H
-#include <pthread.h>
+/* Extent of dimension 'd' of the ndarray 't', -1 if 't' has fewer dimensions. */
+static int64_t
+dim_shape(const ndt_t *t, int d)
+{
+    for (int i = 0; i < d; i++) {
+        if (t->tag != FixedDim) {
+            return -1;
+        }
+        t = t->FixedDim.type;
+    }
+
+    return t->tag == FixedDim ? t->FixedDim.shape : -1;
+}
+
+/*
+ * Return the extent of the first core dimension if the kernel may be applied
+ * to parts of it, -1 otherwise.  All arguments with core dimensions must agree
+ * on the extent, arguments with a scalar core are passed whole to each part.
+ * The loop and Fortran kernels rely on layouts that a part does not keep.
+ */
+static int64_t
+core_split_shape(const gm_kernel_t *kernel, const ndt_t *types[], int nrows,
+                 int outer_dims)
+{
+    int64_t shape = -1;
+
+    if (!(kernel->set->cap & GM_CAP_SPLIT)) {
+        return -1;
+    }
+
+    switch (kernel->flag) {
+    case NDT_INNER_C: case NDT_INNER_STRIDED: case NDT_INNER_XND:
+        break;
+    default:
+        return -1;
+    }
+
+    for (int i = 0; i < nrows; i++) {
+        const int64_t n = dim_shape(types[i], outer_dims);
+        if (n < 0) {
+            continue;
+        }
+        if (shape >= 0 && n != shape) {
+            return -1;
+        }
+        shape = n;
+    }
+
+    return shape;
+}
+
+/*
+ * Choose the dimension along which the arguments are divided.  -1 means that
+ * xnd_split() divides the outer dimensions.  If the first outer dimension has
+ * fewer indices than threads, elementwise calls are divided along the innermost
+ * outer dimension and GM_CAP_SPLIT kernels along the first core dimension.
+ */
+static int
+split_dim(const gm_kernel_t *kernel, const ndt_t *types[], int nrows,
+          int outer_dims, int64_t nthreads, int64_t *shape)
+{
+    const int64_t outer = outer_dims > 0 ? dim_shape(types[0], 0) : 1;
+    int64_t n;
+
+    if (outer >= nthreads) {
+        return -1;
+    }
+
+    if (outer_dims > 1 && gm_is_elementwise(kernel)) {
+        n = dim_shape(types[0], outer_dims-1);
+        if (n > outer) {
+            *shape = n;
+            return outer_dims-1;
+        }
+    }
+
+    n = core_split_shape(kernel, types, nrows, outer_dims);
+    if (n > outer) {
+        *shape = n;
+        return outer_dims;
+    }
+
+    return -1;
+}
+
+/*
+ * Number of elements in the index range [a, b) of the var dimension 't',
+ * computed from the offsets of the nested var dimensions.  Return -1 if a
+ * dimension is sliced.
+ */
+static int64_t
+var_range_nelem(const ndt_t *t, int64_t a, int64_t b)
+{
+    while (t->tag == VarDim) {
+        const int32_t *v = t->Concrete.VarDim.offsets->v;
+
+        if (t->Concrete.VarDim.nslices > 0) {
+            return -1;
+        }
+
+        a = v[a];
+        b = v[b];
+        t = t->VarDim.type;
+    }
+
+    return b - a;
+}
+
+static inline xnd_t
+row_next(const xnd_t *x, int64_t start, int64_t step, int64_t i)
+{
+    if (x->type->tag == VarDim) {
+        return xnd_var_dim_next(x, start, step, i);
+    }
+
+    return xnd_array_next(x, i);
+}
+
+/* Cost of a row: one for the row itself and one for each element. */
+static int64_t
+row_weight(const xnd_t *x)
+{
+    const ndt_t *t = x->type;
+    int64_t n = 1;
+
+    if (t->tag == VarDim) {
+        n = var_range_nelem(t, x->index, x->index+1);
+    }
+    else if (t->tag == Array) {
+        n = XND_ARRAY_DATA(x->ptr) == NULL ? 0 : XND_ARRAY_SHAPE(x->ptr);
+    }
+
+    return n < 0 ? 2 : n+1;
+}
+
+/*
+ * Sum of the row weights of 'x' minus the number of rows, which is the
+ * number of elements that apply_threaded_rows() compares to the cutoff.
+ */
+static int64_t
+row_elements(const xnd_t *x)
+{
+    NDT_STATIC_CONTEXT(ctx);
+    int64_t start = 0, step = 0, shape, n = 0;
+
+    if (x->type->tag == VarDim) {
+        shape = ndt_var_indices(&start, &step, x->type, x->index, &ctx);
+        if (shape < 0) {
+            ndt_err_clear(&ctx);
+            return 0;
+        }
+    }
+    else {
+        shape = XND_ARRAY_SHAPE(x->ptr);
+    }
+
+    for (int64_t i = 0; i < shape; i++) {
+        const xnd_t row = row_next(x, start, step, i);
+        n += row_weight(&row) - 1;
+    }
+
+    return n;
+}
+
+/*
+ * Check if the var or flexible array arguments can be divided into rows of
+ * their first dimension.  Return the number of elements of the first argument
+ * or -1 if the arguments cannot be divided.  'known' is false if the number
+ * of elements depends on data that is not in 'args'.
+ */
+static int64_t
+rows_nelem(const gm_kernel_t *kernel, const xnd_t args[], const ndt_t *types[],
+           int nrows, int outer_dims, bool *known, const char **reason)
+{
+    const int nin = (int)kernel->set->sig->Function.nin;
+    const enum ndt tag = types[0]->tag;
+    const ndt_t *t = types[0];
+    int64_t n;
+
+    *known = true;
+
+    if (outer_dims == 0) {
+        *reason = "no outer dimensions";
+        return -1;
+    }
+
+    if ((tag != VarDim && tag != Array) ||
+        ((kernel->flag & (NDT_EXT_C|NDT_EXT_ZERO|NDT_EXT_STRIDED)) &&
+         outer_dims < 2)) {
+        *reason = "argument is not an ndarray";
+        return -1;
+    }
+
+    for (int i = 0; i < nrows; i++) {
+        if (types[i]->tag != tag || have_stored_index(types[i])) {
+            *reason = "argument is not an ndarray";
+            return -1;
+        }
+        /* Bits of a shared validity bitmap cannot be written concurrently. */
+        if (i >= nin && ndt_subtree_is_optional(types[i])) {
+            *reason = "output has optional values";
+            return -1;
+        }
+    }
+
+    if (tag == VarDim) {
+        n = var_range_nelem(t, 0, t->Concrete.VarDim.offsets->n-1);
+        if (n >= 0) {
+            return n;
+        }
+    }
+
+    /* Flexible arrays and sliced var dimensions are counted row by row. */
+    if (args == NULL || args[0].type->tag != tag ||
+        (tag == Array && args[0].ptr == NULL)) {
+        *known = false;
+        return 0;
+    }
+
+    return row_elements(&args[0]);
+}
+#endif
+
+/*
+ * Return the number of threads that gm_apply_thread() uses for 'types'
+ * after broadcasting.  'args' are the arguments, which are needed to count
+ * the elements of flexible arrays.  'reason' is set to a short explanation.
+ */
+int64_t
+gm_thread_decision(const gm_kernel_t *kernel, const xnd_t args[], const ndt_t *types[],
+                   int outer_dims, int64_t nthreads, const char **reason)
+{
+    const int nrows = (int)kernel->set->sig->Function.nargs;
+
+#ifndef HAVE_PTHREAD_H
+    (void)args; (void)types; (void)outer_dims; (void)nthreads; (void)nrows;
+    *reason = "built without thread support";
+    return 1;
+#else
+    int64_t shape;
+    int d;
+
+    if (nthreads <= 1) {
+        *reason = "threads disabled";
+        return 1;
+    }
+    if (nrows == 0) {
+        *reason = "no arguments";
+        return 1;
+    }
+
+    for (int i = 0; i < nrows; i++) {
+        if (!ndt_is_ndarray(types[i])) {
+            bool known;
+            const int64_t n = rows_nelem(kernel, args, types, nrows, outer_dims,
+                                         &known, reason);
+            if (n < 0) {
+                return 1;
+            }
+            if (known && n < thread_cutoff) {
+                *reason = "argument is smaller than GM_THREAD_CUTOFF";
+                return 1;
+            }
+            *reason = "split the rows by element count";
+            return nthreads;
+        }
+    }
+
+    d = split_dim(kernel, types, nrows, outer_dims, nthreads, &shape);
+
+    for (int i = 0; i < nrows; i++) {
+        if (d >= 0 && dim_shape(types[i], d) < 0) {
+            continue; /* passed whole to each part */
+        }
+        if (ndt_nelem(types[i]) < thread_cutoff) {
+            *reason = "argument is smaller than GM_THREAD_CUTOFF";
+            return 1;
+        }
+    }
+
+    if (d < 0) {
+        if (outer_dims == 0) {
+            *reason = "no outer dimensions";
+            return 1;
+        }
+        *reason = "split along the outer dimensions";
+        return nthreads;
+    }
+
+    *reason = d == outer_dims ? "split along the first core dimension" :
+                                "split along the innermost outer dimension";
+    return shape < nthreads ? shape : nthreads;
+#endif
+}
+
+
+#ifdef HAVE_PTHREAD_H
+#include <fenv.h>
+
+/* Number of parts of a threaded call over 'nelem' elements. */
+static int64_t
+num_parts(int64_t nelem, int64_t nthreads)
+{
+    int64_t parts;
+
+    if (yield_chunk == 0) {
+        return nthreads;
+    }
+
+    parts = nelem / yield_chunk;
+    if (parts < nthreads) {
+        return nthreads;
+    }
+    if (parts > GM_MAX_PARTS * nthreads) {
+        return GM_MAX_PARTS * nthreads;
+    }
+
+    return parts;
+}
 
 struct thread_info {
-    pthread_t tid;
     int tnum;
     int nrows;
     int ncols;
+    int rounding;
     const gm_kernel_t *kernel;
     xnd_t **slices;
     int outer_dims;
+    bool count;               /* read the hardware counters around the part */
+    gm_counters_t counters;   /* counts of the part */
     ndt_context_t ctx;
 };
 
@@ -67,6 +452,36 @@ init_static_context(ndt_context_t *ctx)
     *ctx = c;
 }
 
+/*
+ * The hardware counters only count the calling thread, so each part reads
+ * them on the thread that runs it.
+ */
+static inline bool
+part_counters_start(bool count, gm_counters_t *counters)
+{
+    return count && gm_counters_start(counters);
+}
+
+static inline void
+part_counters_stop(bool started, gm_counters_t *counters)
+{
+    if (started) {
+        gm_counters_stop(counters);
+    }
+    else {
+        memset(counters, 0, sizeof *counters);
+    }
+}
+
+static void
+add_counters(gm_counters_t *sum, const gm_counters_t *part)
+{
+    sum->cycles += part->cycles;
+    sum->instructions += part->instructions;
+    sum->cache_misses += part->cache_misses;
+    sum->branch_misses += part->branch_misses;
+}
+
 static void
 clear_all_slices(xnd_t *slices[], int *nslices, int stop)
 {
@@ -78,49 +493,132 @@ clear_all_slices(xnd_t *slices[], int *nslices, int stop)
     }
 }
 
-static void *
-apply_thread(void *arg)
+/*
+ * Divide 'x' into 'ncols' parts along dimension 'd', which has 'shape'
+ * indices.  An argument without dimension 'd' is passed whole to each part.
+ */
+static xnd_t *
+split_along(const xnd_t *x, int d, int64_t shape, int64_t ncols,
+            ndt_context_t *ctx)
+{
+    ALLOCA(xnd_index_t, indices, d+1);
+    const ndt_t *t = x->type;
+    xnd_t *slices;
+
+    slices = ndt_alloc(ncols, sizeof *slices);
+    if (slices == NULL) {
+        (void)ndt_memory_error(ctx);
+        return NULL;
+    }
+
+    if (dim_shape(x->type, d) < 0) {
+        for (int64_t k = 0; k < ncols; k++) {
+            ndt_incref(x->type);
+            slices[k] = *x;
+        }
+        return slices;
+    }
+
+    for (int i = 0; i <= d; i++) {
+        indices[i].tag = Slice;
+        indices[i].Slice.start = 0;
+        indices[i].Slice.stop = t->FixedDim.shape;
+        indices[i].Slice.step = 1;
+        t = t->FixedDim.type;
+    }
+
+    for (int64_t k = 0; k < ncols; k++) {
+        indices[d].Slice.start = k * shape / ncols;
+        indices[d].Slice.stop = (k+1) * shape / ncols;
+
+        slices[k] = xnd_subscript(x, indices, d+1, ctx);
+        if (ndt_err_occurred(ctx)) {
+            for (int64_t j = 0; j < k; j++) {
+                ndt_decref(slices[j].type);
+            }
+            ndt_free(slices);
+            return NULL;
+        }
+    }
+
+    return slices;
+}
+
+static void
+apply_thread(struct thread_info *tinfo)
 {
-    struct thread_info *tinfo = arg;
     ALLOCA(xnd_t, stack, tinfo->nrows);
+    gm_trace_event_t event = {
+      GM_TRACE_CHUNK, NULL, tinfo->kernel->set, tinfo->kernel->flag, stack,
+      tinfo->nrows, tinfo->tnum, 0, 0 };
+    const int rounding = fegetround();
+    bool counted;
 
     for (int i = 0; i < tinfo->nrows; i++) {
         stack[i] = tinfo->slices[i][tinfo->tnum];
     }
 
-    gm_apply(tinfo->kernel, stack, tinfo->outer_dims, &tinfo->ctx);
-    return NULL;
+    /* Executor threads do not inherit the rounding mode of the caller. */
+    if (rounding != tinfo->rounding) {
+        fesetround(tinfo->rounding);
+    }
+
+    gm_trace_begin(&event);
+    counted = part_counters_start(tinfo->count, &tinfo->counters);
+    gm_apply_nostats(tinfo->kernel, stack, tinfo->outer_dims, &tinfo->ctx);
+    part_counters_stop(counted, &tinfo->counters);
+    gm_trace_end(&event);
+
+    if (rounding != tinfo->rounding) {
+        fesetround(rounding);
+    }
 }
 
-int
-gm_apply_thread(const gm_kernel_t *kernel, xnd_t stack[], int outer_dims,
-                const int64_t nthreads, ndt_context_t *ctx)
+static void
+apply_range(int64_t begin, int64_t end, void *arg)
+{
+    struct thread_info *tinfo = arg;
+
+    for (int64_t tnum = begin; tnum < end; tnum++) {
+        apply_thread(&tinfo[tnum]);
+    }
+}
+
+static int
+apply_threaded(const gm_kernel_t *kernel, xnd_t stack[], int outer_dims,
+               const int64_t nthreads, gm_counters_t *counters,
+               ndt_context_t *ctx)
 {
     const int nrows = (int)kernel->set->sig->Function.nargs;
+    const int rounding = fegetround();
     ALLOCA(xnd_t *, slices, nrows);
     ALLOCA(int, nslices, nrows);
+    ALLOCA(const ndt_t *, types, nrows);
     struct thread_info *tinfo;
-    int ncols, tnum;
-    bool use_threads = true;
-
-    if (nthreads <= 1 || nrows == 0 || outer_dims == 0) {
-        use_threads = false;
-    }
+    int64_t shape = 0, nelem = 0, parts;
+    int ncols, tnum, d;
+    gm_trace_event_t join = {
+      GM_TRACE_JOIN, NULL, kernel->set, kernel->flag, NULL, 0, -1, 0, 0 };
 
     for (int i = 0; i < nrows; i++) {
-        const ndt_t *t = stack[i].type;
-        if (!ndt_is_ndarray(t) || ndt_nelem(t) < GM_THREAD_CUTOFF) {
-            use_threads = false;
+        const int64_t n = ndt_nelem(stack[i].type);
+        types[i] = stack[i].type;
+        if (n > nelem) {
+            nelem = n;
         }
     }
-
-    if (!use_threads) {
-        return gm_apply(kernel, stack, outer_dims, ctx);
-    }
+    d = split_dim(kernel, types, nrows, outer_dims, nthreads, &shape);
+    parts = num_parts(nelem, nthreads);
 
     for (int i = 0; i < nrows; i++) {
-        int64_t ncols = nthreads;
-        slices[i] = xnd_split(&stack[i], &ncols, outer_dims, ctx);
+        int64_t ncols = parts;
+        if (d < 0) {
+            slices[i] = xnd_split(&stack[i], &ncols, outer_dims, ctx);
+        }
+        else {
+            ncols = shape < parts ? shape : parts;
+            slices[i] = split_along(&stack[i], d, shape, ncols, ctx);
+        }
         if (ndt_err_occurred(ctx)) {
             clear_all_slices(slices, nslices, i);
             return -1;
@@ -138,10 +636,9 @@ gm_apply_thread(const gm_kernel_t *kernel, xnd_t stack[], int outer_dims,
         }
     }
 
-    tinfo = ndt_calloc(nthreads, sizeof *tinfo);
+    tinfo = gm_pool_alloc(ncols * (int64_t)sizeof *tinfo, ctx);
     if (tinfo == NULL) {
         clear_all_slices(slices, nslices, nrows);
-        (void)ndt_memory_error(ctx);
         return -1;
     }
 
@@ -150,39 +647,290 @@ gm_apply_thread(const gm_kernel_t *kernel, xnd_t stack[], int outer_dims,
         tinfo[tnum].kernel = kernel;
         tinfo[tnum].nrows = nrows;
         tinfo[tnum].ncols = ncols;
+        tinfo[tnum].rounding = rounding;
         tinfo[tnum].slices = slices;
         tinfo[tnum].outer_dims = outer_dims;
+        tinfo[tnum].count = counters != NULL;
         init_static_context(&tinfo[tnum].ctx);
-
-        int ret = pthread_create(&tinfo[tnum].tid, NULL, &apply_thread,
-                                 &tinfo[tnum]);
-        if (ret != 0) {
-            clear_all_slices(slices, nslices, nrows);
-            ndt_free(tinfo);
-            ndt_err_format(ctx, NDT_RuntimeError, "could not create thread");
-            return -1;
-        }
     }
 
-    int ret = 0;
+    gm_trace_begin(&join);
+    gm_parallel_for(ncols, 1, nthreads, apply_range, tinfo);
+    gm_trace_end(&join);
+
     for (tnum = 0; tnum < ncols; tnum++) {
-        ret |= pthread_join(tinfo[tnum].tid, NULL);
+        if (counters != NULL) {
+            add_counters(counters, &tinfo[tnum].counters);
+        }
         if (ndt_err_occurred(&tinfo[tnum].ctx)) {
             if (!ndt_err_occurred(ctx)) {
-                ndt_err_format(ctx, tinfo[tnum].ctx.err,
+                ndt_err_format(ctx, tinfo[tnum].ctx.err, "%s",
                                ndt_context_msg(&tinfo[tnum].ctx));
             }
             ndt_err_clear(&tinfo[tnum].ctx);
         }
     }
 
-    if (ret != 0 && !ndt_err_occurred(ctx)) {
-        ndt_err_format(ctx, NDT_RuntimeError, "error in thread");
-    }
- 
     clear_all_slices(slices, nslices, nrows);
-    ndt_free(tinfo);
+    gm_pool_free(tinfo);
+
+    return ndt_err_occurred(ctx) ? -1 : 0;
+}
+
+struct row_info {
+    int tnum;
+    int nrows;
+    int rounding;
+    const gm_kernel_t *kernel;
+    const xnd_t *stack;
+    const int64_t *start;
+    const int64_t *step;
+    int64_t begin;
+    int64_t end;
+    int outer_dims;
+    bool count;
+    gm_counters_t counters;
+    ndt_context_t ctx;
+};
+
+/* Apply the kernel to the rows of 'r' in one call on slices of the var dimension. */
+static void
+apply_var_rows(struct row_info *r)
+{
+    ALLOCA(xnd_t, views, r->nrows);
+    xnd_index_t index;
+    int k;
+
+    index.tag = Slice;
+    index.Slice.start = r->begin;
+    index.Slice.stop = r->end;
+    index.Slice.step = 1;
+
+    for (k = 0; k < r->nrows; k++) {
+        views[k] = xnd_subscript(&r->stack[k], &index, 1, &r->ctx);
+        if (ndt_err_occurred(&r->ctx)) {
+            break;
+        }
+    }
+
+    if (k == r->nrows) {
+        (void)gm_apply_nostats(r->kernel, views, r->outer_dims, &r->ctx);
+    }
+
+    for (int i = 0; i < k; i++) {
+        ndt_decref(views[i].type);
+    }
+}
+
+static void
+apply_rows(struct row_info *r)
+{
+    ALLOCA(xnd_t, next, r->nrows);
+    gm_trace_event_t event = {
+      GM_TRACE_CHUNK, NULL, r->kernel->set, r->kernel->flag, NULL, 0,
+      r->tnum, 0, 0 };
+    const int rounding = fegetround();
+    bool counted;
+
+    if (rounding != r->rounding) {
+        fesetround(r->rounding);
+    }
+
+    gm_trace_begin(&event);
+    counted = part_counters_start(r->count, &r->counters);
+    if (r->stack[0].type->tag == VarDim) {
+        apply_var_rows(r);
+    }
+    else {
+        /* Flexible arrays cannot be sliced, so their rows are applied one
+           at a time. */
+        for (int64_t i = r->begin; i < r->end; i++) {
+            for (int k = 0; k < r->nrows; k++) {
+                next[k] = row_next(&r->stack[k], r->start[k], r->step[k], i);
+            }
+
+            if (gm_apply_nostats(r->kernel, next, r->outer_dims-1, &r->ctx) < 0) {
+                break;
+            }
+        }
+    }
+    part_counters_stop(counted, &r->counters);
+    gm_trace_end(&event);
+
+    if (rounding != r->rounding) {
+        fesetround(rounding);
+    }
+}
+
+static void
+apply_row_range(int64_t begin, int64_t end, void *arg)
+{
+    struct row_info *rinfo = arg;
+
+    for (int64_t tnum = begin; tnum < end; tnum++) {
+        apply_rows(&rinfo[tnum]);
+    }
+}
+
+/*
+ * Divide the first dimension of var or flexible array arguments into ranges
+ * of rows with about the same number of elements.
+ */
+static int
+apply_threaded_rows(const gm_kernel_t *kernel, xnd_t stack[], int outer_dims,
+                    const int64_t nthreads, gm_counters_t *counters,
+                    ndt_context_t *ctx)
+{
+    const int nrows = (int)kernel->set->sig->Function.nargs;
+    const int rounding = fegetround();
+    ALLOCA(int64_t, start, nrows);
+    ALLOCA(int64_t, step, nrows);
+    struct row_info *rinfo;
+    int64_t shape = 0, total = 0, acc = 0;
+    int64_t ncols, tnum, part;
+    gm_trace_event_t join = {
+      GM_TRACE_JOIN, NULL, kernel->set, kernel->flag, NULL, 0, -1, 0, 0 };
+
+    if (stack[0].type->tag == VarDim) {
+        for (int k = 0; k < nrows; k++) {
+            const int64_t n = ndt_var_indices(&start[k], &step[k], stack[k].type,
+                                              stack[k].index, ctx);
+            if (n < 0) {
+                return -1;
+            }
+            if (k > 0 && n != shape) {
+                ndt_err_format(ctx, NDT_RuntimeError,
+                    "shape mismatch in outer dimensions");
+                return -1;
+            }
+            shape = n;
+        }
+    }
+    else {
+        shape = XND_ARRAY_SHAPE(stack[0].ptr);
+        start[0] = step[0] = 0;
+        for (int k = 1; k < nrows; k++) {
+            if (array_shape_check(&stack[k], shape, ctx) < 0) {
+                return -1;
+            }
+            start[k] = step[k] = 0;
+        }
+    }
+
+    for (int64_t i = 0; i < shape; i++) {
+        const xnd_t row = row_next(&stack[0], start[0], step[0], i);
+        total += row_weight(&row);
+    }
+
+    ncols = total - shape < thread_cutoff ? 1 : num_parts(total, nthreads);
+    if (ncols > shape) {
+        ncols = shape;
+    }
+    if (ncols == 0) {
+        return 0;
+    }
+
+    rinfo = gm_pool_alloc(ncols * (int64_t)sizeof *rinfo, ctx);
+    if (rinfo == NULL) {
+        return -1;
+    }
+
+    for (tnum = 0; tnum < ncols; tnum++) {
+        rinfo[tnum].tnum = (int)tnum;
+        rinfo[tnum].nrows = nrows;
+        rinfo[tnum].rounding = rounding;
+        rinfo[tnum].kernel = kernel;
+        rinfo[tnum].stack = stack;
+        rinfo[tnum].start = start;
+        rinfo[tnum].step = step;
+        rinfo[tnum].begin = 0;
+        rinfo[tnum].end = shape;
+        rinfo[tnum].outer_dims = outer_dims;
+        rinfo[tnum].count = counters != NULL;
+        init_static_context(&rinfo[tnum].ctx);
+    }
+
+    /* Part k ends at the first row where the running cost reaches k/ncols. */
+    part = 1;
+    for (int64_t i = 0; i < shape && part < ncols; i++) {
+        const xnd_t row = row_next(&stack[0], start[0], step[0], i);
+        acc += row_weight(&row);
+        while (part < ncols && acc * ncols >= part * total) {
+            rinfo[part-1].end = rinfo[part].begin = i+1;
+            part++;
+        }
+    }
+
+    gm_trace_begin(&join);
+    gm_parallel_for(ncols, 1, nthreads, apply_row_range, rinfo);
+    gm_trace_end(&join);
+
+    for (tnum = 0; tnum < ncols; tnum++) {
+        if (counters != NULL) {
+            add_counters(counters, &rinfo[tnum].counters);
+        }
+        if (ndt_err_occurred(&rinfo[tnum].ctx)) {
+            if (!ndt_err_occurred(ctx)) {
+                ndt_err_format(ctx, rinfo[tnum].ctx.err, "%s",
+                               ndt_context_msg(&rinfo[tnum].ctx));
+            }
+            ndt_err_clear(&rinfo[tnum].ctx);
+        }
+    }
+
+    gm_pool_free(rinfo);
 
     return ndt_err_occurred(ctx) ? -1 : 0;
 }
+
+int
+gm_apply_thread(const gm_kernel_t *kernel, xnd_t stack[], int outer_dims,
+                const int64_t nthreads, ndt_context_t *ctx)
+{
+    const int nrows = (int)kernel->set->sig->Function.nargs;
+    const bool stats = gm_stats_enabled();
+    gm_trace_event_t event = {
+      GM_TRACE_APPLY, NULL, kernel->set, kernel->flag, stack, nrows, -1, 0, 0 };
+    ALLOCA(const ndt_t *, types, nrows);
+    gm_counters_t counters;
+    bool count = false;
+    const char *reason;
+    int64_t bulk;
+    double start = 0;
+    int ret;
+
+    for (int i = 0; i < nrows; i++) {
+        types[i] = stack[i].type;
+    }
+
+    /* Small calls run at once on the calling thread. */
+    if (gm_thread_decision(kernel, stack, types, outer_dims, nthreads, &reason) <= 1) {
+        return gm_apply(kernel, stack, outer_dims, ctx);
+    }
+    bulk = gm_lane_threads(nthreads);
+
+    gm_trace_begin(&event);
+    if (stats) {
+        count = gm_counters_enabled();
+        memset(&counters, 0, sizeof counters);
+        start = gm_stats_clock();
+    }
+
+    if (ndt_is_ndarray(types[0])) {
+        ret = apply_threaded(kernel, stack, outer_dims, bulk,
+                             count ? &counters : NULL, ctx);
+    }
+    else {
+        ret = apply_threaded_rows(kernel, stack, outer_dims, bulk,
+                                  count ? &counters : NULL, ctx);
+    }
+
+    if (stats && ret == 0) {
+        const double time = gm_stats_clock() - start;
+        gm_stats_record(kernel, stack, time, true, count ? &counters : NULL);
+    }
+    gm_trace_end(&event);
+
+    return ret;
+}
 #endif
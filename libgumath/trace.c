@@ -0,0 +1,375 @@
+/*
+ * BSD 3-Clause License
+ *
+ * Copyright (c) 2017-2018, plures
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include <inttypes.h>
+#include "ndtypes.h"
+#include "xnd.h"
+#include "gumath.h"
+#include "sys.h"
+
+
+/*
+ * Tracing hooks.
+ *
+ * A single hook receives begin and end events for kernel selection, output
+ * allocation, kernel application and the chunks and join phase of threaded
+ * applications.  With no hook installed the cost is one pointer test per
+ * call.
+ *
+ * The hook and its state are published together as one pointer to an
+ * immutable pair.  Pairs are interned and never freed, so a thread that has
+ * loaded a pair can still call it after the hook has been replaced.
+ *
+ * The built-in sink writes the Chrome trace event format, which can be
+ * loaded into chrome://tracing and the Perfetto UI.
+ */
+
+typedef struct trace_hook {
+    gm_trace_hook_t hook;
+    void *state;
+    struct trace_hook *next;
+} trace_hook_t;
+
+static gm_mutex_t hooks_lock = GM_MUTEX_INIT;
+static trace_hook_t *hooks = NULL;        /* all pairs, protected by hooks_lock */
+static trace_hook_t *trace_hook = NULL;   /* installed pair or NULL */
+
+/* Return the interned pair for 'hook' and 'state'. */
+static trace_hook_t *
+intern_hook(gm_trace_hook_t hook, void *state, ndt_context_t *ctx)
+{
+    trace_hook_t *t;
+
+    gm_mutex_lock(&hooks_lock);
+    for (t = hooks; t != NULL; t = t->next) {
+        if (t->hook == hook && t->state == state) {
+            break;
+        }
+    }
+
+    if (t == NULL) {
+        t = ndt_alloc_size(sizeof *t);
+        if (t == NULL) {
+            gm_mutex_unlock(&hooks_lock);
+            return ndt_memory_error(ctx);
+        }
+        t->hook = hook;
+        t->state = state;
+        t->next = hooks;
+        hooks = t;
+    }
+    gm_mutex_unlock(&hooks_lock);
+
+    return t;
+}
+
+int
+gm_trace_set_hook(gm_trace_hook_t hook, void *state, ndt_context_t *ctx)
+{
+    trace_hook_t *t = NULL;
+
+    if (hook != NULL) {
+        t = intern_hook(hook, state, ctx);
+        if (t == NULL) {
+            return -1;
+        }
+    }
+
+    gm_store_release_ptr(&trace_hook, t);
+
+    return 0;
+}
+
+bool
+gm_trace_enabled(void)
+{
+    return gm_load_acquire_ptr(&trace_hook) != NULL;
+}
+
+static double
+trace_clock(void)
+{
+    return gm_stats_clock();
+}
+
+void
+gm_trace_begin(gm_trace_event_t *event)
+{
+    const trace_hook_t *t = gm_load_acquire_ptr(&trace_hook);
+
+    if (t != NULL) {
+        event->tid = gm_thread_id();
+        event->time = trace_clock();
+        t->hook(event, true, t->state);
+    }
+}
+
+void
+gm_trace_end(gm_trace_event_t *event)
+{
+    const trace_hook_t *t = gm_load_acquire_ptr(&trace_hook);
+
+    if (t != NULL) {
+        event->tid = gm_thread_id();
+        event->time = trace_clock();
+        t->hook(event, false, t->state);
+    }
+}
+
+
+/******************************************************************************/
+/*                             Chrome trace sink                              */
+/******************************************************************************/
+
+/* Kernel sets seen in selection events, to name application events.  The
+   names passed to gm_select() are owned by the caller, so the sink keeps
+   copies. */
+#define SINK_NAMES 4096
+
+static struct {
+    gm_mutex_t lock;
+    FILE *fp;
+    double t0;
+    bool first;
+    struct {
+        const gm_kernel_set_t *set;
+        char *name;
+    } names[SINK_NAMES];
+} sink = {
+  .lock = GM_MUTEX_INIT,
+  .fp = NULL,
+  .t0 = 0,
+  .first = true,
+  .names = {{NULL, NULL}}
+};
+
+static const char *phase_name[] = {
+  "select", "alloc", "apply", "chunk", "join"
+};
+
+static inline size_t
+name_slot(const gm_kernel_set_t *set)
+{
+    return ((uintptr_t)set >> 4) % SINK_NAMES;
+}
+
+/* Called with the lock held.  If the copy fails the set stays unnamed. */
+static void
+learn_name(const gm_kernel_set_t *set, const char *name)
+{
+    NDT_STATIC_CONTEXT(ctx);
+    size_t i = name_slot(set);
+
+    for (size_t n = 0; n < SINK_NAMES; n++, i = (i+1) % SINK_NAMES) {
+        if (sink.names[i].set == set) {
+            return;
+        }
+        if (sink.names[i].set == NULL) {
+            char *copy = ndt_strdup(name, &ctx);
+            if (copy == NULL) {
+                ndt_err_clear(&ctx);
+                return;
+            }
+            sink.names[i].set = set;
+            sink.names[i].name = copy;
+            return;
+        }
+    }
+}
+
+/* Called with the lock held. */
+static void
+clear_names(void)
+{
+    for (size_t i = 0; i < SINK_NAMES; i++) {
+        ndt_free(sink.names[i].name);
+        sink.names[i].set = NULL;
+        sink.names[i].name = NULL;
+    }
+}
+
+/* Called with the lock held. */
+static const char *
+lookup_name(const gm_kernel_set_t *set)
+{
+    size_t i = name_slot(set);
+
+    for (size_t n = 0; n < SINK_NAMES; n++, i = (i+1) % SINK_NAMES) {
+        if (sink.names[i].set == set) {
+            return sink.names[i].name;
+        }
+        if (sink.names[i].set == NULL) {
+            break;
+        }
+    }
+
+    return "kernel";
+}
+
+static void
+write_shapes(FILE *fp, const xnd_t *stack, int nargs)
+{
+    fputs(",\"shapes\":[", fp);
+
+    for (int i = 0; i < nargs; i++) {
+        const ndt_t *t = stack[i].type;
+
+        fputs(i == 0 ? "" : ",", fp);
+        if (ndt_is_ndarray(t)) {
+            fputc('[', fp);
+            for (int k = 0; k < t->ndim; k++, t = t->FixedDim.type) {
+                fprintf(fp, k == 0 ? "%" PRIi64 : ",%" PRIi64, t->FixedDim.shape);
+            }
+            fputc(']', fp);
+        }
+        else {
+            fputs("null", fp);
+        }
+    }
+
+    fputc(']', fp);
+}
+
+static void
+sink_hook(const gm_trace_event_t *e, bool begin, void *state)
+{
+    const char *name;
+    (void)state;
+
+    gm_mutex_lock(&sink.lock);
+    if (sink.fp == NULL) {
+        gm_mutex_unlock(&sink.lock);
+        return;
+    }
+
+    if (e->phase == GM_TRACE_SELECT && !begin && e->set != NULL && e->name != NULL) {
+        learn_name(e->set, e->name);
+    }
+
+    name = e->name != NULL ? e->name :
+           e->set != NULL ? lookup_name(e->set) : "kernel";
+
+    fprintf(sink.fp,
+        "%s\n{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"%s\",\"ts\":%.3f,\"pid\":1,\"tid\":%" PRIu64,
+        sink.first ? "" : ",", name, phase_name[e->phase], begin ? "B" : "E",
+        (e->time - sink.t0) * 1e6, e->tid);
+    sink.first = false;
+
+    if (begin || e->phase == GM_TRACE_SELECT) {
+        fputs(",\"args\":{", sink.fp);
+        fprintf(sink.fp, "\"variant\":\"%s\"", e->set ? gm_variant_name(e->flag) : "");
+        if (e->chunk >= 0) {
+            fprintf(sink.fp, ",\"chunk\":%" PRIi64, e->chunk);
+        }
+        if (e->stack != NULL) {
+            write_shapes(sink.fp, e->stack, e->nargs);
+        }
+        fputc('}', sink.fp);
+    }
+
+    fputc('}', sink.fp);
+    gm_mutex_unlock(&sink.lock);
+}
+
+/* Write all events to 'path' until gm_trace_stop() is called. */
+int
+gm_trace_start(const char *path, ndt_context_t *ctx)
+{
+    FILE *fp;
+
+    gm_mutex_lock(&sink.lock);
+    if (sink.fp != NULL) {
+        gm_mutex_unlock(&sink.lock);
+        ndt_err_format(ctx, NDT_RuntimeError, "trace is already running");
+        return -1;
+    }
+
+    fp = fopen(path, "w");
+    if (fp == NULL) {
+        gm_mutex_unlock(&sink.lock);
+        ndt_err_format(ctx, NDT_OSError, "could not open trace file '%s'", path);
+        return -1;
+    }
+
+    fputs("{\"traceEvents\":[", fp);
+    sink.fp = fp;
+    sink.t0 = trace_clock();
+    sink.first = true;
+    clear_names();
+    gm_mutex_unlock(&sink.lock);
+
+    if (gm_trace_set_hook(sink_hook, NULL, ctx) < 0) {
+        NDT_STATIC_CONTEXT(ctx2);
+        (void)gm_trace_stop(&ctx2);
+        ndt_err_clear(&ctx2);
+        return -1;
+    }
+
+    return 0;
+}
+
+int
+gm_trace_stop(ndt_context_t *ctx)
+{
+    trace_hook_t *t = gm_load_acquire_ptr(&trace_hook);
+    FILE *fp;
+
+    /* Remove the sink unless another hook has replaced it. */
+    if (t != NULL && t->hook == sink_hook) {
+        (void)gm_cas_ptr(&trace_hook, t, NULL);
+    }
+
+    gm_mutex_lock(&sink.lock);
+    fp = sink.fp;
+    sink.fp = NULL;
+    clear_names();
+    gm_mutex_unlock(&sink.lock);
+
+    if (fp == NULL) {
+        ndt_err_format(ctx, NDT_RuntimeError, "trace is not running");
+        return -1;
+    }
+
+    fputs("\n],\"displayTimeUnit\":\"ns\"}\n", fp);
+    if (fclose(fp) != 0) {
+        ndt_err_format(ctx, NDT_OSError, "could not write trace file");
+        return -1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,248 @@
+/*
+ * BSD 3-Clause License
+ *
+ * Copyright (c) 2017-2018, plures
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include "ndtypes.h"
+#include "xnd.h"
+#include "gumath.h"
+
+
+/*
+ * Masked application of elementwise kernels.
+ *
+ * The innermost outer dimension is scanned for runs of true mask values.
+ * Each run is passed to the selected kernel as a one-dimensional view, so
+ * the vectorized 1D loops compute and write only the selected elements.
+ * The types of runs with up to RUN_CACHE elements are created once per
+ * argument and length.
+ */
+
+#define RUN_CACHE 64
+
+typedef struct {
+    const gm_kernel_t *kernel;
+    int nargs;
+    const ndt_t **cache; /* nargs rows of RUN_CACHE+1 types */
+} where_t;
+
+
+/* Type of a run of 'n' elements of the one-dimensional argument 'x'. */
+static const ndt_t *
+run_type(where_t *w, int k, const xnd_t *x, int64_t n, ndt_context_t *ctx)
+{
+    const ndt_t *t = x->type;
+    const ndt_t **slot;
+    const ndt_t *u;
+
+    if (n > RUN_CACHE) {
+        return ndt_fixed_dim(t->FixedDim.type, n, t->Concrete.FixedDim.step, ctx);
+    }
+
+    slot = &w->cache[k * (RUN_CACHE+1) + n];
+    if (*slot == NULL) {
+        u = ndt_fixed_dim(t->FixedDim.type, n, t->Concrete.FixedDim.step, ctx);
+        if (u == NULL) {
+            return NULL;
+        }
+        *slot = u;
+    }
+
+    return *slot;
+}
+
+/* Apply the kernel to the elements [a, b) of the one-dimensional 'row'. */
+static int
+apply_run(where_t *w, const xnd_t row[], int64_t a, int64_t b,
+          ndt_context_t *ctx)
+{
+    ALLOCA(xnd_t, views, w->nargs);
+    const int64_t n = b - a;
+    int k, ret;
+
+    for (k = 0; k < w->nargs; k++) {
+        views[k] = row[k];
+        views[k].index = row[k].index + a * row[k].type->Concrete.FixedDim.step;
+        views[k].type = run_type(w, k, &row[k], n, ctx);
+        if (views[k].type == NULL) {
+            ret = -1;
+            goto out;
+        }
+    }
+
+    ret = gm_apply_nostats(w->kernel, views, 1, ctx);
+
+out:
+    if (n > RUN_CACHE) {
+        for (int i = 0; i < k; i++) {
+            ndt_decref(views[i].type);
+        }
+    }
+
+    return ret;
+}
+
+static int
+apply_rows(where_t *w, const xnd_t stack[], const xnd_t *mask, int dims,
+           ndt_context_t *ctx)
+{
+    const int64_t shape = mask->type->FixedDim.shape;
+
+    if (dims == 1) {
+        const int64_t step = mask->type->Concrete.FixedDim.step;
+        const char *m = xnd_fixed_apply_index(mask);
+        int64_t i = 0;
+
+        while (i < shape) {
+            int64_t a;
+
+            while (i < shape && !m[i*step]) {
+                i++;
+            }
+            a = i;
+            while (i < shape && m[i*step]) {
+                i++;
+            }
+
+            if (i > a && apply_run(w, stack, a, i, ctx) < 0) {
+                return -1;
+            }
+        }
+
+        return 0;
+    }
+    else {
+        ALLOCA(xnd_t, next, w->nargs);
+
+        for (int64_t i = 0; i < shape; i++) {
+            const xnd_t m = xnd_fixed_dim_next(mask, i);
+
+            for (int k = 0; k < w->nargs; k++) {
+                next[k] = xnd_fixed_dim_next(&stack[k], i);
+            }
+
+            if (apply_rows(w, next, &m, dims-1, ctx) < 0) {
+                return -1;
+            }
+        }
+
+        return 0;
+    }
+}
+
+static bool
+same_shape(const ndt_t *t, const ndt_t *u)
+{
+    while (t->tag == FixedDim) {
+        if (u->tag != FixedDim || u->FixedDim.shape != t->FixedDim.shape) {
+            return false;
+        }
+        t = t->FixedDim.type;
+        u = u->FixedDim.type;
+    }
+
+    return u->tag != FixedDim;
+}
+
+/*
+ * Apply an elementwise kernel to the elements where the boolean 'mask' is
+ * true.  The other elements of the outputs are not written.  The arguments
+ * must be fixed arrays after broadcasting, and the mask must have the shape
+ * of the outputs.
+ */
+int
+gm_apply_where(const gm_kernel_t *kernel, xnd_t stack[], int outer_dims,
+               const xnd_t *mask, ndt_context_t *ctx)
+{
+    const int nargs = (int)kernel->set->sig->Function.nargs;
+    gm_trace_event_t event = {
+      GM_TRACE_APPLY, NULL, kernel->set, kernel->flag, stack, nargs, -1, 0, 0 };
+    const ndt_t *dtype = ndt_dtype(mask->type);
+    where_t w;
+    int ret;
+
+    if (!gm_is_elementwise(kernel)) {
+        ndt_err_format(ctx, NDT_NotImplementedError,
+            "where: a mask is only supported for elementwise functions");
+        return -1;
+    }
+
+    if (dtype->tag != Bool || ndt_is_optional(dtype) ||
+        !ndt_is_ndarray(mask->type)) {
+        ndt_err_format(ctx, NDT_TypeError,
+            "where: mask must be a fixed array with dtype bool");
+        return -1;
+    }
+
+    for (int k = 0; k < nargs; k++) {
+        if (!ndt_is_ndarray(stack[k].type) || stack[k].type->ndim != outer_dims) {
+            ndt_err_format(ctx, NDT_NotImplementedError,
+                "where: arguments must be fixed arrays");
+            return -1;
+        }
+    }
+
+    if (nargs == 0 || mask->type->ndim != outer_dims ||
+        !same_shape(mask->type, stack[nargs-1].type)) {
+        ndt_err_format(ctx, NDT_ValueError,
+            "where: mask shape does not match the output shape");
+        return -1;
+    }
+
+    if (outer_dims == 0) {
+        return *mask->ptr ? gm_apply_nostats(kernel, stack, 0, ctx) : 0;
+    }
+
+    w.kernel = kernel;
+    w.nargs = nargs;
+    w.cache = ndt_calloc(nargs * (RUN_CACHE+1), sizeof *w.cache);
+    if (w.cache == NULL) {
+        (void)ndt_memory_error(ctx);
+        return -1;
+    }
+
+    gm_trace_begin(&event);
+    ret = apply_rows(&w, stack, mask, outer_dims, ctx);
+    gm_trace_end(&event);
+
+    for (int i = 0; i < nargs * (RUN_CACHE+1); i++) {
+        if (w.cache[i] != NULL) {
+            ndt_decref(w.cache[i]);
+        }
+    }
+    ndt_free(w.cache);
+
+    return ret;
+}
@@ -64,6 +64,8 @@ array_shape_check(xnd_t *x, const int64_t shape, ndt_context_t *ctx)
             return -1;
         }
 
+        /* The data is owned by the master buffer of 'x' and released with
+           ndt_aligned_free(), so it cannot be taken from the buffer pool. */
         char *data = ndt_aligned_calloc(t->align, size);
         if (data == NULL) {
             ndt_err_format(ctx, NDT_MemoryError, "out of memory");
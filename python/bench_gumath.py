@@ -0,0 +1,424 @@
+#
+# BSD 3-Clause License
+#
+# Copyright (c) 2017-2018, plures
+# All rights reserved.
+#
+# Redistribution and use in source and binary forms, with or without
+# modification, are permitted provided that the following conditions are met:
+#
+# 1. Redistributions of source code must retain the above copyright notice,
+#    this list of conditions and the following disclaimer.
+#
+# 2. Redistributions in binary form must reproduce the above copyright notice,
+#    this list of conditions and the following disclaimer in the documentation
+#    and/or other materials provided with the distribution.
+#
+# 3. Neither the name of the copyright holder nor the names of its
+#    contributors may be used to endorse or promote products derived from
+#    this software without specific prior written permission.
+#
+# THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+# AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+# IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+# DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+# FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+# DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+# SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+# CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+# OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+# OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+#
+
+# Benchmarks comparing gumath.functions with NumPy ufuncs.
+#
+# The classes follow the conventions of asv (airspeed velocity): 'params',
+# 'param_names', 'setup' and 'time_*' methods.  They can be used from an
+# asv benchmark directory, but the script also has a self-contained runner
+# that only needs the standard library:
+#
+#   python3 bench_gumath.py                 # all benchmarks
+#   python3 bench_gumath.py -k Elementwise  # benchmarks matching a regex
+#   python3 bench_gumath.py --json new.json --compare old.json
+#
+# Every benchmark has a 'time_gumath' method.  'time_numpy' is the NumPy
+# baseline, which is skipped if NumPy is not installed.  For optional types
+# and ragged arrays NumPy has no direct equivalent: the baselines are masked
+# arrays and a loop over a list of arrays.
+
+import gumath as gm
+import gumath.functions as fn
+from xnd import xnd
+import sys, re, json, timeit
+import platform
+import argparse
+
+try:
+    import numpy as np
+except ImportError:
+    np = None
+
+
+SMALL = 1000
+LARGE = 1000000
+
+
+def _prod(shape):
+    n = 1
+    for v in shape:
+        n *= v
+    return n
+
+def _array(shape, dtype):
+    """Return an xnd array with values in [1, 100] and the corresponding
+       NumPy array (or None)."""
+    if isinstance(shape, int):
+        shape = (shape,)
+    if np is not None:
+        a = (np.arange(_prod(shape)) % 100 + 1).astype(dtype).reshape(shape)
+        return xnd.from_buffer(a), a
+    conv = float if dtype.startswith("float") else int
+    def build(shape, start):
+        if len(shape) == 1:
+            return [conv((start + i) % 100 + 1) for i in range(shape[0])]
+        step = _prod(shape[1:])
+        return [build(shape[1:], start + i * step) for i in range(shape[0])]
+    return xnd(build(shape, 0), dtype=dtype), None
+
+
+# ==============================================================================
+#                                Call overhead
+# ==============================================================================
+
+class TimeCallOverhead:
+    """Calls on 0-d and single element arrays: dominated by dispatch."""
+
+    params = [["add", "multiply", "sin"], [0, 1]]
+    param_names = ["func", "ndim"]
+
+    def setup(self, func, ndim):
+        self.gf = getattr(fn, func)
+        self.nin = 1 if func == "sin" else 2
+        if ndim == 0:
+            self.x = xnd(1.5)
+            self.a = np.float64(1.5) if np is not None else None
+        else:
+            self.x = xnd([1.5])
+            self.a = np.array([1.5]) if np is not None else None
+        if np is not None:
+            self.uf = getattr(np, func)
+
+    def time_gumath(self, func, ndim):
+        if self.nin == 1:
+            self.gf(self.x)
+        else:
+            self.gf(self.x, self.x)
+
+    def time_numpy(self, func, ndim):
+        if self.nin == 1:
+            self.uf(self.a)
+        else:
+            self.uf(self.a, self.a)
+
+
+# ==============================================================================
+#                                 Elementwise
+# ==============================================================================
+
+class TimeElementwise:
+    """Throughput of unary and binary kernels on contiguous arrays."""
+
+    params = [["add", "multiply", "sin", "sqrt"],
+              ["float32", "float64", "int64"],
+              [SMALL, LARGE]]
+    param_names = ["func", "dtype", "size"]
+
+    def setup(self, func, dtype, size):
+        if dtype == "int64" and func in ("sin", "sqrt"):
+            raise NotImplementedError("float functions only")
+        self.gf = getattr(fn, func)
+        self.nin = 1 if func in ("sin", "sqrt") else 2
+        self.x, self.a = _array(size, dtype)
+        self.y, self.b = _array(size, dtype)
+        if np is not None:
+            self.uf = getattr(np, func)
+
+    def time_gumath(self, func, dtype, size):
+        if self.nin == 1:
+            self.gf(self.x)
+        else:
+            self.gf(self.x, self.y)
+
+    def time_numpy(self, func, dtype, size):
+        if self.nin == 1:
+            self.uf(self.a)
+        else:
+            self.uf(self.a, self.b)
+
+
+class TimeStrided:
+    """Elementwise kernels on every second element."""
+
+    params = [["add", "sin"], [SMALL, LARGE]]
+    param_names = ["func", "size"]
+
+    def setup(self, func, size):
+        x, a = _array(2 * size, "float64")
+        self.x = x[::2]
+        self.a = a[::2] if a is not None else None
+        self.gf = getattr(fn, func)
+        if np is not None:
+            self.uf = getattr(np, func)
+
+    def time_gumath(self, func, size):
+        if func == "sin":
+            self.gf(self.x)
+        else:
+            self.gf(self.x, self.x)
+
+    def time_numpy(self, func, size):
+        if func == "sin":
+            self.uf(self.a)
+        else:
+            self.uf(self.a, self.a)
+
+
+# ==============================================================================
+#                                 Broadcasting
+# ==============================================================================
+
+class TimeBroadcast:
+    """Binary kernels with a scalar, a row and a column operand."""
+
+    params = [["scalar", "row", "column"], [100, 1000]]
+    param_names = ["operand", "n"]
+
+    def setup(self, operand, n):
+        self.x, self.a = _array((n, n), "float64")
+        if operand == "scalar":
+            self.y = xnd(2.0)
+            self.b = np.float64(2.0) if np is not None else None
+        elif operand == "row":
+            self.y, self.b = _array(n, "float64")
+        else:
+            self.y, self.b = _array((n, 1), "float64")
+
+    def time_gumath(self, operand, n):
+        fn.multiply(self.x, self.y)
+
+    def time_numpy(self, operand, n):
+        np.multiply(self.a, self.b)
+
+
+# ==============================================================================
+#                                  Reductions
+# ==============================================================================
+
+class TimeReduction:
+    """gumath.reduce (a fold over gufuncs) against ufunc.reduce."""
+
+    params = [["add", "multiply"], [0, 1, None], [100, 1000]]
+    param_names = ["func", "axes", "n"]
+
+    def setup(self, func, axes, n):
+        self.x, self.a = _array((n, n), "float64")
+        self.gf = getattr(fn, func)
+        if np is not None:
+            self.uf = getattr(np, func)
+
+    def time_gumath(self, func, axes, n):
+        gm.reduce(self.gf, self.x, axes=axes)
+
+    def time_numpy(self, func, axes, n):
+        self.uf.reduce(self.a, axis=axes)
+
+
+# ==============================================================================
+#                       Optional types and ragged arrays
+# ==============================================================================
+
+class TimeOptional:
+    """Kernels on ?float64 with every tenth value missing.
+
+       The NumPy baseline uses masked arrays."""
+
+    params = [["add", "sin"], [SMALL, LARGE]]
+    param_names = ["func", "size"]
+
+    def setup(self, func, size):
+        values = [None if i % 10 == 0 else float(i % 100) for i in range(size)]
+        self.x = xnd(values, dtype="?float64")
+        if np is not None:
+            mask = [v is None for v in values]
+            self.a = np.ma.masked_array([0.0 if v is None else v for v in values],
+                                        mask=mask)
+        self.gf = getattr(fn, func)
+        if np is not None:
+            self.uf = getattr(np.ma, func)
+
+    def time_gumath(self, func, size):
+        if func == "sin":
+            self.gf(self.x)
+        else:
+            self.gf(self.x, self.x)
+
+    def time_numpy(self, func, size):
+        if func == "sin":
+            self.uf(self.a)
+        else:
+            self.uf(self.a, self.a)
+
+
+class TimeRagged:
+    """Kernels on var dimensions (rows of length 0 to 2*avg-1).
+
+       The NumPy baseline loops over a list of arrays."""
+
+    params = [["add", "sin"], [(1000, 10), (100, 1000)]]
+    param_names = ["func", "rows_x_avg"]
+
+    def setup(self, func, shape):
+        rows, avg = shape
+        data = [[float(j) for j in range((i * 7919) % (2 * avg))]
+                for i in range(rows)]
+        self.x = xnd(data, dtype="float64")
+        if np is not None:
+            self.a = [np.array(r, dtype="float64") for r in data]
+        self.gf = getattr(fn, func)
+        if np is not None:
+            self.uf = getattr(np, func)
+
+    def time_gumath(self, func, shape):
+        if func == "sin":
+            self.gf(self.x)
+        else:
+            self.gf(self.x, self.x)
+
+    def time_numpy(self, func, shape):
+        if func == "sin":
+            [self.uf(r) for r in self.a]
+        else:
+            [self.uf(r, r) for r in self.a]
+
+
+ALL_BENCHMARKS = [
+  TimeCallOverhead,
+  TimeElementwise,
+  TimeStrided,
+  TimeBroadcast,
+  TimeReduction,
+  TimeOptional,
+  TimeRagged,
+]
+
+
+# ==============================================================================
+#                                    Runner
+# ==============================================================================
+
+def _product(params):
+    if not params:
+        yield ()
+        return
+    for v in params[0]:
+        for rest in _product(params[1:]):
+            yield (v,) + rest
+
+def _timeit(f, args, min_time, repeat):
+    """Minimum time per call in seconds."""
+    timer = timeit.Timer(lambda: f(*args))
+    number = 1
+    while True:
+        t = timer.timeit(number)
+        if t >= min_time / repeat:
+            break
+        number *= 2
+    return min([t] + timer.repeat(repeat - 1, number)) / number
+
+def run(pattern=None, min_time=0.2, repeat=5):
+    """Yield (name, {'gumath': t, 'numpy': t}) for each benchmark."""
+    for cls in ALL_BENCHMARKS:
+        for params in _product(cls.params):
+            name = "%s(%s)" % (cls.__name__,
+                               ", ".join("%s=%s" % (k, v) for k, v in
+                                         zip(cls.param_names, params)))
+            if pattern and not re.search(pattern, name):
+                continue
+
+            bench = cls()
+            try:
+                bench.setup(*params)
+            except NotImplementedError:
+                continue
+
+            result = {}
+            result['gumath'] = _timeit(bench.time_gumath, params, min_time, repeat)
+            if np is not None:
+                result['numpy'] = _timeit(bench.time_numpy, params, min_time, repeat)
+
+            yield name, result
+
+def _fmt(t):
+    for unit, scale in (("s", 1), ("ms", 1e3), ("us", 1e6)):
+        if t >= 1 / scale:
+            return "%8.3f %-2s" % (t * scale, unit)
+    return "%8.3f ns" % (t * 1e9)
+
+
+if __name__ == '__main__':
+    parser = argparse.ArgumentParser(description="gumath benchmarks")
+    parser.add_argument("-k", dest="pattern", default=None,
+                        help="only run benchmarks matching the regular expression")
+    parser.add_argument("--quick", action="store_true",
+                        help="shorter measurements, less accurate")
+    parser.add_argument("--threads", type=int, default=None,
+                        help="gumath.set_max_threads() for the run")
+    parser.add_argument("--json", default=None,
+                        help="write the results to a json file")
+    parser.add_argument("--compare", default=None,
+                        help="json file of an earlier run: report regressions")
+    parser.add_argument("--threshold", type=float, default=1.2,
+                        help="ratio new/old that counts as a regression")
+    args = parser.parse_args()
+
+    if args.threads is not None:
+        gm.set_max_threads(args.threads)
+
+    old = {}
+    if args.compare:
+        with open(args.compare) as f:
+            old = json.load(f)['results']
+
+    min_time, repeat = (0.02, 3) if args.quick else (0.2, 5)
+    results = {}
+    regressions = []
+
+    print("%-64s %11s %11s %7s %7s" % ("benchmark", "gumath", "numpy",
+                                       "ratio", "change"))
+    for name, r in run(args.pattern, min_time, repeat):
+        results[name] = r
+        g = r['gumath']
+        line = "%-64s %11s" % (name, _fmt(g))
+        line += " %11s %7.2f" % (_fmt(r['numpy']), g / r['numpy']) \
+                if 'numpy' in r else " %11s %7s" % ("-", "-")
+        if name in old:
+            change = g / old[name]['gumath']
+            line += " %7.2f" % change
+            if change > args.threshold:
+                regressions.append((name, change))
+        print(line)
+        sys.stdout.flush()
+
+    if args.json:
+        with open(args.json, "w") as f:
+            json.dump({'machine': platform.machine(),
+                       'python': platform.python_version(),
+                       'max_threads': gm.get_max_threads(),
+                       'results': results}, f, indent=2, sort_keys=True)
+
+    if regressions:
+        print("\nregressions (new/old > %.2f):" % args.threshold)
+        for name, change in regressions:
+            print("  %-64s %7.2f" % (name, change))
+
+    sys.exit(1 if regressions else 0)
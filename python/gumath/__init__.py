@@ -33,7 +33,11 @@
 from ndtypes import ndt
 from xnd import xnd
 from ._gumath import *
+from ._gumath import _set_deferred_hook, _set_deferring, _set_await_hook
+from ._gumath import _block_view
+from ._gumath import _arrow_export, _arrow_import
 from . import functions as _fn
+import threading as _threading
 
 try:
     from . import cuda as _cd
@@ -41,8 +45,17 @@ except ImportError:
     _cd = None
 
 
-__all__ = ['cuda', 'fold', 'functions', 'get_max_threads', 'gufunc', 'reduce',
-           'set_max_threads', 'unsafe_add_kernel', 'vfold', 'xndvectorize']
+__all__ = ['ArrowArray', 'Expr', 'Future', 'TaskGraph', 'clear_kernel_stats',
+           'clear_pool', 'cpu_isa', 'cuda', 'deferred', 'evaluate', 'fold',
+           'from_arrow', 'functions', 'get_executor', 'get_kernel_stats',
+           'get_max_threads', 'get_numa', 'get_pool_stats', 'get_reduce_block',
+           'get_reserved_threads', 'get_thread_cutoff', 'get_yield_chunk',
+           'gufunc', 'reduce', 'set_executor', 'set_kernel_counters',
+           'set_kernel_stats', 'set_max_threads', 'set_numa', 'set_pool_cap',
+           'set_reduce_block', 'set_reserved_threads', 'set_thread_cutoff',
+           'set_yield_chunk', 'stream_apply', 'task_graph', 'to_arrow',
+           'trace_start', 'trace_stop', 'unsafe_add_kernel', 'vfold',
+           'xndvectorize']
 
 
 # ==============================================================================
@@ -90,6 +103,60 @@ def _copyto(dest, value):
     x = xnd(value, dtype=dest.dtype)
     _fn.copy(x, out=dest)
 
+_reduce_block = 0
+
+def get_reduce_block():
+    """Return the block size of deterministic reductions (0 if disabled)."""
+    return _reduce_block
+
+def set_reduce_block(n):
+    """Enable deterministic reductions with partial results over blocks of
+       'n' elements, or disable them if 'n' is 0."""
+    global _reduce_block
+    if not isinstance(n, int):
+        raise TypeError("block size must be an integer")
+    if n < 0:
+        raise ValueError("block size must be non-negative")
+    _reduce_block = n
+
+def _fixed_extent(t):
+    try:
+        return t.shape[0]
+    except (TypeError, ValueError):
+        return None
+
+def _reduce_blocks(f, T, dtype, block):
+    """Reduce the first dimension of T.  Block i accumulates the elements
+       [i*block, (i+1)*block) in order, all full blocks in one fold over a
+       strided view, and the partial results are combined by repeatedly
+       folding the upper half onto the lower half.  The folds run serially
+       and the combining calls are elementwise over the blocks, so the
+       result does not depend on the number of threads."""
+    n = _fixed_extent(T.type)
+    t = T.type.at(1, dtype=dtype)
+    acc = T.empty(t, device=T.device)
+
+    if n is None or n <= block:
+        _copyto(acc, f.identity)
+        return fold(f, acc, T)
+
+    m = (n + block - 1) // block
+    k = n // block
+    p = T.empty(ndt("%d * %s" % (m, t)), device=T.device)
+    _copyto(p, f.identity)
+
+    fold(f, p[0:k], _block_view(T, block))
+    if k < m:
+        fold(f, p[k], T[k*block:n])
+
+    while m > 1:
+        h = m // 2
+        f(p[0:h], p[m-h:m], out=p[0:h])
+        m -= h
+
+    _fn.copy(p[0], out=acc)
+    return acc
+
 def reduce_cpu(f, x, axes, dtype):
     """NumPy's reduce in terms of fold."""
     axes = _get_axes(axes, x.ndim)
@@ -102,6 +169,11 @@ def reduce_cpu(f, x, axes, dtype):
     T = x.transpose(permute=permute)
 
     N = len(axes)
+    if _reduce_block > 0 and f.identity is not None:
+        for _ in range(N):
+            T = _reduce_blocks(f, T, dtype, _reduce_block)
+        return T
+
     t = T.type.at(N, dtype=dtype)
     acc = x.empty(t, device=x.device)
 
@@ -181,6 +253,271 @@ maxcast = {
 }
 
 
+# ==============================================================================
+#                              Arrow interchange
+# ==============================================================================
+
+class ArrowArray(object):
+    """Zero-copy export of an xnd array, or of a dict of columns as a record
+       batch, through the Arrow PyCapsule interface."""
+
+    def __init__(self, data):
+        self.data = data
+
+    def __arrow_c_array__(self, requested_schema=None):
+        return _arrow_export(self.data)
+
+def to_arrow(data):
+    return ArrowArray(data)
+
+def from_arrow(obj):
+    if hasattr(obj, "__arrow_c_array__"):
+        obj = obj.__arrow_c_array__()
+    schema, array = obj
+    return _arrow_import(schema, array)
+
+
+# ==============================================================================
+#                             Asynchronous calls
+# ==============================================================================
+
+def _await_future(future):
+    """Return the iterator for 'await future'.  The completion descriptor of
+       the future wakes up the event loop, so no thread waits for the call."""
+    import asyncio
+    loop = asyncio.get_event_loop()
+    waiter = loop.create_future()
+
+    def resolve():
+        if waiter.done():
+            return
+        try:
+            waiter.set_result(future.result())
+        except Exception as e:
+            waiter.set_exception(e)
+
+    if future.done():
+        resolve()
+        return waiter.__await__()
+
+    fd = future.fileno()
+
+    def wakeup():
+        loop.remove_reader(fd)
+        resolve()
+
+    try:
+        loop.add_reader(fd, wakeup)
+    except NotImplementedError:
+        # Event loops without reader support, e.g. the Windows proactor.
+        return loop.run_in_executor(None, future.result).__await__()
+
+    waiter.add_done_callback(lambda _: loop.remove_reader(fd))
+    return waiter.__await__()
+
+_set_await_hook(_await_future)
+
+
+# ==============================================================================
+#                     Deferred evaluation with kernel fusion
+# ==============================================================================
+
+# Inside a 'deferred()' block gufunc calls return 'Expr' nodes instead of
+# results.  'evaluate()' runs maximal chains of elementwise kernels block by
+# block along the outer dimension, so that intermediate results live in
+# small scratch buffers that are reused for every block.
+
+_BLOCK_SIZE = 256 * 1024
+_LEAF, _NODE = 0, 1
+
+# The hook is installed once.  The C module only calls it in threads that
+# have enabled deferral with '_set_deferring()', calls in other threads do
+# not pay for it.
+_deferred_state = _threading.local()
+
+
+def _update_deferring(depth, suspended):
+    _deferred_state.depth = depth
+    _deferred_state.suspended = suspended
+    _set_deferring(depth > 0 and suspended == 0)
+
+class _suspended(object):
+    """Execute gufunc calls eagerly, even inside a 'deferred()' block."""
+    def __enter__(self):
+        _update_deferring(getattr(_deferred_state, 'depth', 0),
+                          getattr(_deferred_state, 'suspended', 0) + 1)
+    def __exit__(self, *exc):
+        _update_deferring(_deferred_state.depth, _deferred_state.suspended - 1)
+
+def _defer(f, args, kwargs):
+    if kwargs or f.nout != 1:
+        args = [evaluate(a) for a in args]
+        with _suspended():
+            return f(*args, **(kwargs or {}))
+
+    return Expr(f, tuple(args))
+
+_set_deferred_hook(_defer)
+
+
+class Expr(object):
+    """Deferred gufunc call with a single result."""
+
+    __slots__ = ('func', 'args', '_value')
+
+    def __init__(self, func, args):
+        self.func = func
+        self.args = args
+        self._value = None
+
+    def evaluate(self, block_size=None):
+        return evaluate(self, block_size=block_size)
+
+
+class deferred(object):
+    """Context manager: gufunc calls inside the block build an expression
+       graph that is computed by 'evaluate()'.  Calls with keyword arguments
+       or multiple return values are executed immediately."""
+
+    def __enter__(self):
+        _update_deferring(getattr(_deferred_state, 'depth', 0) + 1,
+                          getattr(_deferred_state, 'suspended', 0))
+        return self
+
+    def __exit__(self, *exc):
+        _update_deferring(_deferred_state.depth - 1, _deferred_state.suspended)
+
+
+def evaluate(x, block_size=None):
+    """Compute an expression graph.  Chains of elementwise kernels are fused
+       and run on blocks of about 'block_size' bytes per argument.  Other
+       values are returned unchanged."""
+    if not isinstance(x, Expr):
+        return x
+
+    if block_size is None:
+        block_size = _BLOCK_SIZE
+
+    with _suspended():
+        return _evaluate(x, block_size)
+
+def _evaluate(e, block_size):
+    if e._value is not None:
+        return e._value
+
+    if e.func.elementwise:
+        order, leaves = _fusion_region(e, block_size)
+        if len(order) > 1:
+            value = _evaluate_fused(order, leaves, block_size)
+            if value is not None:
+                e._value = value
+                return value
+
+    args = [_evaluate(a, block_size) if isinstance(a, Expr) else a for a in e.args]
+    e._value = e.func(*args)
+    return e._value
+
+def _fusion_region(root, block_size):
+    """Collect the elementwise nodes reachable from root in evaluation order.
+       Other nodes are computed first and become leaves of the region."""
+    order = []
+    leaves = []
+    index = {}
+
+    def leaf(x):
+        key = (_LEAF, id(x))
+        if key not in index:
+            index[key] = len(leaves)
+            leaves.append(x)
+        return (_LEAF, index[key])
+
+    def visit(e):
+        key = (_NODE, id(e))
+        if key in index:
+            return (_NODE, index[key])
+
+        spec = []
+        for a in e.args:
+            if not isinstance(a, Expr):
+                spec.append(leaf(a))
+            elif a._value is not None:
+                spec.append(leaf(a._value))
+            elif a.func.elementwise:
+                spec.append(visit(a))
+            else:
+                spec.append(leaf(_evaluate(a, block_size)))
+
+        index[key] = len(order)
+        order.append((e.func, spec))
+        return (_NODE, index[key])
+
+    visit(root)
+    return order, leaves
+
+def _evaluate_fused(order, leaves, block_size):
+    """Run the nodes in 'order' block by block.  Return None if the region
+       cannot be split along the outer dimension."""
+    try:
+        ndim = max(x.ndim for x in leaves)
+        shapes = [x.type.shape for x in leaves]
+    except (AttributeError, TypeError, ValueError):
+        return None
+
+    if ndim == 0:
+        return None
+
+    # Leaves with fewer dimensions or an outer dimension of 1 are broadcast.
+    N = None
+    sliced = []
+    rowsize = 1
+    for x, shape in zip(leaves, shapes):
+        if x.ndim == ndim and shape[0] != 1:
+            if N is None:
+                N = shape[0]
+            elif shape[0] != N:
+                return None
+            sliced.append(True)
+            rowsize = max(rowsize, x.type.datasize // shape[0])
+        else:
+            sliced.append(False)
+
+    if N is None:
+        return None
+
+    rows = max(1, block_size // rowsize)
+    if rows >= N:
+        return None
+
+    def block(start, stop):
+        return [x[start:stop] if s else x for x, s in zip(leaves, sliced)]
+
+    # The first block determines the types of the scratch buffers.
+    lv = block(0, rows)
+    scratch = []
+    for f, spec in order:
+        args = [lv[i] if kind == _LEAF else scratch[i] for kind, i in spec]
+        scratch.append(f(*args))
+
+    for v in scratch:
+        if v.ndim == 0 or v.type.shape[0] != rows:
+            return None
+
+    first = scratch[-1]
+    result = xnd.empty(ndt("%d * %s" % (N, first.type.at(1))))
+    _fn.copy(first, out=result[0:rows])
+
+    last = len(order) - 1
+    for start in range(rows, N, rows):
+        stop = min(start + rows, N)
+        buf = scratch if stop - start == rows else [v[0:stop-start] for v in scratch]
+        lv = block(start, stop)
+        for k, (f, spec) in enumerate(order):
+            args = [lv[i] if kind == _LEAF else buf[i] for kind, i in spec]
+            f(*args, out=result[start:stop] if k == last else buf[k])
+
+    return result
+
+
 # ==============================================================================
 #                         Numba's GUVectorize on xnd arrays
 # ==============================================================================
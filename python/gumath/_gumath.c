@@ -71,21 +71,106 @@
 const void *dummy = NULL;
 
 
+/****************************************************************************/
+/*                               Free threading                             */
+/****************************************************************************/
+
+/*
+ * With the GIL, the GIL protects all module state.  In free-threaded builds,
+ * fields that are read on every call use atomic loads, and the rarely
+ * changed process-wide values are protected by 'gumath_lock'.
+ */
+#ifdef Py_GIL_DISABLED
+  #define LOAD_PTR(p) _Py_atomic_load_ptr_acquire(p)
+  #define STORE_PTR(p, v) _Py_atomic_store_ptr_release(p, v)
+  #define LOAD_INT64(p) _Py_atomic_load_int64_relaxed(p)
+  #define STORE_INT64(p, v) _Py_atomic_store_int64_relaxed(p, v)
+  #define LOAD_INT(p) _Py_atomic_load_int_acquire(p)
+  #define STORE_INT(p, v) _Py_atomic_store_int_release(p, v)
+  #define CAS_INT(p, expected, v) _Py_atomic_compare_exchange_int(p, expected, v)
+
+  static PyMutex gumath_lock = {0};
+  #define GUMATH_LOCK() PyMutex_Lock(&gumath_lock)
+  #define GUMATH_UNLOCK() PyMutex_Unlock(&gumath_lock)
+#else
+  #define LOAD_PTR(p) (*(p))
+  #define STORE_PTR(p, v) (*(p) = (v))
+  #define LOAD_INT64(p) (*(p))
+  #define STORE_INT64(p, v) (*(p) = (v))
+  #define LOAD_INT(p) (*(p))
+  #define STORE_INT(p, v) (*(p) = (v))
+  #define CAS_INT(p, expected, v) \
+    (*(p) == *(expected) ? (*(p) = (v), 1) : (*(expected) = *(p), 0))
+
+  #define GUMATH_LOCK()
+  #define GUMATH_UNLOCK()
+#endif
+
+#ifndef Py_BEGIN_CRITICAL_SECTION
+  #define Py_BEGIN_CRITICAL_SECTION(op) {
+  #define Py_END_CRITICAL_SECTION() }
+#endif
+
+
 /****************************************************************************/
 /*                              Module globals                              */
 /****************************************************************************/
 
-/* Function table */
-static gm_tbl_t *table = NULL;
+/* Process-wide values, shared by all interpreters. */
+
+/* Python executor for parallel loops or NULL for the libgumath executor.
+   Only the main interpreter can set it. */
+static PyObject *executor = NULL;
+
+/* Kernel tables of all modules and interpreters, for resolving function
+   names in statistics */
+#define MAX_TABLES 16
+static const gm_tbl_t *tables[MAX_TABLES];
+static int ntables = 0;
+
+
+/* Per-interpreter module state */
+typedef struct {
+    /* Xnd type */
+    PyTypeObject *xnd;
+
+    /* Heap types of this module */
+    PyTypeObject *gufunc_type;
+    PyTypeObject *future_type;
+    PyTypeObject *pool_buffer_type;
+    PyTypeObject *arrow_owner_type;
+    PyTypeObject *graph_type;
 
-/* Xnd type */
-static PyTypeObject *xnd = NULL;
+    /* Kernels registered from Python in this interpreter */
+    gm_tbl_t *table;
 
-/* Empty positional arguments */
-static PyObject *positional_empty = NULL;
+    /* Empty positional arguments */
+    PyObject *positional_empty;
 
-/* Maximum number of threads */
-static int64_t max_threads = 1;
+    /* Maximum number of threads */
+    int64_t max_threads;
+
+    /* Called instead of the kernel while deferred evaluation is active */
+    PyObject *deferred_hook;
+
+    /* Thread-local: deferred evaluation is active in this thread */
+#if PY_VERSION_HEX >= 0x03070000
+    Py_tss_t *deferring;
+#endif
+
+    /* Returns the iterator for 'await future' */
+    PyObject *await_hook;
+
+    /* All hooks that have been installed.  Calls read the hooks without
+       locking, so replaced hooks stay alive until the module is cleared. */
+    PyObject *hooks;
+} gumath_state;
+
+static inline gumath_state *
+get_state(PyObject *m)
+{
+    return (gumath_state *)PyModule_GetState(m);
+}
 
 
 /****************************************************************************/
@@ -103,739 +188,3274 @@ seterr(ndt_context_t *ctx)
 /*                              Function object                             */
 /****************************************************************************/
 
-static PyTypeObject Gufunc_Type;
-
 static PyObject *
-gufunc_new(const gm_tbl_t *tbl, const char *name, const uint32_t flags)
+gufunc_new(PyObject *module, const gm_tbl_t *tbl, const char *name,
+           const uint32_t flags)
 {
     NDT_STATIC_CONTEXT(ctx);
     GufuncObject *self;
 
-    self = PyObject_New(GufuncObject, &Gufunc_Type);
+    self = PyObject_GC_New(GufuncObject, get_state(module)->gufunc_type);
     if (self == NULL) {
         return NULL;
     }
 
     self->tbl = tbl;
     self->flags = flags;
+    self->name = NULL;
+
+    self->identity = Py_None;
+    Py_INCREF(self->identity);
+
+    self->module = module;
+    Py_INCREF(self->module);
+
+    PyObject_GC_Track(self);
 
     self->name = ndt_strdup(name, &ctx);
     if (self->name == NULL) {
+        Py_DECREF(self);
         return seterr(&ctx);
     }
 
-    self->identity = Py_None;
-    Py_INCREF(self->identity);
-
     return (PyObject *)self;
 }
 
+static int
+gufunc_traverse(GufuncObject *self, visitproc visit, void *arg)
+{
+#if PY_VERSION_HEX >= 0x03090000
+    Py_VISIT(Py_TYPE(self));
+#endif
+    Py_VISIT(self->identity);
+    Py_VISIT(self->module);
+    return 0;
+}
+
+/* The module is needed by calls until the function is deallocated.  The
+   cycle through the module dict is broken by clearing the module. */
+static int
+gufunc_clear(GufuncObject *self)
+{
+    Py_CLEAR(self->identity);
+    return 0;
+}
+
 static void
 gufunc_dealloc(GufuncObject *self)
 {
+    PyTypeObject *tp = Py_TYPE(self);
+
+    PyObject_GC_UnTrack(self);
     ndt_free(self->name);
-    Py_DECREF(self->identity);
-    PyObject_Del(self);
+    Py_XDECREF(self->identity);
+    Py_XDECREF(self->module);
+    PyObject_GC_Del(self);
+#if PY_VERSION_HEX >= 0x03080000
+    Py_DECREF(tp);
+#else
+    (void)tp;
+#endif
 }
 
+static inline gumath_state *
+gufunc_state(const GufuncObject *self)
+{
+    return get_state(self->module);
+}
 
-/****************************************************************************/
-/*                              Function calls                              */
-/****************************************************************************/
+/* Python 3.6 has no thread specific storage API that can be reset, so the
+   flag is kept in the thread state dict there. */
+#if PY_VERSION_HEX < 0x03070000
+#define DEFERRING_KEY "_gumath.deferring"
+#endif
 
-static void
-clear_pystack(PyObject *pystack[], Py_ssize_t len)
+static inline bool
+get_deferring(gumath_state *st)
 {
-    for (Py_ssize_t i = 0; i < len; i++) {
-        Py_CLEAR(pystack[i]);
-    }
+#if PY_VERSION_HEX >= 0x03070000
+    return PyThread_tss_get(st->deferring) != NULL;
+#else
+    PyObject *dict = PyThreadState_GetDict();
+    (void)st;
+    return dict != NULL && PyDict_GetItemString(dict, DEFERRING_KEY) != NULL;
+#endif
 }
 
 static int
-parse_args(PyObject *pystack[NDT_MAX_ARGS], int *py_nin, int *py_nout, int *py_nargs,
-           PyObject *args, PyObject *out)
+set_deferring(gumath_state *st, bool flag)
 {
-    Py_ssize_t nin;
-    Py_ssize_t nout;
-
-    if (!args || !PyTuple_Check(args)) {
-        const char *name = args ? Py_TYPE(args)->tp_name : "NULL";
-        PyErr_Format(PyExc_SystemError,
-            "internal error: expected tuple, got '%.200s'", name);
+#if PY_VERSION_HEX >= 0x03070000
+    if (PyThread_tss_set(st->deferring, flag ? (void *)st : NULL) != 0) {
+        PyErr_SetString(PyExc_RuntimeError, "cannot set thread-local storage");
         return -1;
     }
-
-    nin = PyTuple_GET_SIZE(args);
-    if (nin > NDT_MAX_ARGS) {
-        PyErr_Format(PyExc_TypeError,
-            "maximum number of arguments is %d, got %n", NDT_MAX_ARGS, nin);
+    return 0;
+#else
+    PyObject *dict = PyThreadState_GetDict();
+    (void)st;
+    if (dict == NULL) {
+        PyErr_SetString(PyExc_RuntimeError, "no thread state dict");
         return -1;
     }
+    if (flag) {
+        return PyDict_SetItemString(dict, DEFERRING_KEY, Py_True);
+    }
+    if (PyDict_GetItemString(dict, DEFERRING_KEY) != NULL) {
+        return PyDict_DelItemString(dict, DEFERRING_KEY);
+    }
+    return 0;
+#endif
+}
 
-    for (Py_ssize_t i = 0; i < nin; i++) {
-        PyObject *v = PyTuple_GET_ITEM(args, i);
-        if (!Xnd_Check(v)) {
-            PyErr_Format(PyExc_TypeError,
-                "expected xnd argument, got '%.200s'", Py_TYPE(v)->tp_name);
-            return -1;
-        }
 
-        pystack[i] = v;
-    }
+/****************************************************************************/
+/*                               Future object                              */
+/****************************************************************************/
 
-    if (out == NULL) {
-        nout = 0;
-    }
-    else {
-        if (Xnd_Check(out)) {
-            nout = 1;
-            if (nin+nout > NDT_MAX_ARGS) {
-                PyErr_Format(PyExc_TypeError,
-                    "maximum number of arguments is %d, got %n", NDT_MAX_ARGS, nin+nout);
-                return -1;
-            }
-            pystack[nin] = out;
-        }
-        else if (PyTuple_Check(out)) {
-            nout = PyTuple_GET_SIZE(out);
-            if (nout > NDT_MAX_ARGS || nin+nout > NDT_MAX_ARGS) {
-                PyErr_Format(PyExc_TypeError,
-                    "maximum number of arguments is %d, got %n", NDT_MAX_ARGS, nin+nout);
-                return -1;
-            }
+typedef struct {
+    PyObject_HEAD
+    void *future;     /* gm_future_t, NULL if the call has finished */
+    PyObject *args;   /* arguments that must stay alive during the call */
+    PyObject *result;
+    PyObject *module; /* _gumath module of the creating interpreter */
+} FutureObject;
 
-            for (Py_ssize_t i = 0; i < nout; i++) {
-                PyObject *v = PyTuple_GET_ITEM(out, i);
-                if (!Xnd_Check(v)) {
-                    PyErr_Format(PyExc_TypeError,
-                        "expected xnd argument, got '%.200s'", Py_TYPE(v)->tp_name);
-                    return -1;
-                }
+/* Steals the references to 'args' and 'result'. */
+static PyObject *
+future_new(PyObject *module, void *future, PyObject *args, PyObject *result)
+{
+    FutureObject *self;
 
-                pystack[nin+i] = v;
-            }
-        }
-        else {
-            PyErr_Format(PyExc_TypeError,
-                "'out' argument must be xnd or a tuple of xnd, got '%.200s'",
-                Py_TYPE(out)->tp_name);
-            return -1;
-        }
+    self = PyObject_New(FutureObject, get_state(module)->future_type);
+    if (self == NULL) {
+    #ifdef HAVE_PTHREAD_H
+        Py_BEGIN_ALLOW_THREADS
+        gm_future_del(future);
+        Py_END_ALLOW_THREADS
+    #endif
+        Py_XDECREF(args);
+        Py_DECREF(result);
+        return NULL;
     }
 
-    for (int i = 0; i < nin+nout; i++) {
-        Py_INCREF(pystack[i]);
-    }
+    self->future = future;
+    self->args = args;
+    self->result = result;
+    self->module = module;
+    Py_INCREF(module);
 
-    *py_nin = (int)nin;
-    *py_nout = (int)nout;
-    *py_nargs = (int)nin+(int)nout;
+    return (PyObject *)self;
+}
 
-    return 0;
+static void
+future_dealloc(FutureObject *self)
+{
+    PyTypeObject *tp = Py_TYPE(self);
+
+#ifdef HAVE_PTHREAD_H
+    if (self->future != NULL) {
+        Py_BEGIN_ALLOW_THREADS
+        gm_future_del(self->future);
+        Py_END_ALLOW_THREADS
+    }
+#endif
+    Py_XDECREF(self->args);
+    Py_DECREF(self->result);
+    Py_DECREF(self->module);
+    PyObject_Del(self);
+#if PY_VERSION_HEX >= 0x03080000
+    Py_DECREF(tp);
+#else
+    (void)tp;
+#endif
 }
 
 static PyObject *
-_gufunc_call(GufuncObject *self, PyObject *args, PyObject *kwargs,
-             bool enable_threads, bool check_broadcast)
+future_done(FutureObject *self, PyObject *args UNUSED)
 {
-    static char *kwlist[] = {"out", "dtype", "cls", NULL};
-    PyObject *out = Py_None;
-    PyObject *dt = Py_None;
-    PyObject *cls = Py_None;
+#ifdef HAVE_PTHREAD_H
+    if (self->future != NULL) {
+        return PyBool_FromLong(gm_future_done(self->future));
+    }
+#endif
+    Py_RETURN_TRUE;
+}
 
-    NDT_STATIC_CONTEXT(ctx);
-    PyObject *pystack[NDT_MAX_ARGS];
-    xnd_t stack[NDT_MAX_ARGS];
-    const ndt_t *types[NDT_MAX_ARGS];
-    int64_t li[NDT_MAX_ARGS];
-    ndt_apply_spec_t spec = ndt_apply_spec_empty;
-    gm_kernel_t kernel;
-    bool have_cpu_device = false;
-    ndt_t *dtype = NULL;
-    int nin, nout, nargs;
-    int k;
+static PyObject *
+future_result(FutureObject *self, PyObject *args UNUSED)
+{
+#ifdef HAVE_PTHREAD_H
+    if (self->future != NULL) {
+        NDT_STATIC_CONTEXT(ctx);
+        int ret;
 
-    if (!PyArg_ParseTupleAndKeywords(positional_empty, kwargs, "|$OOO", kwlist,
-                                     &out, &dt, &cls)) {
-        return NULL;
+        Py_BEGIN_ALLOW_THREADS
+        ret = gm_future_wait(self->future, &ctx);
+        Py_END_ALLOW_THREADS
+
+        if (ret < 0) {
+            return seterr(&ctx);
+        }
     }
+#endif
 
-    out = out == Py_None ? NULL : out;
-    dt = dt == Py_None ? NULL : dt;
-    cls = cls == Py_None ? (PyObject *)xnd : cls;
+    Py_INCREF(self->result);
+    return self->result;
+}
 
-    if (dt != NULL) {
-        if (out != NULL) {
-            PyErr_SetString(PyExc_TypeError,
-                "the 'out' and 'dtype' arguments are mutually exclusive");
-            return NULL;
-        }
-        if (!Ndt_Check(dt)) {
-            PyErr_Format(PyExc_TypeError,
-                "'dtype' argument must be ndt, got '%.200s'",
-                Py_TYPE(dt)->tp_name);
-                return NULL;
+static PyObject *
+future_fileno(FutureObject *self, PyObject *args UNUSED)
+{
+#ifdef HAVE_PTHREAD_H
+    if (self->future != NULL) {
+        NDT_STATIC_CONTEXT(ctx);
+        const int fd = gm_future_fd(self->future, &ctx);
+        if (fd < 0) {
+            return seterr(&ctx);
         }
-        dtype = (ndt_t *)NDT(dt);
-        ndt_incref(dtype);
+        return PyLong_FromLong(fd);
     }
+#endif
 
-    if (!PyType_Check(cls) || !PyType_IsSubtype((PyTypeObject *)cls, xnd)) {
-        PyErr_SetString(PyExc_TypeError,
-            "the 'cls' argument must be a subtype of 'xnd'");
-        return NULL;
-    }
+    PyErr_SetString(PyExc_ValueError,
+        "future has finished and has no completion descriptor");
+    return NULL;
+}
 
-    if (parse_args(pystack, &nin, &nout, &nargs, args, out) < 0) {
+static PyObject *
+future_await(FutureObject *self)
+{
+    PyObject *hook = LOAD_PTR(&get_state(self->module)->await_hook);
+
+    if (hook == NULL) {
+        PyErr_SetString(PyExc_RuntimeError, "await hook is not installed");
         return NULL;
     }
-    assert(nout == 0 || dtype == NULL);
 
-    for (k = 0; k < nargs; k++) {
-        const XndObject *x = (XndObject *)pystack[k];
-        if (!(x->mblock->xnd->flags&XND_CUDA_MANAGED)) {
-            have_cpu_device = true;
-        }
+    return PyObject_CallFunctionObjArgs(hook, (PyObject *)self, NULL);
+}
 
-        stack[k] = *CONST_XND((PyObject *)x);
-        types[k] = stack[k].type;
-        li[k] = stack[k].index;
-    }
 
-    if (have_cpu_device) {
-        if (self->flags & GM_CUDA_MANAGED_FUNC) {
-            PyErr_SetString(PyExc_ValueError,
-                "cannot run a cuda function on xnd objects with cpu memory");
-            clear_pystack(pystack, nargs);
-            return NULL;
-        }
-    }
+static PyMethodDef future_methods [] =
+{
+  { "done", (PyCFunction)future_done, METH_NOARGS, NULL },
+  { "result", (PyCFunction)future_result, METH_NOARGS, NULL },
+  { "fileno", (PyCFunction)future_fileno, METH_NOARGS, NULL },
+  { NULL, NULL, 1 }
+};
 
-    kernel = gm_select(&spec, self->tbl, self->name, types, li, nin, nout,
-                       nout && check_broadcast, stack, &ctx);
-    if (kernel.set == NULL) {
-        return seterr(&ctx);
-    }
+/* Each interpreter creates its own heap types from the specs. */
+#ifdef Py_TPFLAGS_IMMUTABLETYPE
+  #define GM_TPFLAGS_IMMUTABLE Py_TPFLAGS_IMMUTABLETYPE
+#else
+  #define GM_TPFLAGS_IMMUTABLE 0
+#endif
 
-    if (dtype) {
-        if (spec.nout != 1) {
-            ndt_err_format(&ctx, NDT_TypeError,
-                "the 'dtype' argument is only supported for a single "
-                "return value");
-            ndt_apply_spec_clear(&spec);
-            ndt_decref(dtype);
-            return seterr(&ctx);
-        }
+static PyType_Slot future_slots[] = {
+  { Py_tp_dealloc, (void *)future_dealloc },
+  { Py_am_await, (void *)future_await },
+  { Py_tp_hash, (void *)PyObject_HashNotImplemented },
+  { Py_tp_getattro, (void *)PyObject_GenericGetAttr },
+  { Py_tp_methods, (void *)future_methods },
+  { 0, NULL }
+};
 
-        const ndt_t *u = spec.types[spec.nin];
-        const ndt_t *v = ndt_copy_contiguous_dtype(u, dtype, 0, &ctx);
+static PyType_Spec future_spec = {
+    .name = "_gumath.Future",
+    .basicsize = sizeof(FutureObject),
+    .flags = Py_TPFLAGS_DEFAULT|GM_TPFLAGS_IMMUTABLE,
+    .slots = future_slots
+};
 
-        ndt_apply_spec_clear(&spec);
-        ndt_decref(dtype);
 
-        if (v == NULL) {
-            return seterr(&ctx);
-        }
+/****************************************************************************/
+/*                               Pooled outputs                             */
+/****************************************************************************/
 
-        types[nin] = v;
-        kernel = gm_select(&spec, self->tbl, self->name, types, li, nin, 1,
-                           1 && check_broadcast, stack, &ctx);
-        if (kernel.set == NULL) {
-            return seterr(&ctx);
-        }
+/*
+ * Inferred outputs that the kernel writes in full are taken from the buffer
+ * pool without zero-filling.  A PoolBuffer owns the pooled container and
+ * exports it through the buffer protocol, and the output is an xnd view of
+ * the buffer with the output type, so the block returns to the pool when the
+ * last view is deallocated.  Buffer slots in type specs need Python 3.9.
+ */
+#if PY_VERSION_HEX >= 0x03090000
+/* Smaller outputs are cheaper to allocate with xnd than to wrap. */
+#define POOL_MIN_OUTPUT (64 * 1024)
+
+typedef struct {
+    PyObject_HEAD
+    xnd_t xnd; /* pooled container, see gm_pool_xnd_empty() */
+} PoolBufferObject;
+
+static void
+pool_buffer_dealloc(PoolBufferObject *self)
+{
+    PyTypeObject *tp = Py_TYPE(self);
+
+    if (self->xnd.type != NULL) {
+        gm_pool_xnd_del(&self->xnd);
     }
+    PyObject_Del(self);
+    Py_DECREF(tp);
+}
 
-    /*
-     * Replace args/kwargs types with types after substitution and broadcasting.
-     * This includes 'out' types, if explicitly passed as kwargs.
-     */
-    for (int i = 0; i < spec.nargs; i++) {
-        stack[i].type = spec.types[i];
+static int
+pool_buffer_getbuffer(PoolBufferObject *self, Py_buffer *view, int flags)
+{
+    return PyBuffer_FillInfo(view, (PyObject *)self, self->xnd.ptr,
+                             self->xnd.type->datasize, 0, flags);
+}
+
+static PyType_Slot pool_buffer_slots[] = {
+  { Py_tp_dealloc, (void *)pool_buffer_dealloc },
+  { Py_bf_getbuffer, (void *)pool_buffer_getbuffer },
+  { 0, NULL }
+};
+
+static PyType_Spec pool_buffer_spec = {
+    .name = "_gumath.PoolBuffer",
+    .basicsize = sizeof(PoolBufferObject),
+    .flags = Py_TPFLAGS_DEFAULT|GM_TPFLAGS_IMMUTABLE,
+    .slots = pool_buffer_slots
+};
+
+static PyObject *
+pool_output(gumath_state *st, PyObject *cls, const ndt_t *t)
+{
+    NDT_STATIC_CONTEXT(ctx);
+    PoolBufferObject *buf;
+    PyObject *x, *v;
+
+    buf = PyObject_New(PoolBufferObject, st->pool_buffer_type);
+    if (buf == NULL) {
+        return NULL;
     }
+    buf->xnd.ptr = NULL;
+    buf->xnd.type = NULL;
 
-    if (nout == 0) {
-        /* 'out' types have been inferred, create new XndObjects. */
-        for (int i = 0; i < spec.nout; i++) {
-            if (ndt_is_concrete(spec.types[nin+i])) {
-                uint32_t flags = self->flags == GM_CUDA_MANAGED_FUNC ? XND_CUDA_MANAGED : 0;
-                PyObject *x = Xnd_EmptyFromType((PyTypeObject *)cls, spec.types[nin+i], flags);
-                if (x == NULL) {
-                    clear_pystack(pystack, nin+i);
-                    ndt_apply_spec_clear(&spec);
-                return NULL;
-            }
-            pystack[nin+i] = x;
-            stack[nin+i] = *CONST_XND(x);
-            }
-            else {
-                clear_pystack(pystack, nin+i);
-                ndt_apply_spec_clear(&spec);
-                PyErr_SetString(PyExc_ValueError,
-                    "arguments with abstract types are temporarily disabled");
-                return NULL;
-            }
-        }
+    if (gm_pool_xnd_empty(&buf->xnd, t, &ctx) < 0) {
+        Py_DECREF(buf);
+        return seterr(&ctx);
     }
 
-    if (self->flags == GM_CUDA_MANAGED_FUNC) {
-    #if HAVE_CUDA
-        if (!check_broadcast) {
-            ndt_err_format(&ctx, NDT_NotImplementedError,
-               "fold() is currently not supported on cuda");
-            clear_pystack(pystack, spec.nargs);
-            ndt_apply_spec_clear(&spec);
-            return seterr(&ctx);
+    x = PyObject_CallMethod(cls, "from_buffer", "O", (PyObject *)buf);
+    Py_DECREF(buf);
+    if (x == NULL) {
+        return NULL;
+    }
+
+    ndt_incref(t);
+    v = Xnd_ViewMoveNdt(x, (ndt_t *)t);
+    Py_DECREF(x);
+
+    return v;
+}
+#endif
+
+/*
+ * New output of type 't'.  'full' is true if the kernel writes every
+ * element, which is assumed for elementwise kernels without a 'where' mask.
+ * Otherwise the output is zero-filled.
+ */
+static PyObject *
+new_output(gumath_state *st, PyObject *cls, const ndt_t *t, uint32_t flags,
+           bool full)
+{
+#if PY_VERSION_HEX >= 0x03090000
+    if (full && flags == 0 && t->datasize >= POOL_MIN_OUTPUT &&
+        t->align <= GM_POOL_ALIGN && ndt_is_ndarray(t) &&
+        !ndt_is_optional(ndt_dtype(t))) {
+        return pool_output(st, cls, t);
+    }
+#else
+    (void)st;
+    (void)full;
+#endif
+
+    return Xnd_EmptyFromType((PyTypeObject *)cls, t, flags);
+}
+
+
+/****************************************************************************/
+/*                             Arrow interchange                            */
+/****************************************************************************/
+
+/*
+ * Arrow arrays are exchanged as the PyCapsules "arrow_schema" and
+ * "arrow_array" of the Arrow PyCapsule interface.  Exported arrays hold a
+ * reference to the xnd objects until the consumer releases them.
+ */
+
+static void
+arrow_schema_capsule_del(PyObject *capsule)
+{
+    struct ArrowSchema *schema = PyCapsule_GetPointer(capsule, "arrow_schema");
+
+    if (schema->release != NULL) {
+        schema->release(schema);
+    }
+    PyMem_Free(schema);
+}
+
+static void
+arrow_array_capsule_del(PyObject *capsule)
+{
+    struct ArrowArray *array = PyCapsule_GetPointer(capsule, "arrow_array");
+
+    if (array->release != NULL) {
+        array->release(array);
+    }
+    PyMem_Free(array);
+}
+
+/* Consumers may release exported arrays in any thread. */
+static void
+arrow_release_pyobject(void *owner)
+{
+    PyGILState_STATE gstate = PyGILState_Ensure();
+    Py_DECREF((PyObject *)owner);
+    PyGILState_Release(gstate);
+}
+
+static int
+arrow_export_array(struct ArrowSchema *schema, struct ArrowArray *array,
+                   PyObject *x)
+{
+    NDT_STATIC_CONTEXT(ctx);
+
+    if (!Xnd_Check(x)) {
+        PyErr_Format(PyExc_TypeError,
+            "_arrow_export: expected xnd instance or dict, got '%.200s'",
+            Py_TYPE(x)->tp_name);
+        return -1;
+    }
+
+    Py_INCREF(x);
+    if (gm_arrow_export_view(schema, array, CONST_XND(x),
+                             arrow_release_pyobject, x, &ctx) < 0) {
+        Py_DECREF(x);
+        (void)seterr(&ctx);
+        return -1;
+    }
+
+    return 0;
+}
+
+static int
+arrow_export_batch(struct ArrowSchema *schema, struct ArrowArray *array,
+                   PyObject *dict)
+{
+    NDT_STATIC_CONTEXT(ctx);
+    PyObject *items;
+    const char **names = NULL;
+    xnd_t *columns = NULL;
+    void **owners = NULL;
+    Py_ssize_t n;
+    int ret = -1;
+
+    items = PyDict_Items(dict);
+    if (items == NULL) {
+        return -1;
+    }
+    n = PyList_GET_SIZE(items);
+
+    names = PyMem_Calloc(n == 0 ? 1 : n, sizeof *names);
+    columns = PyMem_Calloc(n == 0 ? 1 : n, sizeof *columns);
+    owners = PyMem_Calloc(n == 0 ? 1 : n, sizeof *owners);
+    if (names == NULL || columns == NULL || owners == NULL) {
+        PyErr_NoMemory();
+        goto out;
+    }
+
+    for (Py_ssize_t i = 0; i < n; i++) {
+        PyObject *item = PyList_GET_ITEM(items, i);
+        PyObject *name = PyTuple_GET_ITEM(item, 0);
+        PyObject *x = PyTuple_GET_ITEM(item, 1);
+
+        if (!PyUnicode_Check(name) || !Xnd_Check(x)) {
+            PyErr_SetString(PyExc_TypeError,
+                "_arrow_export: record batches must map str to xnd");
+            goto out;
         }
 
-        const int ret = gm_apply(&kernel, stack, spec.outer_dims, &ctx);
+        names[i] = PyUnicode_AsUTF8(name);
+        if (names[i] == NULL) {
+            goto out;
+        }
+        columns[i] = *CONST_XND(x);
+        owners[i] = x;
+    }
 
-        if (xnd_cuda_device_synchronize(&ctx) < 0 || ret < 0) {
-            clear_pystack(pystack, spec.nargs);
-            ndt_apply_spec_clear(&spec);
-            return seterr(&ctx);
+    for (Py_ssize_t i = 0; i < n; i++) {
+        Py_INCREF((PyObject *)owners[i]);
+    }
+
+    ret = gm_arrow_export_batch_view(schema, array, names, columns, n,
+                                     arrow_release_pyobject, owners, &ctx);
+    if (ret < 0) {
+        for (Py_ssize_t i = 0; i < n; i++) {
+            Py_DECREF((PyObject *)owners[i]);
         }
-    #else
-        ndt_err_format(&ctx, NDT_RuntimeError,
-           "internal error: GM_CUDA_MANAGED_FUNC set in a build without cuda support");
-        clear_pystack(pystack, spec.nargs);
-        ndt_apply_spec_clear(&spec);
-        return seterr(&ctx);
-    #endif
+        (void)seterr(&ctx);
+    }
+
+out:
+    PyMem_Free(names);
+    PyMem_Free(columns);
+    PyMem_Free(owners);
+    Py_DECREF(items);
+    return ret;
+}
+
+/* Export an xnd array or a dict of columns as (schema, array) capsules. */
+static PyObject *
+arrow_export(PyObject *m UNUSED, PyObject *data)
+{
+    struct ArrowSchema *schema;
+    struct ArrowArray *array;
+    PyObject *schema_capsule, *array_capsule, *res;
+    int ret;
+
+    schema = PyMem_Malloc(sizeof *schema);
+    if (schema == NULL) {
+        return PyErr_NoMemory();
+    }
+    schema->release = NULL;
+
+    schema_capsule = PyCapsule_New(schema, "arrow_schema", arrow_schema_capsule_del);
+    if (schema_capsule == NULL) {
+        PyMem_Free(schema);
+        return NULL;
+    }
+
+    array = PyMem_Malloc(sizeof *array);
+    if (array == NULL) {
+        Py_DECREF(schema_capsule);
+        return PyErr_NoMemory();
+    }
+    array->release = NULL;
+
+    array_capsule = PyCapsule_New(array, "arrow_array", arrow_array_capsule_del);
+    if (array_capsule == NULL) {
+        PyMem_Free(array);
+        Py_DECREF(schema_capsule);
+        return NULL;
+    }
+
+    if (PyDict_Check(data)) {
+        ret = arrow_export_batch(schema, array, data);
     }
     else {
-    #ifdef HAVE_PTHREAD_H
-        const int rounding = fegetround();
-        fesetround(FE_TONEAREST);
+        ret = arrow_export_array(schema, array, data);
+    }
 
-        const int64_t N = enable_threads ? max_threads : 1;
-        const int ret = gm_apply_thread(&kernel, stack, spec.outer_dims, N,
-                                        &ctx);
-        fesetround(rounding);
+    if (ret < 0) {
+        Py_DECREF(schema_capsule);
+        Py_DECREF(array_capsule);
+        return NULL;
+    }
 
-        if (ret < 0) {
-            clear_pystack(pystack, spec.nargs);
-            ndt_apply_spec_clear(&spec);
-            return seterr(&ctx);
-        }
-    #else
-        const int rounding = fegetround();
-        fesetround(FE_TONEAREST);
+    res = PyTuple_Pack(2, schema_capsule, array_capsule);
+    Py_DECREF(schema_capsule);
+    Py_DECREF(array_capsule);
+    return res;
+}
 
-        const int ret = gm_apply(&kernel, stack, spec.outer_dims, &ctx);
+/*
+ * Imported views borrow the Arrow buffers.  The ArrowArray is moved into an
+ * ArrowOwner, which releases it when the last view is deallocated.  Like
+ * PoolBuffer, the owner is attached to the views through the buffer protocol.
+ */
+#if PY_VERSION_HEX >= 0x03090000
+typedef struct {
+    PyObject_HEAD
+    struct ArrowArray array;
+} ArrowOwnerObject;
 
-        fesetround(rounding);
+static void
+arrow_owner_dealloc(ArrowOwnerObject *self)
+{
+    PyTypeObject *tp = Py_TYPE(self);
 
-        if (ret < 0) {
-            clear_pystack(pystack, spec.nargs);
-            ndt_apply_spec_clear(&spec);
-            return seterr(&ctx);
-        }
-    #endif
+    if (self->array.release != NULL) {
+        self->array.release(&self->array);
     }
+    PyObject_Del(self);
+    Py_DECREF(tp);
+}
 
-    nin = spec.nin;
-    nout = spec.nout;
-    nargs = spec.nargs;
-    ndt_apply_spec_clear(&spec);
+/* The exported buffer is empty, the views are redirected to the Arrow data. */
+static int
+arrow_owner_getbuffer(ArrowOwnerObject *self, Py_buffer *view, int flags)
+{
+    return PyBuffer_FillInfo(view, (PyObject *)self, &self->array, 0, 0, flags);
+}
 
-    switch (nout) {
-    case 0: {
-        clear_pystack(pystack, nargs);
-        Py_RETURN_NONE;
+static PyType_Slot arrow_owner_slots[] = {
+  { Py_tp_dealloc, (void *)arrow_owner_dealloc },
+  { Py_bf_getbuffer, (void *)arrow_owner_getbuffer },
+  { 0, NULL }
+};
+
+static PyType_Spec arrow_owner_spec = {
+    .name = "_gumath.ArrowOwner",
+    .basicsize = sizeof(ArrowOwnerObject),
+    .flags = Py_TPFLAGS_DEFAULT|GM_TPFLAGS_IMMUTABLE,
+    .slots = arrow_owner_slots
+};
+
+/* New xnd object for the view 'x', steals the reference to x->type. */
+static PyObject *
+arrow_view(gumath_state *st, ArrowOwnerObject *owner, const xnd_t *x)
+{
+    PyObject *b, *v;
+
+    b = PyObject_CallMethod((PyObject *)st->xnd, "from_buffer", "O",
+                            (PyObject *)owner);
+    if (b == NULL) {
+        ndt_decref(x->type);
+        return NULL;
     }
-    case 1: {
-        clear_pystack(pystack, nin);
-        return pystack[nin];
+
+    v = Xnd_ViewMoveNdt(b, (ndt_t *)x->type);
+    Py_DECREF(b);
+    if (v == NULL) {
+        return NULL;
     }
-    default: {
-        PyObject *tuple = PyTuple_New(nout);
-        if (tuple == NULL) {
-            clear_pystack(pystack, nargs);
+
+    XND(v)->bitmap = x->bitmap;
+    XND(v)->index = x->index;
+    XND(v)->ptr = x->ptr;
+
+    return v;
+}
+
+static PyObject *
+arrow_import_batch(gumath_state *st, ArrowOwnerObject *owner,
+                   const struct ArrowSchema *schema)
+{
+    NDT_STATIC_CONTEXT(ctx);
+    PyObject *dict;
+
+    dict = PyDict_New();
+    if (dict == NULL) {
+        return NULL;
+    }
+
+    for (int64_t i = 0; i < schema->n_children; i++) {
+        const char *name = schema->children[i]->name;
+        PyObject *v;
+        xnd_t x;
+        int ret;
+
+        if (gm_arrow_import_column(&x, schema, &owner->array, i, &ctx) < 0) {
+            Py_DECREF(dict);
+            return seterr(&ctx);
+        }
+
+        v = arrow_view(st, owner, &x);
+        if (v == NULL) {
+            Py_DECREF(dict);
             return NULL;
         }
-        for (int i = 0; i < nout; i++) {
-            PyTuple_SET_ITEM(tuple, i, pystack[nin+i]);
+
+        if (name == NULL || name[0] == '\0') {
+            PyObject *key = PyUnicode_FromFormat("%lld", (long long)i);
+            if (key == NULL) {
+                Py_DECREF(v);
+                Py_DECREF(dict);
+                return NULL;
+            }
+            ret = PyDict_SetItem(dict, key, v);
+            Py_DECREF(key);
         }
-        return tuple;
-      }
+        else {
+            ret = PyDict_SetItemString(dict, name, v);
+        }
+
+        Py_DECREF(v);
+        if (ret < 0) {
+            Py_DECREF(dict);
+            return NULL;
+        }
+    }
+
+    return dict;
+}
+#endif
+
+/*
+ * View of the (schema, array) capsules.  Struct arrays are returned as a
+ * dict of column views.  The array capsule is consumed.
+ */
+static PyObject *
+arrow_import(PyObject *m, PyObject *args)
+{
+#if PY_VERSION_HEX >= 0x03090000
+    NDT_STATIC_CONTEXT(ctx);
+    gumath_state *st = get_state(m);
+    PyObject *schema_capsule, *array_capsule, *res;
+    struct ArrowSchema *schema;
+    struct ArrowArray *array;
+    ArrowOwnerObject *owner;
+
+    if (!PyArg_ParseTuple(args, "OO", &schema_capsule, &array_capsule)) {
+        return NULL;
+    }
+
+    schema = PyCapsule_GetPointer(schema_capsule, "arrow_schema");
+    if (schema == NULL) {
+        return NULL;
+    }
+
+    array = PyCapsule_GetPointer(array_capsule, "arrow_array");
+    if (array == NULL) {
+        return NULL;
+    }
+
+    if (array->release == NULL) {
+        PyErr_SetString(PyExc_ValueError,
+            "_arrow_import: the arrow array has already been consumed");
+        return NULL;
+    }
+
+    owner = PyObject_New(ArrowOwnerObject, st->arrow_owner_type);
+    if (owner == NULL) {
+        return NULL;
+    }
+    owner->array = *array;
+    array->release = NULL;
+
+    if (schema->format != NULL && strcmp(schema->format, "+s") == 0) {
+        res = arrow_import_batch(st, owner, schema);
+    }
+    else {
+        xnd_t x;
+        if (gm_arrow_import(&x, schema, &owner->array, &ctx) < 0) {
+            res = seterr(&ctx);
+        }
+        else {
+            res = arrow_view(st, owner, &x);
+        }
+    }
+
+    Py_DECREF(owner);
+    return res;
+#else
+    (void)m;
+    (void)args;
+    PyErr_SetString(PyExc_NotImplementedError,
+        "_arrow_import: importing arrow arrays needs Python 3.9");
+    return NULL;
+#endif
+}
+
+
+/****************************************************************************/
+/*                             Task graph object                            */
+/****************************************************************************/
+
+typedef struct {
+    PyObject_HEAD
+    gm_graph_t *graph;
+    PyObject *args;   /* arguments of the nodes, which must stay alive */
+    PyObject *module; /* _gumath module of the creating interpreter */
+} GraphObject;
+
+
+/****************************************************************************/
+/*                              Function calls                              */
+/****************************************************************************/
+
+static void
+clear_pystack(PyObject *pystack[], Py_ssize_t len)
+{
+    for (Py_ssize_t i = 0; i < len; i++) {
+        Py_CLEAR(pystack[i]);
+    }
+}
+
+static int
+parse_args(PyObject *pystack[NDT_MAX_ARGS], int *py_nin, int *py_nout, int *py_nargs,
+           PyObject *args, PyObject *out)
+{
+    Py_ssize_t nin;
+    Py_ssize_t nout;
+
+    if (!args || !PyTuple_Check(args)) {
+        const char *name = args ? Py_TYPE(args)->tp_name : "NULL";
+        PyErr_Format(PyExc_SystemError,
+            "internal error: expected tuple, got '%.200s'", name);
+        return -1;
+    }
+
+    nin = PyTuple_GET_SIZE(args);
+    if (nin > NDT_MAX_ARGS) {
+        PyErr_Format(PyExc_TypeError,
+            "maximum number of arguments is %d, got %n", NDT_MAX_ARGS, nin);
+        return -1;
+    }
+
+    for (Py_ssize_t i = 0; i < nin; i++) {
+        PyObject *v = PyTuple_GET_ITEM(args, i);
+        if (!Xnd_Check(v)) {
+            PyErr_Format(PyExc_TypeError,
+                "expected xnd argument, got '%.200s'", Py_TYPE(v)->tp_name);
+            return -1;
+        }
+
+        pystack[i] = v;
+    }
+
+    if (out == NULL) {
+        nout = 0;
+    }
+    else {
+        if (Xnd_Check(out)) {
+            nout = 1;
+            if (nin+nout > NDT_MAX_ARGS) {
+                PyErr_Format(PyExc_TypeError,
+                    "maximum number of arguments is %d, got %n", NDT_MAX_ARGS, nin+nout);
+                return -1;
+            }
+            pystack[nin] = out;
+        }
+        else if (PyTuple_Check(out)) {
+            nout = PyTuple_GET_SIZE(out);
+            if (nout > NDT_MAX_ARGS || nin+nout > NDT_MAX_ARGS) {
+                PyErr_Format(PyExc_TypeError,
+                    "maximum number of arguments is %d, got %n", NDT_MAX_ARGS, nin+nout);
+                return -1;
+            }
+
+            for (Py_ssize_t i = 0; i < nout; i++) {
+                PyObject *v = PyTuple_GET_ITEM(out, i);
+                if (!Xnd_Check(v)) {
+                    PyErr_Format(PyExc_TypeError,
+                        "expected xnd argument, got '%.200s'", Py_TYPE(v)->tp_name);
+                    return -1;
+                }
+
+                pystack[nin+i] = v;
+            }
+        }
+        else {
+            PyErr_Format(PyExc_TypeError,
+                "'out' argument must be xnd or a tuple of xnd, got '%.200s'",
+                Py_TYPE(out)->tp_name);
+            return -1;
+        }
+    }
+
+    for (int i = 0; i < nin+nout; i++) {
+        Py_INCREF(pystack[i]);
+    }
+
+    *py_nin = (int)nin;
+    *py_nout = (int)nout;
+    *py_nargs = (int)nin+(int)nout;
+
+    return 0;
+}
+
+/* Add a node to 'g'.  The graph keeps the arguments alive until it is deallocated. */
+static int
+graph_add(GraphObject *g, const gm_kernel_t *kernel, PyObject *pystack[],
+          const xnd_t stack[], int nargs, int outer_dims, ndt_context_t *ctx)
+{
+    const Py_ssize_t n = PyList_GET_SIZE(g->args);
+    PyObject *keep;
+    int ret;
+
+    keep = PyTuple_New(nargs);
+    if (keep == NULL) {
+        ndt_err_format(ctx, NDT_MemoryError, "out of memory");
+        return -1;
+    }
+    for (int i = 0; i < nargs; i++) {
+        Py_INCREF(pystack[i]);
+        PyTuple_SET_ITEM(keep, i, pystack[i]);
+    }
+
+    ret = PyList_Append(g->args, keep);
+    Py_DECREF(keep);
+    if (ret < 0) {
+        PyErr_Clear();
+        ndt_err_format(ctx, NDT_MemoryError, "out of memory");
+        return -1;
+    }
+
+    if (gm_graph_add(g->graph, kernel, stack, outer_dims, ctx) < 0) {
+        (void)PyList_SetSlice(g->args, n, n+1, NULL);
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * Apply the function, or with 'submit' start the call and return a Future.
+ * With 'graph', the call is added as a node and the outputs are written
+ * when the graph runs.
+ */
+static PyObject *
+_gufunc_call(GufuncObject *self, PyObject *args, PyObject *kwargs,
+             bool enable_threads, bool check_broadcast, bool submit,
+             GraphObject *graph)
+{
+    static char *kwlist[] = {"out", "dtype", "cls", "where", NULL};
+    gumath_state *st = gufunc_state(self);
+    PyObject *out = Py_None;
+    PyObject *dt = Py_None;
+    PyObject *cls = Py_None;
+    PyObject *where = Py_None;
+
+    NDT_STATIC_CONTEXT(ctx);
+    PyObject *pystack[NDT_MAX_ARGS];
+    xnd_t stack[NDT_MAX_ARGS];
+    const ndt_t *types[NDT_MAX_ARGS];
+    int64_t li[NDT_MAX_ARGS];
+    ndt_apply_spec_t spec = ndt_apply_spec_empty;
+    gm_kernel_t kernel;
+    bool have_cpu_device = false;
+    ndt_t *dtype = NULL;
+    bool serial = false;
+    void *future = NULL;
+    PyObject *keep = NULL;
+    PyObject *res;
+    int nin, nout, nargs;
+    int k;
+
+    if (!PyArg_ParseTupleAndKeywords(st->positional_empty, kwargs, "|$OOOO", kwlist,
+                                     &out, &dt, &cls, &where)) {
+        return NULL;
+    }
+
+    out = out == Py_None ? NULL : out;
+    dt = dt == Py_None ? NULL : dt;
+    cls = cls == Py_None ? (PyObject *)st->xnd : cls;
+    where = where == Py_None ? NULL : where;
+
+    if (where != NULL) {
+        if (!Xnd_Check(where)) {
+            PyErr_Format(PyExc_TypeError,
+                "'where' argument must be xnd, got '%.200s'",
+                Py_TYPE(where)->tp_name);
+            return NULL;
+        }
+        if (submit || graph != NULL || self->flags & GM_CUDA_MANAGED_FUNC) {
+            PyErr_SetString(PyExc_NotImplementedError,
+                "the 'where' argument is only supported for cpu calls");
+            return NULL;
+        }
+    }
+
+    if (graph != NULL && self->flags & GM_CUDA_MANAGED_FUNC) {
+        PyErr_SetString(PyExc_NotImplementedError,
+            "task graphs are only supported for cpu functions");
+        return NULL;
+    }
+
+    if (dt != NULL) {
+        if (out != NULL) {
+            PyErr_SetString(PyExc_TypeError,
+                "the 'out' and 'dtype' arguments are mutually exclusive");
+            return NULL;
+        }
+        if (!Ndt_Check(dt)) {
+            PyErr_Format(PyExc_TypeError,
+                "'dtype' argument must be ndt, got '%.200s'",
+                Py_TYPE(dt)->tp_name);
+                return NULL;
+        }
+        dtype = (ndt_t *)NDT(dt);
+        ndt_incref(dtype);
+    }
+
+    if (!PyType_Check(cls) || !PyType_IsSubtype((PyTypeObject *)cls, st->xnd)) {
+        PyErr_SetString(PyExc_TypeError,
+            "the 'cls' argument must be a subtype of 'xnd'");
+        return NULL;
+    }
+
+    if (parse_args(pystack, &nin, &nout, &nargs, args, out) < 0) {
+        return NULL;
+    }
+    assert(nout == 0 || dtype == NULL);
+
+    for (k = 0; k < nargs; k++) {
+        const XndObject *x = (XndObject *)pystack[k];
+        if (!(x->mblock->xnd->flags&XND_CUDA_MANAGED)) {
+            have_cpu_device = true;
+        }
+
+        stack[k] = *CONST_XND((PyObject *)x);
+        types[k] = stack[k].type;
+        li[k] = stack[k].index;
+    }
+
+    if (have_cpu_device) {
+        if (self->flags & GM_CUDA_MANAGED_FUNC) {
+            PyErr_SetString(PyExc_ValueError,
+                "cannot run a cuda function on xnd objects with cpu memory");
+            clear_pystack(pystack, nargs);
+            return NULL;
+        }
+    }
+
+    kernel = gm_select(&spec, self->tbl, self->name, types, li, nin, nout,
+                       nout && check_broadcast, stack, &ctx);
+    if (kernel.set == NULL) {
+        return seterr(&ctx);
+    }
+
+    if (dtype) {
+        if (spec.nout != 1) {
+            ndt_err_format(&ctx, NDT_TypeError,
+                "the 'dtype' argument is only supported for a single "
+                "return value");
+            ndt_apply_spec_clear(&spec);
+            ndt_decref(dtype);
+            return seterr(&ctx);
+        }
+
+        const ndt_t *u = spec.types[spec.nin];
+        const ndt_t *v = ndt_copy_contiguous_dtype(u, dtype, 0, &ctx);
+
+        ndt_apply_spec_clear(&spec);
+        ndt_decref(dtype);
+
+        if (v == NULL) {
+            return seterr(&ctx);
+        }
+
+        types[nin] = v;
+        kernel = gm_select(&spec, self->tbl, self->name, types, li, nin, 1,
+                           1 && check_broadcast, stack, &ctx);
+        if (kernel.set == NULL) {
+            return seterr(&ctx);
+        }
+    }
+
+    /*
+     * Resolve memory overlap between inputs and explicitly passed outputs.
+     * Overlapping inputs that cannot be read in place are replaced by copies.
+     */
+    if (nout > 0) {
+        xnd_t views[NDT_MAX_ARGS];
+        int plan[NDT_MAX_ARGS];
+        int action;
+
+        for (int i = 0; i < spec.nargs; i++) {
+            views[i] = stack[i];
+            views[i].type = spec.types[i];
+        }
+
+        action = gm_overlap_plan(plan, &kernel, views, spec.nin, spec.nout);
+        if (action == GM_OVERLAP_COPY) {
+            ndt_apply_spec_clear(&spec);
+
+            for (int i = 0; i < nin; i++) {
+                if (plan[i] == GM_OVERLAP_COPY) {
+                    PyObject *x = PyObject_CallMethod(pystack[i], "copy_contiguous", NULL);
+                    if (x == NULL) {
+                        clear_pystack(pystack, nargs);
+                        return NULL;
+                    }
+                    Py_DECREF(pystack[i]);
+                    pystack[i] = x;
+
+                    stack[i] = *CONST_XND(x);
+                    types[i] = stack[i].type;
+                    li[i] = stack[i].index;
+                    plan[i] = GM_OVERLAP_NONE;
+                }
+                else if (plan[i] == GM_OVERLAP_SERIAL) {
+                    serial = true;
+                }
+            }
+
+            kernel = gm_select(&spec, self->tbl, self->name, types, li, nin, nout,
+                               check_broadcast, stack, &ctx);
+            if (kernel.set == NULL) {
+                clear_pystack(pystack, nargs);
+                return seterr(&ctx);
+            }
+        }
+        else if (action == GM_OVERLAP_SERIAL) {
+            serial = true;
+        }
+    }
+
+    /*
+     * Replace args/kwargs types with types after substitution and broadcasting.
+     * This includes 'out' types, if explicitly passed as kwargs.
+     */
+    for (int i = 0; i < spec.nargs; i++) {
+        stack[i].type = spec.types[i];
+    }
+
+    if (nout == 0) {
+        /* 'out' types have been inferred, create new XndObjects. */
+        for (int i = 0; i < spec.nout; i++) {
+            if (ndt_is_concrete(spec.types[nin+i])) {
+                uint32_t flags = self->flags == GM_CUDA_MANAGED_FUNC ? XND_CUDA_MANAGED : 0;
+                gm_trace_event_t event = {
+                  GM_TRACE_ALLOC, self->name, kernel.set, kernel.flag, NULL, 0, -1, 0, 0 };
+                gm_trace_begin(&event);
+                PyObject *x = new_output(st, cls, spec.types[nin+i], flags,
+                                         where == NULL && gm_is_elementwise(&kernel));
+                gm_trace_end(&event);
+                if (x == NULL) {
+                    clear_pystack(pystack, nin+i);
+                    ndt_apply_spec_clear(&spec);
+                return NULL;
+            }
+            pystack[nin+i] = x;
+            stack[nin+i] = *CONST_XND(x);
+            }
+            else {
+                clear_pystack(pystack, nin+i);
+                ndt_apply_spec_clear(&spec);
+                PyErr_SetString(PyExc_ValueError,
+                    "arguments with abstract types are temporarily disabled");
+                return NULL;
+            }
+        }
+    }
+
+    if (self->flags == GM_CUDA_MANAGED_FUNC) {
+    #if HAVE_CUDA
+        if (!check_broadcast) {
+            ndt_err_format(&ctx, NDT_NotImplementedError,
+               "fold() is currently not supported on cuda");
+            clear_pystack(pystack, spec.nargs);
+            ndt_apply_spec_clear(&spec);
+            return seterr(&ctx);
+        }
+
+        const int ret = gm_apply(&kernel, stack, spec.outer_dims, &ctx);
+
+        if (xnd_cuda_device_synchronize(&ctx) < 0 || ret < 0) {
+            clear_pystack(pystack, spec.nargs);
+            ndt_apply_spec_clear(&spec);
+            return seterr(&ctx);
+        }
+    #else
+        ndt_err_format(&ctx, NDT_RuntimeError,
+           "internal error: GM_CUDA_MANAGED_FUNC set in a build without cuda support");
+        clear_pystack(pystack, spec.nargs);
+        ndt_apply_spec_clear(&spec);
+        return seterr(&ctx);
+    #endif
+    }
+    else {
+    #ifdef HAVE_PTHREAD_H
+        const int rounding = fegetround();
+        fesetround(FE_TONEAREST);
+
+        const int64_t N = enable_threads && !serial ? LOAD_INT64(&st->max_threads) : 1;
+
+        int ret;
+        if (graph != NULL) {
+            ret = graph_add(graph, &kernel, pystack, stack, spec.nargs,
+                            spec.outer_dims, &ctx);
+        }
+        else if (where != NULL) {
+            ret = gm_apply_where(&kernel, stack, spec.outer_dims, CONST_XND(where), &ctx);
+        }
+        else if (submit) {
+            future = gm_apply_async(&kernel, stack, spec.outer_dims, N, &ctx);
+            ret = future == NULL ? -1 : 0;
+        }
+        else {
+            ret = gm_apply_thread(&kernel, stack, spec.outer_dims, N, &ctx);
+        }
+        fesetround(rounding);
+
+        if (ret < 0) {
+            clear_pystack(pystack, spec.nargs);
+            ndt_apply_spec_clear(&spec);
+            return seterr(&ctx);
+        }
+    #else
+        const int rounding = fegetround();
+        fesetround(FE_TONEAREST);
+
+        const int ret = graph != NULL
+            ? graph_add(graph, &kernel, pystack, stack, spec.nargs, spec.outer_dims, &ctx)
+            : where != NULL
+            ? gm_apply_where(&kernel, stack, spec.outer_dims, CONST_XND(where), &ctx)
+            : gm_apply(&kernel, stack, spec.outer_dims, &ctx);
+
+        fesetround(rounding);
+
+        if (ret < 0) {
+            clear_pystack(pystack, spec.nargs);
+            ndt_apply_spec_clear(&spec);
+            return seterr(&ctx);
+        }
+    #endif
+    }
+
+    nin = spec.nin;
+    nout = spec.nout;
+    nargs = spec.nargs;
+    ndt_apply_spec_clear(&spec);
+
+    /* A pending call keeps all arguments alive until it has finished. */
+    if (future != NULL) {
+        keep = PyTuple_New(nargs);
+        if (keep == NULL) {
+            clear_pystack(pystack, nargs);
+            res = NULL;
+            goto finish;
+        }
+        for (int i = 0; i < nargs; i++) {
+            Py_INCREF(pystack[i]);
+            PyTuple_SET_ITEM(keep, i, pystack[i]);
+        }
+    }
+
+    switch (nout) {
+    case 0: {
+        clear_pystack(pystack, nargs);
+        res = Py_None;
+        Py_INCREF(res);
+        break;
+    }
+    case 1: {
+        clear_pystack(pystack, nin);
+        res = pystack[nin];
+        break;
+    }
+    default: {
+        res = PyTuple_New(nout);
+        if (res == NULL) {
+            clear_pystack(pystack, nargs);
+            break;
+        }
+        for (int i = 0; i < nout; i++) {
+            PyTuple_SET_ITEM(res, i, pystack[nin+i]);
+        }
+        break;
+      }
+    }
+
+finish:
+    if (res == NULL) {
+    #ifdef HAVE_PTHREAD_H
+        Py_BEGIN_ALLOW_THREADS
+        gm_future_del(future);
+        Py_END_ALLOW_THREADS
+    #endif
+        Py_XDECREF(keep);
+        return NULL;
+    }
+
+    if (submit) {
+        return future_new(self->module, future, keep, res);
+    }
+
+    return res;
+}
+
+static PyObject *
+gufunc_call(GufuncObject *self, PyObject *args, PyObject *kwargs)
+{
+    gumath_state *st = gufunc_state(self);
+    PyObject *hook = get_deferring(st) ? LOAD_PTR(&st->deferred_hook) : NULL;
+
+    if (hook != NULL) {
+        PyObject *res = PyObject_CallFunctionObjArgs(hook,
+                            (PyObject *)self, args, kwargs ? kwargs : Py_None,
+                            NULL);
+        if (res != Py_NotImplemented) {
+            return res;
+        }
+        Py_DECREF(res);
+    }
+
+    return _gufunc_call(self, args, kwargs, true, true, false, NULL);
+}
+
+static PyObject *
+gufunc_submit(GufuncObject *self, PyObject *args, PyObject *kwargs)
+{
+    return _gufunc_call(self, args, kwargs, true, true, true, NULL);
+}
+
+/* Store the inputs of the items of 'seq' in 'in', return the number of inputs. */
+static int
+map_inputs(xnd_t **in, PyObject *seq)
+{
+    const Py_ssize_t n = PyTuple_GET_SIZE(seq);
+    int nin = -1;
+
+    for (Py_ssize_t i = 0; i < n; i++) {
+        PyObject *item = PyTuple_GET_ITEM(seq, i);
+        const bool single = Xnd_Check(item);
+        Py_ssize_t k;
+
+        if (single) {
+            k = 1;
+        }
+        else if (PyTuple_Check(item)) {
+            k = PyTuple_GET_SIZE(item);
+        }
+        else {
+            PyErr_Format(PyExc_TypeError,
+                "map() items must be xnd or tuples of xnd, got '%.200s'",
+                Py_TYPE(item)->tp_name);
+            return -1;
+        }
+
+        if (nin < 0) {
+            if (k > NDT_MAX_ARGS) {
+                PyErr_Format(PyExc_TypeError,
+                    "maximum number of arguments is %d, got %n", NDT_MAX_ARGS, k);
+                return -1;
+            }
+            nin = (int)k;
+            *in = PyMem_Malloc((n * nin == 0 ? 1 : n * nin) * sizeof **in);
+            if (*in == NULL) {
+                PyErr_NoMemory();
+                return -1;
+            }
+        }
+        else if (k != nin) {
+            PyErr_SetString(PyExc_TypeError,
+                "map() items must have the same number of arguments");
+            return -1;
+        }
+
+        for (int j = 0; j < nin; j++) {
+            PyObject *v = single ? item : PyTuple_GET_ITEM(item, j);
+            if (!Xnd_Check(v)) {
+                PyErr_Format(PyExc_TypeError,
+                    "expected xnd argument, got '%.200s'", Py_TYPE(v)->tp_name);
+                return -1;
+            }
+            (*in)[i * nin + j] = *CONST_XND(v);
+        }
+    }
+
+    return nin;
+}
+
+/*
+ * Create the outputs of all items.  Outputs of fixed array type are views
+ * of one container per group and output.
+ */
+static PyObject *
+map_outputs(gumath_state *st, gm_batch_t *b, PyObject *cls, ndt_context_t *ctx)
+{
+    const int nin = b->nin;
+    const int nout = b->nout;
+    PyObject *outs, *arenas;
+    int64_t *next;
+
+    outs = PyList_New(b->nitems * nout);
+    arenas = PyList_New(b->ngroups * nout);
+    next = PyMem_Calloc(b->ngroups == 0 ? 1 : b->ngroups, sizeof *next);
+    if (outs == NULL || arenas == NULL || next == NULL) {
+        PyErr_NoMemory();
+        goto error;
+    }
+
+    for (int64_t g = 0; g < b->ngroups; g++) {
+        const gm_batch_group_t *group = &b->groups[g];
+        for (int k = 0; k < nout; k++) {
+            const ndt_t *t = group->spec.types[nin+k];
+            PyObject *x = Py_None;
+
+            if (group->nitems > 1 && ndt_is_ndarray(t)) {
+                const ndt_t *u = ndt_fixed_dim(t, group->nitems, INT64_MAX, ctx);
+                if (u == NULL) {
+                    (void)seterr(ctx);
+                    goto error;
+                }
+                x = new_output(st, cls, u, 0, gm_is_elementwise(&group->kernel));
+                ndt_decref(u);
+                if (x == NULL) {
+                    goto error;
+                }
+            }
+            else {
+                Py_INCREF(x);
+            }
+
+            PyList_SET_ITEM(arenas, g * nout + k, x);
+        }
+    }
+
+    for (int64_t i = 0; i < b->nitems; i++) {
+        const int64_t g = b->group[i];
+        const int64_t j = next[g]++;
+
+        for (int k = 0; k < nout; k++) {
+            PyObject *arena = PyList_GET_ITEM(arenas, g * nout + k);
+            const ndt_t *t = b->groups[g].spec.types[nin+k];
+            xnd_t *x = &b->args[i * (nin+nout) + nin + k];
+            PyObject *v;
+
+            if (arena == Py_None) {
+                v = new_output(st, cls, t, 0,
+                               gm_is_elementwise(&b->groups[g].kernel));
+            }
+            else {
+                PyObject *index = PyLong_FromLongLong(j);
+                if (index == NULL) {
+                    goto error;
+                }
+                v = PyObject_GetItem(arena, index);
+                Py_DECREF(index);
+            }
+            if (v == NULL) {
+                goto error;
+            }
+
+            PyList_SET_ITEM(outs, i * nout + k, v);
+            *x = *CONST_XND(v);
+            x->type = t;
+        }
+    }
+
+    PyMem_Free(next);
+    Py_DECREF(arenas);
+    return outs;
+
+error:
+    PyMem_Free(next);
+    Py_XDECREF(arenas);
+    Py_XDECREF(outs);
+    return NULL;
+}
+
+/*
+ * Apply the gufunc to each item of a sequence.  An item is an xnd object or
+ * a tuple of xnd objects.  Items with equal types are type checked once.
+ */
+static PyObject *
+gufunc_map(GufuncObject *self, PyObject *args, PyObject *kwargs)
+{
+    static char *kwlist[] = {"items", "cls", NULL};
+    gumath_state *st = gufunc_state(self);
+    PyObject *items = NULL;
+    PyObject *cls = Py_None;
+
+    NDT_STATIC_CONTEXT(ctx);
+    PyObject *seq, *outs, *res = NULL;
+    xnd_t *in = NULL;
+    gm_batch_t b;
+    Py_ssize_t n;
+    int nin, nout;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "O|$O", kwlist, &items, &cls)) {
+        return NULL;
+    }
+
+    cls = cls == Py_None ? (PyObject *)st->xnd : cls;
+    if (!PyType_Check(cls) || !PyType_IsSubtype((PyTypeObject *)cls, st->xnd)) {
+        PyErr_SetString(PyExc_TypeError,
+            "the 'cls' argument must be a subtype of 'xnd'");
+        return NULL;
+    }
+
+    if (self->flags & GM_CUDA_MANAGED_FUNC) {
+        PyErr_SetString(PyExc_NotImplementedError,
+            "map() is currently not supported on cuda");
+        return NULL;
+    }
+
+    seq = PySequence_Tuple(items);
+    if (seq == NULL) {
+        return NULL;
+    }
+
+    n = PyTuple_GET_SIZE(seq);
+    if (n == 0) {
+        Py_DECREF(seq);
+        return PyList_New(0);
+    }
+
+    nin = map_inputs(&in, seq);
+    if (nin < 0) {
+        PyMem_Free(in);
+        Py_DECREF(seq);
+        return NULL;
+    }
+
+    if (gm_batch_init(&b, self->tbl, self->name, in, n, nin, &ctx) < 0) {
+        PyMem_Free(in);
+        Py_DECREF(seq);
+        return seterr(&ctx);
+    }
+    PyMem_Free(in);
+    nout = b.nout;
+
+    outs = map_outputs(st, &b, cls, &ctx);
+    if (outs == NULL) {
+        goto finish;
+    }
+
+    {
+        const int rounding = fegetround();
+        int ret;
+
+        fesetround(FE_TONEAREST);
+        ret = gm_batch_run(&b, LOAD_INT64(&st->max_threads), &ctx);
+        fesetround(rounding);
+
+        if (ret < 0) {
+            (void)seterr(&ctx);
+            goto finish;
+        }
+    }
+
+    res = PyList_New(n);
+    if (res == NULL) {
+        goto finish;
+    }
+
+    for (Py_ssize_t i = 0; i < n; i++) {
+        PyObject *v;
+
+        switch (nout) {
+        case 0:
+            v = Py_None;
+            Py_INCREF(v);
+            break;
+        case 1:
+            v = PyList_GET_ITEM(outs, i);
+            Py_INCREF(v);
+            break;
+        default:
+            v = PyTuple_New(nout);
+            if (v == NULL) {
+                Py_CLEAR(res);
+                goto finish;
+            }
+            for (int k = 0; k < nout; k++) {
+                PyObject *x = PyList_GET_ITEM(outs, i * nout + k);
+                Py_INCREF(x);
+                PyTuple_SET_ITEM(v, k, x);
+            }
+            break;
+        }
+
+        PyList_SET_ITEM(res, i, v);
+    }
+
+finish:
+    gm_batch_clear(&b);
+    Py_XDECREF(outs);
+    Py_DECREF(seq);
+    return res;
+}
+
+static PyObject *
+list_of_types(const ndt_t *types[], int n)
+{
+    NDT_STATIC_CONTEXT(ctx);
+    PyObject *list;
+
+    list = PyList_New(n);
+    if (list == NULL) {
+        return NULL;
+    }
+
+    for (int i = 0; i < n; i++) {
+        char *s = ndt_as_string(types[i], &ctx);
+        if (s == NULL) {
+            Py_DECREF(list);
+            return seterr(&ctx);
+        }
+
+        PyObject *tmp = PyUnicode_FromString(s);
+        ndt_free(s);
+        if (tmp == NULL) {
+            Py_DECREF(list);
+            return NULL;
+        }
+        PyList_SET_ITEM(list, i, tmp);
+    }
+
+    return list;
+}
+
+static PyObject *
+gufunc_explain(GufuncObject *self, PyObject *args, PyObject *kwargs)
+{
+    static char *kwlist[] = {"out", NULL};
+    static const char *overlap_name[] = {"none", "serial", "copy"};
+    gumath_state *st = gufunc_state(self);
+    PyObject *out = Py_None;
+
+    NDT_STATIC_CONTEXT(ctx);
+    PyObject *pystack[NDT_MAX_ARGS];
+    xnd_t stack[NDT_MAX_ARGS];
+    const ndt_t *types[NDT_MAX_ARGS];
+    int64_t li[NDT_MAX_ARGS];
+    PyObject *type_list, *inner, *res;
+    gm_explain_t e;
+    int action = GM_OVERLAP_NONE;
+    int nin, nout, nargs;
+    char *sig;
+
+    if (!PyArg_ParseTupleAndKeywords(st->positional_empty, kwargs, "|$O", kwlist,
+                                     &out)) {
+        return NULL;
+    }
+    out = out == Py_None ? NULL : out;
+
+    if (parse_args(pystack, &nin, &nout, &nargs, args, out) < 0) {
+        return NULL;
+    }
+
+    for (int k = 0; k < nargs; k++) {
+        stack[k] = *CONST_XND(pystack[k]);
+        types[k] = stack[k].type;
+        li[k] = stack[k].index;
+    }
+
+    if (gm_explain(&e, self->tbl, self->name, types, li, nin, nout, nout > 0,
+                   stack, LOAD_INT64(&st->max_threads), &ctx) < 0) {
+        clear_pystack(pystack, nargs);
+        return seterr(&ctx);
+    }
+
+    /* Overlap between inputs and explicitly passed outputs, see _gufunc_call(). */
+    if (nout > 0) {
+        xnd_t views[NDT_MAX_ARGS];
+        int plan[NDT_MAX_ARGS];
+
+        for (int i = 0; i < e.spec.nargs; i++) {
+            views[i] = stack[i];
+            views[i].type = e.spec.types[i];
+        }
+
+        action = gm_overlap_plan(plan, &e.kernel, views, e.spec.nin, e.spec.nout);
+        if (action == GM_OVERLAP_SERIAL && e.nthreads > 1) {
+            e.nthreads = 1;
+            e.reason = "inputs overlap outputs";
+        }
+    }
+
+    if (self->flags & GM_CUDA_MANAGED_FUNC) {
+        e.nthreads = 1;
+        e.reason = "cuda function";
+    }
+
+    clear_pystack(pystack, nargs);
+
+    sig = ndt_as_string(e.kernel.set->sig, &ctx);
+    if (sig == NULL) {
+        gm_explain_clear(&e);
+        return seterr(&ctx);
+    }
+
+    type_list = list_of_types(e.spec.types, e.spec.nargs);
+    inner = PyList_New(e.spec.nargs);
+    if (type_list == NULL || inner == NULL) {
+        Py_XDECREF(type_list);
+        Py_XDECREF(inner);
+        ndt_free(sig);
+        gm_explain_clear(&e);
+        return NULL;
+    }
+
+    for (int i = 0; i < e.spec.nargs; i++) {
+        PyObject *v = PyLong_FromLong(e.spec.types[i]->ndim - e.spec.outer_dims);
+        if (v == NULL) {
+            Py_DECREF(type_list);
+            Py_DECREF(inner);
+            ndt_free(sig);
+            gm_explain_clear(&e);
+            return NULL;
+        }
+        PyList_SET_ITEM(inner, i, v);
+    }
+
+    res = Py_BuildValue("{sssssssOsisOsLsssssdsO}",
+                        "sig", sig,
+                        "variant", gm_variant_name(e.kernel.flag),
+                        "flags", ndt_apply_flags_as_string(&e.spec),
+                        "types", type_list,
+                        "outer_dims", e.spec.outer_dims,
+                        "inner_dims", inner,
+                        "threads", (long long)e.nthreads,
+                        "reason", e.reason,
+                        "overlap", overlap_name[action],
+                        "cost", e.cost,
+                        "measured", e.measured ? Py_True : Py_False);
+
+    Py_DECREF(type_list);
+    Py_DECREF(inner);
+    ndt_free(sig);
+    gm_explain_clear(&e);
+
+    return res;
+}
+
+static PyObject *
+gufunc_getdevice(GufuncObject *self, PyObject *args GM_UNUSED)
+{
+    if (self->flags & GM_CUDA_MANAGED_FUNC) {
+        return PyUnicode_FromString("cuda:managed");
+    }
+
+    Py_RETURN_NONE;
+}
+
+static PyObject *
+gufunc_getidentity(GufuncObject *self, PyObject *args GM_UNUSED)
+{
+    PyObject *identity;
+
+    Py_BEGIN_CRITICAL_SECTION(self);
+    identity = self->identity ? self->identity : Py_None;
+    Py_INCREF(identity);
+    Py_END_CRITICAL_SECTION();
+
+    return identity;
+}
+
+static int
+gufunc_setidentity(GufuncObject *self, PyObject *value, void *closure GM_UNUSED)
+{
+    PyObject *tmp;
+
+    if (value == NULL) {
+        PyErr_SetString(PyExc_AttributeError, "cannot delete the identity");
+        return -1;
+    }
+
+    Py_INCREF(value);
+    Py_BEGIN_CRITICAL_SECTION(self);
+    tmp = self->identity;
+    self->identity = value;
+    Py_END_CRITICAL_SECTION();
+    Py_XDECREF(tmp);
+
+    return 0;
+}
+
+static PyObject *
+gufunc_getkernels(GufuncObject *self, PyObject *args GM_UNUSED)
+{
+    NDT_STATIC_CONTEXT(ctx);
+    PyObject *list, *tmp;
+    const gm_func_t *f;
+    char *s;
+    int i, n;
+
+    f = gm_tbl_find(self->tbl, self->name, &ctx);
+    if (f == NULL) {
+        return seterr(&ctx);
+    }
+
+    n = gm_func_nkernels(f);
+    list = PyList_New(n);
+    if (list == NULL) {
+        return NULL;
+    }
+
+    for (i = 0; i < n; i++) {
+        s = ndt_as_string(f->kernels[i].sig, &ctx);
+        if (s == NULL) {
+            Py_DECREF(list);
+            return seterr(&ctx);
+        }
+
+        tmp = PyUnicode_FromString(s);
+        ndt_free(s);
+        if (tmp == NULL) {
+            Py_DECREF(list);
+            return NULL;
+        }
+
+        PyList_SET_ITEM(list, i, tmp);
+    }
+
+    return list;
+}
+
+
+/* True if all kernels are cpu kernels of the form '... * scalar'. */
+static PyObject *
+gufunc_getelementwise(GufuncObject *self, PyObject *args GM_UNUSED)
+{
+    NDT_STATIC_CONTEXT(ctx);
+    const gm_func_t *f;
+    int n;
+
+    f = gm_tbl_find(self->tbl, self->name, &ctx);
+    if (f == NULL) {
+        return seterr(&ctx);
+    }
+
+    if (self->flags & GM_CUDA_MANAGED_FUNC) {
+        Py_RETURN_FALSE;
+    }
+
+    n = gm_func_nkernels(f);
+    for (int i = 0; i < n; i++) {
+        const gm_kernel_t kernel = { 0, &f->kernels[i] };
+        if (!gm_is_elementwise(&kernel)) {
+            Py_RETURN_FALSE;
+        }
+    }
+
+    Py_RETURN_TRUE;
+}
+
+/* Number of outputs, None if it differs between kernels. */
+static PyObject *
+gufunc_getnout(GufuncObject *self, PyObject *args GM_UNUSED)
+{
+    NDT_STATIC_CONTEXT(ctx);
+    const gm_func_t *f;
+    int64_t nout = -1;
+    int n;
+
+    f = gm_tbl_find(self->tbl, self->name, &ctx);
+    if (f == NULL) {
+        return seterr(&ctx);
+    }
+
+    n = gm_func_nkernels(f);
+    for (int i = 0; i < n; i++) {
+        const int64_t k = f->kernels[i].sig->Function.nout;
+        if (nout >= 0 && k != nout) {
+            Py_RETURN_NONE;
+        }
+        nout = k;
+    }
+
+    if (nout < 0) {
+        Py_RETURN_NONE;
+    }
+
+    return PyLong_FromLongLong(nout);
+}
+
+static PyGetSetDef gufunc_getsets [] =
+{
+  { "device", (getter)gufunc_getdevice, NULL, NULL, NULL},
+  { "elementwise", (getter)gufunc_getelementwise, NULL, NULL, NULL},
+  { "identity", (getter)gufunc_getidentity, (setter)gufunc_setidentity, NULL, NULL},
+  { "kernels", (getter)gufunc_getkernels, NULL, NULL, NULL},
+  { "nout", (getter)gufunc_getnout, NULL, NULL, NULL},
+  {NULL}
+};
+
+
+static PyMethodDef gufunc_methods [] =
+{
+  { "explain", (PyCFunction)gufunc_explain, METH_VARARGS|METH_KEYWORDS, NULL },
+  { "submit", (PyCFunction)gufunc_submit, METH_VARARGS|METH_KEYWORDS, NULL },
+  { "map", (PyCFunction)gufunc_map, METH_VARARGS|METH_KEYWORDS, NULL },
+  { NULL, NULL, 1 }
+};
+
+
+static PyType_Slot gufunc_slots[] = {
+  { Py_tp_dealloc, (void *)gufunc_dealloc },
+  { Py_tp_hash, (void *)PyObject_HashNotImplemented },
+  { Py_tp_call, (void *)gufunc_call },
+  { Py_tp_getattro, (void *)PyObject_GenericGetAttr },
+  { Py_tp_traverse, (void *)gufunc_traverse },
+  { Py_tp_clear, (void *)gufunc_clear },
+  { Py_tp_methods, (void *)gufunc_methods },
+  { Py_tp_getset, (void *)gufunc_getsets },
+  { 0, NULL }
+};
+
+static PyType_Spec gufunc_spec = {
+    .name = "_gumath.gufunc",
+    .basicsize = sizeof(GufuncObject),
+    .flags = Py_TPFLAGS_DEFAULT|Py_TPFLAGS_HAVE_GC|GM_TPFLAGS_IMMUTABLE,
+    .slots = gufunc_slots
+};
+
+
+/****************************************************************************/
+/*                                Task graphs                               */
+/****************************************************************************/
+
+static PyObject *
+graph_new(PyObject *module, PyObject *args UNUSED)
+{
+    NDT_STATIC_CONTEXT(ctx);
+    GraphObject *self;
+
+    self = PyObject_New(GraphObject, get_state(module)->graph_type);
+    if (self == NULL) {
+        return NULL;
+    }
+
+    self->graph = NULL;
+    self->module = module;
+    Py_INCREF(module);
+
+    self->args = PyList_New(0);
+    if (self->args == NULL) {
+        Py_DECREF(self);
+        return NULL;
+    }
+
+    self->graph = gm_graph_new(&ctx);
+    if (self->graph == NULL) {
+        Py_DECREF(self);
+        return seterr(&ctx);
+    }
+
+    return (PyObject *)self;
+}
+
+static void
+graph_dealloc(GraphObject *self)
+{
+    PyTypeObject *tp = Py_TYPE(self);
+
+    if (self->graph != NULL) {
+        gm_graph_del(self->graph);
+    }
+    Py_XDECREF(self->args);
+    Py_DECREF(self->module);
+    PyObject_Del(self);
+#if PY_VERSION_HEX >= 0x03080000
+    Py_DECREF(tp);
+#else
+    (void)tp;
+#endif
+}
+
+static Py_ssize_t
+graph_len(GraphObject *self)
+{
+    return PyList_GET_SIZE(self->args);
+}
+
+/* add(f, *args, out=None, dtype=None, cls=None) */
+static PyObject *
+graph_add_node(GraphObject *self, PyObject *args, PyObject *kwargs)
+{
+    PyObject *f, *rest, *res;
+
+    if (PyTuple_GET_SIZE(args) < 1 || !Gufunc_Check(PyTuple_GET_ITEM(args, 0))) {
+        PyErr_SetString(PyExc_TypeError,
+            "add: the first argument must be a gufunc");
+        return NULL;
+    }
+    f = PyTuple_GET_ITEM(args, 0);
+
+    if (gufunc_state((GufuncObject *)f) != get_state(self->module)) {
+        PyErr_SetString(PyExc_ValueError,
+            "add: the gufunc belongs to a different interpreter");
+        return NULL;
+    }
+
+    rest = PyTuple_GetSlice(args, 1, PyTuple_GET_SIZE(args));
+    if (rest == NULL) {
+        return NULL;
+    }
+
+    Py_BEGIN_CRITICAL_SECTION(self);
+    res = _gufunc_call((GufuncObject *)f, rest, kwargs, true, true, false, self);
+    Py_END_CRITICAL_SECTION();
+    Py_DECREF(rest);
+
+    return res;
+}
+
+static PyObject *
+graph_run(GraphObject *self, PyObject *args, PyObject *kwargs)
+{
+    static char *kwlist[] = {"nchunks", NULL};
+    NDT_STATIC_CONTEXT(ctx);
+    gumath_state *st = get_state(self->module);
+    long long nchunks = 0;
+    int rounding;
+    int ret;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "|$L", kwlist, &nchunks)) {
+        return NULL;
+    }
+
+    if (nchunks < 0) {
+        PyErr_SetString(PyExc_ValueError, "nchunks must be non-negative");
+        return NULL;
+    }
+
+    Py_BEGIN_CRITICAL_SECTION(self);
+    rounding = fegetround();
+    fesetround(FE_TONEAREST);
+    ret = gm_graph_run(self->graph, LOAD_INT64(&st->max_threads), nchunks, &ctx);
+    fesetround(rounding);
+    Py_END_CRITICAL_SECTION();
+
+    if (ret < 0) {
+        return seterr(&ctx);
+    }
+
+    Py_RETURN_NONE;
+}
+
+static PyObject *
+graph_node_time(GraphObject *self, PyObject *arg)
+{
+    Py_ssize_t node = PyNumber_AsSsize_t(arg, PyExc_IndexError);
+
+    if (node == -1 && PyErr_Occurred()) {
+        return NULL;
+    }
+
+    if (node < 0 || node >= PyList_GET_SIZE(self->args)) {
+        PyErr_SetString(PyExc_IndexError, "node index out of range");
+        return NULL;
+    }
+
+    return PyFloat_FromDouble(gm_graph_node_time(self->graph, (int)node));
+}
+
+/* Return the time and the nodes of the longest chain of dependent nodes. */
+static PyObject *
+graph_critical_path(GraphObject *self, PyObject *args UNUSED)
+{
+    const Py_ssize_t nnodes = PyList_GET_SIZE(self->args);
+    PyObject *path;
+    double time;
+    int length = 0;
+    int *nodes;
+
+    nodes = PyMem_Malloc((nnodes == 0 ? 1 : nnodes) * sizeof *nodes);
+    if (nodes == NULL) {
+        return PyErr_NoMemory();
+    }
+
+    time = gm_graph_critical_path(self->graph, nodes, &length);
+
+    path = PyList_New(length);
+    if (path == NULL) {
+        PyMem_Free(nodes);
+        return NULL;
+    }
+    for (int i = 0; i < length; i++) {
+        PyObject *v = PyLong_FromLong(nodes[i]);
+        if (v == NULL) {
+            PyMem_Free(nodes);
+            Py_DECREF(path);
+            return NULL;
+        }
+        PyList_SET_ITEM(path, i, v);
+    }
+    PyMem_Free(nodes);
+
+    return Py_BuildValue("(dN)", time, path);
+}
+
+static PyMethodDef graph_methods [] =
+{
+  { "add", (PyCFunction)graph_add_node, METH_VARARGS|METH_KEYWORDS, NULL },
+  { "run", (PyCFunction)graph_run, METH_VARARGS|METH_KEYWORDS, NULL },
+  { "node_time", (PyCFunction)graph_node_time, METH_O, NULL },
+  { "critical_path", (PyCFunction)graph_critical_path, METH_NOARGS, NULL },
+  { NULL, NULL, 1 }
+};
+
+static PyType_Slot graph_slots[] = {
+  { Py_tp_dealloc, (void *)graph_dealloc },
+  { Py_tp_hash, (void *)PyObject_HashNotImplemented },
+  { Py_tp_getattro, (void *)PyObject_GenericGetAttr },
+  { Py_tp_methods, (void *)graph_methods },
+  { Py_sq_length, (void *)graph_len },
+  { 0, NULL }
+};
+
+static PyType_Spec graph_spec = {
+    .name = "_gumath.TaskGraph",
+    .basicsize = sizeof(GraphObject),
+    .flags = Py_TPFLAGS_DEFAULT|GM_TPFLAGS_IMMUTABLE,
+    .slots = graph_slots
+};
+
+
+/****************************************************************************/
+/*                                   C-API                                  */
+/****************************************************************************/
+
+static void **gumath_api[GUMATH_MAX_API];
+
+struct map_args {
+    PyObject *gumath;  /* _gumath module that owns the functions */
+    PyObject *module;
+    const gm_tbl_t *tbl;
+    uint32_t flags;
+};
+
+/* The gufunc types of all interpreters share gufunc_dealloc(). */
+static int
+Gufunc_CheckExact(const PyObject *v)
+{
+    return Py_TYPE(v)->tp_dealloc == (destructor)gufunc_dealloc;
+}
+
+static int
+Gufunc_Check(const PyObject *v)
+{
+    for (PyTypeObject *tp = Py_TYPE(v); tp != NULL; tp = tp->tp_base) {
+        if (tp->tp_dealloc == (destructor)gufunc_dealloc) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+static int
+add_function(const gm_func_t *f, void *args)
+{
+    struct map_args *a = (struct map_args *)args;
+    PyObject *func;
+
+    func = gufunc_new(a->gumath, a->tbl, f->name, a->flags);
+    if (func == NULL) {
+        return -1;
+    }
+
+    return PyModule_AddObject(a->module, f->name, func);
+}
+
+static void
+register_table(const gm_tbl_t *tbl)
+{
+    GUMATH_LOCK();
+    for (int i = 0; i < ntables; i++) {
+        if (tables[i] == tbl) {
+            GUMATH_UNLOCK();
+            return;
+        }
+    }
+
+    if (ntables < MAX_TABLES) {
+        tables[ntables++] = tbl;
+    }
+    GUMATH_UNLOCK();
+}
+
+static void
+unregister_table(const gm_tbl_t *tbl)
+{
+    GUMATH_LOCK();
+    for (int i = 0; i < ntables; i++) {
+        if (tables[i] == tbl) {
+            tables[i] = tables[--ntables];
+            break;
+        }
+    }
+    GUMATH_UNLOCK();
+}
+
+static int
+add_functions(PyObject *gumath, PyObject *m, const gm_tbl_t *tbl,
+              uint32_t flags)
+{
+    struct map_args args = {gumath, m, tbl, flags};
+
+    register_table(tbl);
+
+    if (gm_tbl_map(tbl, add_function, &args) < 0) {
+        return -1;
+    }
+
+    return 0;
+}
+
+/* The functions of other modules belong to the _gumath module of the
+   importing interpreter. */
+static int
+add_functions_import(PyObject *m, const gm_tbl_t *tbl, uint32_t flags)
+{
+    PyObject *gumath;
+    int ret;
+
+    gumath = PyImport_ImportModule("gumath._gumath");
+    if (gumath == NULL) {
+        return -1;
+    }
+
+    ret = add_functions(gumath, m, tbl, flags);
+    Py_DECREF(gumath);
+
+    return ret;
+}
+
+static int
+Gumath_AddFunctions(PyObject *m, const gm_tbl_t *tbl)
+{
+    return add_functions_import(m, tbl, GM_CPU_FUNC);
+}
+
+static int
+Gumath_AddCudaFunctions(PyObject *m, const gm_tbl_t *tbl)
+{
+    return add_functions_import(m, tbl, GM_CUDA_MANAGED_FUNC);
+}
+
+static void
+init_api(void)
+{
+    gumath_api[Gufunc_CheckExact_INDEX] = (void *)Gufunc_CheckExact;
+    gumath_api[Gufunc_Check_INDEX] = (void *)Gufunc_Check;
+    gumath_api[Gumath_AddFunctions_INDEX] = (void *)Gumath_AddFunctions;
+    gumath_api[Gumath_AddCudaFunctions_INDEX] = (void *)Gumath_AddCudaFunctions;
+}
+
+
+/****************************************************************************/
+/*                                  Module                                  */
+/****************************************************************************/
+
+static PyObject *
+gufunc_vfold(PyObject *m, PyObject *args, PyObject *kwargs)
+{
+    static char *kwlist[] = {"f", "acc", NULL};
+    PyObject *func = Py_None;
+    PyObject *acc = Py_None;
+    PyObject *tuple;
+    PyObject *dict;
+    PyObject *res;
+    Py_ssize_t size, i;
+    int ret;
+
+    ret = PyArg_ParseTupleAndKeywords(get_state(m)->positional_empty, kwargs, "|$OO", kwlist,
+                                      &func, &acc);
+    if (ret < 0) {
+        return NULL;
+    }
+
+    if (!Gufunc_Check(func)) {
+        PyErr_Format(PyExc_TypeError,
+            "vfold: expected gufunc object, got '%.200s'", Py_TYPE(func));
+        return NULL;
+    }
+
+    if (!Xnd_Check(acc)) {
+        PyErr_Format(PyExc_TypeError,
+            "vfold: expected xnd instance, got '%.200s'", Py_TYPE(acc));
+        return NULL;
+    }
+
+    /* Push the accumulator onto the argument stack. */
+    size = PyTuple_Size(args);
+    tuple = PyTuple_New(size+1);
+    if (tuple == NULL) {
+        return NULL;
+    }
+
+    Py_INCREF(acc);
+    PyTuple_SET_ITEM(tuple, 0, acc);
+    for (i = 0; i < size; i++) {
+        PyObject *v = PyTuple_GET_ITEM(args, i);
+        Py_INCREF(v);
+        PyTuple_SET_ITEM(tuple, i+1, v);
+    }
+
+    /* Simultaneously use the accumulator as the 'out' argument. */
+    dict = PyDict_New();
+    if (dict == NULL) {
+        Py_DECREF(tuple);
+        return NULL;
+    }
+    if (PyDict_SetItemString(dict, "out", acc) < 0) {
+        Py_DECREF(dict);
+        Py_DECREF(tuple);
+        return NULL;
+    }
+    if (PyDict_SetItemString(dict, "cls", (PyObject *)(Py_TYPE(acc))) < 0) {
+        Py_DECREF(dict);
+        Py_DECREF(tuple);
+        return NULL;
+    }
+
+    res = _gufunc_call((GufuncObject *)func, tuple, dict, false, false, false, NULL);
+    Py_DECREF(tuple);
+    Py_DECREF(dict);
+
+    return res;
+}
+
+/*
+ * View of the first (n // block) * block entries of the outer dimension of
+ * 'x' with the shape 'block * (n // block) * ...'.  Entry [i, j] is
+ * x[j*block + i], so folding the view accumulates each block in order.
+ */
+static PyObject *
+block_view(PyObject *m UNUSED, PyObject *args)
+{
+    NDT_STATIC_CONTEXT(ctx);
+    PyObject *x;
+    Py_ssize_t block;
+    const ndt_t *t, *u, *v;
+    int64_t step;
+
+    if (!PyArg_ParseTuple(args, "On", &x, &block)) {
+        return NULL;
+    }
+
+    if (!Xnd_Check(x)) {
+        PyErr_Format(PyExc_TypeError,
+            "_block_view: expected xnd instance, got '%.200s'",
+            Py_TYPE(x)->tp_name);
+        return NULL;
+    }
+
+    t = CONST_XND(x)->type;
+    if (t->tag != FixedDim || block <= 0) {
+        PyErr_SetString(PyExc_ValueError,
+            "_block_view: expected a fixed dimension and a positive block size");
+        return NULL;
+    }
+    step = t->Concrete.FixedDim.step;
+
+    u = ndt_fixed_dim(t->FixedDim.type, t->FixedDim.shape / block, block * step,
+                      &ctx);
+    if (u == NULL) {
+        return seterr(&ctx);
+    }
+
+    v = ndt_fixed_dim(u, block, step, &ctx);
+    ndt_decref(u);
+    if (v == NULL) {
+        return seterr(&ctx);
+    }
+
+    return Xnd_ViewMoveNdt(x, (ndt_t *)v);
+}
+
+#ifndef _WIN32
+typedef struct {
+    PyTypeObject *xnd;
+    PyObject *reduce;
+    PyThreadState *tstate; /* saved while the GIL is released */
+} stream_state_t;
+
+/* Pass a copy of the block to the Python callback. */
+static int
+stream_reduce(const xnd_t *block, int64_t row, void *state, ndt_context_t *ctx)
+{
+    stream_state_t *s = state;
+    PyObject *x, *res = NULL;
+
+    PyEval_RestoreThread(s->tstate);
+    x = Xnd_EmptyFromType(s->xnd, block->type, 0);
+    if (x != NULL) {
+        memcpy(XND(x)->ptr, block->ptr, block->type->datasize);
+        res = PyObject_CallFunction(s->reduce, "OL", x, (long long)row);
+        Py_DECREF(x);
+    }
+    Py_XDECREF(res);
+    s->tstate = PyEval_SaveThread();
+
+    /* The Python exception is raised when the GIL is reacquired. */
+    if (res == NULL) {
+        ndt_err_format(ctx, NDT_RuntimeError, "stream: reduce callback failed");
+        return -1;
+    }
+
+    return 0;
+}
+#endif
+
+static PyObject *
+stream_apply(PyObject *m, PyObject *args, PyObject *kwds)
+{
+    static char *kwlist[] = {"f", "path", "out", "reduce", "rowtype", "block_size", NULL};
+    PyObject *f, *path;
+    PyObject *out = Py_None;
+    PyObject *reduce = Py_None;
+    PyObject *rowtype = Py_None;
+    Py_ssize_t block_size = 0;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "OO&|$OOOn", kwlist, &f,
+                                     PyUnicode_FSConverter, &path, &out,
+                                     &reduce, &rowtype, &block_size)) {
+        return NULL;
+    }
+
+#ifdef _WIN32
+    (void)m;
+    Py_DECREF(path);
+    PyErr_SetString(PyExc_NotImplementedError,
+        "stream_apply: not available on Windows");
+    return NULL;
+#else
+    NDT_STATIC_CONTEXT(ctx);
+    gumath_state *st = get_state(m);
+    stream_state_t state = { st->xnd, reduce, NULL };
+    gm_stream_t opts = { .rowtype = NULL };
+    GufuncObject *self;
+    PyObject *outpath = NULL;
+    int ret;
+
+    if (!Gufunc_Check(f)) {
+        PyErr_Format(PyExc_TypeError,
+            "stream_apply: expected gufunc object, got '%.200s'",
+            Py_TYPE(f)->tp_name);
+        goto error;
+    }
+    self = (GufuncObject *)f;
+
+    if (self->flags & GM_CUDA_MANAGED_FUNC) {
+        PyErr_SetString(PyExc_NotImplementedError,
+            "stream_apply: cuda functions are not supported");
+        goto error;
+    }
+
+    if (out != Py_None) {
+        if (!PyUnicode_FSConverter(out, &outpath)) {
+            goto error;
+        }
+        opts.out = PyBytes_AS_STRING(outpath);
+    }
+
+    if (reduce != Py_None) {
+        if (!PyCallable_Check(reduce)) {
+            PyErr_SetString(PyExc_TypeError, "stream_apply: reduce must be callable");
+            goto error;
+        }
+        opts.reduce = stream_reduce;
+        opts.state = &state;
+    }
+
+    if (rowtype != Py_None) {
+        opts.rowtype = PyUnicode_AsUTF8(rowtype);
+        if (opts.rowtype == NULL) {
+            goto error;
+        }
+    }
+
+    opts.block_size = block_size;
+    opts.nthreads = LOAD_INT64(&st->max_threads);
+
+    state.tstate = PyEval_SaveThread();
+    ret = gm_stream_apply(self->tbl, self->name, PyBytes_AS_STRING(path), &opts,
+                          &ctx);
+    PyEval_RestoreThread(state.tstate);
+
+    Py_XDECREF(outpath);
+    Py_DECREF(path);
+
+    if (ret < 0) {
+        if (PyErr_Occurred()) {
+            ndt_err_clear(&ctx);
+            return NULL;
+        }
+        return seterr(&ctx);
+    }
+
+    Py_RETURN_NONE;
+
+error:
+    Py_XDECREF(outpath);
+    Py_DECREF(path);
+    return NULL;
+#endif
+}
+
+static PyObject *
+unsafe_add_kernel(PyObject *m, PyObject *args, PyObject *kwds)
+{
+    gumath_state *st = get_state(m);
+    NDT_STATIC_CONTEXT(ctx);
+    static char *kwlist[] = {"name", "sig", "tag", "ptr", NULL};
+    gm_kernel_init_t k = {NULL};
+    gm_func_t *f;
+    char *name;
+    char *sig;
+    char *tag;
+    PyObject *ptr;
+    void *p;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "sssO", kwlist, &name, &sig,
+        &tag, &ptr)) {
+        return NULL;
+    }
+
+    p = PyLong_AsVoidPtr(ptr);
+    if (p == NULL) {
+        return NULL;
+    }
+
+    k.name = name;
+    k.sig = sig;
+
+    if (strcmp(tag, "Opt") == 0) { /* XXX */
+        k.OptC = p;
+    }
+    else if (strcmp(tag, "C") == 0) {
+        k.C = p;
+    }
+    else if (strcmp(tag, "Fortran") == 0) {
+        k.Fortran = p;
+    }
+    else if (strcmp(tag, "Xnd") == 0) {
+        k.Xnd = p;
+    }
+    else if (strcmp(tag, "Strided") == 0) {
+        k.Strided = p;
+    }
+    else {
+        PyErr_SetString(PyExc_ValueError,
+            "tag must be 'Opt', 'C', 'Fortran', 'Xnd' or 'Strided'");
+        return NULL;
+    }
+
+    if (gm_add_kernel(st->table, &k, &ctx) < 0) {
+        return seterr(&ctx);
+    }
+
+    f = gm_tbl_find(st->table, name, &ctx);
+    if (f == NULL) {
+        return seterr(&ctx);
+    }
+
+    return gufunc_new(m, st->table, f->name, GM_CPU_FUNC);
+}
+
+static void
+init_max_threads(gumath_state *st)
+{
+    PyObject *os = NULL;
+    PyObject *n = NULL;
+    int64_t i64;
+
+    os = PyImport_ImportModule("os");
+    if (os == NULL) {
+        goto error;
+    }
+
+    n = PyObject_CallMethod(os, "cpu_count", "()");
+    if (n == NULL) {
+        goto error;
+    }
+
+    i64 = PyLong_AsLongLong(n);
+    if (i64 < 1) {
+        goto error;
+    }
+
+    st->max_threads = i64;
+
+out:
+    Py_XDECREF(os);
+    Py_XDECREF(n);
+    return;
+
+error:
+    if (PyErr_Occurred()) {
+        PyErr_Clear();
     }
+    PyErr_WarnEx(PyExc_RuntimeWarning,
+        "could not get cpu count: using max_threads==1", 1);
+    goto out;
 }
 
 static PyObject *
-gufunc_call(GufuncObject *self, PyObject *args, PyObject *kwargs)
+get_max_threads(PyObject *m, PyObject *args UNUSED)
 {
-    return _gufunc_call(self, args, kwargs, true, true);
+    return PyLong_FromLongLong(LOAD_INT64(&get_state(m)->max_threads));
 }
 
 static PyObject *
-gufunc_getdevice(GufuncObject *self, PyObject *args GM_UNUSED)
+set_max_threads(PyObject *m, PyObject *obj)
 {
-    if (self->flags & GM_CUDA_MANAGED_FUNC) {
-        return PyUnicode_FromString("cuda:managed");
+    int64_t n;
+
+    n = PyLong_AsLongLong(obj);
+    if (n == -1 && PyErr_Occurred()) {
+        return NULL;
     }
 
+    if (n <= 0) {
+        PyErr_SetString(PyExc_ValueError,
+            "max_threads must be greater than 0");
+        return NULL;
+    }
+
+    STORE_INT64(&get_state(m)->max_threads, n);
+
     Py_RETURN_NONE;
 }
 
 static PyObject *
-gufunc_getidentity(GufuncObject *self, PyObject *args GM_UNUSED)
+cpu_isa(PyObject *m UNUSED, PyObject *args UNUSED)
 {
-    Py_INCREF(self->identity);
-    return self->identity;
+    return PyUnicode_FromString(gm_cpu_isa());
 }
 
-static int
-gufunc_setidentity(GufuncObject *self, PyObject *value, void *closure GM_UNUSED)
+static PyObject *
+get_thread_cutoff(PyObject *m UNUSED, PyObject *args UNUSED)
 {
-    Py_DECREF(self->identity);
-    Py_INCREF(value);
-    self->identity = value;
-    return 0;
+    return PyLong_FromLongLong(gm_thread_cutoff());
 }
 
 static PyObject *
-gufunc_getkernels(GufuncObject *self, PyObject *args GM_UNUSED)
+set_thread_cutoff(PyObject *m UNUSED, PyObject *obj)
 {
-    NDT_STATIC_CONTEXT(ctx);
-    PyObject *list, *tmp;
-    const gm_func_t *f;
-    char *s;
-    int i;
+    int64_t n;
 
-    f = gm_tbl_find(self->tbl, self->name, &ctx);
-    if (f == NULL) {
-        return seterr(&ctx);
+    n = PyLong_AsLongLong(obj);
+    if (n == -1 && PyErr_Occurred()) {
+        return NULL;
     }
 
-    list = PyList_New(f->nkernels);
-    if (list == NULL) {
+    if (n < 0) {
+        PyErr_SetString(PyExc_ValueError,
+            "thread cutoff must be greater than or equal to 0");
         return NULL;
     }
 
-    for (i = 0; i < f->nkernels; i++) {
-        s = ndt_as_string(f->kernels[i].sig, &ctx);
-        if (s == NULL) {
-            Py_DECREF(list);
-            return seterr(&ctx);
-        }
+    gm_set_thread_cutoff(n);
 
-        tmp = PyUnicode_FromString(s);
-        ndt_free(s);
-        if (tmp == NULL) {
-            Py_DECREF(list);
-            return NULL;
-        }
+    Py_RETURN_NONE;
+}
 
-        PyList_SET_ITEM(list, i, tmp);
+static PyObject *
+get_yield_chunk(PyObject *m UNUSED, PyObject *args UNUSED)
+{
+    return PyLong_FromLongLong(gm_yield_chunk());
+}
+
+static PyObject *
+set_yield_chunk(PyObject *m UNUSED, PyObject *obj)
+{
+    int64_t n;
+
+    n = PyLong_AsLongLong(obj);
+    if (n == -1 && PyErr_Occurred()) {
+        return NULL;
     }
 
-    return list;
+    if (n < 0) {
+        PyErr_SetString(PyExc_ValueError,
+            "yield chunk must be greater than or equal to 0");
+        return NULL;
+    }
+
+    gm_set_yield_chunk(n);
+
+    Py_RETURN_NONE;
 }
 
+static PyObject *
+get_reserved_threads(PyObject *m UNUSED, PyObject *args UNUSED)
+{
+    return PyLong_FromLongLong(gm_reserved_threads());
+}
 
-static PyGetSetDef gufunc_getsets [] =
+static PyObject *
+set_reserved_threads(PyObject *m UNUSED, PyObject *obj)
 {
-  { "device", (getter)gufunc_getdevice, NULL, NULL, NULL},
-  { "identity", (getter)gufunc_getidentity, (setter)gufunc_setidentity, NULL, NULL},
-  { "kernels", (getter)gufunc_getkernels, NULL, NULL, NULL},
-  {NULL}
-};
+    int64_t n;
 
+    n = PyLong_AsLongLong(obj);
+    if (n == -1 && PyErr_Occurred()) {
+        return NULL;
+    }
 
-static PyTypeObject Gufunc_Type = {
-    PyVarObject_HEAD_INIT(NULL, 0)
-    .tp_name = "_gumath.gufunc",
-    .tp_basicsize = sizeof(GufuncObject),
-    .tp_dealloc = (destructor)gufunc_dealloc,
-    .tp_hash = PyObject_HashNotImplemented,
-    .tp_call = (ternaryfunc)gufunc_call,
-    .tp_getattro = PyObject_GenericGetAttr,
-    .tp_flags = Py_TPFLAGS_DEFAULT,
-    .tp_getset = gufunc_getsets
-};
+    if (n < 0) {
+        PyErr_SetString(PyExc_ValueError,
+            "reserved threads must be greater than or equal to 0");
+        return NULL;
+    }
 
+    gm_set_reserved_threads(n);
+
+    Py_RETURN_NONE;
+}
 
 /****************************************************************************/
-/*                                   C-API                                  */
+/*                               Python executor                            */
 /****************************************************************************/
 
-static void **gumath_api[GUMATH_MAX_API];
+/*
+ * Each range of a parallel loop except the first is submitted to the
+ * executor as a callable that owns its py_range_t.  The calling thread runs
+ * the first range and then reclaims the ranges that the executor has not
+ * started in the meantime, which also avoids a deadlock if the caller is
+ * itself a task of a saturated executor.  The state only moves from pending
+ * to running once (atomically in free-threaded builds), so a range runs
+ * exactly once.
+ */
 
-struct map_args {
-    PyObject *module;
-    const gm_tbl_t *tbl;
-};
+enum { RANGE_PENDING, RANGE_RUNNING, RANGE_DONE };
 
-static int
-Gufunc_CheckExact(const PyObject *v)
-{
-    return Py_TYPE(v) == &Gufunc_Type;
-}
+typedef struct {
+    gm_range_t f;
+    void *arg;
+    int64_t begin;
+    int64_t end;
+    int state;
+} py_range_t;
 
-static int
-Gufunc_Check(const PyObject *v)
+static void
+range_capsule_free(PyObject *capsule)
 {
-    return PyObject_TypeCheck(v, &Gufunc_Type);
+    PyMem_Free(PyCapsule_GetPointer(capsule, NULL));
 }
 
-static int
-add_function(const gm_func_t *f, void *args)
+/* Run 'r' if no other thread has started it.  Returns true if it ran. */
+static bool
+range_run(py_range_t *r)
 {
-    struct map_args *a = (struct map_args *)args;
-    PyObject *func;
+    int expected = RANGE_PENDING;
 
-    func = gufunc_new(a->tbl, f->name, GM_CPU_FUNC);
-    if (func == NULL) {
-        return -1;
+    if (!CAS_INT(&r->state, &expected, RANGE_RUNNING)) {
+        return false;
     }
 
-    return PyModule_AddObject(a->module, f->name, func);
+    Py_BEGIN_ALLOW_THREADS
+    r->f(r->begin, r->end, r->arg);
+    Py_END_ALLOW_THREADS
+    STORE_INT(&r->state, RANGE_DONE);
+
+    return true;
 }
 
-static int
-Gumath_AddFunctions(PyObject *m, const gm_tbl_t *tbl)
+/* Returns True if the range ran in the executor, False if it was reclaimed. */
+static PyObject *
+range_call(PyObject *capsule, PyObject *args UNUSED)
 {
-    struct map_args args = {m, tbl};
+    py_range_t *r = PyCapsule_GetPointer(capsule, NULL);
 
-    if (gm_tbl_map(tbl, add_function, &args) < 0) {
-        return -1;
+    if (r == NULL) {
+        return NULL;
     }
 
-    return 0;
+    return PyBool_FromLong(range_run(r));
 }
 
-static int
-add_cuda_function(const gm_func_t *f, void *args)
+static PyMethodDef range_call_def = {
+  "range", (PyCFunction)range_call, METH_NOARGS, NULL };
+
+static void
+range_cancel(PyObject *future)
 {
-    struct map_args *a = (struct map_args *)args;
-    PyObject *func;
+    PyObject *res;
 
-    func = gufunc_new(a->tbl, f->name, GM_CUDA_MANAGED_FUNC);
-    if (func == NULL) {
-        return -1;
+    res = PyObject_CallMethod(future, "cancel", NULL);
+    Py_XDECREF(res);
+    PyErr_Clear();
+}
+
+static void
+range_wait(py_range_t *r, PyObject *future)
+{
+    /* Reclaim the range if the executor has not started it. */
+    if (range_run(r)) {
+        if (future != NULL) {
+            range_cancel(future);
+        }
+        return;
     }
 
-    return PyModule_AddObject(a->module, f->name, func);
+    if (future != NULL && LOAD_INT(&r->state) != RANGE_DONE) {
+        PyObject *res = PyObject_CallMethod(future, "result", NULL);
+        if (res == NULL) {
+            PyErr_WriteUnraisable(future);
+        }
+        Py_XDECREF(res);
+    }
+
+    /* result() was interrupted while the range is still running. */
+    while (LOAD_INT(&r->state) != RANGE_DONE) {
+        Py_BEGIN_ALLOW_THREADS
+        Py_END_ALLOW_THREADS
+    }
 }
 
-static int
-Gumath_AddCudaFunctions(PyObject *m, const gm_tbl_t *tbl)
+static bool
+is_main_interpreter(void)
+{
+#if PY_VERSION_HEX >= 0x03090000
+    return PyInterpreterState_Get() == PyInterpreterState_Main();
+#else
+    return true;
+#endif
+}
+
+static void
+python_parallel_for(void *state, int64_t n, int64_t grain, int64_t nthreads,
+                    gm_range_t f, void *arg)
 {
-    struct map_args args = {m, tbl};
+    PyObject *ex = state;
+    PyGILState_STATE gstate;
+    PyObject **capsules;
+    PyObject **futures;
+    int64_t k, q, rem;
+
+    k = n / grain;
+    if (k > nthreads) {
+        k = nthreads;
+    }
+    if (k < 1) {
+        k = 1;
+    }
+    q = n / k;
+    rem = n % k;
+
+    if (k == 1) {
+        f(0, n, arg);
+        return;
+    }
+
+    gstate = PyGILState_Ensure();
+
+    /* The executor belongs to the main interpreter. */
+    if (!is_main_interpreter()) {
+        Py_BEGIN_ALLOW_THREADS
+        f(0, n, arg);
+        Py_END_ALLOW_THREADS
+        PyGILState_Release(gstate);
+        return;
+    }
+
+    capsules = PyMem_Calloc(k, sizeof *capsules);
+    futures = PyMem_Calloc(k, sizeof *futures);
+    if (capsules == NULL || futures == NULL) {
+        PyMem_Free(capsules);
+        PyMem_Free(futures);
+        Py_BEGIN_ALLOW_THREADS
+        f(0, n, arg);
+        Py_END_ALLOW_THREADS
+        PyGILState_Release(gstate);
+        return;
+    }
+
+    for (int64_t i = 0; i < k; i++) {
+        const int64_t begin = i * q + (i < rem ? i : rem);
+        const int64_t end = begin + q + (i < rem ? 1 : 0);
+        py_range_t *r;
+        PyObject *callable;
+
+        r = PyMem_Malloc(sizeof *r);
+        if (r != NULL) {
+            r->f = f;
+            r->arg = arg;
+            r->begin = begin;
+            r->end = end;
+            r->state = RANGE_PENDING;
+
+            capsules[i] = PyCapsule_New(r, NULL, range_capsule_free);
+            if (capsules[i] == NULL) {
+                PyMem_Free(r);
+            }
+        }
 
-    if (gm_tbl_map(tbl, add_cuda_function, &args) < 0) {
-        return -1;
+        if (capsules[i] == NULL) {
+            PyErr_Clear();
+            Py_BEGIN_ALLOW_THREADS
+            f(begin, end, arg);
+            Py_END_ALLOW_THREADS
+            continue;
+        }
+
+        /* The first range is run by the calling thread. */
+        if (i == 0) {
+            continue;
+        }
+
+        callable = PyCFunction_New(&range_call_def, capsules[i]);
+        if (callable != NULL) {
+            futures[i] = PyObject_CallMethod(ex, "submit", "O", callable);
+            Py_DECREF(callable);
+        }
+        if (futures[i] == NULL) {
+            PyErr_WriteUnraisable(ex);
+        }
     }
 
-    return 0;
+    /* Ranges that have not started by the time the first range is done
+       are reclaimed in range_wait(). */
+    for (int64_t i = 0; i < k; i++) {
+        if (capsules[i] != NULL) {
+            range_wait(PyCapsule_GetPointer(capsules[i], NULL), futures[i]);
+        }
+        Py_XDECREF(futures[i]);
+        Py_XDECREF(capsules[i]);
+    }
+
+    PyMem_Free(capsules);
+    PyMem_Free(futures);
+    PyGILState_Release(gstate);
 }
 
-static PyObject *
-init_api(void)
+/* Called by libgumath when the last loop on a replaced executor is done. */
+static void
+python_executor_release(void *state)
 {
-    gumath_api[Gufunc_CheckExact_INDEX] = (void *)Gufunc_CheckExact;
-    gumath_api[Gufunc_Check_INDEX] = (void *)Gufunc_Check;
-    gumath_api[Gumath_AddFunctions_INDEX] = (void *)Gumath_AddFunctions;
-    gumath_api[Gumath_AddFunctions_INDEX] = (void *)Gumath_AddFunctions;
-    gumath_api[Gumath_AddCudaFunctions_INDEX] = (void *)Gumath_AddCudaFunctions;
-
-    return PyCapsule_New(gumath_api, "gumath._gumath._API", NULL);
+    PyGILState_STATE gstate = PyGILState_Ensure();
+    Py_DECREF((PyObject *)state);
+    PyGILState_Release(gstate);
 }
 
+static PyObject *
+get_executor(PyObject *m UNUSED, PyObject *args UNUSED)
+{
+    PyObject *ex;
 
-/****************************************************************************/
-/*                                  Module                                  */
-/****************************************************************************/
+    GUMATH_LOCK();
+    ex = executor ? executor : Py_None;
+    Py_INCREF(ex);
+    GUMATH_UNLOCK();
+
+    return ex;
+}
 
 static PyObject *
-gufunc_vfold(PyObject *m GM_UNUSED, PyObject *args, PyObject *kwargs)
+set_executor(PyObject *m UNUSED, PyObject *obj)
 {
-    static char *kwlist[] = {"f", "acc", NULL};
-    PyObject *func = Py_None;
-    PyObject *acc = Py_None;
-    PyObject *tuple;
-    PyObject *dict;
-    PyObject *res;
-    Py_ssize_t size, i;
+    NDT_STATIC_CONTEXT(ctx);
+    PyObject *tmp;
     int ret;
 
-    ret = PyArg_ParseTupleAndKeywords(positional_empty, kwargs, "|$OO", kwlist,
-                                      &func, &acc);
-    if (ret < 0) {
+    if (!is_main_interpreter()) {
+        PyErr_SetString(PyExc_RuntimeError,
+            "the executor can only be set in the main interpreter");
         return NULL;
     }
 
-    if (!Gufunc_Check(func)) {
-        PyErr_Format(PyExc_TypeError,
-            "vfold: expected gufunc object, got '%.200s'", Py_TYPE(func));
-        return NULL;
+    if (obj == Py_None) {
+        GUMATH_LOCK();
+        tmp = executor;
+        (void)gm_set_executor(NULL, &ctx);
+        executor = NULL;
+        GUMATH_UNLOCK();
+        Py_XDECREF(tmp);
+        Py_RETURN_NONE;
     }
 
-    if (!Xnd_Check(acc)) {
-        PyErr_Format(PyExc_TypeError,
-            "vfold: expected xnd instance, got '%.200s'", Py_TYPE(acc));
+    if (!PyObject_HasAttrString(obj, "submit")) {
+        PyErr_SetString(PyExc_TypeError,
+            "executor must have a submit() method");
         return NULL;
     }
 
-    /* Push the accumulator onto the argument stack. */
-    size = PyTuple_Size(args);
-    tuple = PyTuple_New(size+1);
-    if (tuple == NULL) {
-        return NULL;
-    }
+    /* One reference for 'executor' and one that libgumath releases when
+       the executor has been replaced and its last loop has finished. */
+    gm_executor_t e = {
+      .name = "python",
+      .parallel_for = python_parallel_for,
+      .state = obj,
+      .release = python_executor_release };
 
-    Py_INCREF(acc);
-    PyTuple_SET_ITEM(tuple, 0, acc);
-    for (i = 0; i < size; i++) {
-        PyObject *v = PyTuple_GET_ITEM(args, i);
-        Py_INCREF(v);
-        PyTuple_SET_ITEM(tuple, i+1, v);
+    Py_INCREF(obj);
+    Py_INCREF(obj);
+    GUMATH_LOCK();
+    ret = gm_set_executor(&e, &ctx);
+    if (ret < 0) {
+        GUMATH_UNLOCK();
+        Py_DECREF(obj);
+        Py_DECREF(obj);
+        return seterr(&ctx);
     }
+    tmp = executor;
+    executor = obj;
+    GUMATH_UNLOCK();
+    Py_XDECREF(tmp);
 
-    /* Simultaneously use the accumulator as the 'out' argument. */
-    dict = PyDict_New();
-    if (dict == NULL) {
-        Py_DECREF(tuple);
+    Py_RETURN_NONE;
+}
+
+static PyObject *
+get_numa(PyObject *m UNUSED, PyObject *args UNUSED)
+{
+    const uint32_t policy = gm_numa_policy();
+
+    return Py_BuildValue("{s:i,s:O,s:O}",
+        "nodes", gm_numa_nodes(),
+        "pin", policy & GM_NUMA_PIN ? Py_True : Py_False,
+        "first_touch", policy & GM_NUMA_FIRST_TOUCH ? Py_True : Py_False);
+}
+
+static PyObject *
+set_numa(PyObject *m UNUSED, PyObject *args, PyObject *kwds)
+{
+    static char *kwlist[] = {"pin", "first_touch", NULL};
+    int pin = 0;
+    int first_touch = 0;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "|pp", kwlist, &pin,
+                                     &first_touch)) {
         return NULL;
     }
-    if (PyDict_SetItemString(dict, "out", acc) < 0) {
-        Py_DECREF(dict);
-        Py_DECREF(tuple);
-        return NULL;
+
+    gm_set_numa_policy((pin ? GM_NUMA_PIN : 0) |
+                       (first_touch ? GM_NUMA_FIRST_TOUCH : 0));
+
+    Py_RETURN_NONE;
+}
+
+/* Keep 'hook' alive in st->hooks and publish it in 'slot'. */
+static int
+set_hook(gumath_state *st, PyObject **slot, PyObject *hook)
+{
+    int ret = 0;
+
+    Py_BEGIN_CRITICAL_SECTION(st->hooks);
+    if (hook != NULL) {
+        Py_ssize_t i, n = PyList_GET_SIZE(st->hooks);
+        for (i = 0; i < n; i++) {
+            if (PyList_GET_ITEM(st->hooks, i) == hook) {
+                break;
+            }
+        }
+        if (i == n) {
+            ret = PyList_Append(st->hooks, hook);
+        }
     }
-    if (PyDict_SetItemString(dict, "cls", (PyObject *)(Py_TYPE(acc))) < 0) {
-        Py_DECREF(dict);
-        Py_DECREF(tuple);
+    if (ret == 0) {
+        STORE_PTR(slot, hook);
+    }
+    Py_END_CRITICAL_SECTION();
+
+    return ret;
+}
+
+static PyObject *
+set_await_hook(PyObject *m, PyObject *obj)
+{
+    gumath_state *st = get_state(m);
+
+    if (!PyCallable_Check(obj)) {
+        PyErr_SetString(PyExc_TypeError, "await hook must be callable");
         return NULL;
     }
 
-    res = _gufunc_call((GufuncObject *)func, tuple, dict, false, false);
-    Py_DECREF(tuple);
-    Py_DECREF(dict);
+    if (set_hook(st, &st->await_hook, obj) < 0) {
+        return NULL;
+    }
 
-    return res;
+    Py_RETURN_NONE;
 }
 
+/* Enable or disable deferred evaluation in the calling thread. */
 static PyObject *
-unsafe_add_kernel(PyObject *m GM_UNUSED, PyObject *args, PyObject *kwds)
+set_deferring_flag(PyObject *m, PyObject *obj)
 {
-    NDT_STATIC_CONTEXT(ctx);
-    static char *kwlist[] = {"name", "sig", "tag", "ptr", NULL};
-    gm_kernel_init_t k = {NULL};
-    gm_func_t *f;
-    char *name;
-    char *sig;
-    char *tag;
-    PyObject *ptr;
-    void *p;
+    int flag = PyObject_IsTrue(obj);
 
-    if (!PyArg_ParseTupleAndKeywords(args, kwds, "sssO", kwlist, &name, &sig,
-        &tag, &ptr)) {
+    if (flag < 0) {
         return NULL;
     }
 
-    p = PyLong_AsVoidPtr(ptr);
-    if (p == NULL) {
+    if (set_deferring(get_state(m), flag) < 0) {
         return NULL;
     }
 
-    k.name = name;
-    k.sig = sig;
+    Py_RETURN_NONE;
+}
 
-    if (strcmp(tag, "Opt") == 0) { /* XXX */
-        k.OptC = p;
-    }
-    else if (strcmp(tag, "C") == 0) {
-        k.C = p;
+static PyObject *
+set_deferred_hook(PyObject *m, PyObject *obj)
+{
+    gumath_state *st = get_state(m);
+
+    if (obj == Py_None) {
+        obj = NULL;
     }
-    else if (strcmp(tag, "Fortran") == 0) {
-        k.Fortran = p;
+    else if (!PyCallable_Check(obj)) {
+        PyErr_SetString(PyExc_TypeError, "deferred hook must be callable");
+        return NULL;
     }
-    else if (strcmp(tag, "Xnd") == 0) {
-        k.Xnd = p;
+
+    if (set_hook(st, &st->deferred_hook, obj) < 0) {
+        return NULL;
     }
-    else if (strcmp(tag, "Strided") == 0) {
-        k.Strided = p;
+
+    Py_RETURN_NONE;
+}
+
+static PyObject *
+get_pool_stats(PyObject *m UNUSED, PyObject *args UNUSED)
+{
+    gm_pool_stats_t stats;
+
+    gm_pool_stats(&stats);
+
+    return Py_BuildValue("{sLsLsLsLsLsLsL}",
+                         "cap", (long long)stats.cap,
+                         "cached", (long long)stats.cached,
+                         "in_use", (long long)stats.in_use,
+                         "peak", (long long)stats.peak,
+                         "hits", (long long)stats.hits,
+                         "misses", (long long)stats.misses,
+                         "evictions", (long long)stats.evictions);
+}
+
+static PyObject *
+set_pool_cap(PyObject *m UNUSED, PyObject *obj)
+{
+    int64_t n;
+
+    n = PyLong_AsLongLong(obj);
+    if (n == -1 && PyErr_Occurred()) {
+        return NULL;
     }
-    else {
+
+    if (n < 0) {
         PyErr_SetString(PyExc_ValueError,
-            "tag must be 'Opt', 'C', 'Fortran', 'Xnd' or 'Strided'");
+            "pool cap must be greater than or equal to 0");
         return NULL;
     }
 
-    if (gm_add_kernel(table, &k, &ctx) < 0) {
-        return seterr(&ctx);
+    gm_pool_set_cap(n);
+
+    Py_RETURN_NONE;
+}
+
+static PyObject *
+clear_pool(PyObject *m UNUSED, PyObject *args UNUSED)
+{
+    gm_pool_clear();
+    Py_RETURN_NONE;
+}
+
+static PyObject *
+set_kernel_stats(PyObject *m UNUSED, PyObject *obj)
+{
+    int enable = PyObject_IsTrue(obj);
+    if (enable < 0) {
+        return NULL;
     }
 
-    f = gm_tbl_find(table, name, &ctx);
-    if (f == NULL) {
+    gm_stats_enable(enable);
+
+    Py_RETURN_NONE;
+}
+
+static PyObject *
+set_kernel_counters(PyObject *m UNUSED, PyObject *obj)
+{
+    NDT_STATIC_CONTEXT(ctx);
+    int enable = PyObject_IsTrue(obj);
+    if (enable < 0) {
+        return NULL;
+    }
+
+    if (gm_counters_enable(enable, &ctx) < 0) {
         return seterr(&ctx);
     }
 
-    return gufunc_new(table, f->name, GM_CPU_FUNC);
+    Py_RETURN_NONE;
 }
 
-static void
-init_max_threads(void)
+static int
+add_kernel_stats(const gm_stats_t *e, void *state)
 {
-    PyObject *os = NULL;
-    PyObject *n = NULL;
-    int64_t i64;
+    NDT_STATIC_CONTEXT(ctx);
+    PyObject *list = (PyObject *)state;
+    const char *func = NULL;
+    PyObject *dict;
+    char *sig;
+    int ret;
 
-    os = PyImport_ImportModule("os");
-    if (os == NULL) {
-        goto error;
+    GUMATH_LOCK();
+    for (int i = 0; i < ntables && func == NULL; i++) {
+        func = gm_stats_func(tables[i], e->set);
     }
+    GUMATH_UNLOCK();
 
-    n = PyObject_CallMethod(os, "cpu_count", "()");
-    if (n == NULL) {
-        goto error;
+    sig = ndt_as_string(e->set->sig, &ctx);
+    if (sig == NULL) {
+        (void)seterr(&ctx);
+        return -1;
     }
 
-    i64 = PyLong_AsLongLong(n);
-    if (i64 < 1) {
-        goto error;
+    dict = Py_BuildValue("{szsssssLsLsLsLsLsdsLsLsLsL}",
+                         "func", func,
+                         "sig", sig,
+                         "variant", gm_variant_name(e->flag),
+                         "calls", (long long)e->calls,
+                         "elements", (long long)e->elements,
+                         "bytes", (long long)e->bytes,
+                         "threaded", (long long)e->threaded,
+                         "fallbacks", (long long)e->fallbacks,
+                         "time", e->time,
+                         "cycles", (long long)e->counters.cycles,
+                         "instructions", (long long)e->counters.instructions,
+                         "cache_misses", (long long)e->counters.cache_misses,
+                         "branch_misses", (long long)e->counters.branch_misses);
+    ndt_free(sig);
+    if (dict == NULL) {
+        return -1;
     }
 
-    max_threads = i64;
+    ret = PyList_Append(list, dict);
+    Py_DECREF(dict);
 
-out:
-    Py_XDECREF(os);
-    Py_XDECREF(n);
-    return;
+    return ret;
+}
 
-error:
-    if (PyErr_Occurred()) {
-        PyErr_Clear();
+static PyObject *
+get_kernel_stats(PyObject *m UNUSED, PyObject *args UNUSED)
+{
+    NDT_STATIC_CONTEXT(ctx);
+    PyObject *list;
+
+    list = PyList_New(0);
+    if (list == NULL) {
+        return NULL;
     }
-    PyErr_WarnEx(PyExc_RuntimeWarning,
-        "could not get cpu count: using max_threads==1", 1);
-    goto out;
+
+    if (gm_stats_map(add_kernel_stats, list, &ctx) < 0) {
+        Py_DECREF(list);
+        return PyErr_Occurred() ? NULL : seterr(&ctx);
+    }
+
+    return list;
 }
 
 static PyObject *
-get_max_threads(PyObject *m UNUSED, PyObject *args UNUSED)
+clear_kernel_stats(PyObject *m UNUSED, PyObject *args UNUSED)
 {
-    return PyLong_FromLongLong(max_threads);
+    gm_stats_reset();
+    Py_RETURN_NONE;
 }
 
 static PyObject *
-set_max_threads(PyObject *m UNUSED, PyObject *obj)
+trace_start(PyObject *m UNUSED, PyObject *obj)
 {
-    int64_t n;
+    NDT_STATIC_CONTEXT(ctx);
+    PyObject *path;
+    int ret;
 
-    n = PyLong_AsLongLong(obj);
-    if (n == -1 && PyErr_Occurred()) {
+    if (!PyUnicode_FSConverter(obj, &path)) {
         return NULL;
     }
 
-    if (n <= 0) {
-        PyErr_SetString(PyExc_ValueError,
-            "max_threads must be greater than 0");
-        return NULL;
+    ret = gm_trace_start(PyBytes_AS_STRING(path), &ctx);
+    Py_DECREF(path);
+    if (ret < 0) {
+        return seterr(&ctx);
     }
 
-    max_threads = n;
+    Py_RETURN_NONE;
+}
+
+static PyObject *
+trace_stop(PyObject *m UNUSED, PyObject *args UNUSED)
+{
+    NDT_STATIC_CONTEXT(ctx);
+
+    if (gm_trace_stop(&ctx) < 0) {
+        return seterr(&ctx);
+    }
 
     Py_RETURN_NONE;
 }
@@ -845,99 +3465,263 @@ static PyMethodDef gumath_methods [] =
 {
   /* Methods */
   { "vfold", (PyCFunction)gufunc_vfold, METH_VARARGS|METH_KEYWORDS, NULL },
+  { "_block_view", (PyCFunction)block_view, METH_VARARGS, NULL },
+  { "task_graph", (PyCFunction)graph_new, METH_NOARGS, NULL },
+  { "stream_apply", (PyCFunction)stream_apply, METH_VARARGS|METH_KEYWORDS, NULL },
+  { "_arrow_export", (PyCFunction)arrow_export, METH_O, NULL },
+  { "_arrow_import", (PyCFunction)arrow_import, METH_VARARGS, NULL },
   { "unsafe_add_kernel", (PyCFunction)unsafe_add_kernel, METH_VARARGS|METH_KEYWORDS, NULL },
   { "get_max_threads", (PyCFunction)get_max_threads, METH_NOARGS, NULL },
   { "set_max_threads", (PyCFunction)set_max_threads, METH_O, NULL },
+  { "cpu_isa", (PyCFunction)cpu_isa, METH_NOARGS, NULL },
+  { "get_thread_cutoff", (PyCFunction)get_thread_cutoff, METH_NOARGS, NULL },
+  { "set_thread_cutoff", (PyCFunction)set_thread_cutoff, METH_O, NULL },
+  { "get_yield_chunk", (PyCFunction)get_yield_chunk, METH_NOARGS, NULL },
+  { "set_yield_chunk", (PyCFunction)set_yield_chunk, METH_O, NULL },
+  { "get_reserved_threads", (PyCFunction)get_reserved_threads, METH_NOARGS, NULL },
+  { "set_reserved_threads", (PyCFunction)set_reserved_threads, METH_O, NULL },
+  { "get_executor", (PyCFunction)get_executor, METH_NOARGS, NULL },
+  { "set_executor", (PyCFunction)set_executor, METH_O, NULL },
+  { "get_numa", (PyCFunction)get_numa, METH_NOARGS, NULL },
+  { "set_numa", (PyCFunction)set_numa, METH_VARARGS|METH_KEYWORDS, NULL },
+  { "get_pool_stats", (PyCFunction)get_pool_stats, METH_NOARGS, NULL },
+  { "set_pool_cap", (PyCFunction)set_pool_cap, METH_O, NULL },
+  { "clear_pool", (PyCFunction)clear_pool, METH_NOARGS, NULL },
+  { "set_kernel_stats", (PyCFunction)set_kernel_stats, METH_O, NULL },
+  { "set_kernel_counters", (PyCFunction)set_kernel_counters, METH_O, NULL },
+  { "get_kernel_stats", (PyCFunction)get_kernel_stats, METH_NOARGS, NULL },
+  { "clear_kernel_stats", (PyCFunction)clear_kernel_stats, METH_NOARGS, NULL },
+  { "trace_start", (PyCFunction)trace_start, METH_O, NULL },
+  { "trace_stop", (PyCFunction)trace_stop, METH_NOARGS, NULL },
+  { "_set_deferred_hook", (PyCFunction)set_deferred_hook, METH_O, NULL },
+  { "_set_deferring", (PyCFunction)set_deferring_flag, METH_O, NULL },
+  { "_set_await_hook", (PyCFunction)set_await_hook, METH_O, NULL },
   { NULL, NULL, 1 }
 };
 
 
-static struct PyModuleDef gumath_module = {
-    PyModuleDef_HEAD_INIT,        /* m_base */
-    "_gumath",                    /* m_name */
-    NULL,                         /* m_doc */
-    -1,                           /* m_size */
-    gumath_methods,               /* m_methods */
-    NULL,                         /* m_slots */
-    NULL,                         /* m_traverse */
-    NULL,                         /* m_clear */
-    NULL                          /* m_free */
-};
+static int
+gumath_traverse(PyObject *m, visitproc visit, void *arg)
+{
+    gumath_state *st = get_state(m);
 
+    if (st == NULL) {
+        return 0;
+    }
 
-PyMODINIT_FUNC
-PyInit__gumath(void)
+    Py_VISIT(st->gufunc_type);
+    Py_VISIT(st->future_type);
+    Py_VISIT(st->pool_buffer_type);
+    Py_VISIT(st->arrow_owner_type);
+    Py_VISIT(st->graph_type);
+    Py_VISIT(st->hooks);
+    return 0;
+}
+
+static int
+gumath_clear(PyObject *m)
+{
+    gumath_state *st = get_state(m);
+
+    if (st == NULL) {
+        return 0;
+    }
+
+    STORE_PTR(&st->deferred_hook, NULL);
+    STORE_PTR(&st->await_hook, NULL);
+    Py_CLEAR(st->hooks);
+    Py_CLEAR(st->positional_empty);
+    Py_CLEAR(st->gufunc_type);
+    Py_CLEAR(st->future_type);
+    Py_CLEAR(st->pool_buffer_type);
+    Py_CLEAR(st->arrow_owner_type);
+    Py_CLEAR(st->graph_type);
+    return 0;
+}
+
+/* The functions hold a reference to the module, so none of them can use
+   the table any more. */
+static void
+gumath_free(void *m)
+{
+    gumath_state *st = get_state((PyObject *)m);
+
+    (void)gumath_clear((PyObject *)m);
+
+    if (st != NULL && st->table != NULL) {
+        unregister_table(st->table);
+        gm_tbl_del(st->table);
+        st->table = NULL;
+    }
+
+#if PY_VERSION_HEX >= 0x03070000
+    if (st != NULL && st->deferring != NULL) {
+        PyThread_tss_free(st->deferring);
+        st->deferring = NULL;
+    }
+#endif
+}
+
+/* Process-wide initialization, shared by all interpreters. */
+static void
+init_process(void)
 {
-    NDT_STATIC_CONTEXT(ctx);
-    PyObject *m = NULL;
-    static PyObject *capsule = NULL;
     static int initialized = 0;
 
+    GUMATH_LOCK();
     if (!initialized) {
-       dummy = &xnd_error;
+        dummy = &xnd_error;
 
-       gm_init();
+        gm_init();
 
-       if (import_ndtypes() < 0) {
-            return NULL;
-       }
-       if (import_xnd() < 0) {
-            return NULL;
-       }
+        init_api();
 
-       capsule = init_api();
-       if (capsule == NULL) {
-            return NULL;
-       }
+        initialized = 1;
+    }
+    GUMATH_UNLOCK();
+}
+
+static int
+gumath_exec(PyObject *m)
+{
+    NDT_STATIC_CONTEXT(ctx);
+    gumath_state *st = get_state(m);
+    PyObject *capsule;
+
+    if (import_ndtypes() < 0) {
+        return -1;
+    }
+    if (import_xnd() < 0) {
+        return -1;
+    }
 
-       table = gm_tbl_new(&ctx);
-       if (table == NULL) {
-           return seterr(&ctx);
-       }
+    init_process();
 
-       init_max_threads();
+    st->table = gm_tbl_new(&ctx);
+    if (st->table == NULL) {
+        (void)seterr(&ctx);
+        return -1;
+    }
 
-       initialized = 1;
+    st->gufunc_type = (PyTypeObject *)PyType_FromSpec(&gufunc_spec);
+    if (st->gufunc_type == NULL) {
+        return -1;
     }
 
-    if (PyType_Ready(&Gufunc_Type) < 0) {
-        return NULL;
+    st->future_type = (PyTypeObject *)PyType_FromSpec(&future_spec);
+    if (st->future_type == NULL) {
+        return -1;
     }
 
-    xnd = Xnd_GetType();
-    if (xnd == NULL) {
-        goto error;
+    st->graph_type = (PyTypeObject *)PyType_FromSpec(&graph_spec);
+    if (st->graph_type == NULL) {
+        return -1;
     }
 
-    positional_empty = PyTuple_New(0);
-    if (positional_empty == NULL) {
-        goto error;
+#if PY_VERSION_HEX >= 0x03090000
+    st->pool_buffer_type = (PyTypeObject *)PyType_FromSpec(&pool_buffer_spec);
+    if (st->pool_buffer_type == NULL) {
+        return -1;
     }
 
-    m = PyModule_Create(&gumath_module);
-    if (m == NULL) {
-        goto error;
+    st->arrow_owner_type = (PyTypeObject *)PyType_FromSpec(&arrow_owner_spec);
+    if (st->arrow_owner_type == NULL) {
+        return -1;
     }
+#endif
 
-    Py_INCREF(&Gufunc_Type);
-    if (PyModule_AddObject(m, "gufunc", (PyObject *)&Gufunc_Type) < 0) {
-        goto error;
+    st->max_threads = 1;
+    init_max_threads(st);
+
+    st->xnd = Xnd_GetType();
+    if (st->xnd == NULL) {
+        return -1;
     }
 
-    Py_INCREF(capsule);
-    if (PyModule_AddObject(m, "_API", capsule) < 0) {
-        goto error;
+    st->positional_empty = PyTuple_New(0);
+    if (st->positional_empty == NULL) {
+        return -1;
     }
 
-    if (Gumath_AddFunctions(m, table) < 0) {
-        goto error;
+    st->hooks = PyList_New(0);
+    if (st->hooks == NULL) {
+        return -1;
     }
 
-    return m;
+#if PY_VERSION_HEX >= 0x03070000
+    st->deferring = PyThread_tss_alloc();
+    if (st->deferring == NULL) {
+        PyErr_NoMemory();
+        return -1;
+    }
+    if (PyThread_tss_create(st->deferring) != 0) {
+        PyErr_SetString(PyExc_RuntimeError, "cannot create thread-local storage");
+        return -1;
+    }
+#endif
 
-error:
-    Py_CLEAR(positional_empty);
-    Py_CLEAR(xnd);
-    Py_CLEAR(m);
-    return NULL;
+    Py_INCREF(st->gufunc_type);
+    if (PyModule_AddObject(m, "gufunc", (PyObject *)st->gufunc_type) < 0) {
+        Py_DECREF(st->gufunc_type);
+        return -1;
+    }
+
+    Py_INCREF(st->future_type);
+    if (PyModule_AddObject(m, "Future", (PyObject *)st->future_type) < 0) {
+        Py_DECREF(st->future_type);
+        return -1;
+    }
+
+    Py_INCREF(st->graph_type);
+    if (PyModule_AddObject(m, "TaskGraph", (PyObject *)st->graph_type) < 0) {
+        Py_DECREF(st->graph_type);
+        return -1;
+    }
+
+    capsule = PyCapsule_New(gumath_api, "gumath._gumath._API", NULL);
+    if (capsule == NULL) {
+        return -1;
+    }
+    if (PyModule_AddObject(m, "_API", capsule) < 0) {
+        Py_DECREF(capsule);
+        return -1;
+    }
+
+    return add_functions(m, m, st->table, GM_CPU_FUNC);
+}
+
+/*
+ * Types and registered kernels are per interpreter.  The executor and the
+ * statistics registry are process-wide and protected by the GIL in builds
+ * with a GIL, so interpreters must share the GIL.  Free-threaded builds are
+ * supported.
+ */
+static PyModuleDef_Slot gumath_slots[] = {
+  { Py_mod_exec, (void *)gumath_exec },
+#ifdef Py_mod_multiple_interpreters
+  { Py_mod_multiple_interpreters, Py_MOD_MULTIPLE_INTERPRETERS_SUPPORTED },
+#endif
+#ifdef Py_mod_gil
+  { Py_mod_gil, Py_MOD_GIL_NOT_USED },
+#endif
+  { 0, NULL }
+};
+
+static struct PyModuleDef gumath_module = {
+    PyModuleDef_HEAD_INIT,        /* m_base */
+    "_gumath",                    /* m_name */
+    NULL,                         /* m_doc */
+    sizeof(gumath_state),         /* m_size */
+    gumath_methods,               /* m_methods */
+    gumath_slots,                 /* m_slots */
+    gumath_traverse,              /* m_traverse */
+    gumath_clear,                 /* m_clear */
+    gumath_free                   /* m_free */
+};
+
+
+PyMODINIT_FUNC
+PyInit__gumath(void)
+{
+    return PyModuleDef_Init(&gumath_module);
 }
@@ -17,13 +17,74 @@ static gm_tbl_t *table = NULL;
 /*                                  Module                                  */
 /****************************************************************************/
 
+/* The kernel table is shared by all interpreters. */
+static int
+init_table(void)
+{
+    NDT_STATIC_CONTEXT(ctx);
+    gm_tbl_t *t = NULL;
+
+    if (table != NULL) {
+        return 0;
+    }
+
+    t = gm_tbl_new(&ctx);
+    if (t == NULL) {
+        goto error;
+    }
+
+    if (gm_init_cuda_unary_kernels(t, &ctx) < 0) {
+        goto error;
+    }
+
+    if (gm_init_cuda_binary_kernels(t, &ctx) < 0) {
+        goto error;
+    }
+
+    table = t;
+    return 0;
+
+error:
+    gm_tbl_del(t);
+    (void)Ndt_SetError(&ctx);
+    return -1;
+}
+
+static int
+cuda_exec(PyObject *m)
+{
+    if (import_ndtypes() < 0) {
+        return -1;
+    }
+    if (import_gumath() < 0) {
+        return -1;
+    }
+
+    if (init_table() < 0) {
+        return -1;
+    }
+
+    return Gumath_AddCudaFunctions(m, table);
+}
+
+static PyModuleDef_Slot cuda_slots[] = {
+  { Py_mod_exec, (void *)cuda_exec },
+#ifdef Py_mod_multiple_interpreters
+  { Py_mod_multiple_interpreters, Py_MOD_MULTIPLE_INTERPRETERS_SUPPORTED },
+#endif
+#ifdef Py_mod_gil
+  { Py_mod_gil, Py_MOD_GIL_NOT_USED },
+#endif
+  { 0, NULL }
+};
+
 static struct PyModuleDef cuda_module = {
     PyModuleDef_HEAD_INIT,        /* m_base */
     "cuda",                       /* m_name */
     NULL,                         /* m_doc */
-    -1,                           /* m_size */
+    0,                            /* m_size */
     NULL,                         /* m_methods */
-    NULL,                         /* m_slots */
+    cuda_slots,                   /* m_slots */
     NULL,                         /* m_traverse */
     NULL,                         /* m_clear */
     NULL                          /* m_free */
@@ -33,46 +94,5 @@ static struct PyModuleDef cuda_module = {
 PyMODINIT_FUNC
 PyInit_cuda(void)
 {
-    NDT_STATIC_CONTEXT(ctx);
-    PyObject *m = NULL;
-    static int initialized = 0;
-
-    if (!initialized) {
-       if (import_ndtypes() < 0) {
-            return NULL;
-       }
-       if (import_gumath() < 0) {
-            return NULL;
-       }
-
-       table = gm_tbl_new(&ctx);
-       if (table == NULL) {
-           return Ndt_SetError(&ctx);
-       }
-
-       if (gm_init_cuda_unary_kernels(table, &ctx) < 0) {
-           return Ndt_SetError(&ctx);
-       }
-
-       if (gm_init_cuda_binary_kernels(table, &ctx) < 0) {
-           return Ndt_SetError(&ctx);
-       }
-
-       initialized = 1;
-    }
-
-    m = PyModule_Create(&cuda_module);
-    if (m == NULL) {
-        goto error;
-    }
-
-    if (Gumath_AddCudaFunctions(m, table) < 0) {
-        goto error;
-    }
-
-    return m;
-
-error:
-    Py_CLEAR(m);
-    return NULL;
+    return PyModuleDef_Init(&cuda_module);
 }
@@ -58,6 +58,7 @@ typedef struct {
     uint32_t flags;      /* memory target */
     char *name;          /* function name */
     PyObject *identity;  /* identity element */
+    PyObject *module;    /* _gumath module of the creating interpreter */
 } GufuncObject;
 
 
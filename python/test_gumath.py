@@ -37,11 +37,15 @@ from xnd import xnd
 from ndtypes import ndt
 from extending import Graph
 import sys, time
+import os, json, tempfile
+import array, struct
 import platform
+import threading
 import math
 import cmath
 import unittest
 import argparse
+from concurrent.futures import Future, ThreadPoolExecutor
 from gumath_aux import *
 
 try:
@@ -55,6 +59,11 @@ try:
 except ImportError:
     np = None
 
+try:
+    import pyarrow as pa
+except ImportError:
+    pa = None
+
 SKIP_LONG = True
 SKIP_BRUTE_FORCE = True
 
@@ -69,6 +78,51 @@ class TestAPI(unittest.TestCase):
         self.assertRaises(TypeError, gm.gufunc.__new__)
         self.assertRaises(TypeError, gm.gufunc.__new__, 1)
 
+    def test_concurrent_calls(self):
+
+        x = xnd([float(i) for i in range(1000)])
+        ans = [math.sin(float(i)) for i in range(1000)]
+
+        def call(_):
+            return fn.sin(x).value
+
+        with ThreadPoolExecutor(4) as pool:
+            for v in pool.map(call, range(32)):
+                self.assertEqual(v, ans)
+
+    def test_subinterpreter(self):
+        try:
+            import _testcapi
+        except ImportError:
+            self.skipTest("test requires _testcapi")
+
+        code = "import sys; sys.path[:0] = %r\n" % sys.path + \
+               "import gumath as gm, gumath.functions as fn\n" + \
+               "from xnd import xnd\n" + \
+               "assert fn.add(xnd([1, 2]), xnd([3, 4])).value == [4, 6]\n" + \
+               "assert type(fn.add) is gm.gufunc\n" + \
+               "gm.set_max_threads(4)\n" + \
+               "x = xnd([2.0] * 100000)\n" + \
+               "assert fn.multiply(x, x)[99999] == 4.0\n" + \
+               "gm.set_max_threads(1)\n"
+
+        n = gm.get_max_threads()
+        cutoff = gm.get_thread_cutoff()
+        pool = ThreadPoolExecutor(2)
+        gm.set_max_threads(3)
+        gm.set_thread_cutoff(100)
+        try:
+            # The executor of the main interpreter is not used by others.
+            gm.set_executor(CountingExecutor(pool))
+            self.assertEqual(_testcapi.run_in_subinterp(code), 0)
+            # Settings are per interpreter.
+            self.assertEqual(gm.get_max_threads(), 3)
+        finally:
+            gm.set_executor(None)
+            gm.set_max_threads(n)
+            gm.set_thread_cutoff(cutoff)
+            pool.shutdown()
+
 
 class TestCall(unittest.TestCase):
 
@@ -217,6 +271,99 @@ class TestCall(unittest.TestCase):
         self.assertEqual(x.value, 23)
         self.assertEqual(y.value, 3)
 
+    def test_reduce_deterministic(self):
+
+        def blocked_sum(lst, block):
+            p = [0.0] * ((len(lst) + block - 1) // block)
+            for j in range(block):
+                for i in range(len(p)):
+                    if i * block + j < len(lst):
+                        p[i] += lst[i * block + j]
+            m = len(p)
+            while m > 1:
+                h = m // 2
+                for i in range(h):
+                    p[i] += p[m-h+i]
+                m -= h
+            return p[0]
+
+        n = gm.get_max_threads()
+        cutoff = gm.get_thread_cutoff()
+        block = gm.get_reduce_block()
+        gm.set_thread_cutoff(0)
+        gm.set_reduce_block(64)
+        try:
+            lst = [1.0 / (i + 1) for i in range(10007)]
+            x = xnd(lst)
+            ans = blocked_sum(lst, 64)
+            for threads in (1, 2, 3, 4):
+                gm.set_max_threads(threads)
+                self.assertEqual(gm.reduce(fn.add, x).value, ans)
+
+            # Full blocks only, and a strided view with a negative step.
+            self.assertEqual(gm.reduce(fn.add, x[0:640]).value,
+                             blocked_sum(lst[0:640], 64))
+            self.assertEqual(gm.reduce(fn.add, x[::-3]).value,
+                             blocked_sum(lst[::-3], 64))
+
+            rows = [[float(i * j % 17) for j in range(5)] for i in range(300)]
+            y = gm.reduce(fn.add, xnd(rows), axes=0)
+            self.assertEqual(y.value, [sum(r[j] for r in rows) for j in range(5)])
+
+            y = gm.reduce(fn.add, xnd(rows), axes=None)
+            self.assertEqual(y.value, sum(map(sum, rows)))
+
+            y = gm.reduce(fn.add, xnd([], dtype="float64"))
+            self.assertEqual(y.value, 0)
+        finally:
+            gm.set_max_threads(n)
+            gm.set_thread_cutoff(cutoff)
+            gm.set_reduce_block(block)
+
+        self.assertRaises(ValueError, gm.set_reduce_block, -1)
+        self.assertRaises(TypeError, gm.set_reduce_block, 1.0)
+
+    def test_map(self):
+        items = [xnd([float(i)] * (i % 3 + 1)) for i in range(10)]
+        ys = fn.sin.map(items)
+        self.assertEqual(len(ys), 10)
+        for i, y in enumerate(ys):
+            self.assertEqual(y, xnd([math.sin(float(i))] * (i % 3 + 1)))
+
+        items = [(xnd([i, i+1]), xnd([10, 20])) for i in range(5)]
+        items.append((xnd([1.5]), xnd([2.5])))
+        ys = fn.add.map(items)
+        for i in range(5):
+            self.assertEqual(ys[i], xnd([i+10, i+21]))
+        self.assertEqual(ys[5], xnd([4.0]))
+
+        ys = ex.divmod10.map([xnd(233), xnd(17)])
+        self.assertEqual([(x.value, y.value) for x, y in ys], [(23, 3), (1, 7)])
+
+        self.assertEqual(fn.sin.map([]), [])
+
+        # Many groups, revisited out of order.
+        items = [xnd([1.0] * (i % 300 + 1)) for i in range(1200)]
+        ys = fn.sin.map(items)
+        for i in (0, 299, 300, 777, 1199):
+            self.assertEqual(ys[i], xnd([math.sin(1.0)] * (i % 300 + 1)))
+
+        n = gm.get_max_threads()
+        cutoff = gm.get_thread_cutoff()
+        gm.set_max_threads(4)
+        gm.set_thread_cutoff(0)
+        try:
+            items = [xnd([float(i), float(i+1)]) for i in range(1000)]
+            ys = fn.multiply.map([(x, x) for x in items])
+            self.assertEqual(ys[999], xnd([999.0 * 999.0, 1000.0 * 1000.0]))
+        finally:
+            gm.set_max_threads(n)
+            gm.set_thread_cutoff(cutoff)
+
+        self.assertRaises(TypeError, fn.sin.map, [1.0])
+        self.assertRaises(TypeError, fn.add.map, [(xnd(1), xnd(2)), (xnd(1),)])
+        self.assertRaises(TypeError, fn.sin.map, [xnd(1.0), xnd("abc")])
+
 
 class TestMissingValues(unittest.TestCase):
 
@@ -545,6 +692,41 @@ class TestRaggedArrays(unittest.TestCase):
         y = fn.sin(x)
         self.assertEqual(y.value, ans)
 
+    def test_threads(self):
+        n = gm.get_max_threads()
+        cutoff = gm.get_thread_cutoff()
+        gm.set_max_threads(4)
+        gm.set_thread_cutoff(0)
+        try:
+            # One long row followed by many short ones.
+            lst = [[float(i) for i in range(1000)]] + \
+                  [[float(i)] * (i % 5) for i in range(200)]
+            x = xnd(lst)
+            e = fn.sin.explain(x)
+            self.assertEqual(e['threads'], 4)
+            self.assertIn('rows', e['reason'])
+            y = fn.sin(x)
+            self.assertEqual(y.value, [[math.sin(v) for v in row] for row in lst])
+
+            z = fn.add(x, x)
+            self.assertEqual(z.value, [[v + v for v in row] for row in lst])
+
+            # Each range of rows is applied in one call on a slice of the
+            # var dimension, which also works for sliced inputs.
+            y = fn.sin(x[1:150])
+            self.assertEqual(y.value, [[math.sin(v) for v in row] for row in lst[1:150]])
+
+            x = xnd([[[1.0], [2.0, 3.0]], [], [[4.0, 5.0, 6.0]]])
+            y = fn.sin(x)
+            self.assertEqual(y.value, [[[math.sin(1.0)], [math.sin(2.0), math.sin(3.0)]], [],
+                                       [[math.sin(4.0), math.sin(5.0), math.sin(6.0)]]])
+
+            gm.set_thread_cutoff(10000)
+            self.assertEqual(fn.sin.explain(xnd(lst))['threads'], 1)
+        finally:
+            gm.set_max_threads(n)
+            gm.set_thread_cutoff(cutoff)
+
 
 class TestFlexibleArrays(unittest.TestCase):
 
@@ -595,6 +777,34 @@ class TestFlexibleArrays(unittest.TestCase):
         z = fn.add(x, y)
         self.assertEqual(z.value, ans)
 
+    def test_threads(self):
+        n = gm.get_max_threads()
+        cutoff = gm.get_thread_cutoff()
+        gm.set_max_threads(4)
+        gm.set_thread_cutoff(0)
+        try:
+            lst = [[float(i)] * (i % 7) for i in range(100)]
+            x = xnd(lst, type="array * array * float64")
+            e = fn.add.explain(x, x)
+            self.assertEqual(e['threads'], 4)
+            self.assertIn('rows', e['reason'])
+            y = fn.add(x, x)
+            self.assertEqual(y.value, [[v + v for v in row] for row in lst])
+
+            # The elements are counted in the data of the first argument.
+            nelem = sum(len(row) for row in lst)
+            gm.set_thread_cutoff(nelem)
+            self.assertEqual(fn.add.explain(x, x)['threads'], 4)
+            gm.set_thread_cutoff(nelem + 1)
+            e = fn.add.explain(x, x)
+            self.assertEqual(e['threads'], 1)
+            self.assertIn('GM_THREAD_CUTOFF', e['reason'])
+            y = fn.add(x, x)
+            self.assertEqual(y.value, [[v + v for v in row] for row in lst])
+        finally:
+            gm.set_max_threads(n)
+            gm.set_thread_cutoff(cutoff)
+
 
 class TestGraphs(unittest.TestCase):
 
@@ -821,6 +1031,84 @@ class TestOut(unittest.TestCase):
         self.assertIs(ans, z)
         self.assertEqual(ans, xnd([2, 4, 6]))
 
+    def test_inplace_cpu(self):
+        # exact aliasing
+        x = xnd([1, 2, 3])
+        ans = fn.negative(x, out=x)
+
+        self.assertIs(ans, x)
+        self.assertEqual(x, xnd([-1, -2, -3]))
+
+        x = xnd([1, 2, 3])
+        ans = fn.add(x, x, out=x)
+
+        self.assertIs(ans, x)
+        self.assertEqual(x, xnd([2, 4, 6]))
+
+        x = xnd([[1, 2], [3, 4]])
+        fn.multiply(x[::-1], x[::-1], out=x[::-1])
+        self.assertEqual(x, xnd([[1, 4], [9, 16]]))
+
+    def test_overlap_cpu(self):
+        lst = list(range(10))
+
+        # output trails the input
+        x = xnd(lst)
+        fn.add(x[1:], x[1:], out=x[:9])
+        self.assertEqual(x, xnd([2 * v for v in lst[1:]] + [9]))
+
+        # output leads the input
+        x = xnd(lst)
+        fn.add(x[:9], x[:9], out=x[1:])
+        self.assertEqual(x, xnd([0] + [2 * v for v in lst[:9]]))
+
+        # reversed input
+        x = xnd(lst)
+        fn.negative(x[::-1], out=x)
+        self.assertEqual(x, xnd([-v for v in lst[::-1]]))
+
+        # broadcast input
+        x = xnd([3, 1, 2])
+        fn.add(x[:1], x, out=x)
+        self.assertEqual(x, xnd([6, 4, 5]))
+
+        # different strides
+        x = xnd(lst)
+        fn.negative(x[::2], out=x[:5])
+        self.assertEqual(x, xnd([0, -2, -4, -6, -8] + lst[5:]))
+
+    def test_where_cpu(self):
+        lst = [float(i) for i in range(200)]
+        mask = [i % 7 < 3 or 50 <= i < 150 for i in range(200)]
+        x = xnd(lst)
+        out = xnd([-1.0] * 200)
+        y = fn.multiply(x, x, out=out, where=xnd(mask))
+        self.assertIs(y, out)
+        self.assertEqual(y, xnd([v * v if m else -1.0 for v, m in zip(lst, mask)]))
+
+        # strided arguments and a broadcast input
+        x = xnd([[1, 2, 3, 4], [5, 6, 7, 8]])
+        out = xnd([[0] * 4] * 2)
+        mask = xnd([[True, False, True, False], [False, True, True, True]])
+        fn.add(x[:, ::-1], xnd(10), out=out, where=mask)
+        self.assertEqual(out, xnd([[14, 0, 12, 0], [0, 17, 16, 15]]))
+
+        # without 'out' the unselected elements are zero
+        y = fn.negative(xnd([1, 2, 3]), where=xnd([False, True, False]))
+        self.assertEqual(y, xnd([0, -2, 0]))
+
+        y = fn.sin(xnd(1.0), where=xnd(False))
+        self.assertEqual(y, xnd(0.0))
+
+        x = xnd([1.0, 2.0, 3.0])
+        self.assertRaises(ValueError, fn.sin, x, where=xnd([True, False]))
+        self.assertRaises(TypeError, fn.sin, x, where=xnd([1, 0, 1]))
+        self.assertRaises(TypeError, fn.sin, x, where=[True, False, True])
+        self.assertRaises(NotImplementedError, fn.sin.submit, x,
+                          where=xnd([True, False, True]))
+        self.assertRaises(NotImplementedError, ex.add_scalar, xnd([1, 2]), xnd(5),
+                          where=xnd([True, False]))
+
 
 class TestUnaryCPU(unittest.TestCase):
 
@@ -921,6 +1209,14 @@ class TestBinaryCPU(unittest.TestCase):
             z = fn.multiply(x, y)
             self.assertEqual(z, [2, 6, 12, 20, 30, 42, 56, 72])
 
+    def test_cpu_isa(self):
+        isa = gm.cpu_isa()
+        self.assertIn(isa, ["avx512", "avx2", "sve", "sse2", "neon", "generic"])
+
+        x = xnd([1.5, 2.5, 3.5, 4.5, 5.5, 6.5, 7.5, 8.5, 9.5], dtype="float64")
+        y = xnd([2.0, 2.0, 2.0, 2.0, 2.0, 2.0, 2.0, 2.0, 2.0], dtype="float64")
+        self.assertEqual(fn.multiply(x, y), [3.0, 5.0, 7.0, 9.0, 11.0, 13.0, 15.0, 17.0, 19.0])
+
 
 @unittest.skipIf(cd is None, "test requires cuda")
 class TestBinaryCUDA(unittest.TestCase):
@@ -1453,6 +1749,1147 @@ class TestCudaManaged(unittest.TestCase):
         self.assertRaises(ValueError, cd.multiply, a, y)
 
 
+class TestPool(unittest.TestCase):
+
+    def test_pool_stats(self):
+
+        stats = gm.get_pool_stats()
+        for key in ['cap', 'cached', 'in_use', 'peak', 'hits', 'misses', 'evictions']:
+            self.assertIn(key, stats)
+            self.assertGreaterEqual(stats[key], 0)
+
+    def test_pool_cap(self):
+
+        cap = gm.get_pool_stats()['cap']
+        try:
+            gm.set_pool_cap(0)
+            self.assertEqual(gm.get_pool_stats()['cap'], 0)
+            self.assertEqual(gm.get_pool_stats()['cached'], 0)
+
+            gm.set_pool_cap(1 << 20)
+            self.assertEqual(gm.get_pool_stats()['cap'], 1 << 20)
+        finally:
+            gm.set_pool_cap(cap)
+
+        self.assertRaises(ValueError, gm.set_pool_cap, -1)
+        self.assertRaises(TypeError, gm.set_pool_cap, "1")
+
+    def test_pool_reuse(self):
+
+        n = gm.get_max_threads()
+        gm.set_max_threads(4)
+        try:
+            x = xnd([1.0] * 2000000, dtype="float64")
+            ans = fn.sin(x)
+
+            before = gm.get_pool_stats()
+            for _ in range(5):
+                self.assertEqual(fn.sin(x), ans)
+            after = gm.get_pool_stats()
+
+            self.assertEqual(after['in_use'], before['in_use'])
+            self.assertGreater(after['hits'], before['hits'])
+        finally:
+            gm.set_max_threads(n)
+
+        gm.clear_pool()
+        self.assertEqual(gm.get_pool_stats()['cached'], 0)
+
+    @unittest.skipIf(sys.version_info < (3, 9), "pooled outputs need Python 3.9")
+    def test_pool_output(self):
+
+        n = gm.get_max_threads()
+        cap = gm.get_pool_stats()['cap']
+        gm.set_max_threads(1)
+        gm.set_pool_cap(1 << 24)
+        try:
+            x = xnd([1.0] * 100000)
+            ans = xnd([math.sin(1.0)] * 100000)
+
+            y = fn.sin(x)
+            self.assertEqual(y, ans)
+            in_use = gm.get_pool_stats()['in_use']
+            self.assertGreaterEqual(in_use, 800000)
+
+            # The block of 'y' is cached and serves the next output.
+            del y
+            before = gm.get_pool_stats()
+            self.assertLessEqual(before['in_use'], in_use - 800000)
+            y = fn.sin(x)
+            after = gm.get_pool_stats()
+            self.assertEqual(y, ans)
+            self.assertEqual(after['hits'], before['hits'] + 1)
+            self.assertEqual(after['misses'], before['misses'])
+
+            # Views keep the block alive.
+            v = y[10:20]
+            del y
+            self.assertEqual(gm.get_pool_stats()['in_use'], after['in_use'])
+            self.assertEqual(v, ans[10:20])
+            del v
+            self.assertEqual(gm.get_pool_stats()['in_use'], before['in_use'])
+
+            # Outputs with a mask are zero-filled by xnd.
+            mask = xnd([False] * 100000)
+            before = gm.get_pool_stats()
+            y = fn.sin(x, where=mask)
+            self.assertEqual(y, xnd([0.0] * 100000))
+            self.assertEqual(gm.get_pool_stats()['in_use'], before['in_use'])
+
+            # Outputs of kernels that are not elementwise are zero-filled, too.
+            p = xnd([[float(i), 0.0] for i in range(200)])
+            before = gm.get_pool_stats()
+            y = ex.euclidian_pdist(p)
+            self.assertEqual(gm.get_pool_stats()['in_use'], before['in_use'])
+            self.assertEqual(gm.get_pool_stats()['hits'], before['hits'])
+            self.assertEqual(len(y), 19900)
+            self.assertEqual(y[0].value, 1.0)
+        finally:
+            gm.set_max_threads(n)
+            gm.set_pool_cap(cap)
+
+
+class TestKernelStats(unittest.TestCase):
+
+    def setUp(self):
+        gm.clear_kernel_stats()
+        gm.set_kernel_stats(True)
+
+    def tearDown(self):
+        gm.set_kernel_stats(False)
+        gm.clear_kernel_stats()
+
+    def find(self, func, variant):
+        for e in gm.get_kernel_stats():
+            if e['func'] == func and e['variant'] == variant:
+                return e
+        return None
+
+    def test_kernel_stats(self):
+        x = xnd([1.0, 2.0, 3.0, 4.0])
+        for _ in range(3):
+            fn.sin(x)
+
+        e = self.find('sin', 'OptC')
+        self.assertIsNotNone(e)
+        self.assertEqual(e['calls'], 3)
+        self.assertEqual(e['elements'], 12)
+        self.assertEqual(e['bytes'], 3 * 2 * 4 * 8)
+        self.assertEqual(e['threaded'], 0)
+        self.assertEqual(e['fallbacks'], 0)
+        self.assertGreaterEqual(e['time'], 0)
+        self.assertIn('float64', e['sig'])
+
+    def test_kernel_stats_disabled(self):
+        gm.set_kernel_stats(False)
+        fn.sin(xnd([1.0, 2.0]))
+        self.assertEqual(gm.get_kernel_stats(), [])
+
+        gm.set_kernel_stats(True)
+        fn.sin(xnd([1.0, 2.0]))
+        self.assertEqual(len(gm.get_kernel_stats()), 1)
+
+        gm.clear_kernel_stats()
+        self.assertEqual(gm.get_kernel_stats(), [])
+
+    def test_kernel_stats_threaded(self):
+        n = gm.get_max_threads()
+        gm.set_max_threads(4)
+        try:
+            fn.sin(xnd([1.0] * 2000000))
+        finally:
+            gm.set_max_threads(n)
+
+        e = self.find('sin', 'OptC')
+        self.assertEqual(e['calls'], 1)
+        self.assertEqual(e['threaded'], 1)
+
+    def test_kernel_stats_concurrent(self):
+        x = xnd([1.0, 2.0, 3.0, 4.0])
+
+        def call(_):
+            for _ in range(50):
+                fn.sin(x)
+
+        # Calls from several threads are recorded in different shards
+        # and merged when read.
+        with ThreadPoolExecutor(8) as pool:
+            list(pool.map(call, range(8)))
+
+        e = self.find('sin', 'OptC')
+        self.assertEqual(e['calls'], 400)
+        self.assertEqual(e['elements'], 1600)
+        self.assertEqual(len([s for s in gm.get_kernel_stats()
+                              if s['func'] == 'sin']), 1)
+
+    def test_kernel_counters(self):
+        try:
+            gm.set_kernel_counters(True)
+        except (OSError, NotImplementedError):
+            self.skipTest("hardware performance counters not available")
+
+        try:
+            fn.sin(xnd([1.0] * 100000))
+        finally:
+            gm.set_kernel_counters(False)
+
+        e = self.find('sin', 'OptC')
+        self.assertGreater(e['cycles'], 0)
+        self.assertGreater(e['instructions'], 0)
+        self.assertGreaterEqual(e['cache_misses'], 0)
+        self.assertGreaterEqual(e['branch_misses'], 0)
+
+    def test_kernel_stats_fallback(self):
+        x = xnd([[1.0, 2.0, 3.0], [4.0, 5.0, 6.0]])
+        y = x[:, ::2]
+        fn.sin(y)
+
+        stats = [e for e in gm.get_kernel_stats() if e['func'] == 'sin']
+        self.assertEqual(len(stats), 1)
+        if stats[0]['variant'] == 'Xnd':
+            self.assertEqual(stats[0]['fallbacks'], 1)
+
+
+class TestTrace(unittest.TestCase):
+
+    def test_trace(self):
+        fd, path = tempfile.mkstemp(suffix=".json")
+        os.close(fd)
+        try:
+            gm.trace_start(path)
+            self.assertRaises(RuntimeError, gm.trace_start, path)
+            try:
+                fn.sin(xnd([1.0, 2.0, 3.0]))
+            finally:
+                gm.trace_stop()
+            self.assertRaises(RuntimeError, gm.trace_stop)
+
+            with open(path) as f:
+                events = json.load(f)['traceEvents']
+        finally:
+            os.remove(path)
+
+        phases = [(e['cat'], e['ph']) for e in events if e['name'] == 'sin']
+        self.assertIn(('select', 'B'), phases)
+        self.assertIn(('alloc', 'B'), phases)
+        self.assertIn(('apply', 'B'), phases)
+        self.assertEqual(len([e for e in events if e['ph'] == 'B']),
+                         len([e for e in events if e['ph'] == 'E']))
+
+        apply = [e for e in events if e['cat'] == 'apply' and e['ph'] == 'B'][0]
+        self.assertEqual(apply['args']['shapes'], [[3], [3]])
+        self.assertEqual(apply['args']['variant'], 'OptC')
+
+    def test_trace_threads(self):
+        fd, path = tempfile.mkstemp(suffix=".json")
+        os.close(fd)
+        n = gm.get_max_threads()
+        gm.set_max_threads(4)
+        try:
+            gm.trace_start(path)
+            try:
+                fn.sin(xnd([1.0] * 2000000))
+            finally:
+                gm.trace_stop()
+                gm.set_max_threads(n)
+
+            with open(path) as f:
+                events = json.load(f)['traceEvents']
+        finally:
+            os.remove(path)
+
+        chunks = [e for e in events if e['cat'] == 'chunk' and e['ph'] == 'B']
+        self.assertEqual(len(chunks), 4)
+        self.assertEqual(sorted(e['args']['chunk'] for e in chunks), [0, 1, 2, 3])
+        self.assertTrue(any(e['cat'] == 'join' for e in events))
+
+
+class TestExplain(unittest.TestCase):
+
+    def test_explain(self):
+        x = xnd([[1.0, 2.0, 3.0], [4.0, 5.0, 6.0]])
+        e = fn.sin.explain(x)
+
+        self.assertEqual(e['variant'], 'OptC')
+        self.assertIn('float64', e['sig'])
+        self.assertEqual(e['types'], ['2 * 3 * float64', '2 * 3 * float64'])
+        self.assertEqual(e['outer_dims'], 2)
+        self.assertEqual(e['inner_dims'], [0, 0])
+        self.assertEqual(e['threads'], 1)
+        self.assertEqual(e['overlap'], 'none')
+        self.assertGreater(e['cost'], 0)
+        self.assertIsInstance(e['flags'], str)
+        self.assertIsInstance(e['reason'], str)
+
+    def test_explain_does_not_apply(self):
+        x = xnd([1.0, 2.0])
+        out = xnd([0.0, 0.0])
+        fn.sin.explain(x, out=out)
+        self.assertEqual(out, xnd([0.0, 0.0]))
+
+    def test_explain_xnd_fallback(self):
+        x = xnd([[1.0, 2.0, 3.0], [4.0, 5.0, 6.0]])
+        e = fn.sin.explain(x[:, ::2])
+        self.assertNotEqual(e['variant'], 'OptC')
+
+    def test_explain_threads(self):
+        n = gm.get_max_threads()
+        gm.set_max_threads(4)
+        try:
+            e = fn.sin.explain(xnd([1.0] * 2000000))
+            self.assertEqual(e['threads'], 4)
+
+            e = fn.sin.explain(xnd([1.0] * 1000))
+            self.assertEqual(e['threads'], 1)
+            self.assertIn('GM_THREAD_CUTOFF', e['reason'])
+
+            x = xnd([1.0] * 2000000)
+            e = fn.sin.explain(x[1:], out=x[:-1])
+            self.assertEqual(e['overlap'], 'serial')
+            self.assertEqual(e['threads'], 1)
+        finally:
+            gm.set_max_threads(n)
+
+    def test_thread_cutoff(self):
+        n = gm.get_max_threads()
+        cutoff = gm.get_thread_cutoff()
+        gm.set_max_threads(4)
+        try:
+            x = xnd([1.0] * 1000)
+            gm.set_thread_cutoff(100)
+            self.assertEqual(gm.get_thread_cutoff(), 100)
+            self.assertEqual(fn.sin.explain(x)['threads'], 4)
+            self.assertEqual(fn.sin(x), xnd([math.sin(1.0)] * 1000))
+
+            gm.set_thread_cutoff(10000)
+            self.assertEqual(fn.sin.explain(x)['threads'], 1)
+        finally:
+            gm.set_max_threads(n)
+            gm.set_thread_cutoff(cutoff)
+
+        self.assertRaises(ValueError, gm.set_thread_cutoff, -1)
+        self.assertRaises(TypeError, gm.set_thread_cutoff, "1")
+
+    def test_yield_chunk(self):
+        fd, path = tempfile.mkstemp(suffix=".json")
+        os.close(fd)
+        n = gm.get_max_threads()
+        cutoff = gm.get_thread_cutoff()
+        chunk = gm.get_yield_chunk()
+        gm.set_max_threads(4)
+        gm.set_thread_cutoff(100)
+        try:
+            x = xnd([1.0] * 1000)
+            gm.set_yield_chunk(100)
+            self.assertEqual(gm.get_yield_chunk(), 100)
+
+            gm.trace_start(path)
+            try:
+                y = fn.sin(x)
+            finally:
+                gm.trace_stop()
+            self.assertEqual(y, xnd([math.sin(1.0)] * 1000))
+
+            with open(path) as f:
+                events = json.load(f)['traceEvents']
+
+            # Ten parts of 100 elements on four threads.
+            chunks = [e for e in events if e['cat'] == 'chunk' and e['ph'] == 'B']
+            self.assertEqual(len(chunks), 10)
+
+            # Small calls submitted after a large call are not queued behind it.
+            large = xnd([1.0] * 100000)
+            futures = [fn.sin.submit(large) for _ in range(4)]
+            small = [fn.sin.submit(xnd([1.0] * 10)) for _ in range(4)]
+            for f in small:
+                self.assertEqual(f.result(), xnd([math.sin(1.0)] * 10))
+            for f in futures:
+                self.assertEqual(f.result(), xnd([math.sin(1.0)] * 100000))
+
+            gm.set_yield_chunk(0)
+            self.assertEqual(fn.sin(x), xnd([math.sin(1.0)] * 1000))
+        finally:
+            os.remove(path)
+            gm.set_max_threads(n)
+            gm.set_thread_cutoff(cutoff)
+            gm.set_yield_chunk(chunk)
+
+        self.assertRaises(ValueError, gm.set_yield_chunk, -1)
+        self.assertRaises(TypeError, gm.set_yield_chunk, "1")
+
+    def test_reserved_threads(self):
+        fd, path = tempfile.mkstemp(suffix=".json")
+        os.close(fd)
+        n = gm.get_max_threads()
+        cutoff = gm.get_thread_cutoff()
+        chunk = gm.get_yield_chunk()
+        reserved = gm.get_reserved_threads()
+        gm.set_max_threads(4)
+        gm.set_thread_cutoff(100)
+        gm.set_yield_chunk(0)
+        try:
+            self.assertEqual(gm.get_reserved_threads(), 0)
+            gm.set_reserved_threads(1)
+            self.assertEqual(gm.get_reserved_threads(), 1)
+
+            x = xnd([1.0] * 1000)
+            gm.trace_start(path)
+            try:
+                y = fn.sin(x)
+            finally:
+                gm.trace_stop()
+            self.assertEqual(y, xnd([math.sin(1.0)] * 1000))
+
+            with open(path) as f:
+                events = json.load(f)['traceEvents']
+
+            # One part per thread on three of the four threads.
+            chunks = [e for e in events if e['cat'] == 'chunk' and e['ph'] == 'B']
+            self.assertEqual(len(chunks), 3)
+
+            # Small calls run on the lane while all workers run large calls.
+            large = xnd([1.0] * 100000)
+            futures = [fn.sin.submit(large) for _ in range(4)]
+            small = [fn.sin.submit(xnd([1.0] * 10)) for _ in range(8)]
+            for f in small:
+                self.assertEqual(f.result(), xnd([math.sin(1.0)] * 10))
+            for f in futures:
+                self.assertEqual(f.result(), xnd([math.sin(1.0)] * 100000))
+
+            # At least one thread is used.
+            gm.set_reserved_threads(8)
+            self.assertEqual(fn.sin(x), xnd([math.sin(1.0)] * 1000))
+        finally:
+            os.remove(path)
+            gm.set_max_threads(n)
+            gm.set_thread_cutoff(cutoff)
+            gm.set_yield_chunk(chunk)
+            gm.set_reserved_threads(reserved)
+
+        self.assertRaises(ValueError, gm.set_reserved_threads, -1)
+        self.assertRaises(TypeError, gm.set_reserved_threads, "1")
+
+    def test_thread_split_inner(self):
+        n = gm.get_max_threads()
+        cutoff = gm.get_thread_cutoff()
+        gm.set_max_threads(4)
+        gm.set_thread_cutoff(0)
+        try:
+            # The outer dimension has fewer indices than threads.
+            x = xnd([[float(i) for i in range(1000)]] * 2)
+            e = fn.add.explain(x, x)
+            self.assertEqual(e['threads'], 4)
+            self.assertIn('innermost', e['reason'])
+            self.assertEqual(fn.add(x, x), xnd([[2.0 * i for i in range(1000)]] * 2))
+
+            # add_scalar has no outer dimensions and declares GM_CAP_SPLIT.
+            x = xnd(list(range(1000)))
+            y = xnd(5)
+            e = ex.add_scalar.explain(x, y)
+            self.assertEqual(e['threads'], 4)
+            self.assertIn('core', e['reason'])
+            self.assertEqual(ex.add_scalar(x, y), xnd([i + 5 for i in range(1000)]))
+
+            x = xnd([[i, i+1] for i in range(1000)])
+            self.assertEqual(ex.add_scalar(x, y), xnd([[i+5, i+6] for i in range(1000)]))
+
+            e = fn.sin.explain(xnd(1.0))
+            self.assertEqual(e['threads'], 1)
+        finally:
+            gm.set_max_threads(n)
+            gm.set_thread_cutoff(cutoff)
+
+    def test_explain_errors(self):
+        self.assertRaises(TypeError, fn.sin.explain, 1.0)
+        self.assertRaises(TypeError, fn.sin.explain, xnd("abc"))
+
+
+
+class CountingExecutor(object):
+
+    def __init__(self, pool):
+        self.pool = pool
+        self.submitted = 0
+
+    def submit(self, fn):
+        self.submitted += 1
+        return self.pool.submit(fn)
+
+
+class RecordingExecutor(object):
+    """Records the threads on which the submitted ranges actually ran."""
+
+    def __init__(self, pool):
+        self.pool = pool
+        self.lock = threading.Lock()
+        self.ran = []
+
+    def submit(self, fn):
+        def task():
+            if fn():
+                with self.lock:
+                    self.ran.append(threading.get_ident())
+        return self.pool.submit(task)
+
+
+class SerialExecutor(object):
+    """Runs every range on the calling thread before submit() returns."""
+
+    def submit(self, fn):
+        f = Future()
+        f.set_result(fn())
+        return f
+
+
+def write_npy(path, descr, shape, data):
+    header = "{'descr': '%s', 'fortran_order': False, 'shape': %r, }" % (descr, shape)
+    n = 10 + len(header) + 1
+    header += " " * (((n + 63) // 64) * 64 - n) + "\n"
+    with open(path, "wb") as f:
+        f.write(b"\x93NUMPY\x01\x00" + struct.pack("<H", len(header)))
+        f.write(header.encode("latin1") + data)
+
+def read_npy(path):
+    with open(path, "rb") as f:
+        data = f.read()
+    n = struct.unpack("<H", data[8:10])[0]
+    return data[10:10+n].decode("latin1"), data[10+n:]
+
+def doubles(data):
+    a = array.array("d")
+    a.frombytes(data)
+    return a.tolist()
+
+@unittest.skipIf(sys.platform == "win32", "streaming is not available on Windows")
+class TestStream(unittest.TestCase):
+
+    def setUp(self):
+        self.tmp = tempfile.TemporaryDirectory()
+
+    def tearDown(self):
+        self.tmp.cleanup()
+
+    def path(self, name):
+        return os.path.join(self.tmp.name, name)
+
+    def assertClose(self, xs, ys):
+        self.assertEqual(len(xs), len(ys))
+        for x, y in zip(xs, ys):
+            self.assertTrue(math.isclose(x, y, rel_tol=1e-15, abs_tol=1e-300), (x, y))
+
+    def test_raw(self):
+        values = [i * 0.25 for i in range(1000)]
+        src = self.path("in.raw")
+        dst = self.path("out.raw")
+        with open(src, "wb") as f:
+            f.write(array.array("d", values).tobytes())
+
+        # 100 rows per block, the prefetch thread reads ahead.
+        gm.stream_apply(fn.sin, src, out=dst, rowtype="float64", block_size=800)
+        with open(dst, "rb") as f:
+            self.assertClose(doubles(f.read()), [math.sin(v) for v in values])
+
+        # Rows of a fixed dimension, blocks of 3 rows.
+        gm.stream_apply(fn.sin, src, out=dst, rowtype="4 * float64", block_size=100)
+        with open(dst, "rb") as f:
+            self.assertClose(doubles(f.read()), [math.sin(v) for v in values])
+
+    def test_npy(self):
+        native = "<" if sys.byteorder == "little" else ">"
+        values = [i * 0.5 for i in range(1000)]
+        src = self.path("in.npy")
+        dst = self.path("out.npy")
+        write_npy(src, native + "f8", (250, 4), array.array("d", values).tobytes())
+
+        gm.stream_apply(fn.sin, src, out=dst, block_size=1000)
+        header, data = read_npy(dst)
+        self.assertIn("'descr': '%sf8'" % native, header)
+        self.assertIn("'shape': (250, 4)", header)
+        self.assertClose(doubles(data), [math.sin(v) for v in values])
+
+        if np is not None:
+            a = np.load(dst)
+            self.assertEqual(a.shape, (250, 4))
+            self.assertClose(a.ravel().tolist(), [math.sin(v) for v in values])
+
+    def test_byte_order(self):
+        other = ">" if sys.byteorder == "little" else "<"
+        src = self.path("in.npy")
+        dst = self.path("out.npy")
+
+        data = array.array("d", [1.0, 2.0]).tobytes()
+        for descr in (other + "f8", "|f8"):
+            write_npy(src, descr, (2,), data)
+            self.assertRaises(ValueError, gm.stream_apply, fn.sin, src, out=dst)
+
+        # Single byte types have no byte order.
+        write_npy(src, "|i1", (3,), b"\x01\x02\x03")
+        gm.stream_apply(fn.negative, src, out=dst)
+        header, data = read_npy(dst)
+        self.assertIn("'descr': '|i1'", header)
+        self.assertEqual(data, b"\xff\xfe\xfd")
+
+    def test_reduce(self):
+        values = [i * 0.25 for i in range(1000)]
+        src = self.path("in.raw")
+        with open(src, "wb") as f:
+            f.write(array.array("d", values).tobytes())
+
+        rows = []
+        acc = []
+        def reduce(block, row):
+            rows.append(row)
+            acc.extend(block.value)
+
+        gm.stream_apply(fn.sin, src, reduce=reduce, rowtype="float64", block_size=800)
+        self.assertEqual(rows, list(range(0, 1000, 100)))
+        self.assertClose(acc, [math.sin(v) for v in values])
+
+        def fail(block, row):
+            raise ZeroDivisionError
+
+        self.assertRaises(ZeroDivisionError, gm.stream_apply, fn.sin, src,
+                          reduce=fail, rowtype="float64")
+
+    def test_empty(self):
+        src = self.path("in.raw")
+        dst = self.path("out.raw")
+        open(src, "wb").close()
+
+        # The output file is created for empty inputs.
+        gm.stream_apply(fn.sin, src, out=dst, rowtype="float64")
+        self.assertTrue(os.path.exists(dst))
+        self.assertEqual(os.path.getsize(dst), 0)
+
+        calls = []
+        gm.stream_apply(fn.sin, src, reduce=lambda b, r: calls.append(r),
+                        rowtype="float64")
+        self.assertEqual(calls, [])
+
+        native = "<" if sys.byteorder == "little" else ">"
+        src = self.path("in.npy")
+        dst = self.path("out.npy")
+        write_npy(src, native + "f8", (0, 3), b"")
+        gm.stream_apply(fn.sin, src, out=dst)
+        header, data = read_npy(dst)
+        self.assertIn("'shape': (0, 3)", header)
+        self.assertEqual(data, b"")
+
+    def test_errors(self):
+        src = self.path("in.raw")
+        dst = self.path("out.raw")
+        with open(src, "wb") as f:
+            f.write(array.array("d", [1.0, 2.0, 3.0]).tobytes())
+
+        self.assertRaises(ValueError, gm.stream_apply, fn.sin, src, rowtype="float64")
+        self.assertRaises(ValueError, gm.stream_apply, fn.sin, src, out=dst,
+                          reduce=lambda b, r: None, rowtype="float64")
+        self.assertRaises(ValueError, gm.stream_apply, fn.sin, src, out=dst)
+        self.assertRaises(ValueError, gm.stream_apply, fn.sin, src, out=dst,
+                          rowtype="2 * float64")
+        self.assertRaises(OSError, gm.stream_apply, fn.sin, self.path("missing"),
+                          out=dst, rowtype="float64")
+        self.assertRaises(TypeError, gm.stream_apply, len, src, out=dst,
+                          rowtype="float64")
+
+
+@unittest.skipIf(sys.version_info < (3, 9), "arrow import needs Python 3.9")
+class TestArrow(unittest.TestCase):
+
+    def roundtrip(self, x):
+        y = gm.from_arrow(gm.to_arrow(x))
+        self.assertEqual(y.type, x.type)
+        self.assertEqual(y.value, x.value)
+        return y
+
+    def test_primitive(self):
+        for t in ("int8", "uint16", "int32", "uint64", "float32", "float64"):
+            x = xnd([1, 2, 3, 4], dtype=t)
+            self.roundtrip(x)
+
+        x = xnd([], type="0 * int64")
+        self.roundtrip(x)
+
+    def test_offset(self):
+        x = xnd(list(range(10)), type="10 * int64")
+
+        y = self.roundtrip(x[3:8])
+        self.assertEqual(y.value, [3, 4, 5, 6, 7])
+
+        # The view shares memory with the original.
+        x[4] = 100
+        self.assertEqual(y[1], 100)
+
+        # Non-contiguous views cannot be exported without copying.
+        self.assertRaises(NotImplementedError, gm.from_arrow, gm.to_arrow(x[::2]))
+
+    def test_nullable(self):
+        x = xnd([1.5, None, 3.5, None, 5.5], type="5 * ?float64")
+        self.roundtrip(x)
+
+        # The validity bitmap is indexed with the offset.
+        y = self.roundtrip(x[1:4])
+        self.assertEqual(y.value, [None, 3.5, None])
+
+        x = xnd([None, None, 2], type="3 * ?int32")
+        self.roundtrip(x)
+
+    def test_fixed_size_list(self):
+        x = xnd([[1, 2, 3], [4, 5, 6], [7, 8, 9]], type="3 * 3 * int32")
+        self.roundtrip(x)
+        y = self.roundtrip(x[1:])
+        self.assertEqual(y.value, [[4, 5, 6], [7, 8, 9]])
+
+        x = xnd([[1.0, None], [None, 4.0]], type="2 * 2 * ?float64")
+        self.roundtrip(x)
+
+    def test_struct(self):
+        a = xnd([1, 2, 3, 4], type="4 * int64")
+        b = xnd([1.0, None, 2.5, 3.5], type="4 * ?float64")
+        c = xnd([[1, 2], [3, 4], [5, 6], [7, 8], [9, 10]], type="5 * 2 * int16")
+        batch = {"a": a, "b": b, "c": c[1:]}
+
+        d = gm.from_arrow(gm.to_arrow(batch))
+        self.assertEqual(list(d), ["a", "b", "c"])
+        for k, v in batch.items():
+            self.assertEqual(d[k].type, v.type)
+            self.assertEqual(d[k].value, v.value)
+
+        self.assertRaises(ValueError, gm.to_arrow({"a": a, "b": c}).__arrow_c_array__)
+        self.assertRaises(TypeError, gm.to_arrow({"a": [1, 2]}).__arrow_c_array__)
+
+    def test_lifetime(self):
+        x = xnd([1.0, None, 3.0], type="3 * ?float64")
+        capsules = gm.to_arrow(x).__arrow_c_array__()
+        del x
+
+        y = gm.from_arrow(capsules)
+        del capsules
+        self.assertEqual(y.value, [1.0, None, 3.0])
+
+        # The array capsule is consumed by the import.
+        capsules = gm.to_arrow(y).__arrow_c_array__()
+        z = gm.from_arrow(capsules)
+        self.assertRaises(ValueError, gm.from_arrow, capsules)
+        del y
+        self.assertEqual(z.value, [1.0, None, 3.0])
+
+    @unittest.skipIf(pa is None, "test requires pyarrow")
+    def test_pyarrow(self):
+        x = xnd([1.0, None, 3.0, 4.0], type="4 * ?float64")
+        a = pa.array(gm.to_arrow(x[1:]))
+        self.assertEqual(a.offset, 1)
+        self.assertEqual(a.null_count, 1)
+        self.assertEqual(a.to_pylist(), [None, 3.0, 4.0])
+
+        a = pa.array([None, 2, None, 4], type=pa.int32()).slice(1)
+        y = gm.from_arrow(a)
+        self.assertEqual(y.type, ndt("3 * ?int32"))
+        self.assertEqual(y.value, [2, None, 4])
+
+        x = xnd([[1, 2], [3, 4]], type="2 * 2 * int64")
+        a = pa.array(gm.to_arrow(x))
+        self.assertEqual(a.type, pa.list_(pa.int64(), 2))
+        self.assertEqual(a.to_pylist(), [[1, 2], [3, 4]])
+
+        batch = pa.record_batch([pa.array([1, 2]), pa.array([0.5, None])],
+                                names=["i", "f"])
+        d = gm.from_arrow(batch)
+        self.assertEqual(d["i"].value, [1, 2])
+        self.assertEqual(d["f"].value, [0.5, None])
+
+
+class TestTaskGraph(unittest.TestCase):
+
+    def check_pipeline(self, nchunks):
+        x = xnd([float(i % 11) for i in range(200000)])
+        s = fn.sin(x)
+        ans = fn.add(fn.add(fn.multiply(s, s), x), fn.cos(x))
+
+        g = gm.task_graph()
+        self.assertIsInstance(g, gm.TaskGraph)
+        y = g.add(fn.sin, x)
+        z = g.add(fn.multiply, y, y)
+        w = g.add(fn.add, z, x)
+        c = g.add(fn.cos, x)
+        v = g.add(fn.add, w, c)
+        self.assertEqual(len(g), 5)
+
+        # A graph can be run multiple times.
+        for _ in range(2):
+            g.run(nchunks=nchunks)
+            self.assertEqual(v, ans)
+
+        for i in range(len(g)):
+            self.assertGreaterEqual(g.node_time(i), 0)
+        self.assertRaises(IndexError, g.node_time, 5)
+
+        t, path = g.critical_path()
+        self.assertGreater(t, 0)
+        self.assertEqual(path[-1], 4)
+        self.assertEqual(path, sorted(path))
+
+        # Explicit outputs: the second node reads what the first one writes.
+        out = xnd([0.0] * 200000)
+        g = gm.task_graph()
+        g.add(fn.sin, x, out=out)
+        r = g.add(fn.multiply, out, out)
+        g.run(nchunks=nchunks)
+        self.assertEqual(r, fn.multiply(s, s))
+
+    def test_task_graph(self):
+        n = gm.get_max_threads()
+        try:
+            for threads in (1, 4):
+                gm.set_max_threads(threads)
+                self.check_pipeline(0)
+                self.check_pipeline(16)
+        finally:
+            gm.set_max_threads(n)
+
+    def test_task_graph_serial_executor(self):
+        n = gm.get_max_threads()
+        gm.set_max_threads(4)
+        try:
+            # All workers run on the calling thread, one after the other.
+            gm.set_executor(SerialExecutor())
+            self.check_pipeline(16)
+        finally:
+            gm.set_executor(None)
+            gm.set_max_threads(n)
+
+    def test_task_graph_errors(self):
+        x = xnd([1.0] * 10)
+        g = gm.task_graph()
+        self.assertRaises(TypeError, g.add, x)
+        self.assertRaises(TypeError, g.add, fn.sin, 1)
+        self.assertRaises(NotImplementedError, g.add, fn.sin, x,
+                          where=xnd([True] * 10))
+        self.assertEqual(len(g), 0)
+        self.assertRaises(ValueError, g.run, nchunks=-1)
+
+
+class TestExecutor(unittest.TestCase):
+
+    def test_executor(self):
+        n = gm.get_max_threads()
+        cutoff = gm.get_thread_cutoff()
+        pool = ThreadPoolExecutor(3)
+        counting = CountingExecutor(pool)
+
+        self.assertIsNone(gm.get_executor())
+        gm.set_max_threads(4)
+        gm.set_thread_cutoff(100)
+        try:
+            gm.set_executor(counting)
+            self.assertIs(gm.get_executor(), counting)
+
+            x = xnd([float(i) for i in range(1000)])
+            y = fn.multiply(x, x)
+            self.assertEqual(y, xnd([float(i * i) for i in range(1000)]))
+            self.assertGreater(counting.submitted, 0)
+
+            # Calls from tasks of the same executor must not deadlock.
+            futures = [pool.submit(fn.multiply, x, x) for _ in range(6)]
+            for f in futures:
+                self.assertEqual(f.result(), y)
+        finally:
+            gm.set_executor(None)
+            gm.set_max_threads(n)
+            gm.set_thread_cutoff(cutoff)
+            pool.shutdown()
+
+        self.assertIsNone(gm.get_executor())
+        self.assertRaises(TypeError, gm.set_executor, 1)
+
+    def test_executor_pool_threads(self):
+        n = gm.get_max_threads()
+        cutoff = gm.get_thread_cutoff()
+        pool = ThreadPoolExecutor(3)
+        recording = RecordingExecutor(pool)
+
+        gm.set_max_threads(4)
+        gm.set_thread_cutoff(100)
+        try:
+            gm.set_executor(recording)
+            x = xnd([1.0] * 2000000)
+            for _ in range(10):
+                self.assertEqual(fn.sin(x)[1999999], math.sin(1.0))
+                if recording.ran:
+                    break
+
+            # The calling thread only reclaims ranges that have not started,
+            # so idle pool threads run some of the work.
+            self.assertTrue(recording.ran)
+            self.assertNotIn(threading.get_ident(), recording.ran)
+        finally:
+            gm.set_executor(None)
+            gm.set_max_threads(n)
+            gm.set_thread_cutoff(cutoff)
+            pool.shutdown()
+
+    def test_executor_replace(self):
+        n = gm.get_max_threads()
+        cutoff = gm.get_thread_cutoff()
+        pools = [ThreadPoolExecutor(2) for _ in range(2)]
+        stop = threading.Event()
+        errors = []
+
+        def work():
+            x = xnd([2.0] * 100000)
+            try:
+                while not stop.is_set():
+                    if fn.multiply(x, x)[99999] != 4.0:
+                        errors.append("wrong result")
+            except Exception as e:
+                errors.append(e)
+
+        gm.set_max_threads(4)
+        gm.set_thread_cutoff(100)
+        t = threading.Thread(target=work)
+        t.start()
+        try:
+            # Loops that are running keep the executor they started on.
+            for i in range(200):
+                gm.set_executor(CountingExecutor(pools[i % 2]))
+                gm.set_executor(None)
+        finally:
+            stop.set()
+            t.join()
+            gm.set_executor(None)
+            gm.set_max_threads(n)
+            gm.set_thread_cutoff(cutoff)
+            for pool in pools:
+                pool.shutdown()
+
+        self.assertEqual(errors, [])
+
+    def test_executor_fallback(self):
+        class Failing(object):
+            def submit(self, fn):
+                raise RuntimeError("executor is shut down")
+
+        n = gm.get_max_threads()
+        cutoff = gm.get_thread_cutoff()
+        hook = getattr(sys, "unraisablehook", None)
+        gm.set_max_threads(4)
+        gm.set_thread_cutoff(100)
+        try:
+            # The submit() errors are reported as unraisable exceptions.
+            if hook is not None:
+                sys.unraisablehook = lambda unraisable: None
+            gm.set_executor(Failing())
+            x = xnd([1.0] * 1000)
+            self.assertEqual(fn.add(x, x), xnd([2.0] * 1000))
+        finally:
+            gm.set_executor(None)
+            gm.set_max_threads(n)
+            gm.set_thread_cutoff(cutoff)
+            if hook is not None:
+                sys.unraisablehook = hook
+
+
+    def test_numa(self):
+        numa = gm.get_numa()
+        self.assertGreaterEqual(numa['nodes'], 1)
+        self.assertFalse(numa['pin'])
+        self.assertFalse(numa['first_touch'])
+
+        n = gm.get_max_threads()
+        gm.set_max_threads(4)
+        try:
+            gm.set_numa(pin=True, first_touch=True)
+            numa = gm.get_numa()
+            self.assertTrue(numa['pin'])
+            self.assertTrue(numa['first_touch'])
+
+            # The output is larger than the first touch minimum of 1MiB.
+            x = xnd([float(i % 7) for i in range(300000)])
+            ans = xnd([float((i % 7) ** 2) for i in range(300000)])
+            y = fn.multiply(x, x)
+            self.assertEqual(y, ans)
+
+            # First touch blocks are cached like other pooled blocks.
+            del y
+            before = gm.get_pool_stats()
+            y = fn.multiply(x, x)
+            self.assertEqual(y, ans)
+            if sys.version_info >= (3, 9):
+                self.assertGreater(gm.get_pool_stats()['hits'], before['hits'])
+        finally:
+            gm.set_numa()
+            gm.set_max_threads(n)
+
+        self.assertFalse(gm.get_numa()['pin'])
+        self.assertRaises(TypeError, gm.set_numa, pin="yes", first_touch=None, extra=1)
+
+
+class TestAsync(unittest.TestCase):
+
+    def test_submit(self):
+        x = xnd([float(i) for i in range(1000)])
+        f = fn.multiply.submit(x, x)
+        self.assertIsInstance(f, gm.Future)
+        y = f.result()
+        self.assertTrue(f.done())
+        self.assertEqual(y, xnd([float(i * i) for i in range(1000)]))
+        self.assertIs(f.result(), y)
+
+        futures = [fn.add.submit(x, x) for _ in range(8)]
+        for f in futures:
+            self.assertEqual(f.result(), xnd([2.0 * i for i in range(1000)]))
+
+        out = xnd([0.0] * 1000)
+        f = fn.add.submit(x, x, out=out)
+        self.assertIs(f.result(), out)
+
+        x, y = ex.divmod10.submit(xnd(233)).result()
+        self.assertEqual((x.value, y.value), (23, 3))
+
+        # Type errors are raised by submit() itself.
+        self.assertRaises(TypeError, fn.sin.submit, xnd("abc"))
+
+    def test_submit_threads(self):
+        n = gm.get_max_threads()
+        cutoff = gm.get_thread_cutoff()
+        gm.set_max_threads(4)
+        gm.set_thread_cutoff(100)
+        try:
+            x = xnd([1.0] * 10000)
+            f = fn.sin.submit(x)
+            self.assertEqual(f.result(), xnd([math.sin(1.0)] * 10000))
+        finally:
+            gm.set_max_threads(n)
+            gm.set_thread_cutoff(cutoff)
+
+    @unittest.skipIf(sys.version_info < (3, 7), "asyncio.run() requires Python 3.7")
+    def test_await(self):
+        import asyncio
+
+        x = xnd([float(i) for i in range(1000)])
+
+        async def compute():
+            a = await fn.multiply.submit(x, x)
+            b, c = await asyncio.gather(fn.add.submit(a, x), fn.sin.submit(x))
+            return b, c
+
+        b, c = asyncio.run(compute())
+        self.assertEqual(b, xnd([float(i * i + i) for i in range(1000)]))
+        self.assertEqual(c, fn.sin(x))
+
+
+class TestDeferred(unittest.TestCase):
+
+    def test_deferred_api(self):
+        a = xnd([1.0, 2.0, 3.0])
+        b = xnd([4.0, 5.0, 6.0])
+
+        with gm.deferred():
+            e = fn.add(a, b)
+            self.assertIsInstance(e, gm.Expr)
+        self.assertEqual(gm.evaluate(e), xnd([5.0, 7.0, 9.0]))
+        self.assertEqual(e.evaluate(), xnd([5.0, 7.0, 9.0]))
+
+        # eager outside of the block
+        self.assertIsInstance(fn.add(a, b), xnd)
+        self.assertIs(gm.evaluate(a), a)
+
+        # calls with keyword arguments are eager
+        c = xnd.empty("3 * float64")
+        with gm.deferred():
+            r = fn.add(fn.multiply(a, b), a, out=c)
+        self.assertIs(r, c)
+        self.assertEqual(c, xnd([5.0, 12.0, 21.0]))
+
+    def test_deferred_threads(self):
+        a = xnd([1.0, 2.0, 3.0])
+        entered = threading.Event()
+        done = threading.Event()
+        results = []
+
+        def deferring():
+            with gm.deferred():
+                results.append(fn.add(a, a))
+                entered.set()
+                done.wait()
+
+        # Deferral is local to the thread that entered the block.
+        t = threading.Thread(target=deferring)
+        t.start()
+        entered.wait()
+        try:
+            self.assertIsInstance(fn.add(a, a), xnd)
+        finally:
+            done.set()
+            t.join()
+
+        self.assertIsInstance(results[0], gm.Expr)
+        self.assertIsInstance(fn.add(a, a), xnd)
+
+        # Nested and suspended blocks.
+        with gm.deferred():
+            with gm.deferred():
+                self.assertIsInstance(fn.add(a, a), gm.Expr)
+            self.assertIsInstance(fn.add(a, a), gm.Expr)
+            e = fn.add(a, a)
+            self.assertEqual(gm.evaluate(e), xnd([2.0, 4.0, 6.0]))
+            self.assertIsInstance(fn.add(a, a), gm.Expr)
+        self.assertIsInstance(fn.add(a, a), xnd)
+
+    def test_kernel_properties(self):
+        self.assertTrue(fn.sin.elementwise)
+        self.assertTrue(fn.add.elementwise)
+        self.assertFalse(ex.euclidian_pdist.elementwise)
+        self.assertEqual(fn.add.nout, 1)
+        self.assertEqual(ex.randtuple.nout, 2)
+
+    def test_deferred_fusion(self):
+        lst1 = [float(i) for i in range(1000)]
+        lst2 = [float(i % 7) for i in range(1000)]
+        a = xnd(lst1)
+        b = xnd(lst2)
+
+        with gm.deferred():
+            e = fn.add(fn.multiply(fn.subtract(a, b), b), fn.sin(a))
+
+        expected = fn.add(fn.multiply(fn.subtract(a, b), b), fn.sin(a))
+
+        # block sizes that do and do not divide the outer dimension
+        for block_size in [64, 80, 8000, 8 * 1000, 10**6]:
+            e._value = None
+            self.assertEqual(gm.evaluate(e, block_size=block_size), expected)
+
+    def test_deferred_broadcast(self):
+        x = xnd([[float(i + j) for j in range(5)] for i in range(100)])
+        y = xnd([1.0, 2.0, 3.0, 4.0, 5.0])
+
+        with gm.deferred():
+            e = fn.multiply(fn.add(x, y), y)
+
+        expected = fn.multiply(fn.add(x, y), y)
+        self.assertEqual(gm.evaluate(e, block_size=100), expected)
+
+    def test_deferred_shared(self):
+        a = xnd([float(i) for i in range(100)])
+
+        with gm.deferred():
+            t = fn.multiply(a, a)
+            e = fn.add(t, fn.multiply(t, a))
+
+        expected = fn.add(fn.multiply(a, a), fn.multiply(fn.multiply(a, a), a))
+        self.assertEqual(gm.evaluate(e, block_size=128), expected)
+
+    def test_deferred_multiple_results(self):
+        x = xnd([10, 20, 30])
+        y = xnd([7, 8, 9])
+
+        with gm.deferred():
+            q, r = fn.divmod(fn.add(x, x), y)
+
+        self.assertEqual(q, xnd([2, 5, 6]))
+        self.assertEqual(r, xnd([6, 0, 6]))
+
+
 class TestSpec(unittest.TestCase):
 
     def __init__(self, *, constr, ndarray, mod,
@@ -1857,6 +3294,16 @@ ALL_TESTS = [
   TestBitwiseCUDA,
   TestFunctions,
   TestCudaManaged,
+  TestPool,
+  TestKernelStats,
+  TestTrace,
+  TestExplain,
+  TestExecutor,
+  TestTaskGraph,
+  TestArrow,
+  TestStream,
+  TestAsync,
+  TestDeferred,
   LongIndexSliceTest,
 ]
 